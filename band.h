@@ -0,0 +1,115 @@
+#ifndef STEREO_BAND_H
+#define STEREO_BAND_H
+
+#include "stereo.h"
+
+/**
+ * Settings for stereo_band_render.
+ */
+typedef struct {
+    /** The number of rows of every band; this is rounded up to a multiple of
+        the row step of the stereo image */
+    unsigned int band_height;
+
+    /** The number of bands sent to a worker before its first result is
+        received; this is at least 1 */
+    unsigned int in_flight;
+} StereoBandSettings;
+
+/**
+ * The default settings: bands of 64 rows and 2 bands in flight per worker.
+ */
+extern const StereoBandSettings stereo_band_settings_default;
+
+/**
+ * A function that receives the rendered bands of stereo_band_render in order.
+ *
+ * @param context
+ *     The context passed to stereo_band_render.
+ * @param band
+ *     The rendered rows. This pattern is freed when the function returns.
+ * @param y
+ *     The row of the stereogram at which the band starts.
+ * @return non-zero to continue, or 0 to abort rendering
+ */
+typedef int (*StereoBandWrite)(void *context, StereoPattern *band,
+    unsigned int y);
+
+/**
+ * Opens a socket listening for coordinators.
+ *
+ * @param address
+ *     The address: unix:PATH for a local socket, or HOST:PORT, where HOST may
+ *     be empty to listen on all interfaces.
+ * @return the socket, or -1 upon error, in which case errno is set
+ */
+int
+stereo_band_listen(const char *address);
+
+/**
+ * Connects to a worker.
+ *
+ * @param address
+ *     The address of the worker, as passed to stereo_band_listen.
+ * @return the connected socket, or -1 upon error, in which case errno is set
+ */
+int
+stereo_band_connect(const char *address);
+
+/**
+ * Serves a coordinator on a connected socket.
+ *
+ * Every render starts with the pattern and the settings of the stereo image of
+ * the coordinator, followed by any number of bands of the z-buffer; the
+ * rendered rows are sent back for every band. Rendering uses the threads of a
+ * stereo image, so a worker uses all processors of its host.
+ *
+ * @param fd
+ *     The socket connected to the coordinator.
+ * @return non-zero if the coordinator closed the connection, or 0 upon a
+ *     protocol or connection error
+ */
+int
+stereo_band_serve(int fd);
+
+/**
+ * Renders a stereogram by distributing bands of rows to workers.
+ *
+ * The pattern and the settings of the stereo image are sent to every worker
+ * once, and the bands are then handed out on demand, so faster workers render
+ * more bands. If a worker fails, the bands it has not returned are rendered
+ * by the other workers. The result is the same as that of
+ * stereo_image_apply.
+ *
+ * @param image
+ *     The stereo image that provides the pattern, the offsets, the
+ *     interpolation and the row step. If write is NULL, the bands are
+ *     received directly into its image, which must have the dimensions of
+ *     buffer; otherwise its image is not used.
+ * @param buffer
+ *     The z-buffer.
+ * @param channel
+ *     The channel of the z-buffer to use.
+ * @param workers
+ *     The sockets connected to the workers; the connections are not closed,
+ *     but those of workers that fail are shut down. If rendering fails, the
+ *     connections must not be used for another render.
+ * @param worker_count
+ *     The number of workers.
+ * @param settings
+ *     The settings, or NULL to use stereo_band_settings_default.
+ * @param write
+ *     A function that receives the bands in order, or NULL to assemble the
+ *     stereogram in the image of the stereo image. Bands are only kept until
+ *     they are written, so the stereogram does not need to fit in memory.
+ * @param context
+ *     The context passed to write.
+ * @return non-zero upon success, or 0 if the dimensions are invalid, write
+ *     aborted rendering or all workers failed
+ */
+int
+stereo_band_render(StereoImage *image, ZBuffer *buffer, unsigned int channel,
+    const int *workers, unsigned int worker_count,
+    const StereoBandSettings *settings, StereoBandWrite write, void *context);
+
+#endif
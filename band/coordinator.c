@@ -0,0 +1,527 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../private/band.h"
+
+const StereoBandSettings stereo_band_settings_default = {64, 2};
+
+typedef struct BandCoordinator BandCoordinator;
+
+/**
+ * A worker as seen by the coordinator.
+ *
+ * Every worker has a sender thread, which hands out bands, and a receiver
+ * thread, which collects them; with a single thread, the worker and the
+ * coordinator could block each other sending large bands.
+ */
+typedef struct {
+    /** The coordinator */
+    BandCoordinator *coordinator;
+
+    /** The connection */
+    int fd;
+
+    /** The threads */
+    pthread_t sender, receiver;
+
+    /** The bands sent and not yet received, oldest first; workers return
+        bands in the order they receive them */
+    unsigned int *pending;
+    unsigned int first, count;
+
+    /** Set when the threads have been started */
+    int started;
+
+    /** Set when the connection has failed */
+    int dead;
+} BandWorker;
+
+struct BandCoordinator {
+    /** The stereo image, the z-buffer and the channel */
+    StereoImage *image;
+    ZBuffer *buffer;
+    unsigned int channel;
+
+    /** The function that receives the bands, and its context */
+    StereoBandWrite write;
+    void *context;
+
+    /** The number of rows of a band, and the number of bands */
+    unsigned int band_height, band_count;
+
+    /** The maximum number of bands pending for a worker */
+    unsigned int in_flight;
+
+    /** The maximum number of bands handed out beyond the last one written */
+    unsigned int window;
+
+    /** The lock of the fields below, and the condition signalled when any
+        of them changes */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    /** The next band that has never been handed out */
+    unsigned int next;
+
+    /** The bands of failed workers, which are handed out again first */
+    unsigned int *retry;
+    unsigned int retry_count;
+
+    /** Whether every band has been received, and the received bands that
+        have not been written yet */
+    unsigned char *done;
+    StereoPattern **bands;
+
+    /** The number of bands written in order, and whether a thread is
+        writing */
+    unsigned int written;
+    int writing;
+
+    /** The number of workers that have not failed */
+    unsigned int alive;
+
+    /** Set when rendering has failed */
+    int failed;
+};
+
+/**
+ * Marks a worker as failed and hands its pending bands to the other workers.
+ *
+ * This must be called with the lock held.
+ */
+static void
+band_worker_fail(BandWorker *worker)
+{
+    BandCoordinator *coordinator = worker->coordinator;
+
+    if (worker->dead) {
+        return;
+    }
+    worker->dead = 1;
+
+    while (worker->count) {
+        coordinator->retry[coordinator->retry_count++] =
+            worker->pending[worker->first];
+        worker->first = (worker->first + 1) % coordinator->in_flight;
+        worker->count--;
+    }
+    if (!--coordinator->alive) {
+        coordinator->failed = 1;
+    }
+
+    /* Wake up the other thread of the worker if it is blocked on the
+       connection */
+    shutdown(worker->fd, SHUT_RDWR);
+    pthread_cond_broadcast(&coordinator->changed);
+}
+
+/**
+ * Returns whether rendering has finished.
+ *
+ * This must be called with the lock held.
+ */
+static int
+band_finished(BandCoordinator *coordinator)
+{
+    return coordinator->failed
+        || coordinator->written == coordinator->band_count;
+}
+
+/**
+ * Waits for a band to hand out to a worker.
+ *
+ * This must be called with the lock held.
+ *
+ * @return the band, or -1 if the worker should stop
+ */
+static int
+band_take(BandWorker *worker)
+{
+    BandCoordinator *coordinator = worker->coordinator;
+
+    for (;;) {
+        if (worker->dead || band_finished(coordinator)) {
+            return -1;
+        }
+        if (worker->count < coordinator->in_flight) {
+            if (coordinator->retry_count) {
+                return coordinator->retry[--coordinator->retry_count];
+            }
+            if (coordinator->next < coordinator->band_count
+                    && coordinator->next
+                        < coordinator->written + coordinator->window) {
+                return coordinator->next++;
+            }
+        }
+        pthread_cond_wait(&coordinator->changed, &coordinator->lock);
+    }
+}
+
+/**
+ * Writes the received bands that are next in order.
+ *
+ * Only one thread writes at a time; the lock is released while writing, and
+ * bands received meanwhile are written by the same thread.
+ *
+ * This must be called with the lock held.
+ */
+static void
+band_write_ready(BandCoordinator *coordinator)
+{
+    if (coordinator->writing) {
+        return;
+    }
+    coordinator->writing = 1;
+
+    while (!coordinator->failed
+            && coordinator->written < coordinator->band_count
+            && coordinator->done[coordinator->written]) {
+        unsigned int band = coordinator->written;
+
+        if (coordinator->write) {
+            StereoPattern *pattern = coordinator->bands[band];
+            int result;
+
+            coordinator->bands[band] = NULL;
+            pthread_mutex_unlock(&coordinator->lock);
+            result = coordinator->write(coordinator->context, pattern,
+                band * coordinator->band_height);
+            stereo_pattern_free(pattern);
+            pthread_mutex_lock(&coordinator->lock);
+
+            if (!result) {
+                coordinator->failed = 1;
+                break;
+            }
+        }
+        coordinator->written++;
+    }
+
+    coordinator->writing = 0;
+    pthread_cond_broadcast(&coordinator->changed);
+}
+
+/**
+ * Returns the number of rows of a band.
+ */
+static unsigned int
+band_rows(BandCoordinator *coordinator, unsigned int band)
+{
+    unsigned int y = band * coordinator->band_height;
+    unsigned int height = coordinator->buffer->height;
+
+    return height - y < coordinator->band_height
+        ? height - y : coordinator->band_height;
+}
+
+/**
+ * Sends bands to a worker.
+ *
+ * This is the entry point of the sender threads.
+ */
+static void*
+band_sender(BandWorker *worker)
+{
+    BandCoordinator *coordinator = worker->coordinator;
+    ZBuffer *buffer = coordinator->buffer;
+    unsigned int bytes = buffer->depth / 8;
+    unsigned char *samples = malloc((size_t)buffer->width
+        * coordinator->band_height * bytes);
+
+    pthread_mutex_lock(&coordinator->lock);
+    for (;;) {
+        int band = band_take(worker);
+        unsigned int rows, x, y;
+        unsigned char *d = samples;
+        BandRows header;
+        int result;
+
+        if (band < 0) {
+            break;
+        }
+        worker->pending[(worker->first + worker->count)
+            % coordinator->in_flight] = band;
+        worker->count++;
+        pthread_cond_broadcast(&coordinator->changed);
+        pthread_mutex_unlock(&coordinator->lock);
+
+        /* Only the selected channel is sent */
+        rows = band_rows(coordinator, band);
+        for (y = band * coordinator->band_height;
+                y < band * coordinator->band_height + rows; y++) {
+            unsigned char *z = stereo_zbuffer_row_get(buffer, y)
+                + coordinator->channel * bytes;
+
+            for (x = 0; x < buffer->width; x++) {
+                if (bytes == 2) {
+                    uint16_t value = htons(*(uint16_t*)z);
+
+                    memcpy(d, &value, 2);
+                }
+                else {
+                    *d = *z;
+                }
+                z += buffer->channels * bytes;
+                d += bytes;
+            }
+        }
+        header.y = htonl(band * coordinator->band_height);
+        header.rows = htonl(rows);
+        result = band_send(worker->fd, BAND_ROWS, &header, sizeof(header),
+            samples, d - samples);
+
+        pthread_mutex_lock(&coordinator->lock);
+
+        /* The receiver notices the failure and hands the pending bands out
+           again, since it may be receiving one of them right now */
+        if (!result) {
+            shutdown(worker->fd, SHUT_RDWR);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&coordinator->lock);
+
+    free(samples);
+
+    return NULL;
+}
+
+/**
+ * Receives a band from a worker.
+ *
+ * @return non-zero upon success
+ */
+static int
+band_receive_band(BandWorker *worker, unsigned int band,
+    StereoPattern **pattern)
+{
+    BandCoordinator *coordinator = worker->coordinator;
+    unsigned int width = coordinator->buffer->width;
+    unsigned int rows = band_rows(coordinator, band);
+    size_t size = (size_t)width * rows * sizeof(PatternPixel);
+    BandMessage message;
+    BandRows header;
+    void *pixels;
+
+    if (band_receive_message(worker->fd, &message) <= 0
+            || message.type != BAND_RESULT
+            || message.length != sizeof(header) + size
+            || !band_receive(worker->fd, &header, sizeof(header))
+            || ntohl(header.y) != band * coordinator->band_height
+            || ntohl(header.rows) != rows) {
+        return 0;
+    }
+
+    /* Without a write function, the rows are received in place */
+    if (coordinator->write) {
+        *pattern = stereo_pattern_allocate(width, rows);
+        pixels = (*pattern)->pixels;
+    }
+    else {
+        *pattern = NULL;
+        pixels = stereo_pattern_row_get(coordinator->image->image,
+            band * coordinator->band_height);
+    }
+    if (!band_receive(worker->fd, pixels, size)) {
+        if (*pattern) {
+            stereo_pattern_free(*pattern);
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Receives bands from a worker.
+ *
+ * This is the entry point of the receiver threads.
+ */
+static void*
+band_receiver(BandWorker *worker)
+{
+    BandCoordinator *coordinator = worker->coordinator;
+
+    pthread_mutex_lock(&coordinator->lock);
+    for (;;) {
+        StereoPattern *pattern;
+        unsigned int band;
+        int result;
+
+        /* Pending bands are received even after a failure, so that the
+           connection can be used again */
+        while (!worker->count && !worker->dead
+                && !band_finished(coordinator)) {
+            pthread_cond_wait(&coordinator->changed, &coordinator->lock);
+        }
+        if (!worker->count || worker->dead) {
+            break;
+        }
+        band = worker->pending[worker->first];
+        pthread_mutex_unlock(&coordinator->lock);
+
+        result = band_receive_band(worker, band, &pattern);
+
+        pthread_mutex_lock(&coordinator->lock);
+        if (!result) {
+            band_worker_fail(worker);
+            break;
+        }
+        worker->first = (worker->first + 1) % coordinator->in_flight;
+        worker->count--;
+        coordinator->done[band] = 1;
+        coordinator->bands[band] = pattern;
+        band_write_ready(coordinator);
+    }
+    pthread_mutex_unlock(&coordinator->lock);
+
+    return NULL;
+}
+
+/**
+ * Sends the pattern and the settings of the stereo image to a worker.
+ *
+ * @return non-zero upon success
+ */
+static int
+band_setup(BandCoordinator *coordinator, int fd)
+{
+    StereoImage *image = coordinator->image;
+    StereoPattern *pattern = image->pattern;
+    BandSetup setup;
+    unsigned int i;
+
+    setup.magic = htonl(BAND_MAGIC);
+    setup.width = htonl(coordinator->buffer->width);
+    setup.depth = htonl(coordinator->buffer->depth);
+    setup.interpolate = htonl(image->interpolate);
+    setup.row_step = htonl(image->row_step);
+    setup.pattern_width = htonl(pattern->width);
+    setup.pattern_height = htonl(pattern->height);
+    for (i = 0; i < STEREO_OFFSET_COUNT; i++) {
+        setup.offsets[i] = htonl((uint32_t)image->offsets[i]);
+    }
+
+    return band_send(fd, BAND_SETUP, &setup, sizeof(setup), pattern->pixels,
+        (size_t)pattern->width * pattern->height * sizeof(PatternPixel));
+}
+
+int
+stereo_band_render(StereoImage *image, ZBuffer *buffer, unsigned int channel,
+    const int *workers, unsigned int worker_count,
+    const StereoBandSettings *settings, StereoBandWrite write, void *context)
+{
+    BandCoordinator coordinator;
+    BandWorker *states;
+    unsigned int step = image->row_step < 1 ? 1 : image->row_step;
+    unsigned int i;
+    int result;
+
+    if (!settings) {
+        settings = &stereo_band_settings_default;
+    }
+
+    /* Verify the arguments */
+    if (!worker_count || channel >= buffer->channels
+            || !buffer->width || buffer->width > BAND_WIDTH_MAX
+            || !buffer->height
+            || (!write && (image->image->width != buffer->width
+                || image->image->height != buffer->height))) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    memset(&coordinator, 0, sizeof(coordinator));
+    coordinator.image = image;
+    coordinator.buffer = buffer;
+    coordinator.channel = channel;
+    coordinator.write = write;
+    coordinator.context = context;
+
+    /* Bands start at multiples of the row step, so that the workers render
+       the same rows as a single stereo image would */
+    coordinator.band_height = settings->band_height < 1
+        ? 1 : settings->band_height;
+    coordinator.band_height = (coordinator.band_height + step - 1) / step
+        * step;
+    while ((size_t)coordinator.band_height * buffer->width > BAND_PIXELS_MAX
+            && coordinator.band_height > step) {
+        coordinator.band_height -= step;
+    }
+    coordinator.band_count = (buffer->height + coordinator.band_height - 1)
+        / coordinator.band_height;
+    coordinator.in_flight = settings->in_flight < 1 ? 1 : settings->in_flight;
+
+    /* When bands are written, only a limited number of them are kept waiting
+       for a slow worker */
+    coordinator.window = write
+        ? 2 * worker_count * coordinator.in_flight : coordinator.band_count;
+
+    coordinator.retry = malloc(worker_count * coordinator.in_flight
+        * sizeof(*coordinator.retry));
+    coordinator.done = calloc(coordinator.band_count, 1);
+    coordinator.bands = calloc(coordinator.band_count,
+        sizeof(*coordinator.bands));
+    states = calloc(worker_count, sizeof(*states));
+    pthread_mutex_init(&coordinator.lock, NULL);
+    pthread_cond_init(&coordinator.changed, NULL);
+
+    for (i = 0; i < worker_count; i++) {
+        states[i].coordinator = &coordinator;
+        states[i].fd = workers[i];
+        states[i].pending = malloc(coordinator.in_flight
+            * sizeof(*states[i].pending));
+        if (band_setup(&coordinator, workers[i])) {
+            coordinator.alive++;
+        }
+        else {
+            states[i].dead = 1;
+        }
+    }
+    coordinator.failed = !coordinator.alive;
+
+    for (i = 0; i < worker_count; i++) {
+        if (!states[i].dead) {
+            pthread_create(&states[i].sender, NULL,
+                (void*(*)(void*))band_sender, &states[i]);
+            pthread_create(&states[i].receiver, NULL,
+                (void*(*)(void*))band_receiver, &states[i]);
+            states[i].started = 1;
+        }
+    }
+    for (i = 0; i < worker_count; i++) {
+        if (!states[i].started) {
+            continue;
+        }
+        pthread_join(states[i].sender, NULL);
+        pthread_join(states[i].receiver, NULL);
+    }
+
+    result = !coordinator.failed
+        && coordinator.written == coordinator.band_count;
+    if (!result) {
+        errno = coordinator.alive ? ECANCELED : EPIPE;
+    }
+
+    for (i = 0; i < coordinator.band_count; i++) {
+        if (coordinator.bands[i]) {
+            stereo_pattern_free(coordinator.bands[i]);
+        }
+    }
+    for (i = 0; i < worker_count; i++) {
+        free(states[i].pending);
+    }
+    free(states);
+    free(coordinator.bands);
+    free(coordinator.done);
+    free(coordinator.retry);
+    pthread_mutex_destroy(&coordinator.lock);
+    pthread_cond_destroy(&coordinator.changed);
+
+    return result;
+}
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../private/band.h"
+
+/**
+ * The prefix of the addresses of local sockets.
+ */
+#define BAND_UNIX "unix:"
+
+/**
+ * The number of pending connections of a listening socket.
+ */
+#define BAND_BACKLOG 16
+
+/**
+ * Opens a socket for an address.
+ *
+ * @param address
+ *     The address passed to stereo_band_listen or stereo_band_connect.
+ * @param is_listening
+ *     Whether to bind and listen, rather than to connect.
+ * @return the socket, or -1 upon error
+ */
+static int
+band_open(const char *address, int is_listening)
+{
+    struct addrinfo hints, *addresses, *a;
+    char *host, *port;
+    int result = -1, error;
+
+    if (!strncmp(address, BAND_UNIX, strlen(BAND_UNIX))) {
+        struct sockaddr_un local;
+        const char *path = address + strlen(BAND_UNIX);
+
+        if (strlen(path) >= sizeof(local.sun_path)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, path);
+
+        result = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (result < 0) {
+            return -1;
+        }
+        if (is_listening) {
+            unlink(path);
+        }
+        if (is_listening
+                ? bind(result, (struct sockaddr*)&local, sizeof(local))
+                    || listen(result, BAND_BACKLOG)
+                : connect(result, (struct sockaddr*)&local, sizeof(local))) {
+            error = errno;
+            close(result);
+            errno = error;
+            return -1;
+        }
+
+        return result;
+    }
+
+    /* HOST:PORT, where HOST may be an IPv6 address in brackets */
+    host = strdup(address);
+    port = strrchr(host, ':');
+    if (!port) {
+        free(host);
+        errno = EINVAL;
+        return -1;
+    }
+    *port++ = '\0';
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        host[strlen(host) - 1] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = is_listening ? AI_PASSIVE : 0;
+    error = getaddrinfo(*host ? host : NULL, port, &hints, &addresses);
+    free(host);
+    if (error) {
+        errno = error == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    for (a = addresses; a; a = a->ai_next) {
+        int one = 1;
+
+        result = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+            a->ai_protocol);
+        if (result < 0) {
+            continue;
+        }
+        if (is_listening) {
+            setsockopt(result, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (!bind(result, a->ai_addr, a->ai_addrlen)
+                    && !listen(result, BAND_BACKLOG)) {
+                break;
+            }
+        }
+        else if (!connect(result, a->ai_addr, a->ai_addrlen)) {
+            /* Bands are sent as soon as they are complete */
+            setsockopt(result, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        error = errno;
+        close(result);
+        errno = error;
+        result = -1;
+    }
+    freeaddrinfo(addresses);
+
+    return result;
+}
+
+int
+stereo_band_listen(const char *address)
+{
+    return band_open(address, 1);
+}
+
+int
+stereo_band_connect(const char *address)
+{
+    return band_open(address, 0);
+}
+
+/**
+ * Sends all of a buffer.
+ *
+ * @param flags
+ *     The flags passed to send in addition to MSG_NOSIGNAL.
+ * @return non-zero upon success
+ */
+static int
+band_send_all(int fd, const void *data, size_t size, int flags)
+{
+    const unsigned char *p = data;
+
+    while (size) {
+        ssize_t sent = send(fd, p, size, flags | MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        p += sent;
+        size -= sent;
+    }
+
+    return 1;
+}
+
+int
+band_send(int fd, unsigned int type, const void *header, size_t header_size,
+    const void *data, size_t size)
+{
+    BandMessage message;
+
+    message.type = htonl(type);
+    message.length = htonl(header_size + size);
+
+    /* The headers are corked so that they leave in one segment with the
+       data */
+    return band_send_all(fd, &message, sizeof(message), MSG_MORE)
+        && band_send_all(fd, header, header_size, size ? MSG_MORE : 0)
+        && (!size || band_send_all(fd, data, size, 0));
+}
+
+/**
+ * Receives up to a number of bytes.
+ *
+ * @return the number of bytes received, which is less than size only if the
+ *     connection was closed, or -1 upon error
+ */
+static ssize_t
+band_receive_all(int fd, void *data, size_t size)
+{
+    unsigned char *p = data;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t received = recv(fd, p + done, size - done, 0);
+
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (!received) {
+            break;
+        }
+        done += received;
+    }
+
+    return done;
+}
+
+int
+band_receive_message(int fd, BandMessage *message)
+{
+    ssize_t received = band_receive_all(fd, message, sizeof(*message));
+
+    if (received != sizeof(*message)) {
+        if (received > 0) {
+            errno = EPROTO;
+        }
+        return received ? -1 : 0;
+    }
+    message->type = ntohl(message->type);
+    message->length = ntohl(message->length);
+
+    return 1;
+}
+
+int
+band_receive(int fd, void *data, size_t size)
+{
+    ssize_t received = band_receive_all(fd, data, size);
+
+    if (received >= 0 && (size_t)received != size) {
+        errno = EPROTO;
+    }
+
+    return received >= 0 && (size_t)received == size;
+}
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+
+#include "../private/band.h"
+
+/**
+ * The state of a worker between messages.
+ */
+typedef struct {
+    /** The stereo image of the current render, or NULL before the first
+        BAND_SETUP; its image has the height of the largest band so far */
+    StereoImage *image;
+
+    /** The number of bits of every z-buffer sample */
+    unsigned int depth;
+
+    /** The z-buffer wrapping samples, with the dimensions of the image */
+    ZBuffer *buffer;
+    unsigned char *samples;
+} BandWorker;
+
+/**
+ * Frees the stereo image and the z-buffer of a worker.
+ */
+static void
+band_worker_reset(BandWorker *worker)
+{
+    if (worker->image) {
+        stereo_image_free(worker->image);
+        worker->image = NULL;
+    }
+    if (worker->buffer) {
+        stereo_zbuffer_free(worker->buffer);
+        worker->buffer = NULL;
+    }
+    free(worker->samples);
+    worker->samples = NULL;
+}
+
+/**
+ * Handles BAND_SETUP.
+ *
+ * @return non-zero upon success
+ */
+static int
+band_worker_setup(BandWorker *worker, int fd, size_t length)
+{
+    StereoPattern *pattern;
+    BandSetup setup;
+    size_t size;
+    unsigned int i;
+
+    if (length < sizeof(setup) || !band_receive(fd, &setup, sizeof(setup))) {
+        return 0;
+    }
+    setup.magic = ntohl(setup.magic);
+    setup.width = ntohl(setup.width);
+    setup.depth = ntohl(setup.depth);
+    setup.interpolate = ntohl(setup.interpolate);
+    setup.row_step = ntohl(setup.row_step);
+    setup.pattern_width = ntohl(setup.pattern_width);
+    setup.pattern_height = ntohl(setup.pattern_height);
+
+    size = (size_t)setup.pattern_width * setup.pattern_height;
+    if (setup.magic != BAND_MAGIC
+            || !setup.width || setup.width > BAND_WIDTH_MAX
+            || (setup.depth != 8 && setup.depth != 16)
+            || !setup.pattern_width || setup.pattern_width > BAND_WIDTH_MAX
+            || !setup.pattern_height || size > BAND_PIXELS_MAX
+            || length != sizeof(setup) + size * sizeof(PatternPixel)) {
+        errno = EPROTO;
+        return 0;
+    }
+
+    pattern = stereo_pattern_allocate(setup.pattern_width,
+        setup.pattern_height);
+    if (!band_receive(fd, pattern->pixels, size * sizeof(PatternPixel))) {
+        stereo_pattern_free(pattern);
+        return 0;
+    }
+
+    /* The image grows with the first band */
+    band_worker_reset(worker);
+    worker->image = stereo_image_create(setup.width, 1, pattern, 0.0, 0);
+    for (i = 0; i < STEREO_OFFSET_COUNT; i++) {
+        worker->image->offsets[i] = (int32_t)ntohl(setup.offsets[i]);
+    }
+    worker->image->interpolate = setup.interpolate;
+    worker->image->row_step = setup.row_step;
+    worker->depth = setup.depth;
+
+    return 1;
+}
+
+/**
+ * Handles BAND_ROWS.
+ *
+ * @return non-zero upon success, also if the rows could not be rendered
+ */
+static int
+band_worker_rows(BandWorker *worker, int fd, size_t length)
+{
+    StereoImage *image = worker->image;
+    unsigned int bytes = worker->depth / 8;
+    BandRows rows;
+    size_t size, i;
+
+    if (!image || length < sizeof(rows)
+            || !band_receive(fd, &rows, sizeof(rows))) {
+        return 0;
+    }
+    rows.y = ntohl(rows.y);
+    rows.rows = ntohl(rows.rows);
+
+    size = (size_t)image->image->width * rows.rows;
+    if (!rows.rows || size > BAND_PIXELS_MAX
+            || length != sizeof(rows) + size * bytes) {
+        errno = EPROTO;
+        return 0;
+    }
+
+    if (!worker->buffer || rows.rows > image->image->height) {
+        unsigned int width = image->image->width;
+
+        if (worker->buffer) {
+            stereo_zbuffer_free(worker->buffer);
+        }
+        free(worker->samples);
+        stereo_pattern_free(image->image);
+        image->image = stereo_pattern_create(width, rows.rows);
+        worker->samples = malloc(size * bytes);
+        worker->buffer = stereo_zbuffer_create_from_data(width, rows.rows,
+            width * bytes, 1, worker->samples);
+        worker->buffer->depth = worker->depth;
+    }
+
+    if (!band_receive(fd, worker->samples, size * bytes)) {
+        return 0;
+    }
+    if (bytes == 2) {
+        uint16_t *samples = (uint16_t*)worker->samples;
+
+        for (i = 0; i < size; i++) {
+            samples[i] = ntohs(samples[i]);
+        }
+    }
+
+    /* The rows are rendered as the rows of the whole stereogram starting at
+       y would be */
+    image->origin = rows.y;
+    if (!stereo_image_apply_lines(image, worker->buffer, 0, 0, rows.rows)) {
+        rows.y = htonl(rows.y);
+        rows.rows = htonl(rows.rows);
+        return band_send(fd, BAND_FAILED, &rows, sizeof(rows), NULL, 0);
+    }
+
+    rows.y = htonl(rows.y);
+    rows.rows = htonl(rows.rows);
+    return band_send(fd, BAND_RESULT, &rows, sizeof(rows),
+        image->image->pixels, size * sizeof(PatternPixel));
+}
+
+int
+stereo_band_serve(int fd)
+{
+    BandWorker worker;
+    int result;
+
+    memset(&worker, 0, sizeof(worker));
+
+    for (;;) {
+        BandMessage message;
+
+        result = band_receive_message(fd, &message);
+        if (result <= 0) {
+            break;
+        }
+
+        switch (message.type) {
+        case BAND_SETUP:
+            result = band_worker_setup(&worker, fd, message.length);
+            break;
+
+        case BAND_ROWS:
+            result = band_worker_rows(&worker, fd, message.length);
+            break;
+
+        default:
+            errno = EPROTO;
+            result = 0;
+            break;
+        }
+        if (!result) {
+            result = -1;
+            break;
+        }
+    }
+
+    band_worker_reset(&worker);
+
+    return !result;
+}
@@ -0,0 +1,188 @@
+#ifndef STEREO_CONTAINER_H
+#define STEREO_CONTAINER_H
+
+#include <stdio.h>
+
+#include "pattern.h"
+#include "zbuffer.h"
+
+/**
+ * The types of frames in a container.
+ */
+enum {
+    /** A pattern; 8 bit RGBA */
+    STEREO_CONTAINER_PATTERN = 1,
+
+    /** A z-buffer with any number of 8 or 16 bit channels */
+    STEREO_CONTAINER_ZBUFFER = 2
+};
+
+/**
+ * The alignment of the first byte of every row of a frame.
+ */
+#define STEREO_CONTAINER_ALIGN 64
+
+/**
+ * A container file mapped into memory.
+ *
+ * A container is a sequence of patterns and z-buffers stored in the native
+ * byte order of the host. Every frame is stored as raw rows, so opening a
+ * container maps the file without decoding it, and frames are used in place;
+ * the header of a pattern is not stored, but built in the mapping when the
+ * pattern is first used.
+ * The pages are shared between all processes mapping the same file; frames
+ * are mapped privately, so modifying a frame copies only the modified pages.
+ */
+typedef struct StereoContainer StereoContainer;
+
+/**
+ * A writer appending frames to a container file.
+ */
+typedef struct StereoContainerWriter StereoContainerWriter;
+
+/**
+ * Maps a container file into memory.
+ *
+ * @param filename
+ *     The name of the file.
+ * @return a new container, or NULL if the file cannot be mapped or is not a
+ *     container created on a host with the same byte order
+ */
+StereoContainer*
+stereo_container_open(const char *filename);
+
+/**
+ * Returns the number of frames of a container.
+ *
+ * @param container
+ *     The container.
+ * @return the number of frames
+ */
+unsigned int
+stereo_container_frame_count(StereoContainer *container);
+
+/**
+ * Returns the type of a frame.
+ *
+ * @param container
+ *     The container.
+ * @param index
+ *     The index of the frame.
+ * @return one of the STEREO_CONTAINER_* values, or 0 if index is out of
+ *     bounds
+ */
+int
+stereo_container_frame_type(StereoContainer *container, unsigned int index);
+
+/**
+ * Returns a pattern stored in a container.
+ *
+ * The pattern is the mapped memory itself. It keeps the mapping alive, so it
+ * may be used after the container is closed, and it must be freed with
+ * stereo_pattern_free; the mapping is removed when the container and all its
+ * patterns are freed. Getting a frame that is already in use returns another
+ * reference to the same pattern.
+ *
+ * @param container
+ *     The container.
+ * @param index
+ *     The index of the frame.
+ * @return the pattern, or NULL if the frame is not a pattern
+ */
+StereoPattern*
+stereo_container_pattern_get(StereoContainer *container, unsigned int index);
+
+/**
+ * Creates a z-buffer using the data of a frame of a container.
+ *
+ * The z-buffer does not keep the mapping alive, so it must be freed before
+ * the container is closed.
+ *
+ * @param container
+ *     The container.
+ * @param index
+ *     The index of the frame.
+ * @return a new z-buffer, or NULL if the frame is not a z-buffer
+ */
+ZBuffer*
+stereo_container_zbuffer_create(StereoContainer *container,
+    unsigned int index);
+
+/**
+ * Closes a container.
+ *
+ * The mapping is kept until all patterns returned by
+ * stereo_container_pattern_get are freed as well.
+ *
+ * @param container
+ *     The container to close.
+ */
+void
+stereo_container_close(StereoContainer *container);
+
+/**
+ * Starts writing a container.
+ *
+ * The frames are written sequentially followed by an index, so the file does
+ * not have to be seekable.
+ *
+ * @param out
+ *     The file to write. Please make sure that it is opened in binary mode.
+ * @return a new writer, or NULL upon failure
+ */
+StereoContainerWriter*
+stereo_container_writer_open(FILE *out);
+
+/**
+ * Starts writing a container.
+ *
+ * @param filename
+ *     The file to write. If this file cannot be created, the function fails.
+ * @return a new writer, or NULL upon failure
+ * @see stereo_container_writer_open
+ */
+StereoContainerWriter*
+stereo_container_writer_open_file(const char *filename);
+
+/**
+ * Appends a pattern to a container.
+ *
+ * @param writer
+ *     The writer.
+ * @param pattern
+ *     The pattern to append.
+ * @return non-zero upon success and 0 otherwise
+ */
+int
+stereo_container_writer_add_pattern(StereoContainerWriter *writer,
+    StereoPattern *pattern);
+
+/**
+ * Appends a z-buffer to a container.
+ *
+ * Rows are padded to a multiple of STEREO_CONTAINER_ALIGN bytes.
+ *
+ * @param writer
+ *     The writer.
+ * @param buffer
+ *     The z-buffer to append.
+ * @return non-zero upon success and 0 otherwise
+ */
+int
+stereo_container_writer_add_zbuffer(StereoContainerWriter *writer,
+    ZBuffer *buffer);
+
+/**
+ * Writes the index of a container and frees the writer.
+ *
+ * If the writer was opened with stereo_container_writer_open_file, the file
+ * is closed, and otherwise it is not.
+ *
+ * @param writer
+ *     The writer to free.
+ * @return non-zero if the complete container was written and 0 otherwise
+ */
+int
+stereo_container_writer_close(StereoContainerWriter *writer);
+
+#endif
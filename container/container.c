@@ -0,0 +1,618 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../container.h"
+
+/**
+ * The magic number at the start of a container.
+ */
+static const char container_magic[8] = "\x89STEREO\n";
+
+/**
+ * The magic number at the start of the trailer.
+ */
+static const char container_trailer_magic[8] = "\x89INDEX\r\n";
+
+/**
+ * The value of ContainerHeader::order; a host with a different byte order
+ * reads this as another value.
+ */
+#define CONTAINER_ORDER 0x01020304
+
+/**
+ * The version of the format.
+ */
+#define CONTAINER_VERSION 2
+
+/**
+ * The number of bytes reserved before the pixels of a pattern.
+ *
+ * Only the pixels of a pattern are stored; the header of the pattern is built
+ * in these bytes of the mapping when the pattern is first used, so it never
+ * comes from the file. This must be at least offsetof(StereoPattern, pixels)
+ * on every host.
+ */
+#define CONTAINER_PATTERN_HEADER STEREO_CONTAINER_ALIGN
+
+/**
+ * The header at the start of a container.
+ *
+ * The header, the entries and the trailer only consist of fixed width fields
+ * without padding.
+ */
+typedef struct {
+    /** container_magic */
+    char magic[8];
+
+    /** CONTAINER_ORDER in the byte order of the writer */
+    uint32_t order;
+
+    /** CONTAINER_VERSION */
+    uint32_t version;
+} ContainerHeader;
+
+/**
+ * An entry of the index.
+ */
+typedef struct {
+    /** One of the STEREO_CONTAINER_* values */
+    uint32_t type;
+
+    /** The dimensions of the frame */
+    uint32_t width, height;
+
+    /** The number of channels and the number of bits of every channel */
+    uint32_t channels, depth;
+
+    /** The number of bytes between the start of a row and the next */
+    uint32_t stride;
+
+    /** The offset of the first row in the file */
+    uint64_t offset;
+} ContainerEntry;
+
+/**
+ * The trailer at the end of a container.
+ */
+typedef struct {
+    /** container_trailer_magic */
+    char magic[8];
+
+    /** The offset of the index in the file */
+    uint64_t index;
+
+    /** The number of entries in the index */
+    uint64_t count;
+} ContainerTrailer;
+
+struct StereoContainer {
+    /** The owner of the patterns of this container */
+    StereoPatternOwner b;
+
+    /** The mapped file */
+    unsigned char *data;
+
+    /** The size of the mapping */
+    size_t size;
+
+    /** The index */
+    const ContainerEntry *entries;
+
+    /** The number of frames */
+    unsigned int count;
+
+    /** Whether the header of every pattern has been built; until then, the
+        bytes before its pixels are those of the file */
+    unsigned char *built;
+
+    /** The number of patterns in use, plus one until the container is
+        closed */
+    unsigned int refs;
+
+    /** The lock protecting refs */
+    pthread_mutex_t lock;
+};
+
+struct StereoContainerWriter {
+    /** The file */
+    FILE *out;
+
+    /** Whether out is closed with the writer */
+    int close;
+
+    /** The number of bytes written */
+    unsigned long long offset;
+
+    /** The entries of the frames written */
+    ContainerEntry *entries;
+
+    /** The number of entries and the allocated length of entries */
+    unsigned int count, capacity;
+
+    /** Whether a write failed */
+    int failed;
+};
+
+/**
+ * Drops a reference to a container, and unmaps it with the last reference.
+ *
+ * @param container
+ *     The container.
+ */
+static void
+container_unref(StereoContainer *container)
+{
+    unsigned int refs;
+
+    pthread_mutex_lock(&container->lock);
+    refs = --container->refs;
+    pthread_mutex_unlock(&container->lock);
+
+    if (!refs) {
+        munmap(container->data, container->size);
+        pthread_mutex_destroy(&container->lock);
+        free(container->built);
+        free(container);
+    }
+}
+
+/**
+ * See StereoPatternOwner::Release.
+ */
+static void
+container_release(StereoContainer *container, StereoPattern *pattern)
+{
+    /* The pattern may have been handed out again since its last reference was
+       dropped, in which case it stays in use */
+    pthread_mutex_lock(&container->lock);
+    if (!__sync_fetch_and_add(&pattern->refs, 0)) {
+        pattern->owner = NULL;
+    }
+    pthread_mutex_unlock(&container->lock);
+
+    container_unref(container);
+}
+
+/**
+ * Checks whether an entry describes a frame within the mapped file.
+ *
+ * Frames must not be empty, they must follow each other in the file without
+ * overlapping, and patterns must leave room for their header after the
+ * previous frame, so that building the header of a pattern never touches
+ * another frame.
+ *
+ * @param container
+ *     The container.
+ * @param entry
+ *     The entry to check.
+ * @param end
+ *     The end of the previous frame; this is updated to the end of the frame
+ *     if the entry is valid.
+ * @return non-zero if the entry is valid
+ */
+static int
+container_entry_valid(StereoContainer *container, const ContainerEntry *entry,
+    unsigned long long *end)
+{
+    unsigned long long rowbytes = (unsigned long long)entry->width
+        * entry->channels * (entry->depth / 8);
+    unsigned long long size = (unsigned long long)entry->stride
+        * entry->height;
+    int valid;
+
+    if (!entry->width || !entry->height || !entry->channels
+            || entry->offset % STEREO_CONTAINER_ALIGN
+            || entry->stride < rowbytes || entry->offset < *end
+            || entry->offset > container->size
+            || size > container->size - entry->offset) {
+        return 0;
+    }
+
+    switch (entry->type) {
+    case STEREO_CONTAINER_PATTERN:
+        valid = entry->channels == 4 && entry->depth == 8
+            && entry->stride == rowbytes
+            && entry->offset - *end >= offsetof(StereoPattern, pixels);
+        break;
+
+    case STEREO_CONTAINER_ZBUFFER:
+        valid = entry->depth == 8 || entry->depth == 16;
+        break;
+
+    default:
+        valid = 0;
+        break;
+    }
+
+    if (valid) {
+        *end = entry->offset + size;
+    }
+
+    return valid;
+}
+
+StereoContainer*
+stereo_container_open(const char *filename)
+{
+    StereoContainer *result;
+    const ContainerHeader *header;
+    const ContainerTrailer *trailer;
+    unsigned long long end = sizeof(ContainerHeader);
+    struct stat st;
+    void *data;
+    unsigned int i;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size
+            < sizeof(ContainerHeader) + sizeof(ContainerTrailer)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Map the file privately, so that patterns may be modified in place
+       without modifying the file */
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    result = malloc(sizeof(StereoContainer));
+    result->b.Release = (void*)container_release;
+    result->data = data;
+    result->size = st.st_size;
+    result->built = NULL;
+    result->refs = 1;
+    pthread_mutex_init(&result->lock, NULL);
+
+    /* Verify the header and the index */
+    header = data;
+    trailer = (const ContainerTrailer*)(result->data + result->size
+        - sizeof(ContainerTrailer));
+    if (memcmp(header->magic, container_magic, sizeof(header->magic))
+            || header->order != CONTAINER_ORDER
+            || header->version != CONTAINER_VERSION
+            || memcmp(trailer->magic, container_trailer_magic,
+                sizeof(trailer->magic))
+            || trailer->index % sizeof(uint64_t)
+            || trailer->index > result->size - sizeof(ContainerTrailer)
+            || trailer->count > (result->size - sizeof(ContainerTrailer)
+                - trailer->index) / sizeof(ContainerEntry)) {
+        container_unref(result);
+        errno = EINVAL;
+        return NULL;
+    }
+    result->entries = (const ContainerEntry*)(result->data + trailer->index);
+    result->count = trailer->count;
+
+    for (i = 0; i < result->count; i++) {
+        if (!container_entry_valid(result, &result->entries[i], &end)) {
+            container_unref(result);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    if (end > trailer->index) {
+        container_unref(result);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result->built = calloc(result->count ? result->count : 1, 1);
+    if (!result->built) {
+        container_unref(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+unsigned int
+stereo_container_frame_count(StereoContainer *container)
+{
+    return container->count;
+}
+
+int
+stereo_container_frame_type(StereoContainer *container, unsigned int index)
+{
+    return index < container->count ? (int)container->entries[index].type : 0;
+}
+
+StereoPattern*
+stereo_container_pattern_get(StereoContainer *container, unsigned int index)
+{
+    const ContainerEntry *entry;
+    StereoPattern *result;
+    unsigned int refs;
+
+    if (stereo_container_frame_type(container, index)
+            != STEREO_CONTAINER_PATTERN) {
+        return NULL;
+    }
+
+    entry = &container->entries[index];
+    result = (StereoPattern*)(container->data + entry->offset
+        - offsetof(StereoPattern, pixels));
+
+    /* The header of a frame is built when the frame is first used, which
+       copies a single page; until then, its bytes come from the file and are
+       not looked at. A frame is only shared while it has references; once
+       its last reference is dropped, its header is rebuilt, even if its
+       release is still pending, so that release sees the new reference and
+       keeps the owner. Every time a frame comes into use, it keeps the
+       container alive until it is released */
+    pthread_mutex_lock(&container->lock);
+    refs = container->built[index] && result->owner
+        ? __sync_fetch_and_add(&result->refs, 0) : 0;
+    while (refs && !__sync_bool_compare_and_swap(&result->refs, refs,
+            refs + 1)) {
+        refs = __sync_fetch_and_add(&result->refs, 0);
+    }
+    if (!refs) {
+        result->width = entry->width;
+        result->height = entry->height;
+        result->refs = 1;
+        result->owner = &container->b;
+        container->built[index] = 1;
+        container->refs++;
+    }
+    pthread_mutex_unlock(&container->lock);
+
+    return result;
+}
+
+ZBuffer*
+stereo_container_zbuffer_create(StereoContainer *container,
+    unsigned int index)
+{
+    const ContainerEntry *entry;
+    ZBuffer *result;
+
+    if (stereo_container_frame_type(container, index)
+            != STEREO_CONTAINER_ZBUFFER) {
+        return NULL;
+    }
+
+    entry = &container->entries[index];
+    result = stereo_zbuffer_create_from_data(entry->width, entry->height,
+        entry->stride, entry->channels, container->data + entry->offset);
+    result->depth = entry->depth;
+
+    return result;
+}
+
+void
+stereo_container_close(StereoContainer *container)
+{
+    container_unref(container);
+}
+
+/**
+ * Writes data to a container.
+ *
+ * @param writer
+ *     The writer.
+ * @param data
+ *     The data to write. If this is NULL, zeros are written.
+ * @param size
+ *     The number of bytes to write.
+ */
+static void
+container_write(StereoContainerWriter *writer, const void *data, size_t size)
+{
+    static const unsigned char zeros[STEREO_CONTAINER_ALIGN];
+
+    writer->offset += size;
+
+    if (data) {
+        if (fwrite(data, 1, size, writer->out) != size) {
+            writer->failed = 1;
+        }
+    }
+    else {
+        while (size) {
+            size_t count = size < sizeof(zeros) ? size : sizeof(zeros);
+
+            if (fwrite(zeros, 1, count, writer->out) != count) {
+                writer->failed = 1;
+            }
+            size -= count;
+        }
+    }
+}
+
+/**
+ * Writes zeros until an offset is reached.
+ *
+ * @param writer
+ *     The writer.
+ * @param offset
+ *     The offset, which must not be before the current offset.
+ */
+static void
+container_pad(StereoContainerWriter *writer, unsigned long long offset)
+{
+    container_write(writer, NULL, offset - writer->offset);
+}
+
+/**
+ * Appends an entry to the index.
+ *
+ * @param writer
+ *     The writer.
+ * @param entry
+ *     The entry to append.
+ */
+static void
+container_entry_add(StereoContainerWriter *writer,
+    const ContainerEntry *entry)
+{
+    if (writer->count == writer->capacity) {
+        writer->capacity = writer->capacity ? 2 * writer->capacity : 16;
+        writer->entries = realloc(writer->entries,
+            writer->capacity * sizeof(*writer->entries));
+    }
+    writer->entries[writer->count++] = *entry;
+}
+
+/**
+ * Returns the smallest multiple of STEREO_CONTAINER_ALIGN not less than a
+ * value.
+ */
+static inline unsigned long long
+container_align(unsigned long long value)
+{
+    return (value + STEREO_CONTAINER_ALIGN - 1)
+        / STEREO_CONTAINER_ALIGN * STEREO_CONTAINER_ALIGN;
+}
+
+StereoContainerWriter*
+stereo_container_writer_open(FILE *out)
+{
+    StereoContainerWriter *result;
+    ContainerHeader header;
+
+    if (!out) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = malloc(sizeof(StereoContainerWriter));
+    result->out = out;
+    result->close = 0;
+    result->offset = 0;
+    result->entries = NULL;
+    result->count = 0;
+    result->capacity = 0;
+    result->failed = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, container_magic, sizeof(header.magic));
+    header.order = CONTAINER_ORDER;
+    header.version = CONTAINER_VERSION;
+    container_write(result, &header, sizeof(header));
+
+    return result;
+}
+
+StereoContainerWriter*
+stereo_container_writer_open_file(const char *filename)
+{
+    FILE *out = fopen(filename, "wb");
+    StereoContainerWriter *result;
+
+    if (!out) {
+        return NULL;
+    }
+
+    result = stereo_container_writer_open(out);
+    if (result) {
+        result->close = 1;
+    }
+    else {
+        fclose(out);
+    }
+
+    return result;
+}
+
+int
+stereo_container_writer_add_pattern(StereoContainerWriter *writer,
+    StereoPattern *pattern)
+{
+    ContainerEntry entry;
+
+    entry.type = STEREO_CONTAINER_PATTERN;
+    entry.width = pattern->width;
+    entry.height = pattern->height;
+    entry.channels = 4;
+    entry.depth = 8;
+    entry.stride = pattern->width * sizeof(PatternPixel);
+    entry.offset = container_align(writer->offset
+        + CONTAINER_PATTERN_HEADER);
+
+    /* Room is left for the header of the pattern just before the pixels, so
+       that the mapped frame becomes a pattern */
+    container_pad(writer, entry.offset);
+    container_write(writer, pattern->pixels,
+        (size_t)entry.stride * entry.height);
+
+    container_entry_add(writer, &entry);
+
+    return !writer->failed;
+}
+
+int
+stereo_container_writer_add_zbuffer(StereoContainerWriter *writer,
+    ZBuffer *buffer)
+{
+    ContainerEntry entry;
+    size_t rowbytes = (size_t)buffer->width * buffer->channels
+        * (buffer->depth / 8);
+    unsigned int y;
+
+    entry.type = STEREO_CONTAINER_ZBUFFER;
+    entry.width = buffer->width;
+    entry.height = buffer->height;
+    entry.channels = buffer->channels;
+    entry.depth = buffer->depth;
+    entry.stride = container_align(rowbytes);
+    entry.offset = container_align(writer->offset);
+
+    container_pad(writer, entry.offset);
+    for (y = 0; y < buffer->height; y++) {
+        container_write(writer, stereo_zbuffer_row_get(buffer, y), rowbytes);
+        container_write(writer, NULL, entry.stride - rowbytes);
+    }
+
+    container_entry_add(writer, &entry);
+
+    return !writer->failed;
+}
+
+int
+stereo_container_writer_close(StereoContainerWriter *writer)
+{
+    ContainerTrailer trailer;
+    int result;
+
+    memset(&trailer, 0, sizeof(trailer));
+    memcpy(trailer.magic, container_trailer_magic, sizeof(trailer.magic));
+    trailer.index = container_align(writer->offset);
+    trailer.count = writer->count;
+
+    container_pad(writer, trailer.index);
+    container_write(writer, writer->entries,
+        writer->count * sizeof(*writer->entries));
+    container_write(writer, &trailer, sizeof(trailer));
+
+    result = !writer->failed && !fflush(writer->out);
+    if (writer->close) {
+        result = !fclose(writer->out) && result;
+    }
+
+    free(writer->entries);
+    free(writer);
+
+    return result;
+}
@@ -0,0 +1,212 @@
+#ifndef STEREO_DAEMON_H
+#define STEREO_DAEMON_H
+
+#include "effect.h"
+#include "pattern.h"
+#include "zbuffer.h"
+
+/**
+ * The maximum length of the name of a pattern of a render daemon, including
+ * the terminating NUL.
+ */
+#define STEREO_DAEMON_NAME_MAX 64
+
+/**
+ * The maximum number of slots of a session.
+ */
+#define STEREO_DAEMON_SLOTS_MAX 64
+
+/**
+ * A render daemon.
+ *
+ * A daemon keeps patterns and effects loaded and renders for any number of
+ * clients connected to a local socket. Every client session owns a ring of
+ * slots in shared memory; a slot contains a z-buffer written by the client and
+ * the stereogram rendered from it by the daemon, so frames are never copied
+ * on either side. The socket is only used to set up and tear down a session,
+ * and the slots are signalled with a pair of eventfds.
+ */
+typedef struct StereoDaemon StereoDaemon;
+
+/**
+ * A client session of a render daemon.
+ */
+typedef struct StereoDaemonClient StereoDaemonClient;
+
+/**
+ * Creates a render daemon listening on a local socket.
+ *
+ * @param path
+ *     The path of the socket. A stale socket at this path is removed.
+ * @return a new daemon, or NULL if the socket cannot be created
+ */
+StereoDaemon*
+stereo_daemon_create(const char *path);
+
+/**
+ * Adds a pattern to a daemon.
+ *
+ * This must not be called while the daemon is running.
+ *
+ * @param daemon
+ *     The daemon.
+ * @param name
+ *     The name by which clients select the pattern.
+ * @param pattern
+ *     The pattern. Ownership is assumed by the daemon. Sessions share it,
+ *     unless it has an effect, in which case every session renders with its
+ *     own copy.
+ * @param effect
+ *     An effect of which the target pattern has the dimensions of pattern, or
+ *     NULL. Ownership is assumed by the daemon. Sessions render the frame
+ *     selected by the client with stereo_pattern_effect_render, so the effect
+ *     itself is never applied.
+ * @return non-zero upon success, or 0 if the name is too long or already used
+ */
+int
+stereo_daemon_add_pattern(StereoDaemon *daemon, const char *name,
+    StereoPattern *pattern, StereoPatternEffect *effect);
+
+/**
+ * Accepts and serves clients until the daemon is stopped.
+ *
+ * Every session is served on a thread of its own. When the daemon is stopped,
+ * all sessions are closed before this function returns.
+ *
+ * @param daemon
+ *     The daemon.
+ * @return non-zero if the daemon was stopped, or 0 if accepting failed
+ */
+int
+stereo_daemon_run(StereoDaemon *daemon);
+
+/**
+ * Stops a daemon.
+ *
+ * This may be called from any thread and from signal handlers.
+ *
+ * @param daemon
+ *     The daemon.
+ */
+void
+stereo_daemon_stop(StereoDaemon *daemon);
+
+/**
+ * Frees a daemon, its patterns and its effects, and removes its socket.
+ *
+ * @param daemon
+ *     The daemon to free. It must not be running.
+ */
+void
+stereo_daemon_free(StereoDaemon *daemon);
+
+/**
+ * Opens a session with a render daemon.
+ *
+ * @param path
+ *     The path of the socket of the daemon.
+ * @param pattern
+ *     The name of the pattern to render with.
+ * @param width
+ *     The width of the z-buffers and of the stereograms.
+ * @param height
+ *     The height of the z-buffers and of the stereograms.
+ * @param depth
+ *     The number of bits of every sample of the z-buffers; this is 8 or 16.
+ * @param slots
+ *     The number of slots; this is at most STEREO_DAEMON_SLOTS_MAX.
+ * @param strength
+ *     The strength of the stereo effect.
+ * @param is_inverted
+ *     Whether the z-buffer values are inverted.
+ * @return a new session, or NULL if the daemon cannot be reached or refused
+ *     the session, in which case errno is set
+ */
+StereoDaemonClient*
+stereo_daemon_client_connect(const char *path, const char *pattern,
+    unsigned int width, unsigned int height, unsigned int depth,
+    unsigned int slots, double strength, int is_inverted);
+
+/**
+ * Returns the number of slots of a session.
+ *
+ * @param client
+ *     The session.
+ * @return the number of slots
+ */
+unsigned int
+stereo_daemon_client_slot_count(StereoDaemonClient *client);
+
+/**
+ * Returns the z-buffer of a slot.
+ *
+ * The z-buffer lives in shared memory and is owned by the session; it must not
+ * be written while the slot is submitted.
+ *
+ * @param client
+ *     The session.
+ * @param slot
+ *     The index of the slot.
+ * @return the z-buffer, or NULL if slot is out of range
+ */
+ZBuffer*
+stereo_daemon_client_zbuffer(StereoDaemonClient *client, unsigned int slot);
+
+/**
+ * Returns the stereogram of a slot.
+ *
+ * The pixels of the stereogram live in shared memory that is mapped
+ * read-only, and the stereogram is owned by the session; it must be neither
+ * written nor freed, and it is only valid after stereo_daemon_client_wait has
+ * returned for the slot. Use stereo_pattern_unshare on a new reference to
+ * obtain a copy that may be modified.
+ *
+ * @param client
+ *     The session.
+ * @param slot
+ *     The index of the slot.
+ * @return the stereogram, or NULL if slot is out of range
+ */
+StereoPattern*
+stereo_daemon_client_image(StereoDaemonClient *client, unsigned int slot);
+
+/**
+ * Submits the z-buffer of a slot for rendering.
+ *
+ * @param client
+ *     The session.
+ * @param slot
+ *     The index of the slot.
+ * @param frame
+ *     The frame of the effect of the pattern to render with; this is ignored
+ *     if the pattern has no effect.
+ * @return non-zero upon success, or 0 if slot is out of range or already
+ *     submitted
+ */
+int
+stereo_daemon_client_submit(StereoDaemonClient *client, unsigned int slot,
+    unsigned int frame);
+
+/**
+ * Waits until a submitted slot has been rendered.
+ *
+ * @param client
+ *     The session.
+ * @param slot
+ *     The index of the slot.
+ * @return non-zero upon success, or 0 if the slot was not submitted, could
+ *     not be rendered or the daemon went away, in which case errno is set
+ */
+int
+stereo_daemon_client_wait(StereoDaemonClient *client, unsigned int slot);
+
+/**
+ * Closes a session.
+ *
+ * @param client
+ *     The session to close.
+ */
+void
+stereo_daemon_client_close(StereoDaemonClient *client);
+
+#endif
@@ -0,0 +1,333 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../private/daemon.h"
+
+struct StereoDaemonClient {
+    /** The connection */
+    int socket;
+
+    /** The eventfds signalled by the client and by the daemon */
+    int submitted, rendered;
+
+    /** The shared memory of the slots, and its size */
+    unsigned char *memory;
+    size_t size;
+
+    /** The number of slots */
+    unsigned int slot_count;
+
+    /** The headers, z-buffers and stereograms of the slots; the pixels of the
+        stereograms are mapped read-only */
+    DaemonSlot **slots;
+    ZBuffer **zbuffers;
+    StereoPattern **images;
+};
+
+/**
+ * Receives the reply of the daemon and the file descriptors sent with it.
+ *
+ * @param fds
+ *     Receives the file descriptors; these are set to -1 if none were sent.
+ * @return non-zero upon success, or 0 if the connection failed
+ */
+static int
+client_receive(StereoDaemonClient *client, DaemonReply *reply, int *fds)
+{
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+    struct msghdr message;
+    struct iovec vector;
+    struct cmsghdr *header;
+    ssize_t size;
+
+    memset(&message, 0, sizeof(message));
+    vector.iov_base = reply;
+    vector.iov_len = sizeof(*reply);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    fds[0] = fds[1] = fds[2] = fds[3] = -1;
+    do {
+        size = recvmsg(client->socket, &message, MSG_CMSG_CLOEXEC);
+    } while (size < 0 && errno == EINTR);
+    if (size != sizeof(*reply)) {
+        if (size >= 0) {
+            errno = EPROTO;
+        }
+        return 0;
+    }
+
+    for (header = CMSG_FIRSTHDR(&message); header;
+            header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET
+                && header->cmsg_type == SCM_RIGHTS
+                && header->cmsg_len == CMSG_LEN(4 * sizeof(int))) {
+            memcpy(fds, CMSG_DATA(header), 4 * sizeof(int));
+        }
+    }
+
+    return 1;
+}
+
+StereoDaemonClient*
+stereo_daemon_client_connect(const char *path, const char *pattern,
+    unsigned int width, unsigned int height, unsigned int depth,
+    unsigned int slots, double strength, int is_inverted)
+{
+    StereoDaemonClient *result;
+    struct sockaddr_un address;
+    DaemonRequest request;
+    DaemonReply reply;
+    int fds[4], error;
+    unsigned int i;
+
+    if (strlen(path) >= sizeof(address.sun_path)
+            || strlen(pattern) >= STEREO_DAEMON_NAME_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = calloc(1, sizeof(StereoDaemonClient));
+    if (!result) {
+        return NULL;
+    }
+    result->submitted = result->rendered = -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    memset(&request, 0, sizeof(request));
+    request.magic = DAEMON_MAGIC;
+    request.width = width;
+    request.height = height;
+    request.depth = depth;
+    request.slots = slots;
+    request.is_inverted = is_inverted;
+    request.strength = strength;
+    strcpy(request.pattern, pattern);
+
+    result->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (result->socket < 0
+            || connect(result->socket, (struct sockaddr*)&address,
+                sizeof(address))
+            || send(result->socket, &request, sizeof(request), MSG_NOSIGNAL)
+                != sizeof(request)
+            || !client_receive(result, &reply, fds)) {
+        goto error;
+    }
+    result->submitted = fds[2];
+    result->rendered = fds[3];
+    if (reply.error || fds[0] < 0 || fds[1] < 0 || fds[2] < 0
+            || fds[3] < 0) {
+        errno = reply.error ? reply.error : EPROTO;
+        goto memory;
+    }
+    if (reply.image_size != daemon_image_size(width, height)) {
+        errno = EPROTO;
+        goto memory;
+    }
+
+    result->size = reply.size;
+    result->memory = mmap(NULL, result->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fds[0], 0);
+    if (result->memory == MAP_FAILED) {
+        result->memory = NULL;
+        goto memory;
+    }
+
+    result->slot_count = slots;
+    result->slots = calloc(slots, sizeof(*result->slots));
+    result->zbuffers = calloc(slots, sizeof(*result->zbuffers));
+    result->images = calloc(slots, sizeof(*result->images));
+    if (!result->slots || !result->zbuffers || !result->images) {
+        errno = ENOMEM;
+        goto memory;
+    }
+    for (i = 0; i < slots; i++) {
+        unsigned char *slot = result->memory + i * reply.slot_size;
+
+        result->slots[i] = (DaemonSlot*)slot;
+        result->zbuffers[i] = stereo_zbuffer_create_from_data(width, height,
+            reply.stride, 1, slot + reply.zbuffer_offset);
+        if (!result->zbuffers[i]) {
+            errno = ENOMEM;
+            goto memory;
+        }
+        result->zbuffers[i]->depth = depth;
+        result->images[i] = daemon_image_map(fds[1], i, width, height,
+            PROT_READ);
+        if (!result->images[i]) {
+            goto memory;
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    return result;
+
+memory:
+    error = errno;
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+    errno = error;
+
+error:
+    error = errno;
+    stereo_daemon_client_close(result);
+    errno = error;
+    return NULL;
+}
+
+unsigned int
+stereo_daemon_client_slot_count(StereoDaemonClient *client)
+{
+    return client->slot_count;
+}
+
+ZBuffer*
+stereo_daemon_client_zbuffer(StereoDaemonClient *client, unsigned int slot)
+{
+    return slot < client->slot_count ? client->zbuffers[slot] : NULL;
+}
+
+StereoPattern*
+stereo_daemon_client_image(StereoDaemonClient *client, unsigned int slot)
+{
+    return slot < client->slot_count ? client->images[slot] : NULL;
+}
+
+int
+stereo_daemon_client_submit(StereoDaemonClient *client, unsigned int slot,
+    unsigned int frame)
+{
+    uint64_t one = 1;
+    DaemonSlot *header;
+
+    if (slot >= client->slot_count) {
+        errno = EINVAL;
+        return 0;
+    }
+    header = client->slots[slot];
+    if (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE)
+            == DAEMON_SLOT_SUBMITTED) {
+        errno = EBUSY;
+        return 0;
+    }
+
+    header->frame = frame;
+    __atomic_store_n(&header->state, DAEMON_SLOT_SUBMITTED,
+        __ATOMIC_RELEASE);
+
+    return write(client->submitted, &one, sizeof(one)) == sizeof(one);
+}
+
+int
+stereo_daemon_client_wait(StereoDaemonClient *client, unsigned int slot)
+{
+    struct pollfd fds[2];
+    DaemonSlot *header;
+
+    if (slot >= client->slot_count) {
+        errno = EINVAL;
+        return 0;
+    }
+    header = client->slots[slot];
+
+    fds[0].fd = client->rendered;
+    fds[0].events = POLLIN;
+    fds[1].fd = client->socket;
+    fds[1].events = POLLIN;
+
+    /* The eventfd counts the slots rendered since it was last read, so it may
+       be consumed while waiting for another slot, or by another thread; the
+       state of the slot is therefore checked before every wait, and the
+       eventfd does not block */
+    for (;;) {
+        uint64_t count;
+
+        switch (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE)) {
+        case DAEMON_SLOT_DONE:
+            __atomic_store_n(&header->state, DAEMON_SLOT_FREE,
+                __ATOMIC_RELAXED);
+            if (!header->result) {
+                errno = EINVAL;
+            }
+            return header->result;
+
+        case DAEMON_SLOT_FREE:
+            errno = EINVAL;
+            return 0;
+        }
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        if (fds[1].revents) {
+            errno = EPIPE;
+            return 0;
+        }
+        if (fds[0].revents
+                && read(client->rendered, &count, sizeof(count)) < 0
+                && errno != EAGAIN) {
+            return 0;
+        }
+    }
+}
+
+void
+stereo_daemon_client_close(StereoDaemonClient *client)
+{
+    unsigned int i;
+
+    if (client->zbuffers) {
+        for (i = 0; i < client->slot_count; i++) {
+            if (client->zbuffers[i]) {
+                stereo_zbuffer_free(client->zbuffers[i]);
+            }
+        }
+    }
+    free(client->zbuffers);
+    if (client->images) {
+        for (i = 0; i < client->slot_count; i++) {
+            if (client->images[i]) {
+                daemon_image_unmap(client->images[i]);
+            }
+        }
+    }
+    free(client->images);
+    free(client->slots);
+    if (client->memory) {
+        munmap(client->memory, client->size);
+    }
+    if (client->submitted >= 0) {
+        close(client->submitted);
+    }
+    if (client->rendered >= 0) {
+        close(client->rendered);
+    }
+    if (client->socket >= 0) {
+        close(client->socket);
+    }
+    free(client);
+}
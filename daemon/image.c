@@ -0,0 +1,65 @@
+#include <stddef.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../private/daemon.h"
+
+/**
+ * Returns the size of a page.
+ */
+static size_t
+daemon_page_size(void)
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+size_t
+daemon_image_size(unsigned int width, unsigned int height)
+{
+    size_t page = daemon_page_size();
+
+    return ((size_t)width * height * sizeof(PatternPixel) + page - 1)
+        & ~(page - 1);
+}
+
+StereoPattern*
+daemon_image_map(int fd, unsigned int slot, unsigned int width,
+    unsigned int height, int prot)
+{
+    StereoPattern *result;
+    size_t page = daemon_page_size();
+    size_t size = daemon_image_size(width, height);
+    unsigned char *memory;
+
+    /* The header lives at the end of a private page, and the shared pixels
+       are mapped over the pages following it */
+    memory = mmap(NULL, page + size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    if (mmap(memory + page, size, prot, MAP_SHARED | MAP_FIXED, fd,
+            (off_t)slot * size) == MAP_FAILED) {
+        munmap(memory, page + size);
+        return NULL;
+    }
+
+    result = (StereoPattern*)(memory + page
+        - offsetof(StereoPattern, pixels));
+    result->width = width;
+    result->height = height;
+    result->refs = 1;
+    result->owner = NULL;
+
+    return result;
+}
+
+void
+daemon_image_unmap(StereoPattern *image)
+{
+    size_t page = daemon_page_size();
+
+    munmap((unsigned char*)image->pixels - page,
+        page + daemon_image_size(image->width, image->height));
+}
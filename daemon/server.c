@@ -0,0 +1,705 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../private/daemon.h"
+#include "../stereo.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+/**
+ * The maximum number of pixels of the frames of a session.
+ */
+#define DAEMON_PIXELS_MAX (1 << 26)
+
+/**
+ * The number of pending connections of the socket.
+ */
+#define DAEMON_BACKLOG 16
+
+/**
+ * A pattern added with stereo_daemon_add_pattern.
+ */
+typedef struct DaemonPattern DaemonPattern;
+struct DaemonPattern {
+    /** The next pattern */
+    DaemonPattern *next;
+
+    /** The name of the pattern */
+    char name[STEREO_DAEMON_NAME_MAX];
+
+    /** The pattern */
+    StereoPattern *pattern;
+
+    /** The effect of the pattern, or NULL */
+    StereoPatternEffect *effect;
+};
+
+/**
+ * A client session.
+ */
+typedef struct DaemonSession DaemonSession;
+struct DaemonSession {
+    /** The next session */
+    DaemonSession *next;
+
+    /** The daemon */
+    StereoDaemon *daemon;
+
+    /** The thread serving the session */
+    pthread_t thread;
+
+    /** Set when the thread has finished */
+    int finished;
+
+    /** The connection */
+    int socket;
+
+    /** The eventfds signalled by the client and by the daemon */
+    int submitted, rendered;
+
+    /** The shared memory of the slots, and its size */
+    unsigned char *memory;
+    size_t size;
+
+    /** The number of slots, and the slot to look at first */
+    unsigned int slot_count, first;
+
+    /** The headers, z-buffers and stereograms of the slots; the headers of the
+        stereograms are private to the daemon */
+    DaemonSlot **slots;
+    ZBuffer **zbuffers;
+    StereoPattern **images;
+
+    /** The stereo image to render with; its own image is kept aside while a
+        slot is rendered */
+    StereoImage *image;
+    StereoPattern *own;
+
+    /** The effect of the pattern, or NULL */
+    StereoPatternEffect *effect;
+};
+
+struct StereoDaemon {
+    /** The path of the socket */
+    char *path;
+
+    /** The listening socket */
+    int socket;
+
+    /** A pipe that becomes readable when the daemon is stopped */
+    int stop[2];
+
+    /** The patterns */
+    DaemonPattern *patterns;
+
+    /** The running sessions */
+    DaemonSession *sessions;
+};
+
+StereoDaemon*
+stereo_daemon_create(const char *path)
+{
+    StereoDaemon *result;
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = malloc(sizeof(StereoDaemon));
+    if (!result) {
+        return NULL;
+    }
+    result->path = strdup(path);
+    result->patterns = NULL;
+    result->sessions = NULL;
+    result->stop[0] = result->stop[1] = -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    result->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (result->socket < 0
+            || bind(result->socket, (struct sockaddr*)&address,
+                sizeof(address))
+            || listen(result->socket, DAEMON_BACKLOG)
+            || pipe2(result->stop, O_CLOEXEC | O_NONBLOCK)) {
+        int error = errno;
+
+        stereo_daemon_free(result);
+        errno = error;
+        return NULL;
+    }
+
+    return result;
+}
+
+int
+stereo_daemon_add_pattern(StereoDaemon *daemon, const char *name,
+    StereoPattern *pattern, StereoPatternEffect *effect)
+{
+    DaemonPattern *entry;
+
+    if (strlen(name) >= STEREO_DAEMON_NAME_MAX) {
+        errno = EINVAL;
+        return 0;
+    }
+    for (entry = daemon->patterns; entry; entry = entry->next) {
+        if (!strcmp(entry->name, name)) {
+            errno = EEXIST;
+            return 0;
+        }
+    }
+
+    entry = malloc(sizeof(DaemonPattern));
+    if (!entry) {
+        return 0;
+    }
+    strcpy(entry->name, name);
+    entry->pattern = pattern;
+    entry->effect = effect;
+    entry->next = daemon->patterns;
+    daemon->patterns = entry;
+
+    return 1;
+}
+
+/**
+ * Sends the reply to the request of a session, with the file descriptors of
+ * the session if it was opened.
+ *
+ * @return non-zero upon success, or 0 if the client went away
+ */
+static int
+daemon_session_reply(DaemonSession *session, DaemonReply *reply,
+    const int *memory)
+{
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+    struct msghdr message;
+    struct iovec vector;
+
+    memset(&message, 0, sizeof(message));
+    vector.iov_base = reply;
+    vector.iov_len = sizeof(*reply);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+
+    if (!reply->error) {
+        struct cmsghdr *header;
+        int fds[4] = {memory[0], memory[1], session->submitted,
+            session->rendered};
+
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.data;
+        message.msg_controllen = sizeof(control.data);
+        header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    }
+
+    return sendmsg(session->socket, &message, MSG_NOSIGNAL)
+        == sizeof(*reply);
+}
+
+/**
+ * Creates a sealed memfd for a session.
+ *
+ * The size of the memory is sealed, so that the client cannot make the
+ * mappings of the daemon fault by truncating it.
+ *
+ * @return the file descriptor, or -1 upon error
+ */
+static int
+daemon_memory_create(const char *name, size_t size)
+{
+    int result = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (result >= 0 && (ftruncate(result, size)
+            || fcntl(result, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW))) {
+        int error = errno;
+
+        close(result);
+        errno = error;
+        return -1;
+    }
+
+    return result;
+}
+
+/**
+ * Opens a session: the shared memory and the stereo image are created and the
+ * reply is filled in.
+ *
+ * @param memory
+ *     Receives the file descriptors of the shared memory of the slots and of
+ *     the stereograms, which the caller closes once they have been sent.
+ * @return 0 upon success, or an errno value
+ */
+static int
+daemon_session_open(DaemonSession *session, const DaemonRequest *request,
+    DaemonReply *reply, int *memory)
+{
+    DaemonPattern *entry;
+    StereoPattern *pattern;
+    size_t j;
+    unsigned int i;
+
+    if (request->magic != DAEMON_MAGIC) {
+        return EPROTO;
+    }
+    if (!request->width || !request->height
+            || (unsigned long long)request->width * request->height
+                > DAEMON_PIXELS_MAX
+            || (request->depth != 8 && request->depth != 16)
+            || !request->slots || request->slots > STEREO_DAEMON_SLOTS_MAX
+            || !memchr(request->pattern, 0, sizeof(request->pattern))) {
+        return EINVAL;
+    }
+    for (entry = session->daemon->patterns; entry; entry = entry->next) {
+        if (!strcmp(entry->name, request->pattern)) {
+            break;
+        }
+    }
+    if (!entry) {
+        return ENOENT;
+    }
+
+    /* Every slot contains its header and the z-buffer, both written by the
+       client; the pixels of the stereograms live in memory of their own that
+       the client cannot write, and their headers are never shared */
+    reply->stride = request->width * (request->depth / 8);
+    reply->zbuffer_offset = DAEMON_ALIGN_UP(sizeof(DaemonSlot));
+    reply->slot_size = DAEMON_ALIGN_UP(reply->zbuffer_offset
+        + (size_t)reply->stride * request->height);
+    reply->size = reply->slot_size * request->slots;
+    reply->image_size = daemon_image_size(request->width, request->height);
+
+    session->slot_count = request->slots;
+    session->size = reply->size;
+    memory[0] = daemon_memory_create("stereo-daemon", session->size);
+    memory[1] = daemon_memory_create("stereo-daemon-images",
+        reply->image_size * request->slots);
+    if (memory[0] < 0 || memory[1] < 0) {
+        return errno;
+    }
+    session->memory = mmap(NULL, session->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, memory[0], 0);
+    if (session->memory == MAP_FAILED) {
+        session->memory = NULL;
+        return errno;
+    }
+
+    session->submitted = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    session->rendered = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (session->submitted < 0 || session->rendered < 0) {
+        return errno;
+    }
+
+    session->slots = calloc(session->slot_count, sizeof(*session->slots));
+    session->zbuffers = calloc(session->slot_count,
+        sizeof(*session->zbuffers));
+    session->images = calloc(session->slot_count, sizeof(*session->images));
+    if (!session->slots || !session->zbuffers || !session->images) {
+        return ENOMEM;
+    }
+    for (i = 0; i < session->slot_count; i++) {
+        unsigned char *slot = session->memory + i * reply->slot_size;
+
+        session->slots[i] = (DaemonSlot*)slot;
+        session->zbuffers[i] = stereo_zbuffer_create_from_data(
+            request->width, request->height, reply->stride, 1,
+            slot + reply->zbuffer_offset);
+        if (!session->zbuffers[i]) {
+            return ENOMEM;
+        }
+        session->zbuffers[i]->depth = request->depth;
+        session->images[i] = daemon_image_map(memory[1], i, request->width,
+            request->height, PROT_READ | PROT_WRITE);
+        if (!session->images[i]) {
+            return errno;
+        }
+
+        /* Rendering does not write alpha, so the stereograms start out as
+           those of stereo_pattern_create */
+        for (j = 0; j < (size_t)request->width * request->height; j++) {
+            PatternPixel *d = &session->images[i]->pixels[j];
+
+            d->r = d->g = d->b = 128;
+            d->a = 255;
+        }
+    }
+
+    /* Mappings created after this seal cannot be written, so only the
+       mappings of the daemon above may write the stereograms; kernels before
+       5.1 do not know the seal, and then the client may at worst scribble
+       over its own stereograms */
+    if (fcntl(memory[1], F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)
+            && (errno != EINVAL
+                || fcntl(memory[1], F_ADD_SEALS, F_SEAL_SEAL))) {
+        return errno;
+    }
+    if (fcntl(memory[0], F_ADD_SEALS, F_SEAL_SEAL)) {
+        return errno;
+    }
+
+    /* Without an effect the pattern is only read, so all sessions share it;
+       effects write to a copy of the session, so sessions may render
+       different frames of one effect at the same time */
+    pattern = stereo_pattern_ref(entry->pattern);
+    if (entry->effect) {
+        pattern = stereo_pattern_unshare(pattern);
+    }
+    session->effect = entry->effect;
+    session->image = stereo_image_create(request->width, request->height,
+        pattern, request->strength, request->is_inverted);
+    if (!session->image) {
+        stereo_pattern_free(pattern);
+        return ENOMEM;
+    }
+    session->own = session->image->image;
+
+    return 0;
+}
+
+/**
+ * Renders all submitted slots of a session.
+ *
+ * Slots are looked at in ring order starting after the last slot rendered, so
+ * that a client submitting in ring order is served in the same order.
+ */
+static void
+daemon_session_render(DaemonSession *session)
+{
+    StereoImage *image = session->image;
+    unsigned int first = session->first, n;
+
+    for (n = 0; n < session->slot_count; n++) {
+        unsigned int index = (first + n) % session->slot_count;
+        DaemonSlot *slot = session->slots[index];
+        StereoPattern *target = session->images[index];
+        uint64_t one = 1;
+
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)
+                != DAEMON_SLOT_SUBMITTED) {
+            continue;
+        }
+
+        slot->result = 1;
+        if (session->effect) {
+            slot->result = stereo_pattern_effect_render(session->effect,
+                image->pattern, slot->frame);
+        }
+        if (slot->result) {
+            image->image = target;
+            slot->result = stereo_image_apply(image,
+                session->zbuffers[index], 0);
+            image->image = session->own;
+        }
+
+        __atomic_store_n(&slot->state, DAEMON_SLOT_DONE, __ATOMIC_RELEASE);
+        if (write(session->rendered, &one, sizeof(one)) < 0) {
+            /* The counter cannot overflow before the client has read it */
+        }
+        session->first = (index + 1) % session->slot_count;
+    }
+}
+
+/**
+ * Frees the resources of a session.
+ */
+static void
+daemon_session_close(DaemonSession *session)
+{
+    unsigned int i;
+
+    if (session->image) {
+        session->image->image = session->own;
+        stereo_image_free(session->image);
+    }
+    if (session->zbuffers) {
+        for (i = 0; i < session->slot_count; i++) {
+            if (session->zbuffers[i]) {
+                stereo_zbuffer_free(session->zbuffers[i]);
+            }
+        }
+    }
+    free(session->zbuffers);
+    if (session->images) {
+        for (i = 0; i < session->slot_count; i++) {
+            if (session->images[i]) {
+                daemon_image_unmap(session->images[i]);
+            }
+        }
+    }
+    free(session->images);
+    free(session->slots);
+    if (session->memory) {
+        munmap(session->memory, session->size);
+    }
+    if (session->submitted >= 0) {
+        close(session->submitted);
+    }
+    if (session->rendered >= 0) {
+        close(session->rendered);
+    }
+    close(session->socket);
+}
+
+/**
+ * Receives the request of a session.
+ *
+ * The socket is polled together with the stop pipe, so a client that never
+ * sends its request does not keep the daemon from stopping.
+ *
+ * @return non-zero upon success or 0 if the connection was closed, failed or
+ *     the daemon was stopped first
+ */
+static int
+daemon_session_receive(DaemonSession *session, DaemonRequest *request)
+{
+    struct pollfd fds[2];
+    size_t received = 0;
+
+    fds[0].fd = session->socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = session->daemon->stop[0];
+    fds[1].events = POLLIN;
+
+    while (received < sizeof(*request)) {
+        ssize_t count;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        if (fds[1].revents) {
+            return 0;
+        }
+
+        count = recv(session->socket, (char*)request + received,
+            sizeof(*request) - received, MSG_DONTWAIT);
+        if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (count <= 0) {
+            return 0;
+        }
+        received += count;
+    }
+
+    return 1;
+}
+
+/**
+ * Serves a session.
+ *
+ * This is the entry point of the session threads.
+ */
+static void*
+daemon_session_run(DaemonSession *session)
+{
+    DaemonRequest request;
+    DaemonReply reply;
+    int memory[2] = {-1, -1};
+
+    memset(&reply, 0, sizeof(reply));
+    if (!daemon_session_receive(session, &request)) {
+        reply.error = EPROTO;
+    }
+    else {
+        reply.error = daemon_session_open(session, &request, &reply, memory);
+    }
+
+    if (daemon_session_reply(session, &reply, memory) && !reply.error) {
+        struct pollfd fds[3];
+
+        fds[0].fd = session->socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = session->submitted;
+        fds[1].events = POLLIN;
+        fds[2].fd = session->daemon->stop[0];
+        fds[2].events = POLLIN;
+
+        /* Nothing is sent on the connection after the request, so any
+           activity on it means that the client has gone */
+        for (;;) {
+            uint64_t count;
+
+            if (poll(fds, 3, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[0].revents || fds[2].revents) {
+                break;
+            }
+            if (fds[1].revents) {
+                if (read(session->submitted, &count, sizeof(count)) < 0
+                        && errno != EAGAIN) {
+                    break;
+                }
+                daemon_session_render(session);
+            }
+        }
+    }
+
+    if (memory[0] >= 0) {
+        close(memory[0]);
+    }
+    if (memory[1] >= 0) {
+        close(memory[1]);
+    }
+    daemon_session_close(session);
+    __atomic_store_n(&session->finished, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/**
+ * Joins and frees the sessions that have finished, or all sessions.
+ *
+ * @param all
+ *     Whether to wait for running sessions as well.
+ */
+static void
+daemon_sessions_reap(StereoDaemon *daemon, int all)
+{
+    DaemonSession **link = &daemon->sessions;
+
+    while (*link) {
+        DaemonSession *session = *link;
+
+        if (all || __atomic_load_n(&session->finished, __ATOMIC_ACQUIRE)) {
+            pthread_join(session->thread, NULL);
+            *link = session->next;
+            free(session);
+        }
+        else {
+            link = &session->next;
+        }
+    }
+}
+
+int
+stereo_daemon_run(StereoDaemon *daemon)
+{
+    struct pollfd fds[2];
+    int result = 0;
+
+    fds[0].fd = daemon->socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = daemon->stop[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        DaemonSession *session;
+        int connection;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            result = 1;
+            break;
+        }
+
+        connection = accept4(daemon->socket, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        daemon_sessions_reap(daemon, 0);
+
+        session = calloc(1, sizeof(DaemonSession));
+        if (!session) {
+            close(connection);
+            continue;
+        }
+        session->daemon = daemon;
+        session->socket = connection;
+        session->submitted = session->rendered = -1;
+        if (pthread_create(&session->thread, NULL,
+                (void*(*)(void*))daemon_session_run, session)) {
+            close(connection);
+            free(session);
+            continue;
+        }
+        session->next = daemon->sessions;
+        daemon->sessions = session;
+    }
+
+    /* The stop pipe stays readable, so every session sees it */
+    stereo_daemon_stop(daemon);
+    daemon_sessions_reap(daemon, 1);
+
+    return result;
+}
+
+void
+stereo_daemon_stop(StereoDaemon *daemon)
+{
+    char c = 0;
+
+    if (write(daemon->stop[1], &c, 1) < 0) {
+        /* The pipe is already readable if it is full */
+    }
+}
+
+void
+stereo_daemon_free(StereoDaemon *daemon)
+{
+    while (daemon->patterns) {
+        DaemonPattern *entry = daemon->patterns;
+
+        daemon->patterns = entry->next;
+        if (entry->effect) {
+            stereo_pattern_effect_free(entry->effect);
+        }
+        stereo_pattern_free(entry->pattern);
+        free(entry);
+    }
+
+    if (daemon->socket >= 0) {
+        close(daemon->socket);
+        unlink(daemon->path);
+    }
+    if (daemon->stop[0] >= 0) {
+        close(daemon->stop[0]);
+        close(daemon->stop[1]);
+    }
+    free(daemon->path);
+    free(daemon);
+}
@@ -22,6 +22,14 @@ struct StereoPatternEffect {
      */
     unsigned int iteration;
 
+    /**
+     * The seed from which the random initial state of the effect is derived.
+     *
+     * This is set to a value returned by rand() when the effect is created;
+     * use stereo_pattern_effect_seed to change it.
+     */
+    unsigned int seed;
+
     /**
      * Applies the effect to the specified rows.
      *
@@ -40,6 +48,52 @@ struct StereoPatternEffect {
     void (*Apply)(StereoPatternEffect *effect, int start, int end, int gstart,
         int gend);
 
+    /**
+     * Applies the effect to a horizontal span of pixels.
+     *
+     * Effects must only read the target pattern at the pixels they write, so
+     * that spans of several effects may be applied back to back.
+     *
+     * @param effect
+     *     The effect that is being applied.
+     * @param pixel
+     *     The first pixel of the span.
+     * @param x, y
+     *     The position of the first pixel.
+     * @param count
+     *     The number of pixels in the span.
+     */
+    void (*ApplySpan)(StereoPatternEffect *effect, PatternPixel *pixel, int x,
+        int count, int y);
+
+    /**
+     * Prefetches the data needed to apply the effect to a tile.
+     *
+     * This is only set for effects that prefer to be applied in tiles, and is
+     * otherwise NULL.
+     *
+     * @param effect
+     *     The effect that is being applied.
+     * @param x, y
+     *     The position of the top left pixel of the tile.
+     * @param width, height
+     *     The dimensions of the tile.
+     */
+    void (*Prefetch)(StereoPatternEffect *effect, int x, int y, int width,
+        int height);
+
+    /**
+     * Prepares the effect for a run.
+     *
+     * This is called every time stereo_pattern_effect_apply is called, before
+     * the calls to StereoPatternEffect::Apply. It is used to calculate values
+     * that are shared by many pixels. This may be NULL.
+     *
+     * @param effect
+     *     The effect that is about to be applied.
+     */
+    void (*Prepare)(StereoPatternEffect *effect);
+
     /**
      * Updates the internal state of the effect.
      *
@@ -51,6 +105,30 @@ struct StereoPatternEffect {
      */
     void (*Update)(StereoPatternEffect *effect);
 
+    /**
+     * Sets the internal state of the effect to that of a frame.
+     *
+     * @param effect
+     *     The effect.
+     * @param frame
+     *     The index of the frame.
+     */
+    void (*Seek)(StereoPatternEffect *effect, unsigned int frame);
+
+    /**
+     * Applies the effect as it is at a frame to a pattern, without changing
+     * the internal state of the effect.
+     *
+     * @param effect
+     *     The effect.
+     * @param target
+     *     The pattern to which to apply the effect.
+     * @param frame
+     *     The index of the frame.
+     */
+    void (*Render)(StereoPatternEffect *effect, StereoPattern *target,
+        unsigned int frame);
+
     /**
      * Releases the resources used by the effect.
      *
@@ -65,15 +143,83 @@ struct StereoPatternEffect {
  *
  * @param effect
  *     The effect to apply.
+ * @return non-zero upon success or 0 if the target pattern is shared, in
+ *     which case errno is set to EBUSY and the pattern is not modified
  */
-void
+int
 stereo_pattern_effect_apply(StereoPatternEffect *effect);
 
+/**
+ * Changes the target pattern of an effect.
+ *
+ * @param effect
+ *     The effect.
+ * @param pattern
+ *     The new target pattern. Its dimensions must be the same as those of the
+ *     current target pattern, and it must not be shared, otherwise this
+ *     function will fail.
+ * @return non-zero upon success or 0 otherwise
+ */
+int
+stereo_pattern_effect_retarget(StereoPatternEffect *effect,
+    StereoPattern *pattern);
+
+/**
+ * Sets the state of an effect to that of a frame.
+ *
+ * The next call to stereo_pattern_effect_apply produces the frame, and
+ * StereoPatternEffect::iteration is set to its index. The state of an effect
+ * depends only on its seed and the index of the frame, so frames may be
+ * produced in any order.
+ *
+ * @param effect
+ *     The effect.
+ * @param frame
+ *     The index of the frame.
+ */
+void
+stereo_pattern_effect_seek(StereoPatternEffect *effect, unsigned int frame);
+
+/**
+ * Changes the seed of an effect.
+ *
+ * The state of the effect is recalculated for the current iteration.
+ *
+ * @param effect
+ *     The effect.
+ * @param seed
+ *     The new seed.
+ */
+void
+stereo_pattern_effect_seed(StereoPatternEffect *effect, unsigned int seed);
+
+/**
+ * Applies an effect as it is at a frame to a pattern.
+ *
+ * The result is the same as seeking to the frame and applying the effect, but
+ * the effect itself is not modified, so several threads may render different
+ * frames of the same effect at the same time, as long as no thread applies,
+ * seeks or frees the effect meanwhile. The effect is applied on the calling
+ * thread.
+ *
+ * @param effect
+ *     The effect.
+ * @param target
+ *     The pattern to which to apply the effect. Its dimensions must be the
+ *     same as those of the target pattern of the effect.
+ * @param frame
+ *     The index of the frame.
+ * @return non-zero upon success or 0 if the dimensions of target are wrong
+ */
+int
+stereo_pattern_effect_render(StereoPatternEffect *effect,
+    StereoPattern *target, unsigned int frame);
+
 /**
  * A convenience macro to quickly create an effect, apply it and the free it.
  *
  * @param pattern
- *     The target pattern.
+ *     The target pattern. It is modified, so it must not be shared.
  * @param name
  *     The name of the effect. This macro uses this to generate the constructor
  *     function name for the effect by prepending stereo_pattern_effect_ to it.
@@ -84,8 +230,10 @@ stereo_pattern_effect_apply(StereoPatternEffect *effect);
     do { \
         StereoPatternEffect *_effect = stereo_pattern_effect_##name(pattern, \
             __VA_ARGS__); \
-        stereo_pattern_effect_apply(_effect); \
-        stereo_pattern_effect_free(_effect); \
+        if (_effect) { \
+            stereo_pattern_effect_apply(_effect); \
+            stereo_pattern_effect_free(_effect); \
+        } \
     } while (0)
 
 /**
@@ -101,7 +249,7 @@ stereo_pattern_effect_free(StereoPatternEffect *effect);
  * Overlays a luminance wave over the pattern.
  *
  * @param pattern
- *     The target pattern.
+ *     The target pattern. It is modified, so it must not be shared.
  * @param wave_count
  *     The number of luminance waves to use. The time complexity grows linearly
  *     with this value. The wave length of a wave is the dimension of the
@@ -111,20 +259,100 @@ stereo_pattern_effect_free(StereoPatternEffect *effect);
  *     visible wave, and a value of 1.0 will create a wave that covers all
  *     luminosity values. It must contain wave_count elements.
  * @param color_components
- *     Which colour components to affect.
- * @return a new effect
+ *     Which colour components to affect; a combination of the PP_* flags. The
+ *     alpha component is only affected if PP_ALPHA is included, regardless of
+ *     whether the library is built with STEREO_ALPHA.
+ * @return a new effect, or NULL if pattern is shared
  */
 StereoPatternEffect*
 stereo_pattern_effect_luminance(StereoPattern *pattern, unsigned int wave_count,
     double *strengths, int color_components);
 
+/**
+ * Flags for stereo_pattern_effect_cache.
+ */
+enum {
+    /** Store frames compressed; this uses less memory, but every replayed
+        frame must be decompressed */
+    STEREO_EFFECT_CACHE_COMPRESS = 1 << 0
+};
+
+/**
+ * Caches the frames of a periodic effect.
+ *
+ * During the first period, the effect is applied as usual and every frame it
+ * produces is stored. After that, frames are copied from the cache instead of
+ * being calculated again. The state of the cached effect is still updated
+ * every frame.
+ *
+ * If the period is not known, it is detected by comparing every frame with the
+ * first one. If the frames of a whole period do not fit in the budget before
+ * the period is detected, caching is abandoned. If the period is known but the
+ * frames do not fit, only the frames at the start of the period are cached.
+ *
+ * Frames are stored in order from the first frame of the period; after a seek
+ * to any other frame, storing resumes once the next frame to store is reached.
+ *
+ * @param pattern
+ *     The target pattern. The effect is retargeted to it, so it must have been
+ *     created for a pattern with the same dimensions.
+ * @param effect
+ *     The effect to cache. Ownership of the effect is assumed by the cache,
+ *     and the cache frees it when it is freed.
+ * @param period
+ *     The number of frames after which the effect repeats, or 0 to detect it.
+ * @param budget
+ *     The maximum number of bytes to use for stored frames.
+ * @param flags
+ *     A combination of STEREO_EFFECT_CACHE_* flags.
+ * @return a new effect, or NULL if the dimensions of the pattern of effect are
+ *     different from those of pattern or if pattern is shared
+ */
+StereoPatternEffect*
+stereo_pattern_effect_cache(StereoPattern *pattern,
+    StereoPatternEffect *effect, unsigned int period, size_t budget,
+    int flags);
+
+/**
+ * Returns the period of a cached effect.
+ *
+ * @param effect
+ *     An effect created by stereo_pattern_effect_cache.
+ * @return the period, or 0 if it has not been detected yet
+ */
+unsigned int
+stereo_pattern_effect_cache_period(StereoPatternEffect *effect);
+
+/**
+ * Fuses several effects into one.
+ *
+ * The effects are applied in a single pass over the pattern: for every short
+ * span of pixels, the effects are applied in order while the span is in the
+ * cache, instead of one full pass per effect. The result is the same as when
+ * applying the effects one after another.
+ *
+ * @param pattern
+ *     The target pattern. The effects are retargeted to it, so they must have
+ *     been created for a pattern with the same dimensions.
+ * @param effect_count
+ *     The number of effects.
+ * @param effects
+ *     The effects to apply, in order. Ownership of the effects is assumed by
+ *     the chain, and the chain frees them when it is freed.
+ * @return a new effect, or NULL if the dimensions of the pattern of any effect
+ *     are different from those of pattern or if pattern is shared
+ */
+StereoPatternEffect*
+stereo_pattern_effect_chain(StereoPattern *pattern, unsigned int effect_count,
+    StereoPatternEffect **effects);
+
 /**
  * Renders a distorted copy of source on pattern.
  *
  * Every time the effect is applied, the waves move slighty.
  *
  * @param pattern
- *     The target pattern.
+ *     The target pattern. It is modified, so it must not be shared.
  * @param wave_count
  *     The number of waves to use. The time complexity grows linearly with this
  *     value. The wave length of a wave is the dimension of the pattern divided
@@ -136,8 +364,9 @@ stereo_pattern_effect_luminance(StereoPattern *pattern, unsigned int wave_count,
  * @param source
  *     The pattern that is distorted and copied to the target. Ownership of this
  *     pattern is assumed by the effect, and the effect frees it when the effect
- *     is freed.
- * @return a new effect
+ *     is freed, or immediately if this function fails. It is only read, so it
+ *     may be shared.
+ * @return a new effect, or NULL if pattern is shared
  */
 StereoPatternEffect*
 stereo_pattern_effect_wave(StereoPattern *pattern, unsigned int wave_count,
@@ -0,0 +1,461 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "../effect.h"
+
+typedef struct CacheEffect CacheEffect;
+#define EFFECT CacheEffect
+#define EFFECT_SPAN
+#define EFFECT_TILED
+#define EFFECT_RENDER
+#include "../private/effect.h"
+
+/**
+ * A stored frame.
+ */
+typedef struct {
+    /** The pixel data, which may be compressed */
+    void *data;
+
+    /** The size of data in bytes */
+    size_t size;
+
+    /** Whether data is compressed */
+    int compressed;
+
+    /** A hash of the uncompressed pixel data */
+    unsigned long long hash;
+} CacheFrame;
+
+/**
+ * Effect data for a frame cache.
+ */
+struct CacheEffect {
+    STEREO_PATTERN_EFFECT_HEADER;
+
+    /** The cached effect */
+    StereoPatternEffect *effect;
+
+    /** The period of the effect, or 0 if it has not yet been detected */
+    unsigned int period;
+
+    /** The maximum number of bytes to use for stored frames */
+    size_t budget;
+
+    /** The number of bytes used by stored frames */
+    size_t used;
+
+    /** The STEREO_EFFECT_CACHE_* flags */
+    int flags;
+
+    /** The index of the next frame */
+    unsigned int frame;
+
+    /** The stored frames, starting with the first frame of the period */
+    CacheFrame *frames;
+
+    /** The number of stored frames */
+    unsigned int frame_count;
+
+    /** The allocated length of frames */
+    unsigned int frame_capacity;
+
+    /** Whether no more frames are stored */
+    int full;
+
+    /** Whether the current frame is replayed from the cache */
+    int hit;
+
+    /** The pixels of the current frame when it is replayed, or the pixels
+        captured from the effect when it is not */
+    PatternPixel *scratch;
+
+    /** The pixels replayed; this points either to a stored frame or to
+        scratch */
+    const PatternPixel *current;
+};
+
+/**
+ * Calculates a hash of pixel data.
+ *
+ * @param pixels
+ *     The pixel data.
+ * @param count
+ *     The number of pixels.
+ * @return a hash
+ */
+static unsigned long long
+cache_hash(const PatternPixel *pixels, size_t count)
+{
+    const unsigned int *words = (const unsigned int*)pixels;
+    unsigned long long result = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        result = (result ^ words[i]) * 1099511628211ULL;
+    }
+
+    return result;
+}
+
+/**
+ * Returns the number of pixels in a frame.
+ *
+ * @param effect
+ *     The cache.
+ * @return the number of pixels
+ */
+static inline size_t
+cache_frame_pixels(CacheEffect *effect)
+{
+    return (size_t)effect->b.pattern->width * effect->b.pattern->height;
+}
+
+/**
+ * Unpacks a stored frame.
+ *
+ * @param effect
+ *     The cache.
+ * @param frame
+ *     The frame to unpack.
+ * @param buffer
+ *     The buffer to which compressed frames are unpacked.
+ * @return the pixels of the frame; this is either the stored data or buffer,
+ *     or NULL if a compressed frame cannot be unpacked, in which case the
+ *     frame must be calculated again
+ */
+static const PatternPixel*
+cache_unpack(CacheEffect *effect, CacheFrame *frame, PatternPixel *buffer)
+{
+    size_t expected = cache_frame_pixels(effect) * sizeof(PatternPixel);
+    uLongf size = expected;
+
+    if (!frame->compressed) {
+        return frame->data;
+    }
+
+    if (uncompress((Bytef*)buffer, &size, frame->data, frame->size) != Z_OK
+            || size != expected) {
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/**
+ * Stores the frame in scratch.
+ *
+ * @param effect
+ *     The cache.
+ * @return non-zero if the frame was stored, or 0 if the budget is exhausted
+ */
+static int
+cache_store(CacheEffect *effect)
+{
+    size_t size = cache_frame_pixels(effect) * sizeof(PatternPixel);
+    CacheFrame frame;
+
+    frame.hash = cache_hash(effect->scratch, cache_frame_pixels(effect));
+    frame.data = NULL;
+    frame.compressed = 0;
+
+    if (effect->flags & STEREO_EFFECT_CACHE_COMPRESS) {
+        uLongf compressed = compressBound(size);
+
+        frame.data = malloc(compressed);
+        if (frame.data && compress2(frame.data, &compressed,
+                (const Bytef*)effect->scratch, size, Z_BEST_SPEED) == Z_OK) {
+            frame.size = compressed;
+            frame.data = realloc(frame.data, compressed);
+            frame.compressed = 1;
+        }
+        else {
+            /* The frame is stored as is */
+            free(frame.data);
+            frame.data = NULL;
+        }
+    }
+    if (!frame.data) {
+        frame.data = malloc(size);
+        if (!frame.data) {
+            return 0;
+        }
+        memcpy(frame.data, effect->scratch, size);
+        frame.size = size;
+    }
+
+    if (effect->used + frame.size > effect->budget) {
+        free(frame.data);
+        return 0;
+    }
+
+    if (effect->frame_count == effect->frame_capacity) {
+        effect->frame_capacity = effect->frame_capacity
+            ? 2 * effect->frame_capacity : 16;
+        effect->frames = realloc(effect->frames,
+            effect->frame_capacity * sizeof(*effect->frames));
+    }
+    effect->frames[effect->frame_count++] = frame;
+    effect->used += frame.size;
+
+    return 1;
+}
+
+/**
+ * Frees all stored frames.
+ *
+ * @param effect
+ *     The cache.
+ */
+static void
+cache_clear(CacheEffect *effect)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->frame_count; i++) {
+        free(effect->frames[i].data);
+    }
+    effect->frame_count = 0;
+    effect->used = 0;
+}
+
+/**
+ * Checks whether the current frame is the next one to store.
+ *
+ * Frames are stored in order from the first frame of the period, so after a
+ * seek nothing is stored until the effect is back at the next missing frame.
+ *
+ * @param effect
+ *     The cache.
+ * @return non-zero if the current frame follows the stored frames
+ */
+static int
+cache_is_next(CacheEffect *effect)
+{
+    return (effect->period ? effect->frame % effect->period : effect->frame)
+        == effect->frame_count;
+}
+
+/**
+ * Checks whether the frame in scratch is a repetition of the first frame.
+ *
+ * @param effect
+ *     The cache.
+ * @return non-zero if the frame is the same as the first frame
+ */
+static int
+cache_is_repeat(CacheEffect *effect)
+{
+    size_t count = cache_frame_pixels(effect);
+    unsigned long long hash;
+    const PatternPixel *pixels;
+    PatternPixel *first;
+    int result;
+
+    if (!effect->frame_count) {
+        return 0;
+    }
+
+    hash = cache_hash(effect->scratch, count);
+    if (hash != effect->frames[0].hash) {
+        return 0;
+    }
+
+    /* Confirm the match, since the hashes may collide */
+    first = malloc(count * sizeof(PatternPixel));
+    memcpy(first, effect->scratch, count * sizeof(PatternPixel));
+    pixels = cache_unpack(effect, &effect->frames[0], effect->scratch);
+    result = pixels && !memcmp(first, pixels, count * sizeof(PatternPixel));
+    memcpy(effect->scratch, first, count * sizeof(PatternPixel));
+    free(first);
+
+    return result;
+}
+
+static inline void
+effect_apply_span(CacheEffect *effect, PatternPixel *pixel, int x, int count,
+    int y)
+{
+    size_t offset = (size_t)y * effect->b.pattern->width + x;
+
+    if (effect->hit) {
+        memcpy(pixel, effect->current + offset, count * sizeof(PatternPixel));
+    }
+    else {
+        effect->effect->ApplySpan(effect->effect, pixel, x, count, y);
+        if (!effect->full) {
+            memcpy(effect->scratch + offset, pixel,
+                count * sizeof(PatternPixel));
+        }
+    }
+}
+
+static inline void
+effect_apply(CacheEffect *effect, PatternPixel *pixel, int x, int y)
+{
+    effect_apply_span(effect, pixel, x, 1, y);
+}
+
+/**
+ * See effect_prefetch.
+ */
+static inline void
+effect_prefetch(CacheEffect *effect, int x, int y, int width, int height)
+{
+    if (!effect->hit && effect->effect->Prefetch) {
+        effect->effect->Prefetch(effect->effect, x, y, width, height);
+    }
+}
+
+/**
+ * See StereoPatternEffect::Prepare.
+ */
+static void
+effect_prepare(CacheEffect *effect)
+{
+    /* Frames are only replayed once the period is known */
+    effect->hit = effect->period
+        && effect->frame % effect->period < effect->frame_count;
+    if (effect->hit) {
+        effect->current = cache_unpack(effect,
+            &effect->frames[effect->frame % effect->period], effect->scratch);
+
+        /* A frame that cannot be unpacked is calculated again */
+        effect->hit = effect->current != NULL;
+    }
+    if (effect->hit) {
+        return;
+    }
+
+    /* The cache may have been retargeted */
+    effect->effect->pattern = effect->b.pattern;
+    if (effect->effect->Prepare) {
+        effect->effect->Prepare(effect->effect);
+    }
+}
+
+/**
+ * See StereoPatternEffect::Update.
+ */
+static void
+effect_update(CacheEffect *effect)
+{
+    /* The state of the effect must advance even when it is not applied */
+    effect->effect->Update(effect->effect);
+    effect->effect->iteration++;
+
+    if (!effect->hit && !effect->full && cache_is_next(effect)) {
+        if (!effect->period && cache_is_repeat(effect)) {
+            /* This frame is the first frame of the next period */
+            effect->period = effect->frame;
+            effect->full = 1;
+        }
+        else if (effect->period
+                && effect->frame_count >= effect->period) {
+            effect->full = 1;
+        }
+        else if (!cache_store(effect)) {
+            /* Without a known period, a partial cache is useless */
+            if (!effect->period) {
+                cache_clear(effect);
+            }
+            effect->full = 1;
+        }
+    }
+
+    effect->frame++;
+}
+
+/**
+ * See StereoPatternEffect::Seek.
+ *
+ * Stored frames are kept, since they are stored by their frame number; see
+ * cache_is_next.
+ */
+static void
+effect_seek(CacheEffect *effect, unsigned int frame)
+{
+    stereo_pattern_effect_seek(effect->effect, frame);
+    effect->frame = frame;
+}
+
+/**
+ * See StereoPatternEffect::Render.
+ *
+ * Stored frames are copied to the target, and other frames are rendered by
+ * the cached effect.
+ */
+static void
+effect_render(CacheEffect *effect, StereoPattern *target, unsigned int frame)
+{
+    const PatternPixel *pixels = NULL;
+
+    if (effect->period && frame % effect->period < effect->frame_count) {
+        pixels = cache_unpack(effect, &effect->frames[frame % effect->period],
+            target->pixels);
+    }
+
+    /* Frames that are not stored or cannot be unpacked are rendered */
+    if (!pixels) {
+        effect->effect->Render(effect->effect, target, frame);
+    }
+    else if (pixels != target->pixels) {
+        memcpy(target->pixels, pixels,
+            cache_frame_pixels(effect) * sizeof(PatternPixel));
+    }
+}
+
+/**
+ * See StereoPatternEffect::Release.
+ */
+static void
+effect_release(CacheEffect *effect)
+{
+    cache_clear(effect);
+    free(effect->frames);
+    free(effect->scratch);
+    stereo_pattern_effect_free(effect->effect);
+    free(effect);
+}
+
+StereoPatternEffect*
+stereo_pattern_effect_cache(StereoPattern *pattern,
+    StereoPatternEffect *effect, unsigned int period, size_t budget, int flags)
+{
+    CacheEffect *result;
+
+    if (!stereo_pattern_effect_retarget(effect, pattern)) {
+        return NULL;
+    }
+
+    result = malloc(sizeof(CacheEffect));
+
+    /* Initialise the basic effect data */
+    stereo_effect_vt_initialize(result, pattern, cache);
+    result->b.Prepare = (void*)effect_prepare;
+
+    result->effect = effect;
+    result->period = period;
+    result->budget = budget;
+    result->used = 0;
+    result->flags = flags;
+    result->frame = 0;
+    result->frames = NULL;
+    result->frame_count = 0;
+    result->frame_capacity = 0;
+    result->full = 0;
+    result->hit = 0;
+    result->scratch = malloc(cache_frame_pixels(result)
+        * sizeof(PatternPixel));
+    result->current = NULL;
+
+    return (StereoPatternEffect*)result;
+}
+
+unsigned int
+stereo_pattern_effect_cache_period(StereoPatternEffect *effect)
+{
+    return ((CacheEffect*)effect)->period;
+}
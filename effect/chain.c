@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../effect.h"
+
+typedef struct ChainEffect ChainEffect;
+#define EFFECT ChainEffect
+#define EFFECT_SPAN
+#define EFFECT_TILED
+#define EFFECT_RENDER
+#include "../private/effect.h"
+
+/**
+ * Effect data for a chain of effects.
+ */
+struct ChainEffect {
+    STEREO_PATTERN_EFFECT_HEADER;
+
+    /** The number of effects */
+    unsigned int effect_count;
+
+    /** The effects; it contains effect_count elements */
+    StereoPatternEffect **effects;
+};
+
+static inline void
+effect_apply(ChainEffect *effect, PatternPixel *pixel, int x, int y)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        effect->effects[i]->ApplySpan(effect->effects[i], pixel, x, 1, y);
+    }
+}
+
+/**
+ * See effect_apply_span.
+ *
+ * Since this effect is tiled, a span is at most EFFECT_TILE_WIDTH pixels, so
+ * it stays in the cache while all effects are applied to it.
+ */
+static inline void
+effect_apply_span(ChainEffect *effect, PatternPixel *pixel, int x, int count,
+    int y)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        effect->effects[i]->ApplySpan(effect->effects[i], pixel, x, count, y);
+    }
+}
+
+/**
+ * See effect_prefetch.
+ */
+static inline void
+effect_prefetch(ChainEffect *effect, int x, int y, int width, int height)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        if (effect->effects[i]->Prefetch) {
+            effect->effects[i]->Prefetch(effect->effects[i], x, y, width,
+                height);
+        }
+    }
+}
+
+/**
+ * See StereoPatternEffect::Prepare.
+ */
+static void
+effect_prepare(ChainEffect *effect)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        /* The chain may have been retargeted */
+        effect->effects[i]->pattern = effect->b.pattern;
+
+        if (effect->effects[i]->Prepare) {
+            effect->effects[i]->Prepare(effect->effects[i]);
+        }
+    }
+}
+
+/**
+ * See StereoPatternEffect::Update.
+ */
+static void
+effect_update(ChainEffect *effect)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        effect->effects[i]->Update(effect->effects[i]);
+        effect->effects[i]->iteration++;
+    }
+}
+
+/**
+ * See StereoPatternEffect::Seek.
+ */
+static void
+effect_seek(ChainEffect *effect, unsigned int frame)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        stereo_pattern_effect_seek(effect->effects[i], frame);
+    }
+}
+
+/**
+ * See StereoPatternEffect::Render.
+ *
+ * The effects are rendered one after another, which gives the same result as
+ * applying the chain.
+ */
+static void
+effect_render(ChainEffect *effect, StereoPattern *target, unsigned int frame)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        effect->effects[i]->Render(effect->effects[i], target, frame);
+    }
+}
+
+/**
+ * See StereoPatternEffect::Release.
+ */
+static void
+effect_release(ChainEffect *effect)
+{
+    unsigned int i;
+
+    for (i = 0; i < effect->effect_count; i++) {
+        stereo_pattern_effect_free(effect->effects[i]);
+    }
+    free(effect->effects);
+    free(effect);
+}
+
+StereoPatternEffect*
+stereo_pattern_effect_chain(StereoPattern *pattern, unsigned int effect_count,
+    StereoPatternEffect **effects)
+{
+    ChainEffect *result;
+    unsigned int i;
+
+    /* All effects must be able to target the pattern; this is checked before
+       any of them is retargeted, so the effects are unchanged upon failure */
+    if (stereo_pattern_is_shared(pattern)) {
+        errno = EBUSY;
+        return NULL;
+    }
+    for (i = 0; i < effect_count; i++) {
+        if (effects[i]->pattern->width != pattern->width
+                || effects[i]->pattern->height != pattern->height) {
+            return NULL;
+        }
+    }
+    for (i = 0; i < effect_count; i++) {
+        stereo_pattern_effect_retarget(effects[i], pattern);
+    }
+
+    result = malloc(sizeof(ChainEffect));
+
+    /* Initialise the basic effect data */
+    stereo_effect_vt_initialize(result, pattern, chain);
+    result->b.Prepare = (void*)effect_prepare;
+
+    result->effect_count = effect_count;
+    result->effects = malloc(effect_count * sizeof(*result->effects));
+    memcpy(result->effects, effects, effect_count * sizeof(*effects));
+
+    return (StereoPatternEffect*)result;
+}
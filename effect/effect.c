@@ -1,12 +1,19 @@
+#include <errno.h>
 #include <stdlib.h>
 
 #include <para/para.h>
 
+#include "../private/sched.h"
+
 #include "../effect.h"
+#include "../tune.h"
 
 typedef struct {
     StereoPatternEffect b;
     ParaContext *para;
+    Sched sched;
+    int grain;
+    size_t size;
 } GenericEffect;
 
 /**
@@ -18,13 +25,93 @@ typedef struct {
 #define stereo_pattern_effect_para(effect) \
     ((GenericEffect*)effect)->para
 
-void
+/**
+ * Retrieves the row scheduler from an effect.
+ *
+ * @see stereo_pattern_effect_para
+ */
+#define stereo_pattern_effect_sched(effect) \
+    (&((GenericEffect*)effect)->sched)
+
+int
 stereo_pattern_effect_apply(StereoPatternEffect *effect)
 {
-    para_execute(stereo_pattern_effect_para(effect),
-        0, effect->pattern->height);
+    StereoPattern *pattern = effect->pattern;
+    const StereoTuning *tuning;
+
+    /* The target may have gained references since it was set */
+    if (stereo_pattern_is_shared(pattern)) {
+        errno = EBUSY;
+        return 0;
+    }
+
+    tuning = stereo_tuning_get(pattern->width, 0);
+    if (effect->Prepare) {
+        effect->Prepare(effect);
+    }
+
+    /* Small patterns are not worth waking up the workers for */
+    if (pattern->width * pattern->height < tuning->inline_pixels) {
+        effect->Apply(effect, 0, pattern->height, 0, pattern->height);
+    }
+    else {
+        sched_initialize(stereo_pattern_effect_sched(effect),
+            0, pattern->height, tuning);
+        stereo_pattern_effect_sched(effect)->grain =
+            ((GenericEffect*)effect)->grain;
+        para_execute(stereo_pattern_effect_para(effect),
+            0, pattern->height);
+    }
     effect->Update(effect);
     effect->iteration++;
+
+    return 1;
+}
+
+int
+stereo_pattern_effect_retarget(StereoPatternEffect *effect,
+    StereoPattern *pattern)
+{
+    if (pattern->width != effect->pattern->width
+            || pattern->height != effect->pattern->height) {
+        return 0;
+    }
+    if (stereo_pattern_is_shared(pattern)) {
+        errno = EBUSY;
+        return 0;
+    }
+
+    effect->pattern = pattern;
+
+    return 1;
+}
+
+void
+stereo_pattern_effect_seek(StereoPatternEffect *effect, unsigned int frame)
+{
+    effect->Seek(effect, frame);
+    effect->iteration = frame;
+}
+
+void
+stereo_pattern_effect_seed(StereoPatternEffect *effect, unsigned int seed)
+{
+    effect->seed = seed;
+    stereo_pattern_effect_seek(effect, effect->iteration);
+}
+
+int
+stereo_pattern_effect_render(StereoPatternEffect *effect,
+    StereoPattern *target, unsigned int frame)
+{
+    if (target->width != effect->pattern->width
+            || target->height != effect->pattern->height) {
+        return 0;
+    }
+
+    effect->Render(effect, target, frame);
+
+    return 1;
 }
 
 void
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../private/fix.h"
 #include "../private/sin.h"
@@ -7,6 +9,7 @@
 
 typedef struct LuminanceEffect LuminanceEffect;
 #define EFFECT LuminanceEffect
+#define EFFECT_VARIANTS
 #include "../private/effect.h"
 
 /**
@@ -27,41 +30,103 @@ struct LuminanceEffect {
     /** The pixel components */
     int components;
 
-    /** The sin lookup table */
-    SinTable hsin, vsin;
+    /** The shared sin lookup tables */
+    SinPhase hsin, vsin;
+
+    /** The sum of the horizontal terms of all waves for every column, scaled
+        by their strengths; it contains pattern->width elements */
+    int *columns;
+
+    /** The sum of the vertical terms of all waves for every row, scaled by
+        their strengths; it contains pattern->height elements */
+    int *rows;
 };
 
 /**
- * See StereoPatternEffect::Apply.
+ * Changes the value of some components of a pixel.
+ *
+ * @param pixel
+ *     The pixel to change.
+ * @param v
+ *     The value change as a fixed point value.
+ * @param components
+ *     The components to change.
  */
 static inline void
-effect_apply(LuminanceEffect *effect, PatternPixel *pixel, int x, int y)
+luminance_apply(PatternPixel *pixel, int v, int components)
 {
-    int i;
-    int v = 0;
-
-    /* Add all waves together */
-    for (i = 0; i < effect->wave_count; i++) {
-        v += mul(effect->strengths[i], 0
-            + ssin(&effect->hsin, effect->offsets[i] + x * (i + 1))
-            + ssin(&effect->vsin, effect->offsets[i] + y * (i + 1)));
-    }
-
-    /* Apply the value change */
-    if (effect->components & PP_RED) {
+    if (components & PP_RED) {
         pixel->r = cap(pixel->r + mul(pixel->r, v));
     }
-    if (effect->components & PP_GREEN) {
+    if (components & PP_GREEN) {
         pixel->g = cap(pixel->g + mul(pixel->g, v));
     }
-    if (effect->components & PP_BLUE) {
+    if (components & PP_BLUE) {
         pixel->b = cap(pixel->b + mul(pixel->b, v));
     }
-#ifdef STEREO_ALPHA
-    if (effect->components & PP_ALPHA) {
+    if (components & PP_ALPHA) {
         pixel->a = cap(pixel->a + mul(pixel->a, v));
     }
-#endif
+}
+
+/**
+ * See StereoPatternEffect::Apply.
+ */
+static inline void
+effect_apply(LuminanceEffect *effect, PatternPixel *pixel, int x, int y)
+{
+    luminance_apply(pixel, unmkfix(effect->columns[x] + effect->rows[y]),
+        effect->components);
+}
+
+/**
+ * See effect_apply_span_variant.
+ *
+ * The variant is the set of components to change. The wave sums are read into
+ * locals first, since the pixel stores could otherwise alias them.
+ */
+static inline void
+effect_apply_span_variant(LuminanceEffect *effect, PatternPixel *pixel, int x,
+    int count, int y, int components)
+{
+    const int *columns = effect->columns + x;
+    int row = effect->rows[y];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        luminance_apply(&pixel[i], unmkfix(columns[i] + row), components);
+    }
+}
+
+/**
+ * See StereoPatternEffect::Prepare.
+ *
+ * The horizontal term of a wave depends only on x and the vertical term only
+ * on y, so the sums are calculated once per column and row instead of once per
+ * pixel.
+ */
+static void
+effect_prepare(LuminanceEffect *effect)
+{
+    StereoPattern *pattern = effect->b.pattern;
+    int i, x, y;
+
+    memset(effect->columns, 0, pattern->width * sizeof(*effect->columns));
+    memset(effect->rows, 0, pattern->height * sizeof(*effect->rows));
+
+    for (i = 0; i < effect->wave_count; i++) {
+        int strength = effect->strengths[i];
+        unsigned int offset = effect->offsets[i];
+
+        for (x = 0; x < pattern->width; x++) {
+            effect->columns[x] += strength
+                * sin_phase(&effect->hsin, offset + x * (i + 1));
+        }
+        for (y = 0; y < pattern->height; y++) {
+            effect->rows[y] += strength
+                * sin_phase(&effect->vsin, offset + y * (i + 1));
+        }
+    }
 }
 
 /**
@@ -77,6 +142,47 @@ effect_update(LuminanceEffect *effect)
     }
 }
 
+/**
+ * See StereoPatternEffect::Seek.
+ *
+ * Every update adds the index of a wave to its offset, so the offsets of a
+ * frame follow directly from the initial offsets.
+ */
+static void
+effect_seek(LuminanceEffect *effect, unsigned int frame)
+{
+    unsigned int seed = effect->b.seed;
+    int i;
+
+    for (i = 0; i < effect->wave_count; i++) {
+        effect->offsets[i] = (unsigned int)rand_r(&seed) + i * frame;
+    }
+}
+
+/**
+ * See effect_frame_initialize.
+ */
+static void
+effect_frame_initialize(LuminanceEffect *effect)
+{
+    StereoPattern *pattern = effect->b.pattern;
+
+    effect->offsets = malloc(effect->wave_count * sizeof(*effect->offsets));
+    effect->columns = malloc(pattern->width * sizeof(*effect->columns));
+    effect->rows = malloc(pattern->height * sizeof(*effect->rows));
+}
+
+/**
+ * See effect_frame_finalize.
+ */
+static void
+effect_frame_finalize(LuminanceEffect *effect)
+{
+    free(effect->offsets);
+    free(effect->columns);
+    free(effect->rows);
+}
+
 /**
  * See StereoPatternEffect::Release.
  */
@@ -84,9 +190,9 @@ static void
 effect_release(LuminanceEffect *effect)
 {
     free(effect->strengths);
-    free(effect->offsets);
-    sin_table_finalize(&effect->hsin);
-    sin_table_finalize(&effect->vsin);
+    effect_frame_finalize(effect);
+    sin_phase_finalize(&effect->hsin);
+    sin_phase_finalize(&effect->vsin);
     free(effect);
 }
 
@@ -94,11 +200,19 @@ StereoPatternEffect*
 stereo_pattern_effect_luminance(StereoPattern *pattern, unsigned int wave_count,
     double *strengths, int components)
 {
-    LuminanceEffect *result = malloc(sizeof(LuminanceEffect));
+    LuminanceEffect *result;
     int i;
 
+    if (stereo_pattern_is_shared(pattern)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    result = malloc(sizeof(LuminanceEffect));
+
     /* Initialise the basic effect data */
     stereo_effect_vt_initialize(result, pattern, luminance);
+    result->b.Prepare = (void*)effect_prepare;
 
     result->wave_count = wave_count;
 
@@ -108,17 +222,18 @@ stereo_pattern_effect_luminance(StereoPattern *pattern, unsigned int wave_count,
         result->strengths[i] = (int)(ONE * strengths[i]);
     }
 
-    result->components = components;
-
-    /* Initialise the random offsets */
-    result->offsets = malloc(wave_count * sizeof(*result->offsets));
-    for (i = 0; i < wave_count; i++) {
-        result->offsets[i] = (unsigned int)rand();
-    }
+    /* Only the requested components are changed, and alpha is only changed
+       if it is requested */
+    result->components = components & (PP_COLORS | PP_ALPHA);
+    stereo_effect_variant_select(result, result->components);
 
     /* Initialise the sine tables */
-    sin_table_initialize(&result->hsin, pattern->width);
-    sin_table_initialize(&result->vsin, pattern->height);
+    sin_phase_initialize(&result->hsin, pattern->width);
+    sin_phase_initialize(&result->vsin, pattern->height);
+
+    /* Initialise the random offsets and the wave sums */
+    effect_frame_initialize(result);
+    effect_seek(result, 0);
 
     return (StereoPatternEffect*)result;
 }
@@ -0,0 +1,95 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "../private/sin.h"
+
+/**
+ * The tables in use.
+ */
+static SinTable *sin_tables;
+
+/**
+ * The lock protecting sin_tables.
+ */
+static pthread_mutex_t sin_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+SinTable*
+sin_table_acquire(int count)
+{
+    SinTable *result;
+    int i;
+
+    pthread_mutex_lock(&sin_tables_lock);
+
+    for (result = sin_tables; result; result = result->next) {
+        if (result->count == count) {
+            result->refs++;
+            pthread_mutex_unlock(&sin_tables_lock);
+            return result;
+        }
+    }
+
+    result = malloc(sizeof(SinTable));
+    result->count = count;
+    result->sin = malloc(count * sizeof(result->sin[0]));
+    result->refs = 1;
+
+    for (i = 0; i < count; i++) {
+        result->sin[i] = (int)((ONE << SIN_BITS)
+            * sin(2.0 * M_PI * (double)i / count));
+    }
+
+    result->next = sin_tables;
+    sin_tables = result;
+
+    pthread_mutex_unlock(&sin_tables_lock);
+
+    return result;
+}
+
+void
+sin_table_release(SinTable *sin_table)
+{
+    SinTable **t;
+
+    pthread_mutex_lock(&sin_tables_lock);
+
+    if (--sin_table->refs) {
+        pthread_mutex_unlock(&sin_tables_lock);
+        return;
+    }
+
+    for (t = &sin_tables; *t != sin_table; t = &(*t)->next);
+    *t = sin_table->next;
+
+    pthread_mutex_unlock(&sin_tables_lock);
+
+    free(sin_table->sin);
+    free(sin_table);
+}
+
+void
+sin_phase_initialize(SinPhase *sin_phase, int period)
+{
+    unsigned long long max = ~0ULL;
+
+    sin_phase->table = sin_table_acquire(1 << SIN_PHASE_BITS);
+    sin_phase->period = period;
+
+    /* The step is 2 ** 64 / period, which does not fit for a period of 1;
+       it then wraps around to 0, which is still correct */
+    sin_phase->step = max / period;
+    if (max % period + 1 == period) {
+        sin_phase->step++;
+    }
+}
+
+void
+sin_phase_finalize(SinPhase *sin_phase)
+{
+    sin_table_release(sin_phase->table);
+    sin_phase->table = NULL;
+    sin_phase->period = 0;
+    sin_phase->step = 0;
+}
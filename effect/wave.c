@@ -1,15 +1,30 @@
+#include <errno.h>
 #include <math.h>
 #include <stdlib.h>
 
 #include "../private/pixel.h"
+#include "../private/simd.h"
 #include "../private/sin.h"
 
 #include "../effect.h"
+#include "../tune.h"
 
 typedef struct WaveEffect WaveEffect;
 #define EFFECT WaveEffect
+#define EFFECT_SPAN
+#define EFFECT_TILED
 #include "../private/effect.h"
 
+/**
+ * The maximum number of source rows prefetched for a tile.
+ */
+#define WAVE_PREFETCH_ROWS (4 * EFFECT_TILE_HEIGHT)
+
+/**
+ * The number of pixels in a cache line.
+ */
+#define WAVE_LINE_PIXELS (SCHED_CACHE_LINE / sizeof(PatternPixel))
+
 /**
  * Effect data for a luminance effect.
  */
@@ -29,35 +44,292 @@ struct WaveEffect {
         elements */
     int *offsets;
 
-    /* The sin lookup tables */
-    SinTable hsin, vsin;
+    /* The shared sin lookup tables */
+    SinPhase hsin, vsin;
+
+    /** The instruction set level used for the current run */
+    int isa;
+
+    /** The source column of the first pixel of every row, and the fractional
+        part of the source column, which is the same for all pixels of a row;
+        these contain pattern->height elements */
+    int *xbase, *xfrac;
+
+    /** The offset from the target row to the source row for every column, and
+        the fractional part of the source row, which is the same for all
+        pixels of a column; these contain pattern->width elements */
+    int *ybase, *yfrac;
+
+    /** Maps a column in [0, pattern->width + source->width) to a source
+        column, which makes wrapping around a lookup */
+    int *wrapx;
+
+    /** Maps a row in [0, pattern->height + source->height) to the index of
+        the first pixel of a source row, which makes wrapping around a lookup */
+    int *wrapy;
 };
 
+/**
+ * Sets pixel to the bilinearly interpolated value of four source pixels.
+ *
+ * This gives the same result as blend4.
+ *
+ * @param pixel
+ *     The pixel to set.
+ * @param p11, p12
+ *     The left and right pixels of the top row.
+ * @param p21, p22
+ *     The left and right pixels of the bottom row.
+ * @param ax
+ *     The weight of the right pixels. This is a fixed floating point value
+ *     less than 1.
+ * @param ay
+ *     The weight of the bottom pixels. This is a fixed floating point value
+ *     less than 1.
+ */
+static inline void
+wave_blend(PatternPixel *pixel, PatternPixel *p11, PatternPixel *p12,
+    PatternPixel *p21, PatternPixel *p22, int ax, int ay)
+{
+    int ax1 = ifrac(ax), ay1 = ifrac(ay);
+
+#define WAVE_BLEND(c) \
+    unmkfix(unmkfix(p11->c * ax1 + p12->c * ax) * ay1 \
+        + unmkfix(p21->c * ax1 + p22->c * ax) * ay)
+
+    pixel->r = WAVE_BLEND(r);
+    pixel->g = WAVE_BLEND(g);
+    pixel->b = WAVE_BLEND(b);
+#ifdef STEREO_ALPHA
+    pixel->a = WAVE_BLEND(a);
+#endif
+
+#undef WAVE_BLEND
+}
+
 static inline void
 effect_apply(WaveEffect *effect, PatternPixel *pixel, int x, int y)
 {
-    int sourcex = mkfix(x);
-    int sourcey = mkfix(y);
-    int *strength = effect->strengths;
-    int *offset = effect->offsets;
-    int i;
-    PatternPixel *row1;
-    PatternPixel *row2;
+    PatternPixel *pixels = effect->source->pixels;
+    int x1 = x + effect->xbase[y];
+    int y1 = y + effect->ybase[x];
+    int *wrapx = effect->wrapx;
+    int *wrapy = effect->wrapy;
 
-    /* Add all waves together */
-    for (i = 0; i < effect->wave_count; i++) {
-        sourcex += mul(*(strength++),
-            ssin(&effect->vsin, y * (i + 1) + *(offset++)
-                 + effect->b.iteration));
-        sourcey += mul(*(strength++),
-            ssin(&effect->hsin, x * (i + 1) + *(offset++)
-                 + effect->b.iteration));
+    wave_blend(pixel,
+        &pixels[wrapy[y1] + wrapx[x1]], &pixels[wrapy[y1] + wrapx[x1 + 1]],
+        &pixels[wrapy[y1 + 1] + wrapx[x1]],
+        &pixels[wrapy[y1 + 1] + wrapx[x1 + 1]],
+        effect->xfrac[y], effect->yfrac[x]);
+}
+
+/**
+ * See effect_prefetch.
+ *
+ * The source rows read by a tile are the rows of the tile displaced by the
+ * smallest and largest vertical displacement of its columns, and they are read
+ * starting at the column of the tile displaced horizontally.
+ */
+static inline void
+effect_prefetch(WaveEffect *effect, int x, int y, int width, int height)
+{
+    PatternPixel *pixels = effect->source->pixels;
+    int sx = effect->wrapx[x + effect->xbase[y]];
+    int columns = width + 1 < effect->source->width - sx
+        ? width + 1 : effect->source->width - sx;
+    int lo = effect->ybase[x], hi = effect->ybase[x];
+    int i, j, rows;
+
+    for (i = x + 1; i < x + width; i++) {
+        if (effect->ybase[i] < lo) {
+            lo = effect->ybase[i];
+        }
+        if (effect->ybase[i] > hi) {
+            hi = effect->ybase[i];
+        }
+    }
+
+    rows = hi - lo + height + 1;
+    if (rows > WAVE_PREFETCH_ROWS) {
+        rows = WAVE_PREFETCH_ROWS;
+    }
+
+    for (i = y + lo; i < y + lo + rows; i++) {
+        PatternPixel *row = pixels + effect->wrapy[i] + sx;
+
+        for (j = 0; j < columns; j += WAVE_LINE_PIXELS) {
+            __builtin_prefetch(row + j);
+        }
     }
+}
 
-    getrows(effect->source->pixels, sourcey, &row1, &row2,
-        effect->source->width, effect->source->height);
+#ifdef SIMD_AVX2
+/**
+ * Blends one channel of eight pixels.
+ *
+ * @param p11, p12, p21, p22
+ *     The source pixels; see wave_blend.
+ * @param ax, ax1
+ *     The weights of the right and left pixels.
+ * @param ay, ay1
+ *     The weights of the bottom and top pixels.
+ * @param shift
+ *     The bit offset of the channel.
+ * @return the blended channel, shifted to its bit offset
+ */
+static inline __m256i SIMD_TARGET_AVX2
+wave_blend_channel(__m256i p11, __m256i p12, __m256i p21, __m256i p22,
+    __m256i ax, __m256i ax1, __m256i ay, __m256i ay1, int shift)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i c11 = _mm256_and_si256(_mm256_srli_epi32(p11, shift), mask);
+    __m256i c12 = _mm256_and_si256(_mm256_srli_epi32(p12, shift), mask);
+    __m256i c21 = _mm256_and_si256(_mm256_srli_epi32(p21, shift), mask);
+    __m256i c22 = _mm256_and_si256(_mm256_srli_epi32(p22, shift), mask);
+    __m256i top = _mm256_srai_epi32(_mm256_add_epi32(
+        _mm256_mullo_epi32(c11, ax1), _mm256_mullo_epi32(c12, ax)), DBITS);
+    __m256i bottom = _mm256_srai_epi32(_mm256_add_epi32(
+        _mm256_mullo_epi32(c21, ax1), _mm256_mullo_epi32(c22, ax)), DBITS);
 
-    blend4(pixel, row1, row2, sourcex, sourcey, effect->source->width);
+    return _mm256_slli_epi32(_mm256_srai_epi32(_mm256_add_epi32(
+        _mm256_mullo_epi32(top, ay1), _mm256_mullo_epi32(bottom, ay)), DBITS),
+        shift);
+}
+
+/**
+ * Applies the effect to a span of pixels, eight pixels at a time.
+ *
+ * The source pixels are fetched with gather instructions, and the indice are
+ * wrapped using the lookup tables, so no division is performed.
+ *
+ * @see effect_apply_span
+ */
+static void SIMD_TARGET_AVX2
+wave_apply_span_avx2(WaveEffect *effect, PatternPixel *pixel, int x,
+    int count, int y)
+{
+    const int *pixels = (const int*)effect->source->pixels;
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i lim = _mm256_set1_epi32(LIM);
+    const __m256i vy = _mm256_set1_epi32(y);
+    const __m256i ax = _mm256_set1_epi32(effect->xfrac[y]);
+    const __m256i ax1 = _mm256_xor_si256(ax, lim);
+    const int *wrapx = effect->wrapx + effect->xbase[y];
+    int end = x + count;
+
+    for (; x + 8 <= end; x += 8) {
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(wrapx + x));
+        __m256i x2 = _mm256_loadu_si256((const __m256i*)(wrapx + x + 1));
+        __m256i y1 = _mm256_add_epi32(vy,
+            _mm256_loadu_si256((const __m256i*)(effect->ybase + x)));
+        __m256i r1 = _mm256_i32gather_epi32(effect->wrapy, y1, 4);
+        __m256i r2 = _mm256_i32gather_epi32(effect->wrapy,
+            _mm256_add_epi32(y1, one), 4);
+        __m256i p11 = _mm256_i32gather_epi32(pixels,
+            _mm256_add_epi32(r1, x1), 4);
+        __m256i p12 = _mm256_i32gather_epi32(pixels,
+            _mm256_add_epi32(r1, x2), 4);
+        __m256i p21 = _mm256_i32gather_epi32(pixels,
+            _mm256_add_epi32(r2, x1), 4);
+        __m256i p22 = _mm256_i32gather_epi32(pixels,
+            _mm256_add_epi32(r2, x2), 4);
+        __m256i ay = _mm256_loadu_si256((const __m256i*)(effect->yfrac + x));
+        __m256i ay1 = _mm256_xor_si256(ay, lim);
+        __m256i result;
+
+        result = _mm256_or_si256(_mm256_or_si256(
+            wave_blend_channel(p11, p12, p21, p22, ax, ax1, ay, ay1, 0),
+            wave_blend_channel(p11, p12, p21, p22, ax, ax1, ay, ay1, 8)),
+            wave_blend_channel(p11, p12, p21, p22, ax, ax1, ay, ay1, 16));
+#ifdef STEREO_ALPHA
+        result = _mm256_or_si256(result,
+            wave_blend_channel(p11, p12, p21, p22, ax, ax1, ay, ay1, 24));
+#else
+        /* Keep the alpha channel of the target */
+        result = _mm256_or_si256(result, _mm256_and_si256(
+            _mm256_loadu_si256((const __m256i*)pixel),
+            _mm256_set1_epi32(0xFF << 24)));
+#endif
+
+        _mm256_storeu_si256((__m256i*)pixel, result);
+        pixel += 8;
+    }
+
+    /* Apply the effect to the remaining pixels */
+    for (; x < end; x++) {
+        effect_apply(effect, pixel, x, y);
+        pixel++;
+    }
+}
+#endif
+
+static inline void
+effect_apply_span(WaveEffect *effect, PatternPixel *pixel, int x, int count,
+    int y)
+{
+    int end = x + count;
+
+#ifdef SIMD_AVX2
+    if (effect->isa >= STEREO_ISA_AVX2) {
+        wave_apply_span_avx2(effect, pixel, x, count, y);
+        return;
+    }
+#endif
+
+    for (; x < end; x++) {
+        effect_apply(effect, pixel, x, y);
+        pixel++;
+    }
+}
+
+/**
+ * See StereoPatternEffect::Prepare.
+ *
+ * The horizontal displacement depends only on the row and the vertical
+ * displacement only on the column, so they are calculated once per row and
+ * column instead of once per pixel.
+ */
+static void
+effect_prepare(WaveEffect *effect)
+{
+    StereoPattern *pattern = effect->b.pattern;
+    int width = effect->source->width;
+    int height = effect->source->height;
+    int i, x, y;
+
+    effect->isa = simd_isa(stereo_tuning_get(pattern->width, 0));
+
+    for (y = 0; y < pattern->height; y++) {
+        int d = 0;
+
+        for (i = 0; i < effect->wave_count; i++) {
+            d += mul(effect->strengths[2 * i],
+                sin_phase(&effect->vsin, y * (i + 1) + effect->offsets[2 * i]
+                    + effect->b.iteration));
+        }
+
+        effect->xbase[y] = unmkfix(d) % width;
+        if (effect->xbase[y] < 0) {
+            effect->xbase[y] += width;
+        }
+        effect->xfrac[y] = getfrac(d);
+    }
+
+    for (x = 0; x < pattern->width; x++) {
+        int d = 0;
+
+        for (i = 0; i < effect->wave_count; i++) {
+            d += mul(effect->strengths[2 * i + 1],
+                sin_phase(&effect->hsin, x * (i + 1)
+                    + effect->offsets[2 * i + 1] + effect->b.iteration));
+        }
+
+        effect->ybase[x] = unmkfix(d) % height;
+        if (effect->ybase[x] < 0) {
+            effect->ybase[x] += height;
+        }
+        effect->yfrac[x] = getfrac(d);
+    }
 }
 
 /**
@@ -73,6 +345,57 @@ effect_update(WaveEffect *effect)
     }
 }
 
+/**
+ * See StereoPatternEffect::Seek.
+ *
+ * Every update adds the index of a wave to the first wave_count offsets, so
+ * the offsets of a frame follow directly from the initial offsets.
+ */
+static void
+effect_seek(WaveEffect *effect, unsigned int frame)
+{
+    unsigned int seed = effect->b.seed;
+    int i;
+
+    for (i = 0; i < effect->wave_count * 2; i++) {
+        unsigned int offset = (unsigned int)rand_r(&seed);
+
+        if (i < effect->wave_count) {
+            offset += i * frame;
+        }
+        effect->offsets[i] = (int)offset;
+    }
+}
+
+/**
+ * See effect_frame_initialize.
+ */
+static void
+effect_frame_initialize(WaveEffect *effect)
+{
+    StereoPattern *pattern = effect->b.pattern;
+
+    effect->offsets = malloc(2 * effect->wave_count
+        * sizeof(*effect->offsets));
+    effect->xbase = malloc(pattern->height * sizeof(*effect->xbase));
+    effect->xfrac = malloc(pattern->height * sizeof(*effect->xfrac));
+    effect->ybase = malloc(pattern->width * sizeof(*effect->ybase));
+    effect->yfrac = malloc(pattern->width * sizeof(*effect->yfrac));
+}
+
+/**
+ * See effect_frame_finalize.
+ */
+static void
+effect_frame_finalize(WaveEffect *effect)
+{
+    free(effect->offsets);
+    free(effect->xbase);
+    free(effect->xfrac);
+    free(effect->ybase);
+    free(effect->yfrac);
+}
+
 /**
  * See StereoPatternEffect::Release.
  */
@@ -80,10 +403,12 @@ static void
 effect_release(WaveEffect *effect)
 {
     free(effect->strengths);
-    free(effect->offsets);
+    effect_frame_finalize(effect);
+    free(effect->wrapx);
+    free(effect->wrapy);
     stereo_pattern_free(effect->source);
-    sin_table_finalize(&effect->hsin);
-    sin_table_finalize(&effect->vsin);
+    sin_phase_finalize(&effect->hsin);
+    sin_phase_finalize(&effect->vsin);
     free(effect);
 }
 
@@ -91,11 +416,20 @@ StereoPatternEffect*
 stereo_pattern_effect_wave(StereoPattern *pattern, unsigned int wave_count,
     double *strengths, StereoPattern *source)
 {
-    WaveEffect *result = malloc(sizeof(WaveEffect));
+    WaveEffect *result;
     int i;
 
+    if (stereo_pattern_is_shared(pattern)) {
+        stereo_pattern_free(source);
+        errno = EBUSY;
+        return NULL;
+    }
+
+    result = malloc(sizeof(WaveEffect));
+
     /* Initialise the basic effect data */
     stereo_effect_vt_initialize(result, pattern, wave);
+    result->b.Prepare = (void*)effect_prepare;
 
     result->wave_count = wave_count;
 
@@ -107,15 +441,25 @@ stereo_pattern_effect_wave(StereoPattern *pattern, unsigned int wave_count,
 
     result->source = source;
 
-    /* Initialise the random offsets */
-    result->offsets = malloc(2 * wave_count * sizeof(*result->offsets));
-    for (i = 0; i < wave_count * 2; i++) {
-        result->offsets[i] = (unsigned int)rand();
-    }
-
     /* Initialise the sine tables */
-    sin_table_initialize(&result->hsin, pattern->width);
-    sin_table_initialize(&result->vsin, pattern->height);
+    sin_phase_initialize(&result->hsin, pattern->width);
+    sin_phase_initialize(&result->vsin, pattern->height);
+
+    /* Initialise the random offsets and the displacements */
+    effect_frame_initialize(result);
+    effect_seek(result, 0);
+
+    /* Initialise the wrap around tables */
+    result->wrapx = malloc((pattern->width + source->width)
+        * sizeof(*result->wrapx));
+    for (i = 0; i < pattern->width + source->width; i++) {
+        result->wrapx[i] = i % source->width;
+    }
+    result->wrapy = malloc((pattern->height + source->height)
+        * sizeof(*result->wrapy));
+    for (i = 0; i < pattern->height + source->height; i++) {
+        result->wrapy[i] = (i % source->height) * source->width;
+    }
 
     return (StereoPatternEffect*)result;
 }
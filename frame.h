@@ -0,0 +1,126 @@
+#ifndef STEREO_FRAME_H
+#define STEREO_FRAME_H
+
+#include "effect.h"
+#include "stereo.h"
+
+/**
+ * The quality levels used by a frame scheduler.
+ *
+ * Every level includes the degradations of the levels before it.
+ */
+enum {
+    /** Effects are applied and the pattern is interpolated */
+    STEREO_QUALITY_FULL = 0,
+
+    /** Effects are skipped, so the pattern of the previous frame is used */
+    STEREO_QUALITY_NO_EFFECTS,
+
+    /** The nearest pattern pixel is used instead of interpolating */
+    STEREO_QUALITY_NEAREST,
+
+    /** Only every other row is rendered, and the other rows are copied */
+    STEREO_QUALITY_HALF_ROWS,
+
+    /** The number of quality levels */
+    STEREO_QUALITY_COUNT
+};
+
+/**
+ * A report about a rendered frame.
+ */
+typedef struct {
+    /** The quality level of the frame */
+    int quality;
+
+    /** The time it took to render the frame, in nanoseconds */
+    long long elapsed;
+
+    /** The time the frame was predicted to take, in nanoseconds */
+    long long predicted;
+
+    /** Whether the frame took longer than the budget */
+    int missed;
+} StereoFrameReport;
+
+typedef struct {
+    /** The stereo image to render */
+    StereoImage *image;
+
+    /** The effects applied to the pattern of the image before rendering */
+    StereoPatternEffect **effects;
+
+    /** The number of effects */
+    unsigned int effect_count;
+
+    /** The time budget for a frame, in nanoseconds */
+    long long budget;
+
+    /** The measured cost of applying all effects, in nanoseconds; this is
+        negative until it has been measured */
+    long long effect_cost;
+
+    /** The measured cost of rendering a single row, in nanoseconds, with and
+        without interpolation; these are negative until they have been
+        measured */
+    long long row_cost[2];
+
+    /** The quality level of the previous frame */
+    int quality;
+} StereoFrameScheduler;
+
+/**
+ * Creates a frame scheduler.
+ *
+ * @param image
+ *     The stereo image to render. Ownership is not transferred.
+ * @param effects
+ *     The effects to apply to the pattern of the image before every frame, in
+ *     order. The array is copied, but ownership of the effects is not
+ *     transferred.
+ * @param effect_count
+ *     The number of effects.
+ * @param budget
+ *     The time budget for a frame, in nanoseconds.
+ * @return a new frame scheduler
+ */
+StereoFrameScheduler*
+stereo_frame_scheduler_create(StereoImage *image,
+    StereoPatternEffect **effects, unsigned int effect_count, long long budget);
+
+/**
+ * Frees a frame scheduler.
+ *
+ * The image and the effects are not freed.
+ *
+ * @param scheduler
+ *     The frame scheduler to free.
+ */
+void
+stereo_frame_scheduler_free(StereoFrameScheduler *scheduler);
+
+/**
+ * Renders a frame.
+ *
+ * The quality level is chosen as the best level that is predicted to fit in
+ * the budget, based on the cost of previous frames. Quality is only increased
+ * by one level per frame, and only when there is a margin, to prevent it from
+ * oscillating. The interpolate and row_step settings of the image are changed
+ * for the frame and restored afterwards.
+ *
+ * @param scheduler
+ *     The frame scheduler.
+ * @param buffer
+ *     The z-buffer to render.
+ * @param channel
+ *     The channel of the z-buffer to use.
+ * @param report
+ *     A report about the rendered frame. This may be NULL.
+ * @return the quality level of the frame, or -1 upon failure
+ * @see stereo_image_apply
+ */
+int
+stereo_frame_scheduler_render(StereoFrameScheduler *scheduler,
+    ZBuffer *buffer, unsigned int channel, StereoFrameReport *report);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../private/sched.h"
+
+#include "../frame.h"
+
+/**
+ * The weight, in 1/8ths, of a new measurement in the cost estimates.
+ */
+#define FRAME_WEIGHT 3
+
+/**
+ * The fraction, in percent, of the budget that a frame may be predicted to use
+ * before quality is increased.
+ */
+#define FRAME_MARGIN 85
+
+/**
+ * Updates a cost estimate with a new measurement.
+ *
+ * @param estimate
+ *     The estimate to update. If it is negative, it is replaced.
+ * @param cost
+ *     The measured cost.
+ */
+static void
+frame_measure(long long *estimate, long long cost)
+{
+    if (*estimate < 0) {
+        *estimate = cost;
+    }
+    else {
+        *estimate += (cost - *estimate) * FRAME_WEIGHT / 8;
+    }
+}
+
+/**
+ * Predicts the cost of a frame at a quality level.
+ *
+ * @param scheduler
+ *     The frame scheduler.
+ * @param quality
+ *     The quality level.
+ * @return the predicted cost in nanoseconds
+ */
+static long long
+frame_predict(StereoFrameScheduler *scheduler, int quality)
+{
+    unsigned int height = scheduler->image->image->height;
+    int interpolate = quality < STEREO_QUALITY_NEAREST;
+    long long row_cost = scheduler->row_cost[interpolate];
+    long long result = 0;
+
+    /* Until the cost without interpolation is known, assume it is the same as
+       with interpolation */
+    if (row_cost < 0) {
+        row_cost = scheduler->row_cost[!interpolate];
+    }
+    if (row_cost > 0) {
+        result += row_cost * (quality < STEREO_QUALITY_HALF_ROWS
+            ? height : (height + 1) / 2);
+    }
+
+    if (quality < STEREO_QUALITY_NO_EFFECTS && scheduler->effect_cost > 0) {
+        result += scheduler->effect_cost;
+    }
+
+    return result;
+}
+
+StereoFrameScheduler*
+stereo_frame_scheduler_create(StereoImage *image,
+    StereoPatternEffect **effects, unsigned int effect_count, long long budget)
+{
+    StereoFrameScheduler *result;
+
+    if (!image) {
+        return NULL;
+    }
+
+    result = malloc(sizeof(StereoFrameScheduler));
+    result->image = image;
+    result->effects = malloc(effect_count * sizeof(*effects));
+    memcpy(result->effects, effects, effect_count * sizeof(*effects));
+    result->effect_count = effect_count;
+    result->budget = budget;
+    result->effect_cost = -1;
+    result->row_cost[0] = -1;
+    result->row_cost[1] = -1;
+    result->quality = STEREO_QUALITY_FULL;
+
+    return result;
+}
+
+void
+stereo_frame_scheduler_free(StereoFrameScheduler *scheduler)
+{
+    free(scheduler->effects);
+    free(scheduler);
+}
+
+int
+stereo_frame_scheduler_render(StereoFrameScheduler *scheduler,
+    ZBuffer *buffer, unsigned int channel, StereoFrameReport *report)
+{
+    StereoImage *image = scheduler->image;
+    int quality = scheduler->quality;
+    int interpolate = image->interpolate;
+    unsigned int row_step = image->row_step;
+    long long start, predicted, t;
+    unsigned int i;
+    int result;
+
+    /* Degrade until the frame is predicted to fit, or increase quality by one
+       level if there is a margin */
+    while (quality < STEREO_QUALITY_COUNT - 1
+            && frame_predict(scheduler, quality) > scheduler->budget) {
+        quality++;
+    }
+    if (quality == scheduler->quality && quality > STEREO_QUALITY_FULL
+            && frame_predict(scheduler, quality - 1)
+                <= scheduler->budget * FRAME_MARGIN / 100) {
+        quality--;
+    }
+
+    predicted = frame_predict(scheduler, quality);
+    start = sched_now();
+
+    /* Apply the effects */
+    if (quality < STEREO_QUALITY_NO_EFFECTS && scheduler->effect_count) {
+        for (i = 0; i < scheduler->effect_count; i++) {
+            stereo_pattern_effect_apply(scheduler->effects[i]);
+        }
+        frame_measure(&scheduler->effect_cost, sched_now() - start);
+    }
+
+    /* Render the stereogram */
+    t = sched_now();
+    image->interpolate = quality < STEREO_QUALITY_NEAREST;
+    image->row_step = quality < STEREO_QUALITY_HALF_ROWS ? 1 : 2;
+    result = stereo_image_apply(image, buffer, channel);
+    if (result) {
+        frame_measure(&scheduler->row_cost[image->interpolate],
+            (sched_now() - t) / ((image->image->height + image->row_step - 1)
+                / image->row_step));
+    }
+
+    /* Restore the settings of the caller */
+    image->interpolate = interpolate;
+    image->row_step = row_step;
+
+    if (report) {
+        report->quality = quality;
+        report->elapsed = sched_now() - start;
+        report->predicted = predicted;
+        report->missed = report->elapsed > scheduler->budget;
+    }
+
+    scheduler->quality = quality;
+
+    return result ? quality : -1;
+}
@@ -1,8 +1,17 @@
+#include <stdlib.h>
+
+#include "tune.h"
+
 /*
  * Called when the library is loaded.
  */
 void __attribute__ ((constructor))
 stereo_initialize(void)
 {
-    /* Add initialisation code */
+    const char *profile = getenv(STEREO_TUNING_ENV);
+
+    /* Load the performance profile */
+    if (profile) {
+        stereo_tuning_load(profile);
+    }
 }
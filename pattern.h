@@ -25,16 +25,44 @@ enum {
  */
 #define PP_COLORS (PP_RED | PP_GREEN | PP_BLUE)
 
-typedef struct {
+typedef struct StereoPattern StereoPattern;
+
+/**
+ * The owner of the memory of patterns that are not allocated by
+ * stereo_pattern_create.
+ */
+typedef struct StereoPatternOwner StereoPatternOwner;
+struct StereoPatternOwner {
+    /**
+     * Releases a pattern; this is called by stereo_pattern_free.
+     *
+     * @param owner
+     *     This owner.
+     * @param pattern
+     *     The pattern to release.
+     */
+    void (*Release)(StereoPatternOwner *owner, StereoPattern *pattern);
+};
+
+struct StereoPattern {
     /** The with of the pattern */
     unsigned int width;
 
     /** The height of the pattern */
     unsigned int height;
 
+    /** The number of references; this is 1 for a new pattern, and the pattern
+        is released when the last reference is dropped with
+        stereo_pattern_free */
+    unsigned int refs;
+
+    /** The owner of the pattern memory, or NULL if the pattern was allocated
+        by stereo_pattern_create or stereo_pattern_allocate */
+    StereoPatternOwner *owner;
+
     /** The pixel data */
     PatternPixel pixels[0];
-} StereoPattern;
+};
 
 /**
  * Creates a pattern with the specified dimensions.
@@ -50,10 +78,27 @@ typedef struct {
 StereoPattern*
 stereo_pattern_create(unsigned int width, unsigned int height);
 
+/**
+ * Allocates a pattern with the specified dimensions.
+ *
+ * Unlike stereo_pattern_create, the pixels are not initialised; use this when
+ * all pixels are written immediately afterwards.
+ *
+ * @param width
+ *     The width of the pattern.
+ * @param height
+ *     The height of the pattern.
+ * @return a new pattern
+ */
+StereoPattern*
+stereo_pattern_allocate(unsigned int width, unsigned int height);
+
 /**
  * Creates a pattern from a PNG file.
  *
  * The dimensions of the pattern are the same as the dimensions of the image.
+ * All PNG formats are converted to 8 bit RGBA while the rows are decoded, and
+ * they are decoded directly into the pattern.
  *
  * @param in
  *     The file to read. Please make sure that it is opened in binary mode. If
@@ -69,14 +114,58 @@ stereo_pattern_create_from_png(FILE *in);
  * @param filename
  *     The name of the file. If it does not exist or cannot be opened, the
  *     function fails.
- * @return a new pattern, or NULL upon failure
+ * @return a new pattern, or NULL upon failure; while the pattern cache is
+ *     enabled, this may be a shared reference to a cached pattern
  * @see stereo_pattern_create_from_png
  */
 StereoPattern*
 stereo_pattern_create_from_png_file(const char *filename);
 
 /**
- * Frees a previously allocated pattern.
+ * Adds a reference to a pattern.
+ *
+ * Functions that assume ownership of a pattern, such as stereo_image_create,
+ * assume ownership of a reference, so a pattern can be used by several stereo
+ * images and effects without being copied. A pattern with more than one
+ * reference must not be modified; see stereo_pattern_unshare.
+ *
+ * @param pattern
+ *     The pattern.
+ * @return pattern
+ */
+StereoPattern*
+stereo_pattern_ref(StereoPattern *pattern);
+
+/**
+ * Returns whether a pattern has more than one reference or belongs to an
+ * owner such as a container, in which case it must not be modified.
+ *
+ * @param pattern
+ *     The pattern.
+ * @return non-zero if the pattern is shared
+ */
+int
+stereo_pattern_is_shared(StereoPattern *pattern);
+
+/**
+ * Returns a pattern that may be modified.
+ *
+ * If the pattern is shared, the reference passed in is dropped and a copy is
+ * returned instead; otherwise the pattern itself is returned. Use this before
+ * a pattern becomes the target of an effect, since effects refuse shared
+ * targets.
+ *
+ * @param pattern
+ *     The pattern. Ownership of this reference is assumed.
+ * @return a pattern with a single reference, which is owned by the caller
+ */
+StereoPattern*
+stereo_pattern_unshare(StereoPattern *pattern);
+
+/**
+ * Drops a reference to a pattern, and frees it with the last reference.
+ *
+ * Patterns with an owner are released by their owner instead.
  *
  * @param pattern
  *     The pattern to free.
@@ -84,9 +173,86 @@ stereo_pattern_create_from_png_file(const char *filename);
 void
 stereo_pattern_free(StereoPattern *pattern);
 
+/**
+ * Enables the pattern cache.
+ *
+ * While the cache is enabled, stereo_pattern_create_from_png_file and
+ * stereo_pattern_create_from_file return a new reference to a pattern already
+ * decoded from the same file, or from a file with the same contents, instead
+ * of decoding it again. Files are recognised by their path, device, inode,
+ * size and modification time, and contents by a hash, so a file that is
+ * replaced is decoded again.
+ *
+ * Patterns returned from the cache are shared, since the cache keeps a
+ * reference to them.
+ *
+ * @param size
+ *     The maximum number of bytes of pixels kept in the cache; the patterns
+ *     used least recently are dropped first. If this is 0, the cache is
+ *     disabled and emptied.
+ */
+void
+stereo_pattern_cache_enable(size_t size);
+
+/**
+ * Drops all patterns from the pattern cache.
+ *
+ * Patterns that are still referenced elsewhere are not freed.
+ */
+void
+stereo_pattern_cache_clear(void);
+
+/**
+ * PNG row filters.
+ */
+enum {
+    STEREO_PNG_FILTER_NONE = 0,
+    STEREO_PNG_FILTER_SUB,
+    STEREO_PNG_FILTER_UP,
+    STEREO_PNG_FILTER_AVERAGE,
+    STEREO_PNG_FILTER_PAETH,
+
+    /** Use the filter giving the smallest values for every row; this gives
+        the smallest files, but filters every row five times */
+    STEREO_PNG_FILTER_ADAPTIVE
+};
+
+/**
+ * Settings that trade PNG encoding speed for file size.
+ */
+typedef struct {
+    /** The zlib compression level, from 0 for none to 9 for the best */
+    int level;
+
+    /** The row filter; one of the STEREO_PNG_FILTER_* values */
+    int filter;
+
+    /** Whether the alpha channel is saved; if this is 0, an RGB image is
+        saved */
+    int alpha;
+} StereoPNGProfile;
+
+/**
+ * Fast encoding: level 1, the sub filter and no alpha channel.
+ */
+extern const StereoPNGProfile stereo_png_profile_fast;
+
+/**
+ * The settings used by stereo_pattern_save_to_png: level 6, adaptive
+ * filtering and an alpha channel.
+ */
+extern const StereoPNGProfile stereo_png_profile_default;
+
+/**
+ * Small files: level 9, adaptive filtering and an alpha channel.
+ */
+extern const StereoPNGProfile stereo_png_profile_small;
+
 /**
  * Saves the pattern to a file in PNG format.
  *
+ * This uses stereo_png_profile_default.
+ *
  * @param pattern
  *     The pattern to save.
  * @param out
@@ -110,6 +276,44 @@ stereo_pattern_save_to_png(StereoPattern *pattern, FILE *out);
 int
 stereo_pattern_save_to_png_file(StereoPattern *pattern, const char *filename);
 
+/**
+ * Saves the pattern to a file in PNG format with specific settings.
+ *
+ * The image is split into bands of rows that are filtered and deflated in
+ * parallel. The bands are deflated as one continuous zlib stream, each using
+ * the end of the previous band as dictionary, so the result is a normal PNG
+ * file that compresses almost as well as a serially encoded one.
+ *
+ * @param pattern
+ *     The pattern to save.
+ * @param out
+ *     The file to write the PNG to. Please make sure that it is opened in
+ *     binary mode.
+ * @param profile
+ *     The encoding settings.
+ * @return non-zero upon success and 0 otherwise; errno is set to EINVAL if the
+ *     level or the filter of profile is out of range
+ */
+int
+stereo_pattern_save_to_png_with_profile(StereoPattern *pattern, FILE *out,
+    const StereoPNGProfile *profile);
+
+/**
+ * Saves the pattern to a file in PNG format with specific settings.
+ *
+ * @param pattern
+ *     The pattern to save.
+ * @param filename
+ *     The file to write. If this file cannot be created, the function fails.
+ * @param profile
+ *     The encoding settings. If these are invalid, the file is not created.
+ * @return non-zero upon success and 0 otherwise
+ * @see stereo_pattern_save_to_png_with_profile
+ */
+int
+stereo_pattern_save_to_png_file_with_profile(StereoPattern *pattern,
+    const char *filename, const StereoPNGProfile *profile);
+
 /**
  * Returns a reference to the y'th row.
  *
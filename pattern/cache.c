@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "../private/pattern.h"
+
+/**
+ * A file from which a cached pattern was loaded.
+ */
+typedef struct PatternCachePath PatternCachePath;
+struct PatternCachePath {
+    /** The next file of the same pattern */
+    PatternCachePath *next;
+
+    /** The name of the file */
+    char *filename;
+
+    /** The identity of the file when it was loaded */
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+};
+
+/**
+ * A cached pattern.
+ */
+typedef struct PatternCacheEntry PatternCacheEntry;
+struct PatternCacheEntry {
+    /** The entry used less recently than this one */
+    PatternCacheEntry *next;
+
+    /** The function that decoded the pattern */
+    PatternDecode decode;
+
+    /** The hash and the size of the contents of the files */
+    uint64_t hash;
+    size_t size;
+
+    /** The files with these contents */
+    PatternCachePath *paths;
+
+    /** The pattern; the cache holds a reference to it */
+    StereoPattern *pattern;
+};
+
+/**
+ * The pattern cache.
+ */
+static struct {
+    /** The lock of the cache */
+    pthread_mutex_t lock;
+
+    /** The maximum and the current number of bytes of pixels, where a
+        maximum of 0 disables the cache */
+    size_t limit, used;
+
+    /** The entries, most recently used first */
+    PatternCacheEntry *entries;
+} pattern_cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL};
+
+/**
+ * Returns the number of bytes of the pixels of a pattern.
+ */
+static size_t
+pattern_cache_bytes(StereoPattern *pattern)
+{
+    return (size_t)pattern->width * pattern->height * sizeof(PatternPixel);
+}
+
+/**
+ * Calculates the FNV-1a hash of data.
+ *
+ * Entries are only shared if both the hash and the size match, which makes an
+ * accidental collision of two patterns unlikely enough to ignore.
+ */
+static uint64_t
+pattern_cache_hash(const unsigned char *data, size_t size)
+{
+    uint64_t result = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        result = (result ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return result;
+}
+
+/**
+ * Frees an entry and drops the reference of the cache to its pattern.
+ *
+ * This must be called with the lock held.
+ */
+static void
+pattern_cache_entry_free(PatternCacheEntry *entry)
+{
+    while (entry->paths) {
+        PatternCachePath *path = entry->paths;
+
+        entry->paths = path->next;
+        free(path->filename);
+        free(path);
+    }
+    pattern_cache.used -= pattern_cache_bytes(entry->pattern);
+    stereo_pattern_free(entry->pattern);
+    free(entry);
+}
+
+/**
+ * Drops the least recently used entries until the cache fits its limit.
+ *
+ * This must be called with the lock held.
+ *
+ * @param keep
+ *     An entry that is never dropped, or NULL.
+ */
+static void
+pattern_cache_trim(PatternCacheEntry *keep)
+{
+    while (pattern_cache.used > pattern_cache.limit) {
+        PatternCacheEntry **link, **last = NULL, *entry;
+
+        for (link = &pattern_cache.entries; *link; link = &(*link)->next) {
+            if (*link != keep) {
+                last = link;
+            }
+        }
+        if (!last) {
+            break;
+        }
+
+        entry = *last;
+        *last = entry->next;
+        pattern_cache_entry_free(entry);
+    }
+}
+
+/**
+ * Makes an entry the most recently used one and returns a new reference to
+ * its pattern.
+ *
+ * This must be called with the lock held.
+ */
+static StereoPattern*
+pattern_cache_use(PatternCacheEntry **link)
+{
+    PatternCacheEntry *entry = *link;
+
+    *link = entry->next;
+    entry->next = pattern_cache.entries;
+    pattern_cache.entries = entry;
+
+    return stereo_pattern_ref(entry->pattern);
+}
+
+/**
+ * Forgets a file in all entries, since its contents have changed.
+ *
+ * This must be called with the lock held.
+ */
+static void
+pattern_cache_forget(const char *filename)
+{
+    PatternCacheEntry *entry;
+
+    for (entry = pattern_cache.entries; entry; entry = entry->next) {
+        PatternCachePath **link = &entry->paths;
+
+        while (*link) {
+            PatternCachePath *path = *link;
+
+            if (!strcmp(path->filename, filename)) {
+                *link = path->next;
+                free(path->filename);
+                free(path);
+            }
+            else {
+                link = &path->next;
+            }
+        }
+    }
+}
+
+/**
+ * Adds a file to an entry.
+ *
+ * This must be called with the lock held.
+ */
+static void
+pattern_cache_add_path(PatternCacheEntry *entry, const char *filename,
+    const struct stat *st)
+{
+    PatternCachePath *path = malloc(sizeof(PatternCachePath));
+
+    pattern_cache_forget(filename);
+    path->filename = strdup(filename);
+    path->device = st->st_dev;
+    path->inode = st->st_ino;
+    path->size = st->st_size;
+    path->modified = st->st_mtim;
+    path->next = entry->paths;
+    entry->paths = path;
+}
+
+/**
+ * Finds the entry of a file that has not changed since it was loaded.
+ *
+ * This must be called with the lock held.
+ *
+ * @return the link to the entry, or NULL
+ */
+static PatternCacheEntry**
+pattern_cache_find_path(const char *filename, const struct stat *st,
+    PatternDecode decode)
+{
+    PatternCacheEntry **link;
+
+    for (link = &pattern_cache.entries; *link; link = &(*link)->next) {
+        PatternCachePath *path;
+
+        if ((*link)->decode != decode) {
+            continue;
+        }
+        for (path = (*link)->paths; path; path = path->next) {
+            if (!strcmp(path->filename, filename)
+                    && path->device == st->st_dev
+                    && path->inode == st->st_ino
+                    && path->size == st->st_size
+                    && path->modified.tv_sec == st->st_mtim.tv_sec
+                    && path->modified.tv_nsec == st->st_mtim.tv_nsec) {
+                return link;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the entry of contents.
+ *
+ * This must be called with the lock held.
+ *
+ * @return the link to the entry, or NULL
+ */
+static PatternCacheEntry**
+pattern_cache_find_contents(uint64_t hash, size_t size, PatternDecode decode)
+{
+    PatternCacheEntry **link;
+
+    for (link = &pattern_cache.entries; *link; link = &(*link)->next) {
+        if ((*link)->decode == decode && (*link)->hash == hash
+                && (*link)->size == size) {
+            return link;
+        }
+    }
+
+    return NULL;
+}
+
+StereoPattern*
+pattern_cache_load(const char *filename, PatternDecode decode)
+{
+    PatternCacheEntry **link, *entry;
+    StereoPattern *result;
+    unsigned char *data;
+    struct stat st;
+    uint64_t hash;
+    size_t size;
+    FILE *in;
+    int enabled;
+
+    in = fopen(filename, "rb");
+    if (!in) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pattern_cache.lock);
+    enabled = pattern_cache.limit > 0;
+    pthread_mutex_unlock(&pattern_cache.lock);
+    if (enabled && fstat(fileno(in), &st)) {
+        fclose(in);
+        return NULL;
+    }
+
+    /* Only regular files can be recognised by their status and read whole;
+       pipes and other special files are decoded as they are */
+    if (!enabled || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        result = decode(in);
+        fclose(in);
+        return result;
+    }
+
+    /* A file that has not changed is found without reading it */
+    pthread_mutex_lock(&pattern_cache.lock);
+    link = pattern_cache_find_path(filename, &st, decode);
+    if (link) {
+        result = pattern_cache_use(link);
+        pthread_mutex_unlock(&pattern_cache.lock);
+        fclose(in);
+        return result;
+    }
+    pthread_mutex_unlock(&pattern_cache.lock);
+
+    /* Otherwise the contents are hashed, so that copies of a file are
+       decoded only once */
+    size = st.st_size;
+    data = malloc(size);
+    if (!data || fread(data, 1, size, in) != size) {
+        free(data);
+        fclose(in);
+        return NULL;
+    }
+    fclose(in);
+    hash = pattern_cache_hash(data, size);
+
+    pthread_mutex_lock(&pattern_cache.lock);
+    link = pattern_cache_find_contents(hash, size, decode);
+    if (link) {
+        pattern_cache_add_path(*link, filename, &st);
+        result = pattern_cache_use(link);
+        pthread_mutex_unlock(&pattern_cache.lock);
+        free(data);
+        return result;
+    }
+    pthread_mutex_unlock(&pattern_cache.lock);
+
+    /* Decoding happens without the lock, so another thread may have decoded
+       the same contents meanwhile */
+    in = fmemopen(data, size, "rb");
+    result = in ? decode(in) : NULL;
+    if (in) {
+        fclose(in);
+    }
+    free(data);
+    if (!result) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pattern_cache.lock);
+    link = pattern_cache_find_contents(hash, size, decode);
+    if (link) {
+        stereo_pattern_free(result);
+        pattern_cache_add_path(*link, filename, &st);
+        result = pattern_cache_use(link);
+    }
+    else if (pattern_cache.limit) {
+        entry = malloc(sizeof(PatternCacheEntry));
+        entry->decode = decode;
+        entry->hash = hash;
+        entry->size = size;
+        entry->paths = NULL;
+        entry->pattern = result;
+        pattern_cache_add_path(entry, filename, &st);
+        entry->next = pattern_cache.entries;
+        pattern_cache.entries = entry;
+        pattern_cache.used += pattern_cache_bytes(result);
+        pattern_cache_trim(entry);
+        stereo_pattern_ref(result);
+    }
+    pthread_mutex_unlock(&pattern_cache.lock);
+
+    return result;
+}
+
+void
+stereo_pattern_cache_enable(size_t size)
+{
+    pthread_mutex_lock(&pattern_cache.lock);
+    pattern_cache.limit = size;
+    pattern_cache_trim(NULL);
+    pthread_mutex_unlock(&pattern_cache.lock);
+}
+
+void
+stereo_pattern_cache_clear(void)
+{
+    pthread_mutex_lock(&pattern_cache.lock);
+    while (pattern_cache.entries) {
+        PatternCacheEntry *entry = pattern_cache.entries;
+
+        pattern_cache.entries = entry->next;
+        pattern_cache_entry_free(entry);
+    }
+    pthread_mutex_unlock(&pattern_cache.lock);
+}
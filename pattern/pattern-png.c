@@ -1,22 +1,25 @@
-#include <alloca.h>
 #include <png.h>
 #include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <errno.h>
 
-#include "../pattern.h"
+#include <para/para.h>
+#include <zlib.h>
+
+#include "../private/pattern.h"
 
 StereoPattern*
 stereo_pattern_create_from_png(FILE *in)
 {
     unsigned char signature[8];
     png_structp png;
-    png_infop info, end;
-    png_bytep *rows = NULL;
-    StereoPattern *result;
-    int x, y;
+    png_infop info;
+    StereoPattern *volatile result;
+    png_uint_32 width, height;
+    int depth, color_type, interlace, passes, pass, y;
 
     result = NULL;
 
@@ -25,7 +28,7 @@ stereo_pattern_create_from_png(FILE *in)
         if (fread(signature, 1, sizeof(signature), in) != sizeof(signature)) {
             return NULL;
         }
-        if (!png_check_sig(signature, sizeof(signature))) {
+        if (png_sig_cmp(signature, 0, sizeof(signature))) {
             errno = EINVAL;
             return NULL;
         }
@@ -37,7 +40,16 @@ stereo_pattern_create_from_png(FILE *in)
 
     /* Create the PNG structures */
     png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        errno = ENOMEM;
+        return NULL;
+    }
     info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        errno = ENOMEM;
+        return NULL;
+    }
     png_set_sig_bytes(png, sizeof(signature));
 
     /* We return here upon errors */
@@ -45,64 +57,49 @@ stereo_pattern_create_from_png(FILE *in)
         if (result) {
             stereo_pattern_free(result);
         }
-        png_destroy_read_struct(&png, &info, &end);
+        png_destroy_read_struct(&png, &info, NULL);
 
         return NULL;
     }
 
     /* Initialise the PNG struct to use in as input stream */
     png_init_io(png, in);
+    png_read_info(png, info);
+    png_get_IHDR(png, info, &width, &height, &depth, &color_type, &interlace,
+        NULL, NULL);
+
+    /* Let libpng convert every format to 8 bit RGBA, so that rows can be
+       decoded directly into the pattern */
+    png_set_strip_16(png);
+    png_set_packing(png);
+    png_set_expand(png);
+    if (!(color_type & PNG_COLOR_MASK_COLOR)) {
+        png_set_gray_to_rgb(png);
+    }
+    if (!(color_type & PNG_COLOR_MASK_ALPHA)
+            && !png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    }
+    passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
 
-    /* Read the PNG and get the pixel data */
-    png_read_png(png, info,
-        PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_EXPAND | PNG_TRANSFORM_PACKING,
-        NULL);
-    rows = png_get_rows(png, info);
-    result = stereo_pattern_create(info->width, info->height);
-
-    /* Convert pixel data */
-    for (y = 0; y < result->height; y++) {
-        unsigned char *s = rows[y];
-        PatternPixel *d = stereo_pattern_row_get(result, y);
-
-        for (x = 0; x < result->width; x++) {
-            switch (info->color_type) {
-            case PNG_COLOR_TYPE_GRAY:
-                d->r = s[0];
-                d->g = s[0];
-                d->b = s[0];
-                d->a = 255;
-                break;
-
-            case PNG_COLOR_TYPE_RGB:
-                d->r = s[0];
-                d->g = s[1];
-                d->b = s[2];
-                d->a = 255;
-                break;
-
-            case PNG_COLOR_TYPE_RGBA:
-                d->r = s[0];
-                d->g = s[1];
-                d->b = s[2];
-                d->a = s[3];
-                break;
-
-            case PNG_COLOR_TYPE_GA:
-                d->r = s[0];
-                d->g = s[0];
-                d->b = s[0];
-                d->a = s[1];
-                break;
-            }
+    if (png_get_rowbytes(png, info) != width * sizeof(PatternPixel)) {
+        png_error(png, "unexpected row format");
+    }
 
-            s += info->channels;
-            d++;
+    /* The pixels are written by the decoder, so they are not initialised;
+       interlaced images are decoded in several passes over the same rows */
+    result = stereo_pattern_allocate(width, height);
+    for (pass = 0; pass < passes; pass++) {
+        for (y = 0; y < height; y++) {
+            png_read_row(png,
+                (png_bytep)stereo_pattern_row_get(result, y), NULL);
         }
     }
+    png_read_end(png, NULL);
 
     /* Free PNG */
-    png_destroy_read_struct(&png, &info, png_infopp_NULL);
+    png_destroy_read_struct(&png, &info, NULL);
 
     return result;
 }
@@ -110,70 +107,553 @@ stereo_pattern_create_from_png(FILE *in)
 StereoPattern*
 stereo_pattern_create_from_png_file(const char *filename)
 {
-    FILE *in = fopen(filename, "rb");
-    StereoPattern* result = NULL;
+    return pattern_cache_load(filename, stereo_pattern_create_from_png);
+}
 
-    if (in) {
-        result = stereo_pattern_create_from_png(in);
-        fclose(in);
+/**
+ * The number of bytes of filtered image data deflated as one band.
+ */
+#define PNG_BAND_BYTES (256 * 1024)
+
+/**
+ * The size of the deflate window, which is the amount of preceding data used
+ * as dictionary for every band.
+ */
+#define PNG_WINDOW 32768
+
+const StereoPNGProfile stereo_png_profile_fast = {
+    1, STEREO_PNG_FILTER_SUB, 0
+};
+
+const StereoPNGProfile stereo_png_profile_default = {
+    6, STEREO_PNG_FILTER_ADAPTIVE, 1
+};
+
+const StereoPNGProfile stereo_png_profile_small = {
+    9, STEREO_PNG_FILTER_ADAPTIVE, 1
+};
+
+/**
+ * A band of rows deflated independently.
+ */
+typedef struct {
+    /** The deflated data */
+    unsigned char *data;
+
+    /** The number of bytes in data */
+    size_t size;
+
+    /** The Adler-32 checksum of the filtered data of the band */
+    unsigned long adler;
+
+    /** Whether the band was deflated successfully */
+    int ok;
+} PNGBand;
+
+/**
+ * The state of a parallel PNG encoding.
+ */
+typedef struct {
+    /** The pattern being saved */
+    StereoPattern *pattern;
+
+    /** The encoding settings */
+    const StereoPNGProfile *profile;
+
+    /** The number of bytes per pixel; 3 or 4 */
+    unsigned int bpp;
+
+    /** The number of bytes per filtered row, including the filter type */
+    size_t rowbytes;
+
+    /** The number of rows per band, and the number of bands */
+    unsigned int band_rows, band_count;
+
+    /** The filtered image data; it contains pattern->height rows */
+    unsigned char *filtered;
+
+    /** The bands; it contains band_count elements */
+    PNGBand *bands;
+
+    /** Whether bands are being deflated; otherwise rows are being filtered */
+    int deflating;
+} PNGEncoder;
+
+/**
+ * Copies a pattern row to a buffer of bpp bytes per pixel.
+ *
+ * @param encoder
+ *     The encoder.
+ * @param d
+ *     The buffer.
+ * @param y
+ *     The row to copy.
+ */
+static void
+png_row_copy(PNGEncoder *encoder, unsigned char *d, unsigned int y)
+{
+    PatternPixel *s = stereo_pattern_row_get(encoder->pattern, y);
+    unsigned int x;
+
+    if (encoder->bpp == sizeof(PatternPixel)) {
+        memcpy(d, s, encoder->pattern->width * sizeof(PatternPixel));
+        return;
+    }
+
+    for (x = 0; x < encoder->pattern->width; x++) {
+        *d++ = s->r;
+        *d++ = s->g;
+        *d++ = s->b;
+        s++;
+    }
+}
+
+/**
+ * The Paeth predictor of the PNG specification.
+ */
+static inline int
+png_paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/**
+ * Filters a row.
+ *
+ * @param filter
+ *     The filter; one of the STEREO_PNG_FILTER_* values except
+ *     STEREO_PNG_FILTER_ADAPTIVE.
+ * @param d
+ *     The output, which receives the filter type followed by len bytes.
+ * @param cur, prev
+ *     The current and previous rows; prev contains zeros for the first row.
+ * @param len
+ *     The number of bytes in a row.
+ * @param bpp
+ *     The number of bytes per pixel.
+ * @return the sum of the absolute values of the filtered bytes, which is used
+ *     to choose between filters
+ */
+static unsigned long
+png_filter_row(int filter, unsigned char *d, const unsigned char *cur,
+    const unsigned char *prev, size_t len, unsigned int bpp)
+{
+    unsigned long result = 0;
+    size_t i;
+
+    *d++ = filter;
+    for (i = 0; i < len; i++) {
+        int a = i >= bpp ? cur[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+        unsigned char v;
+
+        switch (filter) {
+        case STEREO_PNG_FILTER_SUB:
+            v = cur[i] - a;
+            break;
+
+        case STEREO_PNG_FILTER_UP:
+            v = cur[i] - b;
+            break;
+
+        case STEREO_PNG_FILTER_AVERAGE:
+            v = cur[i] - ((a + b) >> 1);
+            break;
+
+        case STEREO_PNG_FILTER_PAETH:
+            v = cur[i] - png_paeth(a, b, c);
+            break;
+
+        default:
+            v = cur[i];
+            break;
+        }
+
+        d[i] = v;
+        result += v < 128 ? v : 256 - v;
     }
 
     return result;
+}
+
+/**
+ * Filters the rows of a band.
+ *
+ * @param encoder
+ *     The encoder.
+ * @param band
+ *     The index of the band.
+ */
+static void
+png_band_filter(PNGEncoder *encoder, unsigned int band)
+{
+    size_t len = encoder->rowbytes - 1;
+    unsigned int y = band * encoder->band_rows;
+    unsigned int end = y + encoder->band_rows < encoder->pattern->height
+        ? y + encoder->band_rows : encoder->pattern->height;
+    unsigned char *cur = malloc(len), *prev = calloc(len, 1);
+    unsigned char *best = NULL;
+
+    if (encoder->profile->filter == STEREO_PNG_FILTER_ADAPTIVE) {
+        best = malloc(encoder->rowbytes);
+    }
+
+    /* The previous row of the first row is the last row of the previous
+       band, which is read from the pattern */
+    if (y > 0) {
+        png_row_copy(encoder, prev, y - 1);
+    }
+
+    for (; y < end; y++) {
+        unsigned char *d = encoder->filtered + y * encoder->rowbytes;
+        unsigned char *swap;
 
+        png_row_copy(encoder, cur, y);
+
+        if (best) {
+            unsigned long cost, best_cost = (unsigned long)-1;
+            int filter;
+
+            for (filter = STEREO_PNG_FILTER_NONE;
+                    filter <= STEREO_PNG_FILTER_PAETH; filter++) {
+                cost = png_filter_row(filter, d, cur, prev, len,
+                    encoder->bpp);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    memcpy(best, d, encoder->rowbytes);
+                }
+            }
+            memcpy(d, best, encoder->rowbytes);
+        }
+        else {
+            png_filter_row(encoder->profile->filter, d, cur, prev, len,
+                encoder->bpp);
+        }
+
+        swap = prev;
+        prev = cur;
+        cur = swap;
+    }
+
+    free(best);
+    free(cur);
+    free(prev);
 }
 
-int
-stereo_pattern_save_to_png(StereoPattern *pattern, FILE *out)
+/**
+ * Deflates a band.
+ *
+ * The band is deflated as raw deflate data that continues the data of the
+ * previous band: the end of the previous band is used as dictionary, and all
+ * but the last band end with a sync flush, so the bands can be concatenated.
+ *
+ * @param encoder
+ *     The encoder.
+ * @param band
+ *     The index of the band.
+ */
+static void
+png_band_deflate(PNGEncoder *encoder, unsigned int band)
+{
+    PNGBand *b = &encoder->bands[band];
+    size_t start = (size_t)band * encoder->band_rows * encoder->rowbytes;
+    size_t end = (size_t)(band + 1) * encoder->band_rows * encoder->rowbytes;
+    size_t total = encoder->rowbytes * encoder->pattern->height;
+    int last = band == encoder->band_count - 1;
+    size_t capacity;
+    z_stream z;
+
+    if (end > total) {
+        end = total;
+    }
+
+    b->ok = 0;
+    b->data = NULL;
+    b->adler = adler32(1L, encoder->filtered + start, end - start);
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, encoder->profile->level, Z_DEFLATED, -15, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+
+    if (start > 0) {
+        size_t size = start < PNG_WINDOW ? start : PNG_WINDOW;
+
+        deflateSetDictionary(&z, encoder->filtered + start - size, size);
+    }
+
+    /* A sync flush adds an empty stored block of five bytes */
+    capacity = deflateBound(&z, end - start) + 16;
+    b->data = malloc(capacity);
+
+    z.next_in = encoder->filtered + start;
+    z.avail_in = end - start;
+    z.next_out = b->data;
+    z.avail_out = capacity;
+    if (deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH)
+            == (last ? Z_STREAM_END : Z_OK) && !z.avail_in) {
+        b->size = capacity - z.avail_out;
+        b->ok = 1;
+    }
+
+    deflateEnd(&z);
+}
+
+/**
+ * Filters or deflates bands.
+ *
+ * This function is called as a parallelised task, and its parameters come from
+ * para_execute.
+ *
+ * @param encoder
+ *     The encoder.
+ * @param start, end, gstart, gend
+ *     See para_execute
+ * @see para_execute
+ */
+static int
+png_bands_do(PNGEncoder *encoder, int start, int end, int gstart, int gend)
 {
-    png_structp png;
-    png_infop info;
-    png_bytep *rows;
     int i;
 
-    /* Create the PNG structures */
-    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    info = png_create_info_struct(png);
+    for (i = start; i < end; i++) {
+        if (encoder->deflating) {
+            png_band_deflate(encoder, i);
+        }
+        else {
+            png_band_filter(encoder, i);
+        }
+    }
 
-    /* We return here upon errors */
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &info);
+    return 0;
+}
 
+/**
+ * Stores a 32 bit value in network byte order.
+ */
+static void
+png_put32(unsigned char *d, unsigned long v)
+{
+    d[0] = v >> 24;
+    d[1] = v >> 16;
+    d[2] = v >> 8;
+    d[3] = v;
+}
+
+/**
+ * Writes a PNG chunk.
+ *
+ * The data of the chunk is the concatenation of up to three parts.
+ *
+ * @param out
+ *     The file to write.
+ * @param type
+ *     The four character chunk type.
+ * @param parts
+ *     The parts of the chunk data; unused parts may be NULL.
+ * @param sizes
+ *     The sizes of the parts.
+ * @return non-zero upon success or 0 otherwise
+ */
+static int
+png_chunk_write(FILE *out, const char *type, const unsigned char *parts[3],
+    const size_t sizes[3])
+{
+    unsigned char header[8], trailer[4];
+    unsigned long crc;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        size += parts[i] ? sizes[i] : 0;
+    }
+
+    png_put32(header, size);
+    memcpy(header + 4, type, 4);
+    crc = crc32(0L, header + 4, 4);
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
         return 0;
     }
 
-    /* Initialise the PNG struct to use out as output stream */
-    png_init_io(png, out);
+    for (i = 0; i < 3; i++) {
+        if (!parts[i] || !sizes[i]) {
+            continue;
+        }
+        crc = crc32(crc, parts[i], sizes[i]);
+        if (fwrite(parts[i], 1, sizes[i], out) != sizes[i]) {
+            return 0;
+        }
+    }
 
-    /* Initialise the information struct */
-    png_set_IHDR(png, info, pattern->width, pattern->height, 8,
-        PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_put32(trailer, crc);
 
-    /* Initialise the image data */
-    rows = alloca(sizeof(png_bytep) * pattern->height);
-    for (i = 0; i < pattern->height; i++) {
-        rows[i] = (png_bytep)&pattern->pixels[i * pattern->width];
+    return fwrite(trailer, 1, sizeof(trailer), out) == sizeof(trailer);
+}
+
+/**
+ * Checks the settings of an encoder.
+ *
+ * @param profile
+ *     The settings.
+ * @return non-zero if the settings are valid, or 0 otherwise, in which case
+ *     errno is set to EINVAL
+ */
+static int
+png_profile_check(const StereoPNGProfile *profile)
+{
+    if (profile->level < Z_NO_COMPRESSION
+            || profile->level > Z_BEST_COMPRESSION
+            || profile->filter < STEREO_PNG_FILTER_NONE
+            || profile->filter > STEREO_PNG_FILTER_ADAPTIVE) {
+        errno = EINVAL;
+        return 0;
     }
 
-    /* Write the image */
-    png_write_info(png, info);
-    png_write_image(png, rows);
-    png_write_end(png, NULL);
+    return 1;
+}
 
-    png_destroy_write_struct(&png, &info);
+int
+stereo_pattern_save_to_png_with_profile(StereoPattern *pattern, FILE *out,
+    const StereoPNGProfile *profile)
+{
+    static const unsigned char signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+    };
+    PNGEncoder encoder;
+    ParaContext *para;
+    unsigned char ihdr[13], zheader[2], ztrailer[4];
+    const unsigned char *parts[3] = {NULL, NULL, NULL};
+    size_t sizes[3] = {0, 0, 0};
+    unsigned long adler = 1L;
+    unsigned int i;
+    int result = 1;
+
+    if (!png_profile_check(profile) || !pattern->width || !pattern->height) {
+        return 0;
+    }
 
-    return 1;
+    encoder.pattern = pattern;
+    encoder.profile = profile;
+    encoder.bpp = profile->alpha ? 4 : 3;
+    encoder.rowbytes = 1 + (size_t)pattern->width * encoder.bpp;
+    encoder.band_rows = PNG_BAND_BYTES / encoder.rowbytes;
+    if (encoder.band_rows < 1) {
+        encoder.band_rows = 1;
+    }
+    encoder.band_count = (pattern->height + encoder.band_rows - 1)
+        / encoder.band_rows;
+    encoder.filtered = malloc(encoder.rowbytes * pattern->height);
+    encoder.bands = malloc(encoder.band_count * sizeof(PNGBand));
+
+    /* Filter all bands, and then deflate them, since the dictionary of a band
+       is the filtered data of the previous band; small images are not worth
+       waking up the workers for */
+    if (encoder.band_count > 1) {
+        para = para_create(&encoder, (ParaCallback)png_bands_do);
+        encoder.deflating = 0;
+        para_execute(para, 0, encoder.band_count);
+        encoder.deflating = 1;
+        para_execute(para, 0, encoder.band_count);
+        para_free(para);
+    }
+    else {
+        encoder.deflating = 0;
+        png_bands_do(&encoder, 0, 1, 0, 1);
+        encoder.deflating = 1;
+        png_bands_do(&encoder, 0, 1, 0, 1);
+    }
+
+    for (i = 0; i < encoder.band_count; i++) {
+        size_t size = i == encoder.band_count - 1
+            ? encoder.rowbytes * pattern->height
+                - (size_t)i * encoder.band_rows * encoder.rowbytes
+            : (size_t)encoder.band_rows * encoder.rowbytes;
+
+        result = result && encoder.bands[i].ok;
+        adler = adler32_combine(adler, encoder.bands[i].adler, size);
+    }
+
+    /* The zlib header, with the compression level as a hint */
+    zheader[0] = 0x78;
+    zheader[1] = (profile->level < 2 ? 0 : profile->level < 6 ? 1
+        : profile->level == 6 ? 2 : 3) << 6;
+    zheader[1] += 31 - ((zheader[0] << 8) + zheader[1]) % 31;
+    png_put32(ztrailer, adler);
+
+    /* The image header */
+    png_put32(ihdr, pattern->width);
+    png_put32(ihdr + 4, pattern->height);
+    ihdr[8] = 8;
+    ihdr[9] = profile->alpha ? 6 : 2;
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+
+    result = result && fwrite(signature, 1, sizeof(signature), out)
+        == sizeof(signature);
+    parts[1] = ihdr;
+    sizes[1] = sizeof(ihdr);
+    result = result && png_chunk_write(out, "IHDR", parts, sizes);
+
+    /* Write one chunk per band; the first starts with the zlib header and the
+       last ends with the checksum */
+    for (i = 0; result && i < encoder.band_count; i++) {
+        parts[0] = i == 0 ? zheader : NULL;
+        sizes[0] = sizeof(zheader);
+        parts[1] = encoder.bands[i].data;
+        sizes[1] = encoder.bands[i].size;
+        parts[2] = i == encoder.band_count - 1 ? ztrailer : NULL;
+        sizes[2] = sizeof(ztrailer);
+        result = png_chunk_write(out, "IDAT", parts, sizes);
+    }
+
+    parts[0] = parts[1] = parts[2] = NULL;
+    result = result && png_chunk_write(out, "IEND", parts, sizes);
+
+    for (i = 0; i < encoder.band_count; i++) {
+        free(encoder.bands[i].data);
+    }
+    free(encoder.bands);
+    free(encoder.filtered);
+
+    return result;
+}
+
+int
+stereo_pattern_save_to_png(StereoPattern *pattern, FILE *out)
+{
+    return stereo_pattern_save_to_png_with_profile(pattern, out,
+        &stereo_png_profile_default);
 }
 
 int
 stereo_pattern_save_to_png_file(StereoPattern *pattern, const char *filename)
 {
-    FILE *out = fopen(filename, "wb");
+    return stereo_pattern_save_to_png_file_with_profile(pattern, filename,
+        &stereo_png_profile_default);
+}
+
+int
+stereo_pattern_save_to_png_file_with_profile(StereoPattern *pattern,
+    const char *filename, const StereoPNGProfile *profile)
+{
+    FILE *out;
     int result = 0;
 
+    if (!png_profile_check(profile)) {
+        return 0;
+    }
+
+    out = fopen(filename, "wb");
     if (out) {
-        result = stereo_pattern_save_to_png(pattern, out);
-        fclose(out);
+        result = stereo_pattern_save_to_png_with_profile(pattern, out,
+            profile);
+        result = !fclose(out) && result;
     }
 
     return result;
@@ -4,15 +4,26 @@
 #include "../pattern.h"
 
 StereoPattern*
-stereo_pattern_create(unsigned int width, unsigned int height)
+stereo_pattern_allocate(unsigned int width, unsigned int height)
 {
     StereoPattern *result = malloc(sizeof(StereoPattern)
         + width * height * sizeof(PatternPixel));
-    int x, y;
-    PatternPixel *d;
 
     result->width = width;
     result->height = height;
+    result->refs = 1;
+    result->owner = NULL;
+
+    return result;
+}
+
+StereoPattern*
+stereo_pattern_create(unsigned int width, unsigned int height)
+{
+    StereoPattern *result = stereo_pattern_allocate(width, height);
+    int x, y;
+    PatternPixel *d;
+
     d = result->pixels;
     for (y = 0; y < height; y++) {
         for (x = 0; x < width; x++) {
@@ -27,8 +38,53 @@ stereo_pattern_create(unsigned int width, unsigned int height)
     return result;
 }
 
+StereoPattern*
+stereo_pattern_ref(StereoPattern *pattern)
+{
+    __sync_fetch_and_add(&pattern->refs, 1);
+
+    return pattern;
+}
+
+int
+stereo_pattern_is_shared(StereoPattern *pattern)
+{
+    return pattern->owner || __sync_fetch_and_add(&pattern->refs, 0) > 1;
+}
+
+StereoPattern*
+stereo_pattern_unshare(StereoPattern *pattern)
+{
+    StereoPattern *result;
+
+    if (!stereo_pattern_is_shared(pattern)) {
+        return pattern;
+    }
+
+    result = stereo_pattern_allocate(pattern->width, pattern->height);
+    memcpy(result->pixels, pattern->pixels,
+        (size_t)pattern->width * pattern->height * sizeof(PatternPixel));
+    stereo_pattern_free(pattern);
+
+    return result;
+}
+
 void
 stereo_pattern_free(StereoPattern *pattern)
 {
-    free(pattern);
+    /* The owner is read while this reference is held; once the count has
+       dropped to 0, the owner may hand the pattern out and release it again
+       on another thread */
+    StereoPatternOwner *owner = pattern->owner;
+
+    if (__sync_sub_and_fetch(&pattern->refs, 1)) {
+        return;
+    }
+
+    if (owner) {
+        owner->Release(owner, pattern);
+    }
+    else {
+        free(pattern);
+    }
 }
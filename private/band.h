@@ -0,0 +1,142 @@
+#ifndef PRIVATE_BAND_H
+#define PRIVATE_BAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../band.h"
+
+/**
+ * The value of BandSetup::magic; this changes with the protocol.
+ */
+#define BAND_MAGIC 0x53424e31
+
+/**
+ * The maximum width of a stereogram and of a pattern.
+ */
+#define BAND_WIDTH_MAX (1 << 20)
+
+/**
+ * The maximum number of pixels of a band and of a pattern.
+ */
+#define BAND_PIXELS_MAX (1 << 26)
+
+/**
+ * The types of the messages.
+ *
+ * A render starts with BAND_SETUP from the coordinator, and is followed by any
+ * number of BAND_ROWS from the coordinator, each of which is answered by
+ * BAND_RESULT or BAND_FAILED from the worker.
+ */
+enum {
+    /** BandSetup followed by the pixels of the pattern */
+    BAND_SETUP = 1,
+
+    /** BandRows followed by the z-buffer samples of the rows; 16 bit samples
+        are big-endian */
+    BAND_ROWS,
+
+    /** BandRows followed by the rendered pixels of the rows */
+    BAND_RESULT,
+
+    /** BandRows of rows that could not be rendered */
+    BAND_FAILED
+};
+
+/**
+ * The header of every message.
+ *
+ * All integers of the headers of messages are 32 bit and in network byte
+ * order.
+ */
+typedef struct {
+    /** One of the BAND_* types */
+    uint32_t type;
+
+    /** The number of bytes following this header */
+    uint32_t length;
+} BandMessage;
+
+/**
+ * The header of BAND_SETUP.
+ */
+typedef struct {
+    /** BAND_MAGIC */
+    uint32_t magic;
+
+    /** The width of the stereogram */
+    uint32_t width;
+
+    /** The number of bits of every z-buffer sample */
+    uint32_t depth;
+
+    /** StereoImage::interpolate and StereoImage::row_step */
+    uint32_t interpolate, row_step;
+
+    /** The dimensions of the pattern */
+    uint32_t pattern_width, pattern_height;
+
+    /** StereoImage::offsets as two's complement */
+    uint32_t offsets[STEREO_OFFSET_COUNT];
+} BandSetup;
+
+/**
+ * The header of BAND_ROWS, BAND_RESULT and BAND_FAILED.
+ */
+typedef struct {
+    /** The first row */
+    uint32_t y;
+
+    /** The number of rows */
+    uint32_t rows;
+} BandRows;
+
+/**
+ * Sends a message.
+ *
+ * @param fd
+ *     The socket.
+ * @param type
+ *     The BAND_* type.
+ * @param header
+ *     The header of the message, in network byte order.
+ * @param header_size
+ *     The size of header.
+ * @param data
+ *     The data following the header, or NULL.
+ * @param size
+ *     The size of data.
+ * @return non-zero upon success
+ */
+int
+band_send(int fd, unsigned int type, const void *header, size_t header_size,
+    const void *data, size_t size);
+
+/**
+ * Receives the header of a message.
+ *
+ * @param fd
+ *     The socket.
+ * @param message
+ *     Receives the header in host byte order.
+ * @return 1 upon success, 0 if the connection was closed before the message,
+ *     or -1 upon error
+ */
+int
+band_receive_message(int fd, BandMessage *message);
+
+/**
+ * Receives data.
+ *
+ * @param fd
+ *     The socket.
+ * @param data
+ *     The buffer.
+ * @param size
+ *     The number of bytes to receive.
+ * @return non-zero upon success
+ */
+int
+band_receive(int fd, void *data, size_t size);
+
+#endif
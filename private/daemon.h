@@ -0,0 +1,155 @@
+#ifndef PRIVATE_DAEMON_H
+#define PRIVATE_DAEMON_H
+
+#include "../daemon.h"
+
+/**
+ * The value of DaemonRequest::magic; this changes with the protocol.
+ */
+#define DAEMON_MAGIC 0x53445232
+
+/**
+ * The alignment of the slots, and of the z-buffers inside them.
+ */
+#define DAEMON_ALIGN 64
+
+/**
+ * Aligns a size or an offset to DAEMON_ALIGN.
+ */
+#define DAEMON_ALIGN_UP(value) \
+    (((value) + DAEMON_ALIGN - 1) & ~(size_t)(DAEMON_ALIGN - 1))
+
+/**
+ * The request sent by a client to open a session.
+ */
+typedef struct {
+    /** DAEMON_MAGIC */
+    unsigned int magic;
+
+    /** The dimensions of the frames */
+    unsigned int width, height;
+
+    /** The number of bits of every z-buffer sample */
+    unsigned int depth;
+
+    /** The number of slots */
+    unsigned int slots;
+
+    /** Whether the z-buffer values are inverted */
+    int is_inverted;
+
+    /** The strength of the stereo effect */
+    double strength;
+
+    /** The name of the pattern */
+    char pattern[STEREO_DAEMON_NAME_MAX];
+} DaemonRequest;
+
+/**
+ * The reply of the daemon to DaemonRequest.
+ *
+ * If the session was opened, the reply carries four file descriptors: the
+ * shared memory of the slots, the shared memory of the stereograms, the
+ * eventfd signalled by the client when it has submitted slots, and the eventfd
+ * signalled by the daemon when it has rendered slots.
+ *
+ * The memory of the stereograms only contains their pixels, one page aligned
+ * block per slot, and is sealed against writes through new mappings, so the
+ * client maps it read-only; the headers of the stereograms are private to
+ * either side.
+ */
+typedef struct {
+    /** 0 if the session was opened, otherwise an errno value */
+    int error;
+
+    /** The size of the shared memory of the slots */
+    unsigned long long size;
+
+    /** The number of bytes between the start of a slot and the next */
+    unsigned long long slot_size;
+
+    /** The offset of the z-buffer inside a slot */
+    unsigned long long zbuffer_offset;
+
+    /** The number of bytes between the pixels of a stereogram and those of
+        the next */
+    unsigned long long image_size;
+
+    /** The number of bytes between the start of a z-buffer row and the
+        next */
+    unsigned int stride;
+} DaemonReply;
+
+/**
+ * The states of a slot.
+ */
+enum {
+    /** The slot belongs to the client */
+    DAEMON_SLOT_FREE = 0,
+
+    /** The z-buffer has been submitted, and the slot belongs to the daemon */
+    DAEMON_SLOT_SUBMITTED,
+
+    /** The stereogram has been rendered, and the slot belongs to the client
+        again */
+    DAEMON_SLOT_DONE
+};
+
+/**
+ * The header at the start of every slot.
+ *
+ * The state is only accessed atomically; the side that moves a slot to the
+ * other side releases its writes to the slot with the store of the state.
+ */
+typedef struct {
+    /** One of the DAEMON_SLOT_* values */
+    unsigned int state;
+
+    /** The frame of the effect to render with */
+    unsigned int frame;
+
+    /** Non-zero if the stereogram was rendered */
+    int result;
+} DaemonSlot;
+
+/**
+ * Returns the number of bytes between the pixels of a stereogram in the
+ * shared memory of the stereograms and those of the next.
+ *
+ * @param width, height
+ *     The dimensions of the stereograms.
+ */
+size_t
+daemon_image_size(unsigned int width, unsigned int height);
+
+/**
+ * Maps the pixels of a stereogram from the shared memory of the stereograms.
+ *
+ * The pixels are preceded by a private header, so the result is a complete
+ * pattern of which nothing but the pixels is visible to the other side.
+ *
+ * @param fd
+ *     The shared memory of the stereograms.
+ * @param slot
+ *     The index of the slot.
+ * @param width, height
+ *     The dimensions of the stereograms.
+ * @param prot
+ *     The protection of the pixels, as passed to mmap.
+ * @return the stereogram, or NULL if the memory cannot be mapped, in which
+ *     case errno is set
+ */
+StereoPattern*
+daemon_image_map(int fd, unsigned int slot, unsigned int width,
+    unsigned int height, int prot);
+
+/**
+ * Unmaps a stereogram mapped with daemon_image_map.
+ *
+ * @param image
+ *     The stereogram.
+ */
+void
+daemon_image_unmap(StereoPattern *image);
+
+#endif
@@ -22,6 +22,49 @@
 /* #endif                                                                     */
 /* }                                                                          */
 /*                                                                            */
+/* Optionally implement a function that applies the effect to a horizontal   */
+/* span of pixels, for example using SIMD instructions, and define           */
+/* EFFECT_SPAN before including this file:                                    */
+/* static void                                                                */
+/* effect_apply_span(EFFECT *effect, PatternPixel *pixel, int x, int count,   */
+/*     int y)                                                                 */
+/* {                                                                          */
+/*     ...                                                                    */
+/* }                                                                          */
+/*                                                                            */
+/* Optionally make the effect walk the pattern in tiles of                   */
+/* EFFECT_TILE_WIDTH x EFFECT_TILE_HEIGHT pixels instead of row by row, which */
+/* is useful for effects sampling a source pattern in a non-linear way, by    */
+/* defining EFFECT_TILED and implementing a function that prefetches the      */
+/* source data needed by a tile:                                              */
+/* static void                                                                */
+/* effect_prefetch(EFFECT *effect, int x, int y, int width, int height)       */
+/* {                                                                          */
+/*     ...                                                                    */
+/* }                                                                          */
+/*                                                                            */
+/* Optionally generate one specialised copy of the row loop for each of      */
+/* EFFECT_VARIANT_COUNT values of a small parameter, such as a component     */
+/* mask, by defining EFFECT_VARIANTS and implementing the span manipulator   */
+/* in terms of the variant; branches on the variant are then resolved at     */
+/* compile time. Select the variant after initialising the v-table:          */
+/* static void                                                                */
+/* effect_apply_span_variant(EFFECT *effect, PatternPixel *pixel, int x,      */
+/*     int count, int y, int variant)                                         */
+/* {                                                                          */
+/*     ...                                                                    */
+/* }                                                                          */
+/*                                                                            */
+/* stereo_effect_variant_select(result, variant);                             */
+/*                                                                            */
+/* Optionally implement a function that prepares values shared by many       */
+/* pixels before every run, and set it after initialising the v-table:        */
+/* static void                                                                */
+/* effect_prepare(SampleEffect *effect)                                       */
+/* {                                                                          */
+/*     ...                                                                    */
+/* }                                                                          */
+/*                                                                            */
 /* Implement the effect update and release functions:                         */
 /* static void                                                                */
 /* effect_update(SampleEffect *effect)                                        */
@@ -29,6 +72,30 @@
 /*     ...                                                                    */
 /* }                                                                          */
 /*                                                                            */
+/* Implement a function that sets the state to that of a frame, deriving any  */
+/* random values from effect->b.seed, and functions that allocate and free    */
+/* the per-frame state; these are used to render frames independently:       */
+/* static void                                                                */
+/* effect_seek(SampleEffect *effect, unsigned int frame)                      */
+/* {                                                                          */
+/*     ...                                                                    */
+/* }                                                                          */
+/*                                                                            */
+/* static void                                                                */
+/* effect_frame_initialize(SampleEffect *effect)                              */
+/* {                                                                          */
+/*     ...                                                                    */
+/* }                                                                          */
+/*                                                                            */
+/* static void                                                                */
+/* effect_frame_finalize(SampleEffect *effect)                                */
+/* {                                                                          */
+/*     ...                                                                    */
+/* }                                                                          */
+/*                                                                            */
+/* Effects that wrap other effects instead define EFFECT_RENDER and implement */
+/* effect_render themselves.                                                  */
+/*                                                                            */
 /* static void                                                                */
 /* effect_release(SampleEffect *effect)                                       */
 /* {                                                                          */
@@ -49,14 +116,43 @@
 #ifndef PRIVATE_EFFECT_H
 #define PRIVATE_EFFECT_H
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <para/para.h>
 
+#include "sched.h"
+
+#ifndef EFFECT_TILE_WIDTH
+/**
+ * The width of a tile for tiled effects.
+ */
+#define EFFECT_TILE_WIDTH 64
+#endif
+
+#ifndef EFFECT_TILE_HEIGHT
+/**
+ * The height of a tile for tiled effects.
+ */
+#define EFFECT_TILE_HEIGHT 16
+#endif
+
 /**
  * The header that must be specified as the first field in an effect.
  */
 #define STEREO_PATTERN_EFFECT_HEADER \
     StereoPatternEffect b; \
-    ParaContext *para
+    ParaContext *para; \
+    Sched sched; \
+    int grain; \
+    size_t size
+
+/**
+ * The layout shared by all effects.
+ */
+typedef struct {
+    STEREO_PATTERN_EFFECT_HEADER;
+} GenericEffect;
 
 /**
  * Applies the effect to a single pixel.
@@ -71,6 +167,55 @@
 static inline void
 effect_apply(EFFECT *effect, PatternPixel *pixel, int x, int y);
 
+/**
+ * Applies the effect to a horizontal span of pixels.
+ *
+ * Unless EFFECT_SPAN is defined, this calls effect_apply for every pixel.
+ *
+ * @param effect
+ *     The current effect.
+ * @param pixel
+ *     The first pixel of the span.
+ * @param x, y
+ *     The position of the first pixel.
+ * @param count
+ *     The number of pixels in the span.
+ */
+#ifdef EFFECT_SPAN
+static inline void
+effect_apply_span(EFFECT *effect, PatternPixel *pixel, int x, int count,
+    int y);
+#else
+static inline void
+effect_apply_span(EFFECT *effect, PatternPixel *pixel, int x, int count,
+    int y)
+{
+    int end = x + count;
+
+    for (; x < end; x++) {
+        effect_apply(effect, pixel, x, y);
+        pixel++;
+    }
+}
+#endif
+
+#ifdef EFFECT_TILED
+/**
+ * Prefetches the source data needed by a tile.
+ *
+ * This is called for the next tile while the current one is processed.
+ *
+ * @param effect
+ *     The current effect.
+ * @param x, y
+ *     The position of the top left pixel of the tile.
+ * @param width, height
+ *     The dimensions of the tile.
+ */
+static inline void
+effect_prefetch(EFFECT *effect, int x, int y, int width, int height);
+#endif
+
 /**
  * Applies an effect.
  *
@@ -79,7 +224,7 @@ effect_apply(EFFECT *effect, PatternPixel *pixel, int x, int y);
  *
  * @param effect
  *     The current effect.
- * @param start, end, start, gend
+ * @param start, end, gstart, gend
  *     See para_execute
  * @see para_execute
  */
@@ -87,22 +232,287 @@ static void
 effect_apply_lines(StereoPatternEffect *effect, int start, int end,
     int gstart, int gend)
 {
-    int x, y;
+    int y;
     StereoPattern *pattern = effect->pattern;
-    PatternPixel *pixel;
 
-    /* Initialise a pointer to the first pixel */
-    pixel = stereo_pattern_row_get(pattern, start);
+#ifdef EFFECT_TILED
+    int x, y1;
 
-    /* Iterate over all our assigned pixels */
-    for (y = start; y < end; y++) {
-        for (x = 0; x < pattern->width; x++) {
-            effect_apply((EFFECT*)effect, pixel, x, y);
-            pixel++;
+    /* Iterate over all tiles of our assigned rows */
+    for (; start < end; start = y1) {
+        y1 = start + EFFECT_TILE_HEIGHT < end
+            ? start + EFFECT_TILE_HEIGHT : end;
+
+        for (x = 0; x < pattern->width; x += EFFECT_TILE_WIDTH) {
+            int width = x + EFFECT_TILE_WIDTH < pattern->width
+                ? EFFECT_TILE_WIDTH : pattern->width - x;
+            int next = x + EFFECT_TILE_WIDTH;
+
+            /* Prefetch the data for the next tile on this row of tiles */
+            if (next < pattern->width) {
+                effect_prefetch((EFFECT*)effect, next, start,
+                    next + EFFECT_TILE_WIDTH < pattern->width
+                        ? EFFECT_TILE_WIDTH : pattern->width - next,
+                    y1 - start);
+            }
+
+            for (y = start; y < y1; y++) {
+                effect_apply_span((EFFECT*)effect,
+                    stereo_pattern_pixel_get(pattern, x, y), x, width, y);
+            }
         }
     }
+#else
+    /* Iterate over all our assigned rows */
+    for (y = start; y < end; y++) {
+        effect_apply_span((EFFECT*)effect, stereo_pattern_row_get(pattern, y),
+            0, pattern->width, y);
+    }
+#endif
 }
 
+#ifdef EFFECT_VARIANTS
+#if defined(EFFECT_SPAN) || defined(EFFECT_TILED)
+#error EFFECT_VARIANTS cannot be combined with EFFECT_SPAN or EFFECT_TILED
+#endif
+
+/**
+ * Applies a variant of the effect to a horizontal span of pixels.
+ *
+ * This is instantiated once for every variant, and variant is a constant in
+ * every instantiation, so tests of it are resolved at compile time.
+ *
+ * @param effect
+ *     The current effect.
+ * @param pixel
+ *     The first pixel of the span.
+ * @param x, y
+ *     The position of the first pixel.
+ * @param count
+ *     The number of pixels in the span.
+ * @param variant
+ *     The variant, in [0, EFFECT_VARIANT_COUNT).
+ */
+static inline void
+effect_apply_span_variant(EFFECT *effect, PatternPixel *pixel, int x,
+    int count, int y, int variant);
+
+/**
+ * The number of variants of an effect.
+ */
+#define EFFECT_VARIANT_COUNT 16
+
+/**
+ * Invokes a macro for every variant.
+ */
+#define EFFECT_VARIANT_LIST(X) \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+    X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+
+/**
+ * Defines the span and row functions of a variant.
+ *
+ * @see effect_apply_span
+ * @see effect_apply_lines
+ */
+#define EFFECT_VARIANT_DEFINE(variant) \
+    static void \
+    effect_apply_span_##variant(EFFECT *effect, PatternPixel *pixel, int x, \
+        int count, int y) \
+    { \
+        effect_apply_span_variant(effect, pixel, x, count, y, variant); \
+    } \
+    \
+    static void \
+    effect_apply_lines_##variant(StereoPatternEffect *effect, int start, \
+        int end, int gstart, int gend) \
+    { \
+        StereoPattern *pattern = effect->pattern; \
+        int y; \
+        \
+        for (y = start; y < end; y++) { \
+            effect_apply_span_##variant((EFFECT*)effect, \
+                stereo_pattern_row_get(pattern, y), 0, pattern->width, y); \
+        } \
+    }
+
+EFFECT_VARIANT_LIST(EFFECT_VARIANT_DEFINE)
+
+/**
+ * The functions of a variant.
+ */
+typedef struct {
+    /** See StereoPatternEffect::Apply */
+    void (*Apply)(StereoPatternEffect *effect, int start, int end, int gstart,
+        int gend);
+
+    /** See StereoPatternEffect::ApplySpan */
+    void (*ApplySpan)(StereoPatternEffect *effect, PatternPixel *pixel, int x,
+        int count, int y);
+} EffectVariant;
+
+#define EFFECT_VARIANT_ENTRY(variant) \
+    { \
+        effect_apply_lines_##variant, \
+        (void*)effect_apply_span_##variant \
+    },
+
+/**
+ * The functions of all variants.
+ */
+static const EffectVariant effect_variants[EFFECT_VARIANT_COUNT] = {
+    EFFECT_VARIANT_LIST(EFFECT_VARIANT_ENTRY)
+};
+
+/**
+ * Makes an effect use the functions specialised for a variant.
+ *
+ * This must be called after stereo_effect_vt_initialize.
+ *
+ * @param effect
+ *     The effect object.
+ * @param variant
+ *     The variant, in [0, EFFECT_VARIANT_COUNT).
+ */
+#define stereo_effect_variant_select(effect, variant) \
+    (effect)->b.Apply = effect_variants[variant].Apply; \
+    (effect)->b.ApplySpan = effect_variants[variant].ApplySpan
+#endif
+
+/**
+ * Applies an effect to a chunk of rows handed out by the scheduler.
+ *
+ * @param effect
+ *     The current effect.
+ * @param start, end
+ *     See SchedCallback.
+ * @see SchedCallback
+ */
+static void
+effect_apply_chunk(StereoPatternEffect *effect, int start, int end)
+{
+    effect->Apply(effect, start, end, 0, effect->pattern->height);
+}
+
+/**
+ * Applies an effect to rows taken from the scheduler of the effect.
+ *
+ * This function is called as a parallelised task, and its parameters come from
+ * para_execute. The rows passed are ignored, since rows are handed out on
+ * demand by the scheduler initialised in stereo_pattern_effect_apply.
+ *
+ * @param effect
+ *     The current effect.
+ * @param start, end, gstart, gend
+ *     See para_execute
+ * @see para_execute
+ */
+static int
+effect_apply_scheduled(StereoPatternEffect *effect, int start, int end,
+    int gstart, int gend)
+{
+    sched_run(&((GenericEffect*)effect)->sched,
+        (SchedCallback)effect_apply_chunk, effect);
+
+    return 0;
+}
+
+/**
+ * Sets the state of an effect to that of a frame.
+ *
+ * @param effect
+ *     The current effect.
+ * @param frame
+ *     The index of the frame.
+ */
+static void
+effect_seek(EFFECT *effect, unsigned int frame);
+
+#ifdef EFFECT_RENDER
+/**
+ * Applies the effect as it is at a frame to another pattern.
+ *
+ * @param effect
+ *     The current effect. This is not modified.
+ * @param target
+ *     The pattern to which to apply the effect.
+ * @param frame
+ *     The index of the frame.
+ */
+static void
+effect_render(EFFECT *effect, StereoPattern *target, unsigned int frame);
+#else
+/**
+ * Allocates the state of an effect that changes from frame to frame.
+ *
+ * @param effect
+ *     The current effect.
+ */
+static void
+effect_frame_initialize(EFFECT *effect);
+
+/**
+ * Frees the state allocated by effect_frame_initialize.
+ *
+ * @param effect
+ *     The current effect.
+ */
+static void
+effect_frame_finalize(EFFECT *effect);
+
+/**
+ * Applies the effect as it is at a frame to another pattern.
+ *
+ * The effect is copied, and the copy is given its own per-frame state, so the
+ * effect itself is only read. The effect is applied on the calling thread.
+ *
+ * @param effect
+ *     The current effect. This is not modified.
+ * @param target
+ *     The pattern to which to apply the effect.
+ * @param frame
+ *     The index of the frame.
+ */
+static void
+effect_render(EFFECT *effect, StereoPattern *target, unsigned int frame)
+{
+    size_t size = ((GenericEffect*)effect)->size;
+    StereoPatternEffect *copy = malloc(size);
+
+    memcpy(copy, effect, size);
+    copy->pattern = target;
+    copy->iteration = frame;
+    effect_frame_initialize((EFFECT*)copy);
+    effect_seek((EFFECT*)copy, frame);
+
+    if (copy->Prepare) {
+        copy->Prepare(copy);
+    }
+    copy->Apply(copy, 0, target->height, 0, target->height);
+
+    effect_frame_finalize((EFFECT*)copy);
+    free(copy);
+}
+#endif
+
+/**
+ * The number of rows an effect prefers to be handed at once.
+ */
+#ifdef EFFECT_TILED
+#define EFFECT_GRAIN EFFECT_TILE_HEIGHT
+#else
+#define EFFECT_GRAIN 1
+#endif
+
+/**
+ * The value of StereoPatternEffect::Prefetch.
+ */
+#ifdef EFFECT_TILED
+#define EFFECT_PREFETCH ((void*)effect_prefetch)
+#else
+#define EFFECT_PREFETCH NULL
+#endif
+
 /**
  * Initialises an effect v-table.
  *
@@ -119,9 +529,17 @@ effect_apply_lines(StereoPatternEffect *effect, int start, int end,
     (effect)->b.pattern = target_pattern; \
     (effect)->b.name = #namespace; \
     (effect)->b.iteration = 0; \
+    (effect)->b.seed = (unsigned int)rand(); \
     (effect)->b.Apply = (void*)effect_apply_lines; \
+    (effect)->b.ApplySpan = (void*)effect_apply_span; \
+    (effect)->b.Prefetch = EFFECT_PREFETCH; \
+    (effect)->b.Prepare = NULL; \
     (effect)->b.Update = (void*)effect_update; \
+    (effect)->b.Seek = (void*)effect_seek; \
+    (effect)->b.Render = (void*)effect_render; \
     (effect)->b.Release = (void*)effect_release; \
-    (effect)->para = para_create(effect, (ParaCallback)effect_apply_lines)
+    (effect)->grain = EFFECT_GRAIN; \
+    (effect)->size = sizeof(*(effect)); \
+    (effect)->para = para_create(effect, (ParaCallback)effect_apply_scheduled)
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef PRIVATE_PATTERN_H
+#define PRIVATE_PATTERN_H
+
+#include <stdio.h>
+
+#include "../pattern.h"
+
+/**
+ * A function that decodes a pattern from a file.
+ *
+ * @param in
+ *     The file.
+ * @return a new pattern, or NULL upon failure
+ */
+typedef StereoPattern *(*PatternDecode)(FILE *in);
+
+/**
+ * Loads a pattern from a file through the pattern cache.
+ *
+ * If the cache is disabled, or the file is not a regular file, such as a pipe,
+ * the file is simply decoded.
+ *
+ * @param filename
+ *     The name of the file.
+ * @param decode
+ *     The function that decodes the file. Patterns decoded by different
+ *     functions are cached separately.
+ * @return a reference to the pattern, or NULL upon failure
+ */
+StereoPattern*
+pattern_cache_load(const char *filename, PatternDecode decode);
+
+#endif
@@ -96,6 +96,43 @@ blend2(PatternPixel *pixel, PatternPixel *row, int x, int width)
 #endif
 }
 
+/**
+ * Sets pixel to the value of the pixel at ix = unmkfix(x).
+ *
+ * Columns wrap around just like in blend2.
+ *
+ * @param pixel
+ *     The pixel to set.
+ * @param row
+ *     The row.
+ * @param x
+ *     The column to retrieve. This is a fixed floating point value.
+ * @param width
+ *     The width of the row data.
+ */
+static inline void
+nearest(PatternPixel *pixel, PatternPixel *row, int x, int width)
+{
+    int x1 = unmkfix(x) % width;
+    PatternPixel *p;
+
+#ifndef MODULUS_UNSIGNED
+    /* If modulus is signed, we need to correct for that */
+    if (x1 < 0) {
+        x1 += width;
+    }
+#endif
+
+    p = &row[x1];
+
+    pixel->r = p->r;
+    pixel->g = p->g;
+    pixel->b = p->b;
+#ifdef STEREO_ALPHA
+    pixel->a = p->a;
+#endif
+}
+
 /**
  * Sets pixel to the linearly interpolated value calculated from the rows at
  * ix = unmkfix(x) and iy = unmkfix(y).
@@ -0,0 +1,248 @@
+#ifndef PRIVATE_SCHED_H
+#define PRIVATE_SCHED_H
+
+#include <time.h>
+#include <unistd.h>
+
+#include "../tune.h"
+
+/**
+ * The maximum number of row queues.
+ */
+#define SCHED_QUEUE_MAX 64
+
+/**
+ * The size of a cache line; queues are padded to this size to prevent false
+ * sharing between workers.
+ */
+#define SCHED_CACHE_LINE 64
+
+/**
+ * The time, in nanoseconds, that a worker should spend on a single chunk.
+ */
+#define SCHED_CHUNK_NS 50000
+
+/**
+ * The maximum number of rows handed out as a single chunk.
+ */
+#define SCHED_CHUNK_MAX 64
+
+/**
+ * A queue of rows.
+ *
+ * Rows are taken from the front of the queue both by the worker owning it and
+ * by workers stealing from it.
+ */
+typedef struct {
+    /** The next row to hand out */
+    volatile int next;
+
+    /** The row after the last row of this queue */
+    int end;
+
+    /** Padding to make sure that no two queues share a cache line */
+    char padding[SCHED_CACHE_LINE - 2 * sizeof(int)];
+} SchedQueue;
+
+/**
+ * A scheduler handing out chunks of rows on demand.
+ *
+ * The rows are initially split evenly between the queues, and every worker
+ * joining the scheduler is assigned one of them. When a worker has emptied its
+ * own queue, it steals chunks from the other queues, so a worker that is
+ * preempted, or that is assigned expensive rows, does not delay the others.
+ */
+typedef struct {
+    /** The number of queues in use */
+    int queue_count;
+
+    /** The number of workers that have joined so far */
+    volatile int workers;
+
+    /** The fixed chunk size, or 0 to adapt it to the cost of rows */
+    int chunk;
+
+    /** Chunks are multiples of this many rows, except at the end of a queue;
+        sched_initialize sets this to 1 */
+    int grain;
+
+    /** The row queues */
+    SchedQueue queues[SCHED_QUEUE_MAX];
+} Sched;
+
+/**
+ * A callback that processes a chunk of rows.
+ *
+ * @param context
+ *     The context passed to sched_run.
+ * @param start
+ *     The first row of the chunk.
+ * @param end
+ *     The row after the last row of the chunk.
+ */
+typedef void (*SchedCallback)(void *context, int start, int end);
+
+/**
+ * Returns the current time in nanoseconds.
+ *
+ * @return a monotonic time stamp
+ */
+static inline long long
+sched_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Initialises a scheduler to hand out the rows start <= row < end.
+ *
+ * This must not be called while workers are running.
+ *
+ * @param sched
+ *     The scheduler to initialise.
+ * @param start
+ *     The first row.
+ * @param end
+ *     The row after the last row.
+ * @param tuning
+ *     The settings that limit the number of workers and the chunk size.
+ */
+static inline void
+sched_initialize(Sched *sched, int start, int end, const StereoTuning *tuning)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (tuning->workers && count > tuning->workers) {
+        count = tuning->workers;
+    }
+    if (count > SCHED_QUEUE_MAX) {
+        count = SCHED_QUEUE_MAX;
+    }
+    if (count > end - start) {
+        count = end - start;
+    }
+    if (count < 1) {
+        count = 1;
+    }
+
+    sched->queue_count = count;
+    sched->workers = 0;
+    sched->chunk = tuning->chunk_rows;
+    sched->grain = 1;
+    for (i = 0; i < count; i++) {
+        sched->queues[i].next = start + (end - start) * i / count;
+        sched->queues[i].end = start + (end - start) * (i + 1) / count;
+    }
+}
+
+/**
+ * Takes a chunk of rows from a queue.
+ *
+ * @param queue
+ *     The queue from which to take rows.
+ * @param rows
+ *     The maximum number of rows to take.
+ * @param start, end
+ *     The chunk taken. These are only modified if rows were taken.
+ * @return non-zero if rows were taken and 0 if the queue is empty
+ */
+static inline int
+sched_take(SchedQueue *queue, int rows, int *start, int *end)
+{
+    int first;
+
+    /* Avoid the atomic operation if the queue is already drained */
+    if (queue->next >= queue->end) {
+        return 0;
+    }
+
+    first = __sync_fetch_and_add(&queue->next, rows);
+    if (first >= queue->end) {
+        return 0;
+    }
+
+    *start = first;
+    *end = first + rows < queue->end ? first + rows : queue->end;
+
+    return 1;
+}
+
+/**
+ * Calculates the size of the next chunk from the cost of the previous one.
+ *
+ * @param rows
+ *     The number of rows in the previous chunk.
+ * @param elapsed
+ *     The time in nanoseconds it took to process the previous chunk.
+ * @param previous
+ *     The previous chunk size.
+ * @return the number of rows to request for the next chunk
+ */
+static inline int
+sched_chunk_size(int rows, long long elapsed, int previous)
+{
+    long long result;
+
+    if (elapsed <= 0) {
+        result = 2 * previous;
+    }
+    else {
+        result = SCHED_CHUNK_NS * rows / elapsed;
+    }
+
+    /* Smooth the estimate to make it less sensitive to single slow chunks */
+    result = (result + previous + 1) / 2;
+
+    return result < 1 ? 1 : result > SCHED_CHUNK_MAX ? SCHED_CHUNK_MAX : result;
+}
+
+/**
+ * Processes rows from a scheduler until all of its queues are empty.
+ *
+ * This function is called once by every worker, and returns when there are no
+ * more rows to hand out. Rows may still be processed by other workers when it
+ * returns. Workers beyond the number of queues return immediately.
+ *
+ * @param sched
+ *     The scheduler.
+ * @param callback
+ *     The function that processes a chunk.
+ * @param context
+ *     The context passed to callback.
+ */
+static inline void
+sched_run(Sched *sched, SchedCallback callback, void *context)
+{
+    int home = __sync_fetch_and_add(&sched->workers, 1);
+    int rows = sched->chunk ? sched->chunk : 1;
+    int i;
+
+    rows = (rows + sched->grain - 1) / sched->grain * sched->grain;
+
+    if (home >= sched->queue_count) {
+        return;
+    }
+
+    /* Start with our own queue, and then steal from the others */
+    for (i = 0; i < sched->queue_count; i++) {
+        SchedQueue *queue = &sched->queues[(home + i) % sched->queue_count];
+        int start, end;
+
+        while (sched_take(queue, rows, &start, &end)) {
+            long long t = sched_now();
+
+            callback(context, start, end);
+            if (!sched->chunk) {
+                rows = sched_chunk_size(end - start, sched_now() - t, rows);
+                rows = (rows + sched->grain - 1) / sched->grain * sched->grain;
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef PRIVATE_SIMD_H
+#define PRIVATE_SIMD_H
+
+#include "../tune.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+/**
+ * Defined if AVX2 kernels can be compiled.
+ */
+#define SIMD_AVX2
+
+/**
+ * Marks a function as using AVX2 instructions.
+ *
+ * Such functions must only be called when simd_isa returns STEREO_ISA_AVX2.
+ */
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/**
+ * Returns the instruction set level that kernels may use.
+ *
+ * @param tuning
+ *     The current settings. The level returned is never higher than
+ *     tuning->isa, unless that is STEREO_ISA_AUTO.
+ * @return the highest instruction set level that is both supported by the
+ *     processor and allowed by the settings
+ */
+static inline int
+simd_isa(const StereoTuning *tuning)
+{
+    int result = STEREO_ISA_GENERIC;
+
+#ifdef SIMD_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        result = STEREO_ISA_AVX2;
+    }
+#endif
+
+    if (tuning->isa != STEREO_ISA_AUTO && tuning->isa < result) {
+        result = tuning->isa;
+    }
+
+    return result;
+}
+
+#endif
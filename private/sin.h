@@ -1,78 +1,170 @@
 #ifndef PRIVATE_SIN_H
 #define PRIVATE_SIN_H
 
-#include <math.h>
-
 #include "fix.h"
 
+/**
+ * The number of bits of precision stored in sine tables in addition to those
+ * of the fixed point values.
+ */
+#define SIN_BITS 8
+
+/**
+ * The base 2 logarithm of the number of entries in the table used by SinPhase.
+ */
+#define SIN_PHASE_BITS 12
+
+/**
+ * The number of bits of the phase used to interpolate between entries.
+ */
+#define SIN_PHASE_FRAC 16
+
 /**
  * A table containing precalculated sin values. It covers an entire period.
+ *
+ * Tables are immutable and shared between all users of the same period; use
+ * sin_table_acquire and sin_table_release to get and release them.
  */
-typedef struct {
+typedef struct SinTable SinTable;
+struct SinTable {
     /** The number of entries in sin */
     int count;
 
-    /** The actual sine values */
+    /** The actual sine values, with SIN_BITS additional bits of precision */
     int *sin;
-} SinTable;
+
+    /** The number of users of this table */
+    unsigned int refs;
+
+    /** The next table in the cache */
+    SinTable *next;
+};
 
 /**
- * Initialises a sin table with count elements and precalculates its values.
- *
- * It does not check whether the table has already been initialised.
+ * Evaluates the sine of a phase by looking it up in a table with a power of
+ * two number of entries.
  *
- * @param sin_table
- *     The sine table to initialise.
- * @param count
- *     The number of sine entries to create. This affects the resolution and
- *     memory footprint of the structure.
+ * The phase is kept as a fraction of a period in 64 bits, so that one table
+ * serves every period and finding the entry is a shift. Since the step is
+ * rounded, the position is reduced modulo the period first, which keeps the
+ * result exactly periodic.
  */
-static inline void
-sin_table_initialize(SinTable *sin_table, int count)
-{
-    int i;
+typedef struct {
+    /** The shared table, which has 1 << SIN_PHASE_BITS entries */
+    SinTable *table;
 
-    sin_table->count = count;
-    sin_table->sin = malloc(count * sizeof(sin_table->sin[0]));
+    /** The number of steps in a period */
+    int period;
 
-    for (i = 0; i < count; i++) {
-        sin_table->sin[i] = (int)(ONE * sin(2.0 * M_PI * (double)i / count));
-    }
-}
+    /** The phase increment for every step; a full period is 2 ** 64 */
+    unsigned long long step;
+} SinPhase;
+
+/**
+ * Returns the sine table for a period.
+ *
+ * The table is created the first time it is requested, and is shared with
+ * later requests. This function is thread safe.
+ *
+ * @param count
+ *     The number of entries of the table.
+ * @return a sine table, which must be released with sin_table_release
+ */
+SinTable*
+sin_table_acquire(int count);
 
 /**
- * Frees a sin table.
+ * Releases a sine table returned by sin_table_acquire.
  *
- * Only the sine table is freed.
+ * The table is freed when its last user releases it. This function is thread
+ * safe.
  *
  * @param sin_table
- *     The sine table to free.
+ *     The sine table to release.
  */
-static inline void
-sin_table_finalize(SinTable *sin_table)
-{
-    free(sin_table->sin);
-    sin_table->sin = NULL;
-    sin_table->count = 0;
-}
+void
+sin_table_release(SinTable *sin_table);
 
 /**
  * Calculates the sin value of 2 * pi * x / sin_table->count.
  *
  * @param sin_table
  *     The sine table.
- * @param
+ * @param x
+ *     The position in the period.
+ * @return the sine as a fixed point value
+ */
+static inline int
+ssin(const SinTable *sin_table, int x)
+{
+    int i = x % sin_table->count;
+
+#ifndef MODULUS_UNSIGNED
+    if (i < 0) {
+        i += sin_table->count;
+    }
+#endif
+
+    return sin_table->sin[i] / (1 << SIN_BITS);
+}
+
+/**
+ * Initialises a phase evaluator for a period.
+ *
+ * @param sin_phase
+ *     The phase evaluator to initialise.
+ * @param period
+ *     The number of steps in a period.
+ */
+void
+sin_phase_initialize(SinPhase *sin_phase, int period);
+
+/**
+ * Frees a phase evaluator.
+ *
+ * @param sin_phase
+ *     The phase evaluator to free.
+ */
+void
+sin_phase_finalize(SinPhase *sin_phase);
+
+/**
+ * Calculates the sin value of 2 * pi * x / period, where period is the value
+ * passed to sin_phase_initialize.
+ *
+ * The value is interpolated between the two closest entries of the table, so
+ * it is within one unit of what ssin returns for a table of the same period.
+ *
+ * @param sin_phase
+ *     The phase evaluator.
+ * @param x
+ *     The position in the period.
+ * @return the sine as a fixed point value
  */
 static inline int
-ssin(SinTable *sin_table, int x)
+sin_phase(const SinPhase *sin_phase, int x)
 {
+    const int *table = sin_phase->table->sin;
+    int position = x % sin_phase->period;
+    unsigned long long phase;
+    unsigned int i;
+    long long frac, a, b;
+
 #ifndef MODULUS_UNSIGNED
-    if (x < 0) {
-        return sin_table->sin[x % sin_table->count + sin_table->count];
+    if (position < 0) {
+        position += sin_phase->period;
     }
 #endif
 
-    return sin_table->sin[x % sin_table->count];
+    phase = (unsigned long long)position * sin_phase->step;
+    i = (unsigned int)(phase >> (64 - SIN_PHASE_BITS));
+    frac = (long long)(phase >> (64 - SIN_PHASE_BITS - SIN_PHASE_FRAC))
+        & ((1 << SIN_PHASE_FRAC) - 1);
+    a = table[i];
+    b = table[(i + 1) & ((1 << SIN_PHASE_BITS) - 1)];
+
+    return (int)(((a << SIN_PHASE_FRAC) + (b - a) * frac)
+        / (1LL << (SIN_PHASE_FRAC + SIN_BITS)));
 }
 
 #endif
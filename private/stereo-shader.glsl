@@ -3,49 +3,73 @@
 This fragment shader will generate a stereogram image from a pattern texture and
 a depth map.
 
+It uses the same algorithm as stereo_image_apply: the offset of a column is the
+offset of the column one pattern width to its left plus the offset of its own
+depth, and the columns of the first pattern width rise smoothly from 0 to the
+offset of their depth.
+
 */
 
 #version 110
 
 /**
- * The strength of the stereogram effect.
+ * The offset in pixels of the nearest depth.
  */
 uniform float strength;
 
 /**
- * The width in texels of the left hand margin.
+ * Whether the z-buffer values are inverted; this is 0.0 or 1.0.
+ */
+uniform float inverted;
+
+/**
+ * The dimensions of the pattern and of the z-buffer in texels.
  */
-uniform int left_margin;
+uniform vec2 pattern_size;
+uniform vec2 zbuffer_size;
 
 /**
- * The background pattern texture.
+ * The background pattern texture. It must repeat horizontally and be filtered
+ * linearly to interpolate the pattern.
  */
 uniform sampler2D pattern;
 
 /**
- * The z-buffer containing the depth map to render.
+ * The z-buffer containing the depth map to render, in the first component.
  */
-uniform sampler2DShadow zbuffer;
+uniform sampler2D zbuffer;
+
+/**
+ * Returns the offset in pixels of a column of the current row.
+ */
+float
+offset(float x)
+{
+    float z = texture2D(zbuffer, vec2(x + 0.5, gl_FragCoord.y)
+        / zbuffer_size).r * 255.0;
+
+    return strength * mix(z, 256.0 - z, inverted) / 255.0;
+}
 
 void
 main()
 {
-    /* This is the source x coordinate in the pattern */
-    float x = gl_FragCoord.x;
-#if 0
-    do {
-        /* Get the depth value at the current location in the z-buffer */
-        float d = shadow2D(zbuffer, vec3(x, gl_FragCoord.y, 0.0))[0];
-
-        /* If we are currently at the first pattern iteration, we need to scale
-           the depth to make the resulting image smooth */
-        if (x < float(left_margin)) {
-            d *= x / float(left_margin);
-        }
-
-        x -= d * strength;
-    } while (x > float(left_margin));
-#endif
+    float x = floor(gl_FragCoord.x);
+    float width = pattern_size.x;
+    float column = mod(x, width);
+
+    /* The first pattern width rises to the offset of the depth */
+    float d = offset(column) * column / width;
+    float c;
+
+    /* Every following column adds its offset to that of the column one
+       pattern width to its left */
+    for (c = column + width; c <= x; c += width) {
+        d += offset(c);
+    }
+
     /* Write the result */
-    gl_FragColor = texture2D(pattern, vec2(gl_FragCoord.x, gl_FragCoord.y));
+    gl_FragColor = texture2D(pattern, vec2(
+        (x + d + 0.5) / width,
+        (mod(floor(gl_FragCoord.y), pattern_size.y) + 0.5) / pattern_size.y));
 }
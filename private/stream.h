@@ -0,0 +1,87 @@
+#ifndef PRIVATE_STREAM_H
+#define PRIVATE_STREAM_H
+
+#include <stddef.h>
+
+#include "../stream.h"
+
+/**
+ * Starts writing a PNG image.
+ *
+ * See stereo_row_writer_open for the parameters.
+ */
+StereoRowWriter*
+stream_writer_open_png(FILE *out, unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth);
+
+/**
+ * Starts writing a PGM, PPM or PAM image.
+ *
+ * See stereo_row_writer_open for the parameters.
+ */
+StereoRowWriter*
+stream_writer_open_pnm(FILE *out, unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth);
+
+/**
+ * Starts writing a QOI image.
+ *
+ * See stereo_row_writer_open for the parameters.
+ */
+StereoRowWriter*
+stream_writer_open_qoi(FILE *out, unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth);
+
+/**
+ * Returns the number of bytes of a row.
+ *
+ * @param width
+ *     The number of pixels.
+ * @param channels
+ *     The number of channels of every pixel.
+ * @param depth
+ *     The number of bits of every channel.
+ * @return the number of bytes
+ */
+static inline size_t
+stream_row_bytes(unsigned int width, unsigned int channels,
+    unsigned int depth)
+{
+    return (size_t)width * channels * (depth / 8);
+}
+
+/**
+ * Returns whether the host stores the least significant byte first.
+ */
+static inline int
+stream_little_endian(void)
+{
+    const unsigned short one = 1;
+
+    return *(const unsigned char*)&one;
+}
+
+/**
+ * Swaps the bytes of 16 bit samples.
+ *
+ * @param d
+ *     The destination. This may be the same as s.
+ * @param s
+ *     The source.
+ * @param count
+ *     The number of samples.
+ */
+static inline void
+stream_swap16(unsigned char *d, const unsigned char *s, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        unsigned char t = s[2 * i];
+
+        d[2 * i] = s[2 * i + 1];
+        d[2 * i + 1] = t;
+    }
+}
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/glew.h>
+
+#include "stereo-gl.h"
+
+struct StereoGLContext {
+    /* The display and the context */
+    EGLDisplay display;
+    EGLContext context;
+};
+
+/**
+ * Returns the display to create the context on.
+ *
+ * Mesa's surfaceless platform needs neither a display server nor a GPU;
+ * otherwise the default display is used.
+ */
+static EGLDisplay
+stereo_gl_context_display(void)
+{
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+            "eglGetPlatformDisplayEXT");
+
+    if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless")
+            && get_platform_display) {
+        EGLDisplay result = get_platform_display(
+            EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+        if (result != EGL_NO_DISPLAY) {
+            return result;
+        }
+    }
+#endif
+
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+StereoGLContext*
+stereo_gl_context_create(void)
+{
+    static const EGLint attributes[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE};
+    StereoGLContext *result;
+    EGLConfig config = NULL;
+    EGLint count = 0;
+    GLenum status;
+
+    result = malloc(sizeof(*result));
+    result->display = stereo_gl_context_display();
+    if (result->display == EGL_NO_DISPLAY
+            || !eglInitialize(result->display, NULL, NULL)) {
+        free(result);
+        return NULL;
+    }
+
+    /* The shader requires desktop OpenGL; rendering only happens into
+       framebuffer objects, so no surface is created, and the surfaceless
+       platform may not offer any configuration at all */
+    if (!eglBindAPI(EGL_OPENGL_API)
+            || !eglChooseConfig(result->display, attributes, &config, 1,
+                &count)) {
+        eglTerminate(result->display);
+        free(result);
+        return NULL;
+    }
+    result->context = eglCreateContext(result->display,
+        count ? config : (EGLConfig)0, EGL_NO_CONTEXT, NULL);
+    if (result->context == EGL_NO_CONTEXT
+            || !eglMakeCurrent(result->display, EGL_NO_SURFACE,
+                EGL_NO_SURFACE, result->context)) {
+        if (result->context != EGL_NO_CONTEXT) {
+            eglDestroyContext(result->display, result->context);
+        }
+        eglTerminate(result->display);
+        free(result);
+        return NULL;
+    }
+
+    /* GLEW loads the entry points of the context; without an X display it
+       still succeeds for OpenGL, but reports that GLX is missing */
+    glewExperimental = GL_TRUE;
+    status = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if (status == GLEW_ERROR_NO_GLX_DISPLAY) {
+        status = GLEW_OK;
+    }
+#endif
+    if (status != GLEW_OK) {
+        stereo_gl_context_free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+void
+stereo_gl_context_free(StereoGLContext *context)
+{
+    eglMakeCurrent(context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+        EGL_NO_CONTEXT);
+    eglDestroyContext(context->display, context->context);
+    eglTerminate(context->display);
+    free(context);
+}
@@ -1,6 +1,11 @@
-#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <GL/glew.h>
 
 #include "stereo-gl.h"
@@ -11,127 +16,773 @@ struct StereoImageGL {
     /* The stereogram program */
     GLuint shader, program;
 
-    /* The background pattern to use */
-    StereoPattern *pattern;
+    /* The dimensions of the pattern */
+    unsigned int pattern_width, pattern_height;
 
     /* The indice of the program uniform values */
     struct {
         GLint strength;
-        GLint left_margin;
+        GLint inverted;
+        GLint pattern_size;
+        GLint zbuffer_size;
         GLint pattern;
         GLint zbuffer;
     } i;
 
-    /* The resourcfes used during runtime */
+    /* The resources used during runtime; the pattern texture lives as long as
+       the stereogram, and the others are allocated for the first z-buffer
+       submitted */
     struct {
         struct {
-            GLint pattern;
+            GLuint pattern;
+            GLuint zbuffer;
+            GLuint target;
         } textures;
+
+        /* The framebuffer rendering to the target texture */
+        GLuint framebuffer;
+
+        /* The pixel buffer object through which z-buffers are uploaded */
+        GLuint upload;
+
+        /* The pixel buffer objects into which frames are read back */
+        GLuint download[STEREO_GL_FRAMES];
     } r;
+
+    /* The format of the z-buffers of the allocated resources, or 0 if they
+       are not allocated */
+    unsigned int width, height, depth;
+
+    /* The index of the oldest frame in flight and the number of frames in
+       flight */
+    unsigned int first, count;
 };
 
-StereoImageGL*
-stereo_image_gl_create(StereoPattern *pattern)
+/**
+ * Uploads pattern pixels to the bound texture.
+ */
+static void
+stereo_image_gl_upload_pattern(StereoPattern *pattern)
 {
-    StereoImageGL *result = NULL;
-    const GLchar *stereo_shader_source = stereo_shader;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pattern->width, pattern->height,
+        GL_RGBA, GL_UNSIGNED_BYTE, pattern->pixels);
+}
 
-    GLuint shader, program;
-    GLint length;
-    GLint compiled, linked;
+/**
+ * The magic number at the start of a cached program binary; this changes with
+ * the layout of the header.
+ */
+#define STEREO_GL_CACHE_MAGIC 0x53474c32
 
-    /* pattern cannot be NULL */
-    if (!pattern) {
+/**
+ * The size of the header of a cached program binary, which is followed by the
+ * binary.
+ *
+ * The header consists of big endian 32 bit values: STEREO_GL_CACHE_MAGIC, the
+ * format of the binary as returned by glGetProgramBinary, the high and low
+ * halves of the key, and the length of the binary.
+ */
+#define STEREO_GL_CACHE_HEADER 20
+
+/**
+ * The maximum length of a cached program binary.
+ */
+#define STEREO_GL_CACHE_LENGTH_MAX (64 << 20)
+
+/**
+ * Reads a big endian 32 bit value.
+ */
+static inline unsigned long
+stereo_gl_cache_get32(const unsigned char *s)
+{
+    return ((unsigned long)s[0] << 24) | ((unsigned long)s[1] << 16)
+        | ((unsigned long)s[2] << 8) | s[3];
+}
+
+/**
+ * Writes a big endian 32 bit value.
+ */
+static inline void
+stereo_gl_cache_put32(unsigned char *d, unsigned long v)
+{
+    d[0] = (unsigned char)(v >> 24);
+    d[1] = (unsigned char)(v >> 16);
+    d[2] = (unsigned char)(v >> 8);
+    d[3] = (unsigned char)v;
+}
+
+/**
+ * The directory of the program binary cache, or NULL if the cache is
+ * disabled.
+ */
+static char *stereo_gl_cache_directory;
+
+/**
+ * Whether stereo_gl_cache_directory has been set.
+ */
+static int stereo_gl_cache_configured;
+
+void
+stereo_image_gl_set_cache(const char *directory)
+{
+    free(stereo_gl_cache_directory);
+    stereo_gl_cache_directory = directory && *directory
+        ? strdup(directory) : NULL;
+    stereo_gl_cache_configured = 1;
+}
+
+/**
+ * Returns the directory of the program binary cache.
+ *
+ * Unless set with stereo_image_gl_set_cache, this is the directory named by
+ * STEREO_GL_CACHE_ENV, or the directory stereo in the cache directory of the
+ * user.
+ *
+ * @return the directory, or NULL if the cache is disabled
+ */
+static const char*
+stereo_gl_cache_get_directory(void)
+{
+    if (!stereo_gl_cache_configured) {
+        const char *directory = getenv(STEREO_GL_CACHE_ENV);
+        const char *home;
+        char buffer[4096];
+
+        if (!directory) {
+            directory = buffer;
+            if ((home = getenv("XDG_CACHE_HOME")) && *home) {
+                snprintf(buffer, sizeof(buffer), "%s/stereo", home);
+            }
+            else if ((home = getenv("HOME")) && *home) {
+                snprintf(buffer, sizeof(buffer), "%s/.cache/stereo", home);
+            }
+            else {
+                directory = NULL;
+            }
+        }
+        stereo_image_gl_set_cache(directory);
+    }
+
+    return stereo_gl_cache_directory;
+}
+
+/**
+ * Calculates the key of the program in the current context.
+ *
+ * A binary is only valid for the driver that created it, so the key includes
+ * the vendor, renderer and version strings as well as the shader source.
+ *
+ * @return the key
+ */
+static unsigned long long
+stereo_gl_cache_key(void)
+{
+    const char *parts[] = {
+        (const char*)glGetString(GL_VENDOR),
+        (const char*)glGetString(GL_RENDERER),
+        (const char*)glGetString(GL_VERSION),
+        stereo_shader};
+    unsigned long long result = 14695981039346656037ULL;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        const char *c;
+
+        /* The terminating NUL separates the parts */
+        for (c = parts[i] ? parts[i] : ""; ; c++) {
+            result ^= (unsigned char)*c;
+            result *= 1099511628211ULL;
+            if (!*c) {
+                break;
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Returns whether program binaries are supported by the current context.
+ */
+static int
+stereo_gl_cache_supported(void)
+{
+    GLint formats = 0;
+
+    if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) {
+        return 0;
+    }
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+    return formats > 0;
+}
+
+/**
+ * Creates the name of the cache file of a key.
+ *
+ * @return the file name, which must be freed, or NULL if the cache is
+ *     disabled
+ */
+static char*
+stereo_gl_cache_filename(unsigned long long key)
+{
+    const char *directory = stereo_gl_cache_get_directory();
+    char *result;
+
+    if (!directory) {
         return NULL;
     }
 
+    result = malloc(strlen(directory) + 32);
+    sprintf(result, "%s/%016llx.bin", directory, key);
+
+    return result;
+}
+
+/**
+ * Loads a program from the cache.
+ *
+ * @return the linked program, or 0 if the cache has no valid binary for the
+ *     current driver
+ */
+static GLuint
+stereo_gl_cache_load(unsigned long long key)
+{
+    char *filename = stereo_gl_cache_filename(key);
+    unsigned char header[STEREO_GL_CACHE_HEADER];
+    unsigned long length;
+    GLuint result = 0;
+    GLint linked = 0;
+    struct stat status;
+    void *binary;
+    FILE *in;
+
+    in = filename ? fopen(filename, "rb") : NULL;
+    free(filename);
+    if (!in) {
+        return 0;
+    }
+
+    /* The file may be truncated or corrupt, so the length is only trusted if
+       it matches the size of the file */
+    if (fread(header, sizeof(header), 1, in) == 1
+            && !fstat(fileno(in), &status)
+            && stereo_gl_cache_get32(header) == STEREO_GL_CACHE_MAGIC
+            && stereo_gl_cache_get32(header + 8) == (unsigned long)(key >> 32)
+            && stereo_gl_cache_get32(header + 12)
+                == (unsigned long)(key & 0xffffffff)
+            && (length = stereo_gl_cache_get32(header + 16)) > 0
+            && length <= STEREO_GL_CACHE_LENGTH_MAX
+            && (unsigned long long)status.st_size
+                == STEREO_GL_CACHE_HEADER + (unsigned long long)length
+            && (binary = malloc(length))) {
+        if (fread(binary, length, 1, in) == 1) {
+            result = glCreateProgram();
+            glProgramBinary(result, (GLenum)stereo_gl_cache_get32(header + 4),
+                binary, (GLsizei)length);
+            glGetProgramiv(result, GL_LINK_STATUS, &linked);
+        }
+        free(binary);
+    }
+    fclose(in);
+
+    /* The driver rejects binaries it can no longer use, for example after an
+       update that kept its version string */
+    if (result && !linked) {
+        glDeleteProgram(result);
+        result = 0;
+    }
+
+    return result;
+}
+
+/**
+ * Creates a directory and its missing parents.
+ */
+static void
+stereo_gl_cache_mkdir(const char *directory)
+{
+    char *path = strdup(directory);
+    char *c;
+
+    for (c = path + 1; *c; c++) {
+        if (*c == '/') {
+            *c = '\0';
+            mkdir(path, 0755);
+            *c = '/';
+        }
+    }
+    mkdir(path, 0755);
+
+    free(path);
+}
+
+/**
+ * Stores the binary of a program in the cache.
+ *
+ * The binary is written to a temporary file that is then renamed, so other
+ * processes never read a partial binary. Failures are ignored, since the
+ * cache only saves time.
+ */
+static void
+stereo_gl_cache_save(unsigned long long key, GLuint program)
+{
+    char *filename = stereo_gl_cache_filename(key);
+    unsigned char header[STEREO_GL_CACHE_HEADER];
+    GLint length = 0;
+    GLenum format = 0;
+    char *temporary;
+    void *binary;
+    FILE *out;
+    int success;
+
+    if (!filename) {
+        return;
+    }
+
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    binary = length > 0 && length <= STEREO_GL_CACHE_LENGTH_MAX
+        ? malloc(length) : NULL;
+    if (!binary) {
+        free(filename);
+        return;
+    }
+    glGetProgramBinary(program, length, &length, &format, binary);
+
+    stereo_gl_cache_put32(header, STEREO_GL_CACHE_MAGIC);
+    stereo_gl_cache_put32(header + 4, format);
+    stereo_gl_cache_put32(header + 8, (unsigned long)(key >> 32));
+    stereo_gl_cache_put32(header + 12, (unsigned long)(key & 0xffffffff));
+    stereo_gl_cache_put32(header + 16, length > 0 ? length : 0);
+
+    stereo_gl_cache_mkdir(stereo_gl_cache_get_directory());
+    temporary = malloc(strlen(filename) + 32);
+    sprintf(temporary, "%s.%ld", filename, (long)getpid());
+    out = fopen(temporary, "wb");
+    if (out) {
+        success = length > 0
+            && fwrite(header, sizeof(header), 1, out) == 1
+            && fwrite(binary, length, 1, out) == 1;
+        success = !fclose(out) && success;
+        if (!success || rename(temporary, filename)) {
+            unlink(temporary);
+        }
+    }
+
+    free(temporary);
+    free(binary);
+    free(filename);
+}
+
+/**
+ * Compiles and links the stereogram program from source.
+ *
+ * @param retrievable
+ *     Whether the binary of the program will be retrieved.
+ * @param shader
+ *     The compiled shader is returned here.
+ * @return the linked program, or 0 upon failure
+ */
+static GLuint
+stereo_gl_compile(int retrievable, GLuint *shader)
+{
+    const GLchar *stereo_shader_source = stereo_shader;
+    GLuint program;
+    GLint length;
+    GLint compiled, linked;
+
     /* Create the shader */
-    shader = glCreateShader(GL_FRAGMENT_SHADER);
-    if (!shader) {
-        return NULL;
+    *shader = glCreateShader(GL_FRAGMENT_SHADER);
+    if (!*shader) {
+        return 0;
     }
 
     /* Compile it... */
     length = strlen(stereo_shader_source);
-    glShaderSource(shader, 1, &stereo_shader_source, &length);
-    glCompileShader(shader);
-    glGetObjectParameterivARB(shader, GL_COMPILE_STATUS, &compiled);
+    glShaderSource(*shader, 1, &stereo_shader_source, &length);
+    glCompileShader(*shader);
+    glGetShaderiv(*shader, GL_COMPILE_STATUS, &compiled);
     if (!compiled) {
         GLchar buffer[1024];
-        glGetShaderInfoLog(shader, sizeof(buffer), NULL, buffer);
-        printf("%s", buffer);
+        glGetShaderInfoLog(*shader, sizeof(buffer), NULL, buffer);
+        fprintf(stderr, "%s", buffer);
 
-        glDeleteShader(shader);
-        return NULL;
+        glDeleteShader(*shader);
+        return 0;
     }
 
     /* Create the program and attach the shader */
     program = glCreateProgram();
     if (!program) {
-        glDeleteShader(shader);
-        return NULL;
+        glDeleteShader(*shader);
+        return 0;
+    }
+    glAttachShader(program, *shader);
+    if (retrievable) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+            GL_TRUE);
     }
-    glAttachShader(program, shader);
 
     /* Finally link the program */
     glLinkProgram(program);
-    glGetObjectParameterivARB(program, GL_LINK_STATUS, &linked);
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
     if (!linked) {
-        glDeleteShader(shader);
+        glDeleteShader(*shader);
         glDeleteProgram(program);
+        return 0;
+    }
+
+    return program;
+}
+
+StereoImageGL*
+stereo_image_gl_create(StereoPattern *pattern)
+{
+    StereoImageGL *result = NULL;
+    GLuint shader = 0, program = 0;
+    unsigned long long key = 0;
+    int cached;
+
+    /* pattern cannot be NULL */
+    if (!pattern) {
         return NULL;
     }
 
+    /* Use the cached binary of the program if there is one, and otherwise
+       compile it and cache its binary */
+    cached = stereo_gl_cache_supported() && stereo_gl_cache_get_directory();
+    if (cached) {
+        key = stereo_gl_cache_key();
+        program = stereo_gl_cache_load(key);
+    }
+    if (!program) {
+        program = stereo_gl_compile(cached, &shader);
+        if (!program) {
+            return NULL;
+        }
+        if (cached) {
+            stereo_gl_cache_save(key, program);
+        }
+    }
+
     /* Create the result struct */
     result = malloc(sizeof(*result));
     memset(result, 0, sizeof(*result));
     result->shader = shader;
     result->program = program;
-    result->pattern = pattern;
+    result->pattern_width = pattern->width;
+    result->pattern_height = pattern->height;
     result->i.strength = glGetUniformLocation(program, "strength");
-    result->i.left_margin  = glGetUniformLocation(program, "left_margin");
-    result->i.pattern  = glGetUniformLocation(program, "pattern");
-    result->i.zbuffer  = glGetUniformLocation(program, "zbuffer");
+    result->i.inverted = glGetUniformLocation(program, "inverted");
+    result->i.pattern_size = glGetUniformLocation(program, "pattern_size");
+    result->i.zbuffer_size = glGetUniformLocation(program, "zbuffer_size");
+    result->i.pattern = glGetUniformLocation(program, "pattern");
+    result->i.zbuffer = glGetUniformLocation(program, "zbuffer");
+
+    /* The pattern texture is uploaded once; it repeats horizontally, since
+       the columns of the pattern wrap around, and it is filtered linearly to
+       interpolate between columns */
+    glGenTextures(1, &result->r.textures.pattern);
+    glBindTexture(GL_TEXTURE_2D, result->r.textures.pattern);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, pattern->width, pattern->height,
+        0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    stereo_image_gl_upload_pattern(pattern);
+    glBindTexture(GL_TEXTURE_2D, 0);
 
     return result;
 }
 
+/**
+ * Frees the resources allocated for the z-buffers.
+ */
+static void
+stereo_image_gl_release(StereoImageGL *stereo_gl)
+{
+    if (!stereo_gl->depth) {
+        return;
+    }
+
+    glDeleteFramebuffers(1, &stereo_gl->r.framebuffer);
+    glDeleteTextures(1, &stereo_gl->r.textures.zbuffer);
+    glDeleteTextures(1, &stereo_gl->r.textures.target);
+    glDeleteBuffers(1, &stereo_gl->r.upload);
+    glDeleteBuffers(STEREO_GL_FRAMES, stereo_gl->r.download);
+
+    stereo_gl->width = stereo_gl->height = stereo_gl->depth = 0;
+}
+
+/**
+ * Allocates the resources for z-buffers of a format.
+ *
+ * @return non-zero upon success, or 0 if the framebuffer is not supported
+ */
+static int
+stereo_image_gl_allocate(StereoImageGL *stereo_gl, unsigned int width,
+    unsigned int height, unsigned int depth)
+{
+    GLenum status;
+
+    stereo_image_gl_release(stereo_gl);
+
+    /* The z-buffer holds a single channel; 16 bit samples keep their
+       precision */
+    glGenTextures(1, &stereo_gl->r.textures.zbuffer);
+    glBindTexture(GL_TEXTURE_2D, stereo_gl->r.textures.zbuffer);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, depth == 16 ? GL_LUMINANCE16 : GL_LUMINANCE8,
+        width, height, 0, GL_LUMINANCE,
+        depth == 16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE, NULL);
+
+    glGenTextures(1, &stereo_gl->r.textures.target);
+    glBindTexture(GL_TEXTURE_2D, stereo_gl->r.textures.target);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
+        GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &stereo_gl->r.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, stereo_gl->r.framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D, stereo_gl->r.textures.target, 0);
+    status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenBuffers(1, &stereo_gl->r.upload);
+    glGenBuffers(STEREO_GL_FRAMES, stereo_gl->r.download);
+
+    stereo_gl->width = width;
+    stereo_gl->height = height;
+    stereo_gl->depth = depth;
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        stereo_image_gl_release(stereo_gl);
+        return 0;
+    }
+
+    return 1;
+}
+
 void
 stereo_image_gl_free(StereoImageGL *stereo_gl)
 {
+    stereo_image_gl_release(stereo_gl);
+    glDeleteTextures(1, &stereo_gl->r.textures.pattern);
     glDeleteShader(stereo_gl->shader);
     glDeleteProgram(stereo_gl->program);
+    free(stereo_gl);
 }
 
 int
-stereo_image_gl_start(StereoImageGL *stereo_gl, GLfloat strength,
-    GLuint zbuffer)
+stereo_image_gl_set_pattern(StereoImageGL *stereo_gl, StereoPattern *pattern)
 {
-    glGenTextures(sizeof(stereo_gl->r.textures) / sizeof(GLuint),
-        (GLuint*)&stereo_gl->r.textures);
+    if (pattern->width != stereo_gl->pattern_width
+            || pattern->height != stereo_gl->pattern_height) {
+        return 0;
+    }
 
-    /* Create the pattern texture */
     glBindTexture(GL_TEXTURE_2D, stereo_gl->r.textures.pattern);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-        stereo_gl->pattern->width, stereo_gl->pattern->height,
-        0, GL_RGBA, GL_UNSIGNED_BYTE, stereo_gl->pattern->pixels);
+    stereo_image_gl_upload_pattern(pattern);
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-    /* Set the program uniform values */
-    glUniform1f(stereo_gl->i.strength, strength);
-    glUniform1i(stereo_gl->i.left_margin, stereo_gl->pattern->width);
-    glUniform1i(stereo_gl->i.pattern, stereo_gl->r.textures.pattern);
-    glUniform1i(stereo_gl->i.zbuffer, zbuffer);
+    return 1;
+}
 
+int
+stereo_image_gl_start(StereoImageGL *stereo_gl, GLfloat strength,
+    int is_inverted, GLuint zbuffer)
+{
+    GLint width, height;
+
+    /* Bind the textures */
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, zbuffer);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, stereo_gl->r.textures.pattern);
+
+    /* Set the program uniform values; the samplers refer to texture units */
     glUseProgram(stereo_gl->program);
+    glUniform1f(stereo_gl->i.strength, strength);
+    glUniform1f(stereo_gl->i.inverted, is_inverted ? 1.0 : 0.0);
+    glUniform2f(stereo_gl->i.pattern_size, stereo_gl->pattern_width,
+        stereo_gl->pattern_height);
+    glUniform2f(stereo_gl->i.zbuffer_size, width, height);
+    glUniform1i(stereo_gl->i.pattern, 0);
+    glUniform1i(stereo_gl->i.zbuffer, 1);
 
-    return 0;
+    return glGetError();
 }
 
 void
 stereo_image_gl_end(StereoImageGL *stereo_gl)
 {
-    glDeleteTextures(sizeof(stereo_gl->r.textures) / sizeof(GLuint),
-        (GLuint*)&stereo_gl->r.textures);
-    memset(&stereo_gl->r.textures, 0, sizeof(stereo_gl->r.textures));
+    glUseProgram(0);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+int
+stereo_image_gl_submit(StereoImageGL *stereo_gl, ZBuffer *buffer,
+    unsigned int channel, GLfloat strength, int is_inverted)
+{
+    unsigned int bytes = buffer->depth / 8;
+    unsigned int frame, x, y;
+    unsigned char *data;
+    GLint viewport[4];
+
+    if (channel >= buffer->channels) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (stereo_gl->count == STEREO_GL_FRAMES) {
+        errno = EBUSY;
+        return 0;
+    }
+
+    if (buffer->width != stereo_gl->width
+            || buffer->height != stereo_gl->height
+            || buffer->depth != stereo_gl->depth) {
+        if (stereo_gl->count) {
+            errno = EBUSY;
+            return 0;
+        }
+        if (!stereo_image_gl_allocate(stereo_gl, buffer->width,
+                buffer->height, buffer->depth)) {
+            errno = ENOTSUP;
+            return 0;
+        }
+    }
+
+    /* The channel is copied to the upload buffer, which is orphaned first so
+       that the previous upload need not complete */
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stereo_gl->r.upload);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer->width * buffer->height * bytes,
+        NULL, GL_STREAM_DRAW);
+    data = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (!data) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        errno = ENOMEM;
+        return 0;
+    }
+    for (y = 0; y < buffer->height; y++) {
+        unsigned char *z = stereo_zbuffer_row_get(buffer, y) + channel * bytes;
+
+        if (buffer->channels == 1) {
+            memcpy(data, z, buffer->width * bytes);
+            data += buffer->width * bytes;
+            continue;
+        }
+        for (x = 0; x < buffer->width; x++) {
+            memcpy(data, z, bytes);
+            data += bytes;
+            z += buffer->channels * bytes;
+        }
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glBindTexture(GL_TEXTURE_2D, stereo_gl->r.textures.zbuffer);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buffer->width, buffer->height,
+        GL_LUMINANCE, bytes == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    /* Render a quad covering the target */
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glBindFramebuffer(GL_FRAMEBUFFER, stereo_gl->r.framebuffer);
+    glViewport(0, 0, buffer->width, buffer->height);
+    stereo_image_gl_start(stereo_gl, strength, is_inverted,
+        stereo_gl->r.textures.zbuffer);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glRectf(-1.0, -1.0, 1.0, 1.0);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    stereo_image_gl_end(stereo_gl);
+
+    /* Read the result back into the buffer of this frame; this returns
+       immediately, and the transfer completes when the buffer is mapped */
+    frame = (stereo_gl->first + stereo_gl->count) % STEREO_GL_FRAMES;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, stereo_gl->r.download[frame]);
+    glBufferData(GL_PIXEL_PACK_BUFFER,
+        buffer->width * buffer->height * sizeof(PatternPixel), NULL,
+        GL_STREAM_READ);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, buffer->width, buffer->height, GL_RGBA,
+        GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glFlush();
+
+    stereo_gl->count++;
+
+    return 1;
+}
+
+int
+stereo_image_gl_retrieve(StereoImageGL *stereo_gl, StereoPattern *image)
+{
+    PatternPixel *data;
+    unsigned int y;
+
+    if (!stereo_gl->count || image->width != stereo_gl->width
+            || image->height != stereo_gl->height) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER,
+        stereo_gl->r.download[stereo_gl->first]);
+    data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (data) {
+        for (y = 0; y < image->height; y++) {
+            PatternPixel *row = stereo_pattern_row_get(image, y);
+
+#ifdef STEREO_ALPHA
+            memcpy(row, data, image->width * sizeof(PatternPixel));
+            data += image->width;
+#else
+            /* The alpha channel is left alone, just like stereo_image_apply
+               does */
+            unsigned int x;
+
+            for (x = 0; x < image->width; x++, row++, data++) {
+                row->r = data->r;
+                row->g = data->g;
+                row->b = data->b;
+            }
+#endif
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    stereo_gl->first = (stereo_gl->first + 1) % STEREO_GL_FRAMES;
+    stereo_gl->count--;
+
+    if (!data) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    return 1;
 }
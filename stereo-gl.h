@@ -5,24 +5,84 @@
 
 #include "stereo.h"
 
+/**
+ * The number of frames that may be submitted with stereo_image_gl_submit
+ * before the first one is retrieved.
+ */
+#define STEREO_GL_FRAMES 2
+
+/**
+ * The name of the environment variable naming the directory of the program
+ * binary cache; if it is empty, the cache is disabled.
+ */
+#define STEREO_GL_CACHE_ENV "STEREO_GL_CACHE"
+
 typedef struct StereoImageGL StereoImageGL;
 
+/**
+ * A headless OpenGL context.
+ */
+typedef struct StereoGLContext StereoGLContext;
+
+/**
+ * Creates a headless OpenGL context and makes it current on the calling
+ * thread.
+ *
+ * The context is created through EGL without any surface, so it works
+ * without a display server, for example with Mesa's software renderer.
+ * Rendering with stereo_image_gl_submit happens in an offscreen framebuffer.
+ *
+ * @return a new context, or NULL if no OpenGL context can be created
+ */
+StereoGLContext*
+stereo_gl_context_create(void);
+
+/**
+ * Releases and frees a headless OpenGL context.
+ *
+ * @param context
+ *     The context to free.
+ */
+void
+stereo_gl_context_free(StereoGLContext *context);
+
 /**
  * Creates an OpenGL fragment shader program.
  *
- * The program requires three uniform values:
- *   1. float strength: The strength of the stereo effect. This is the same as
- *      the strength parameter to stereo_image_create.
- *   2. sampler2D pattern: The background pattern to use.
- *   3. sampler2DShadow zbuffer: The z-buffer that is rendered.
+ * The program is used with stereo_image_gl_start and stereo_image_gl_end to
+ * render into the current framebuffer, or with stereo_image_gl_submit and
+ * stereo_image_gl_retrieve to render z-buffers in memory.
+ *
+ * An OpenGL context must be current, and all functions operating on the
+ * returned stereogram must be called with the same context current.
+ *
+ * If the driver supports program binaries, the linked program is cached on
+ * disk, keyed by the vendor, renderer and version of the driver and by the
+ * shader source, so later processes skip compiling the shader. A cached
+ * binary that the driver rejects is replaced by a freshly compiled one.
  *
  * @param pattern
- *     The background pattern to use.
- * @return a stereogram that may be used as an OpenGL shader program.
+ *     The background pattern to use. It is uploaded to a texture that is kept
+ *     until the stereogram is freed; the pattern itself is not kept.
+ * @return a stereogram that may be used as an OpenGL shader program, or NULL
+ *     if the program cannot be created
  */
 StereoImageGL*
 stereo_image_gl_create(StereoPattern *pattern);
 
+/**
+ * Sets the directory of the program binary cache.
+ *
+ * By default, the directory named by STEREO_GL_CACHE_ENV is used, or the
+ * directory stereo in $XDG_CACHE_HOME or in ~/.cache. The directory is
+ * created when the first binary is stored.
+ *
+ * @param directory
+ *     The directory, or NULL to disable the cache.
+ */
+void
+stereo_image_gl_set_cache(const char *directory);
+
 /**
  * Frees a stereogram and all resources allocated by it.
  *
@@ -32,33 +92,102 @@ stereo_image_gl_create(StereoPattern *pattern);
 void
 stereo_image_gl_free(StereoImageGL *stereo_gl);
 
+/**
+ * Replaces the background pattern of a stereogram.
+ *
+ * This only updates the texture, so an effect may be applied to a pattern
+ * that is then uploaded for every frame.
+ *
+ * @param stereo_gl
+ *     The stereogram.
+ * @param pattern
+ *     The new pattern. Its dimensions must be those of the pattern passed to
+ *     stereo_image_gl_create.
+ * @return non-zero upon success, or 0 if the dimensions do not match
+ */
+int
+stereo_image_gl_set_pattern(StereoImageGL *stereo_gl, StereoPattern *pattern);
+
 /**
  * Sets the stereogram algorithm as the current fragments shader.
  *
- * stereo_image_gl_end must be called when this function
+ * stereo_image_gl_end must be called when rendering is done. The pattern is
+ * bound to texture unit 0 and the z-buffer to texture unit 1, and every
+ * fragment is rendered from the row of the z-buffer at the same height.
  *
  * @param stereo_gl
  *     The stereogram.
  * @param strength
  *     The strength to use when applying the effect. The greater the strength,
- *     the deeper the image appears.
+ *     the deeper the image appears. This is the same as the strength parameter
+ *     to stereo_image_create.
+ * @param is_inverted
+ *     Whether the z-buffer values are inverted.
  * @param zbuffer
- *     The z-buffer to use as source.
- * @return 0 if the fragment shader was sucessfully set, otherise an error code
+ *     The texture of the z-buffer to use as source; the depth is read from its
+ *     first component.
+ * @return 0 if the fragment shader was sucessfully set, otherwise an OpenGL
+ *     error code
  */
 int
 stereo_image_gl_start(StereoImageGL *stereo_gl, GLfloat strength,
-    GLuint zbuffer);
+    int is_inverted, GLuint zbuffer);
 
 /**
- * Sets the stereogram algorithm as the current fragments shader.
+ * Restores the fixed function pipeline after stereo_image_gl_start.
  *
  * @param stereo_gl
  *     The stereogram.
- * @param zbuffer
- *     The z-buffer to use as source.
  */
 void
 stereo_image_gl_end(StereoImageGL *stereo_gl);
 
+/**
+ * Starts rendering a z-buffer.
+ *
+ * The z-buffer is copied to a pixel buffer object, from which it is
+ * transferred to its texture, and the rendered stereogram is transferred to
+ * another pixel buffer object, all without waiting for the GPU. The result is
+ * retrieved with stereo_image_gl_retrieve, so that up to STEREO_GL_FRAMES
+ * frames are in flight while the CPU prepares the next z-buffer.
+ *
+ * The textures and buffers are allocated for the first z-buffer and kept for
+ * all following z-buffers of the same dimensions and depth.
+ *
+ * @param stereo_gl
+ *     The stereogram.
+ * @param buffer
+ *     The z-buffer.
+ * @param channel
+ *     The channel of the z-buffer to use.
+ * @param strength
+ *     The strength of the effect.
+ * @param is_inverted
+ *     Whether the z-buffer values are inverted.
+ * @return non-zero upon success, or 0 otherwise, in which case errno is set
+ *     to EBUSY if STEREO_GL_FRAMES frames are in flight, or if the format of
+ *     the z-buffer changes while frames are in flight, to EINVAL if the
+ *     channel is invalid, and to ENOTSUP if the driver cannot render to a
+ *     texture of the dimensions of the z-buffer
+ */
+int
+stereo_image_gl_submit(StereoImageGL *stereo_gl, ZBuffer *buffer,
+    unsigned int channel, GLfloat strength, int is_inverted);
+
+/**
+ * Retrieves the oldest frame submitted with stereo_image_gl_submit.
+ *
+ * This waits until the frame has been rendered.
+ *
+ * @param stereo_gl
+ *     The stereogram.
+ * @param image
+ *     The image to which to copy the stereogram. Its dimensions must be those
+ *     of the z-buffer.
+ * @return non-zero upon success, or 0 otherwise, in which case errno is set
+ *     to EINVAL if no frame is in flight or the dimensions do not match
+ */
+int
+stereo_image_gl_retrieve(StereoImageGL *stereo_gl, StereoPattern *image);
+
 #endif
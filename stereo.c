@@ -1,4 +1,5 @@
 #include <alloca.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -6,55 +7,125 @@
 
 #include "private/fix.h"
 #include "private/pixel.h"
+#include "private/sched.h"
 
 #include "stereo.h"
+#include "tune.h"
 
 typedef struct {
     StereoImage *image;
+    StereoPattern *pattern;
     ZBuffer *buffer;
     unsigned int channel;
+    unsigned int step;
+    unsigned int start;
+    unsigned int end;
+    Sched sched;
 } StereoImageApplyLinesData;
 
-static int
-stereo_image_apply_lines_do(StereoImageApplyLinesData *data, int start, int end,
-    int gstart, int gend)
+/**
+ * Returns the offset for a 16 bit z-buffer value.
+ *
+ * The value is mapped onto the range of the offset table, and the offset is
+ * interpolated between the two closest entries, so 16 bit depth maps give
+ * smoother surfaces than 8 bit ones.
+ *
+ * @param image
+ *     The stereo image.
+ * @param z
+ *     The z-buffer value.
+ * @return the offset
+ */
+static inline int
+stereo_image_deep_offset(StereoImage *image, unsigned int z)
+{
+    /* The position in the table in 1 / 256 entries; dividing by 65535 maps
+       the 8 bit value v, stored as v * 257, exactly onto entry v */
+    unsigned int position = (unsigned int)(((unsigned long long)z
+        * (STEREO_OFFSET_COUNT - 1) << 8) / 65535);
+    unsigned int i = position >> 8;
+    int a = image->offsets[i];
+    int b = image->offsets[i + (i < STEREO_OFFSET_COUNT - 1)];
+
+    return a + (b - a) * (int)(position & 0xFF) / 256;
+}
+
+static void
+stereo_image_apply_row(StereoImageApplyLinesData *data, int *offsets,
+    unsigned int y)
 {
-    unsigned int x, y;
+    unsigned int x;
     StereoImage *image = data->image;
+    StereoPattern *pattern = data->pattern;
     ZBuffer *buffer = data->buffer;
-    PatternPixel *d = stereo_pattern_row_get(image->image, start);
+    unsigned int bytes = buffer->depth / 8;
+    PatternPixel *d = stereo_pattern_row_get(image->image, y);
+    unsigned char *z = stereo_zbuffer_row_get(buffer, y)
+        + data->channel * bytes;
+    PatternPixel *row = stereo_pattern_row_get(pattern,
+        (image->origin + y) % pattern->height);
+
+    for (x = 0; x < image->image->width; x++) {
+        int zoffset = bytes == 2
+            ? stereo_image_deep_offset(image, *(unsigned short*)z)
+            : image->offsets[*z];
+        int offset;
+
+        /* If we have passed the first pattern columns, the current offset
+           depends on the previous offsets, otherwise we make a slope upwards
+           to the value of the first column of the z-buffer */
+        if (x >= pattern->width) {
+            offset = offsets[x - pattern->width] + zoffset;
+        }
+        else {
+            offset = zoffset * x / pattern->width;
+        }
+        offsets[x] = offset;
+
+        if (image->interpolate) {
+            blend2(d, row, mkfix(x) + offset, pattern->width);
+        }
+        else {
+            nearest(d, row, mkfix(x) + offset, pattern->width);
+        }
+
+        z += buffer->channels * bytes;
+        d++;
+    }
+}
+
+static void
+stereo_image_apply_rows(StereoImageApplyLinesData *data, int start, int end)
+{
+    StereoImage *image = data->image;
+    unsigned int step = data->step;
     int *offsets;
+    int i;
 
     offsets = alloca(image->image->width * sizeof(int));
 
-    for (y = start; y < end; y++) {
-        PatternPixel *stereo_row = (PatternPixel*)stereo_zbuffer_row_get(buffer,
-            y);
-        unsigned char *z = (unsigned char*)stereo_row + data->channel;
-        PatternPixel *row = stereo_pattern_row_get(image->pattern,
-            y % image->pattern->height);
-
-        for (x = 0; x < image->image->width; x++) {
-            int offset;
-
-            /* If we have passed the first pattern columns, the current offset
-               depends on the previous offsets, otherwise we make a slope
-               upwards to the value of the first column of the z-buffer */
-            if (x >= image->pattern->width) {
-                offset = offsets[x - image->pattern->width]
-                    + image->offsets[*z];
-            }
-            else {
-                offset = image->offsets[*z] * x / image->pattern->width;
-            }
-            offsets[x] = offset;
-
-            blend2(d, row, mkfix(x) + offset, image->pattern->width);
-
-            z += buffer->channels;
-            d++;
+    /* Every item handed out is a group of row_step rows; the first row of a
+       group is rendered and the others are copies of it */
+    for (i = start; i < end; i++) {
+        unsigned int y = data->start + i * step;
+        unsigned int j;
+
+        stereo_image_apply_row(data, offsets, y);
+        for (j = y + 1; j < y + step && j < data->end; j++) {
+            memcpy(stereo_pattern_row_get(image->image, j),
+                stereo_pattern_row_get(image->image, y),
+                image->image->width * sizeof(PatternPixel));
         }
     }
+}
+
+static int
+stereo_image_apply_lines_do(StereoImageApplyLinesData *data, int start, int end,
+    int gstart, int gend)
+{
+    /* The rows assigned to this worker are only a hint; the rows are instead
+       handed out on demand by the scheduler */
+    sched_run(&data->sched, (SchedCallback)stereo_image_apply_rows, data);
 
     return 0;
 }
@@ -72,6 +143,10 @@ stereo_image_create(unsigned int width, unsigned int height,
     result = malloc(sizeof(StereoImage));
     result->image = stereo_pattern_create(width, height);
     result->pattern = pattern;
+    result->back = NULL;
+    result->interpolate = 1;
+    result->row_step = 1;
+    result->origin = 0;
     result->para = para_create(NULL,
         (ParaCallback)stereo_image_apply_lines_do);
 
@@ -85,11 +160,38 @@ stereo_image_free(StereoImage *image)
 {
     para_free(image->para);
     stereo_pattern_free(image->pattern);
+    if (image->back) {
+        stereo_pattern_free(image->back);
+    }
     stereo_pattern_free(image->image);
 
     free(image);
 }
 
+int
+stereo_image_set_back_pattern(StereoImage *image, StereoPattern *pattern)
+{
+    if (pattern && (pattern->width != image->pattern->width
+            || pattern->height != image->pattern->height)) {
+        return 0;
+    }
+
+    if (image->back) {
+        stereo_pattern_free(image->back);
+    }
+    image->back = pattern;
+
+    return 1;
+}
+
+void
+stereo_image_swap_patterns(StereoImage *image)
+{
+    if (image->back) {
+        image->back = __sync_lock_test_and_set(&image->pattern, image->back);
+    }
+}
+
 void
 stereo_image_set_strength(StereoImage *image, double strength, int is_inverted)
 {
@@ -108,6 +210,8 @@ stereo_image_apply_lines(StereoImage *image, ZBuffer *buffer,
     unsigned int channel, unsigned int start, unsigned int end)
 {
     StereoImageApplyLinesData data;
+    const StereoTuning *tuning;
+    unsigned int groups;
 
     /* Verify the dimensions of the Z-buffer */
     if (image->image->width != buffer->width
@@ -125,11 +229,67 @@ stereo_image_apply_lines(StereoImage *image, ZBuffer *buffer,
         return 0;
     }
 
+    /* Read the pattern only once, since it may be swapped by
+       stereo_image_swap_patterns while we render */
     data.image = image;
+    data.pattern = image->pattern;
     data.buffer = buffer;
     data.channel = channel;
+    data.step = image->row_step < 1 ? 1 : image->row_step;
+    data.start = start;
+    data.end = end;
+    groups = (end - start + data.step - 1) / data.step;
 
-    para_execute_with_context(image->para, &data, start, end);
+    /* Small calls are not worth waking up the workers for */
+    tuning = stereo_tuning_get(image->image->width, data.pattern->width);
+    if (groups * image->image->width < tuning->inline_pixels) {
+        stereo_image_apply_rows(&data, 0, groups);
+        return 1;
+    }
+
+    sched_initialize(&data.sched, 0, groups, tuning);
+    para_execute_with_context(image->para, &data, 0, groups);
 
     return 1;
 }
+
+/**
+ * Applies an effect to the back pattern of a stereo image.
+ *
+ * This is the thread entry point used by stereo_image_apply_pipelined.
+ *
+ * @param effect
+ *     The effect to apply.
+ * @return NULL
+ */
+static void*
+stereo_image_apply_effect(StereoPatternEffect *effect)
+{
+    stereo_pattern_effect_apply(effect);
+
+    return NULL;
+}
+
+int
+stereo_image_apply_pipelined(StereoImage *image, ZBuffer *buffer,
+    unsigned int channel, StereoPatternEffect *effect)
+{
+    pthread_t thread;
+    int result;
+
+    if (!image->back || !stereo_pattern_effect_retarget(effect, image->back)) {
+        return 0;
+    }
+
+    /* Prepare the next pattern while rendering the current one */
+    if (pthread_create(&thread, NULL,
+            (void*(*)(void*))stereo_image_apply_effect, effect)) {
+        return 0;
+    }
+    result = stereo_image_apply(image, buffer, channel);
+    pthread_join(thread, NULL);
+
+    stereo_image_swap_patterns(image);
+
+    return result;
+}
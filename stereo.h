@@ -3,6 +3,7 @@
 
 #include "para/para.h"
 
+#include "effect.h"
 #include "pattern.h"
 #include "zbuffer.h"
 
@@ -13,11 +14,29 @@ typedef struct {
     /** The pattern used */
     StereoPattern *pattern;
 
+    /** The back pattern, which is swapped with pattern by
+        stereo_image_swap_patterns; this may be NULL */
+    StereoPattern *back;
+
     /** The parallel task context that performs the algorithm */
     ParaContext *para;
 
     /** The offsets applied to values in the z-buffer */
     int offsets[256];
+
+    /** Whether the pattern is interpolated; if this is 0, the nearest pattern
+        pixel is used instead, which is faster but less smooth */
+    int interpolate;
+
+    /** Only every row_step'th row is rendered, and the rows in between are
+        copies of the rendered row above them; this is initially 1 */
+    unsigned int row_step;
+
+    /** The row of a larger stereogram at which this image starts; pattern rows
+        are chosen relative to it, so an image rendered from a band of a
+        z-buffer matches the same rows of the whole stereogram. This is
+        initially 0 */
+    unsigned int origin;
 } StereoImage;
 
 /**
@@ -39,7 +58,8 @@ typedef struct {
  * @param pattern
  *     The background pattern. This function will fail if it is not specified.
  *     Ownership of this pattern is assumed by the stereo image, and the stereo
- *     image frees it when it is freed.
+ *     image frees it when it is freed. Pass stereo_pattern_ref(pattern) to
+ *     keep using the pattern elsewhere.
  * @param strength
  *     The strength of the effect.
  * @param is_inverted
@@ -72,6 +92,38 @@ stereo_image_create(unsigned int width, unsigned int height,
 void
 stereo_image_free(StereoImage *image);
 
+/**
+ * Sets the back pattern of a stereo image.
+ *
+ * The back pattern is not read when rendering, so an effect may update it while
+ * the stereo image is being rendered. When it is complete, it is made the
+ * current pattern by calling stereo_image_swap_patterns.
+ *
+ * @param image
+ *     The stereo image.
+ * @param pattern
+ *     The back pattern. Its dimensions must be the same as those of the
+ *     current pattern, otherwise this function will fail. Ownership of this
+ *     pattern is assumed by the stereo image, and any previous back pattern is
+ *     freed. This may be NULL.
+ * @return non-zero upon success or 0 otherwise
+ */
+int
+stereo_image_set_back_pattern(StereoImage *image, StereoPattern *pattern);
+
+/**
+ * Swaps the current pattern and the back pattern.
+ *
+ * The swap is atomic, and calls to stereo_image_apply_lines already running
+ * keep using the pattern that was current when they were called. If the image
+ * has no back pattern, nothing is done.
+ *
+ * @param image
+ *     The stereo image.
+ */
+void
+stereo_image_swap_patterns(StereoImage *image);
+
 /**
  * Sets the strength of the stereogram effect.
  *
@@ -124,4 +176,29 @@ stereo_image_apply_lines(StereoImage *image, ZBuffer *buffer,
 #define stereo_image_apply(_image, buffer, channel) \
     stereo_image_apply_lines(_image, buffer, channel, 0, _image->image->height)
 
+/**
+ * Applies a z-buffer to the stereo image while an effect prepares the pattern
+ * for the next frame.
+ *
+ * The effect is retargeted to the back pattern and applied on a separate
+ * thread while the current pattern is rendered, and the patterns are swapped
+ * when both are complete. Effects that modify the pattern in place will see
+ * the content of the back pattern, which is the pattern of the previous frame.
+ *
+ * @param image
+ *     The stereo image. It must have a back pattern.
+ * @param buffer
+ *     The z-buffer to use.
+ * @param channel
+ *     The channel of the z-buffer to use.
+ * @param effect
+ *     The effect to apply to the back pattern.
+ * @return non-zero upon success or 0 otherwise
+ * @see stereo_image_apply
+ * @see stereo_image_set_back_pattern
+ */
+int
+stereo_image_apply_pipelined(StereoImage *image, ZBuffer *buffer,
+    unsigned int channel, StereoPatternEffect *effect);
+
 #endif
@@ -0,0 +1,381 @@
+#ifndef STEREO_STREAM_H
+#define STEREO_STREAM_H
+
+#include <stdio.h>
+
+#include "pattern.h"
+#include "zbuffer.h"
+
+/**
+ * The image file formats.
+ */
+enum {
+    /** PNG; this is compact, but slow to encode and decode */
+    STEREO_FORMAT_PNG = 0,
+
+    /** PGM, PPM or PAM depending on the number of channels; the pixels are
+        stored uncompressed, so rows are read and written without parsing */
+    STEREO_FORMAT_PNM,
+
+    /** QOI; this is almost as compact as PNG, but many times faster, and
+        supports only 8 bit RGB and RGBA */
+    STEREO_FORMAT_QOI
+};
+
+/**
+ * A reader decoding an image one row at a time.
+ *
+ * Rows are decoded in the channels and the bit depth of the file; 16 bit
+ * samples are stored in host byte order, like in a ZBuffer.
+ */
+typedef struct StereoRowReader StereoRowReader;
+struct StereoRowReader {
+    /** The dimensions of the image */
+    unsigned int width, height;
+
+    /** The number of channels of every pixel */
+    unsigned int channels;
+
+    /** The number of bits of every channel; this is 8 or 16 */
+    unsigned int depth;
+
+    /** The next row to decode */
+    unsigned int row;
+
+    /**
+     * Decodes the next row.
+     *
+     * @param reader
+     *     This reader.
+     * @param row
+     *     The buffer to decode to. This must have room for
+     *     width * channels * depth / 8 bytes.
+     * @return non-zero upon success and 0 otherwise
+     */
+    int (*Read)(StereoRowReader *reader, unsigned char *row);
+
+    /**
+     * Frees the reader; the file is not closed.
+     *
+     * @param reader
+     *     This reader.
+     */
+    void (*Close)(StereoRowReader *reader);
+};
+
+/**
+ * A writer encoding an image one row at a time.
+ */
+typedef struct StereoRowWriter StereoRowWriter;
+struct StereoRowWriter {
+    /** The dimensions of the image */
+    unsigned int width, height;
+
+    /** The number of channels of every pixel */
+    unsigned int channels;
+
+    /** The number of bits of every channel; this is 8 or 16 */
+    unsigned int depth;
+
+    /** The next row to encode */
+    unsigned int row;
+
+    /**
+     * Encodes the next row.
+     *
+     * @param writer
+     *     This writer.
+     * @param row
+     *     The row to encode, in the format of the writer; 16 bit samples are
+     *     in host byte order.
+     * @return non-zero upon success and 0 otherwise
+     */
+    int (*Write)(StereoRowWriter *writer, const unsigned char *row);
+
+    /**
+     * Completes the image and frees the writer; the file is not closed.
+     *
+     * @param writer
+     *     This writer.
+     * @return non-zero if the complete image was written and 0 otherwise
+     */
+    int (*Close)(StereoRowWriter *writer);
+};
+
+/**
+ * Starts reading an image in any supported format.
+ *
+ * The format is detected from the first byte of the file, so this works on
+ * pipes as well.
+ *
+ * @param in
+ *     The file to read. Please make sure that it is opened in binary mode.
+ * @return a new reader, or NULL upon failure
+ */
+StereoRowReader*
+stereo_row_reader_open(FILE *in);
+
+/**
+ * Starts reading a PNG image.
+ *
+ * The format of the rows is that of stereo_zbuffer_png_open. Interlaced
+ * images are decoded completely by the first read.
+ *
+ * @param in
+ *     The file to read.
+ * @return a new reader, or NULL upon failure
+ */
+StereoRowReader*
+stereo_row_reader_open_png(FILE *in);
+
+/**
+ * Starts reading a binary PGM, PPM or PAM image.
+ *
+ * Samples with a maximum value other than 255 or 65535 are scaled to the
+ * full range of 8 or 16 bits.
+ *
+ * @param in
+ *     The file to read.
+ * @return a new reader, or NULL upon failure
+ */
+StereoRowReader*
+stereo_row_reader_open_pnm(FILE *in);
+
+/**
+ * Starts reading a QOI image.
+ *
+ * The file is read exactly up to the end of the image, so several images may
+ * follow each other in a stream.
+ *
+ * @param in
+ *     The file to read.
+ * @return a new reader, or NULL upon failure
+ */
+StereoRowReader*
+stereo_row_reader_open_qoi(FILE *in);
+
+/**
+ * Decodes the next row of an image.
+ *
+ * @param reader
+ *     The reader.
+ * @param row
+ *     The buffer to decode to.
+ * @return non-zero upon success, and 0 at the end of the image and upon
+ *     failure
+ */
+int
+stereo_row_reader_read(StereoRowReader *reader, unsigned char *row);
+
+/**
+ * Decodes the next rows of an image into a z-buffer.
+ *
+ * @param reader
+ *     The reader.
+ * @param buffer
+ *     The z-buffer to decode to. Its width, channels and depth must be those
+ *     of the image.
+ * @param y
+ *     The first row of buffer to write.
+ * @param count
+ *     The maximum number of rows to decode.
+ * @return the number of rows decoded, which is 0 at the end of the image and
+ *     upon failure
+ */
+unsigned int
+stereo_row_reader_read_zbuffer(StereoRowReader *reader, ZBuffer *buffer,
+    unsigned int y, unsigned int count);
+
+/**
+ * Frees a reader.
+ *
+ * The file is not closed.
+ *
+ * @param reader
+ *     The reader to free.
+ */
+void
+stereo_row_reader_close(StereoRowReader *reader);
+
+/**
+ * Starts writing an image.
+ *
+ * @param out
+ *     The file to write. Please make sure that it is opened in binary mode.
+ * @param format
+ *     The file format; one of the STEREO_FORMAT_* values.
+ * @param width
+ *     The width of the image.
+ * @param height
+ *     The height of the image.
+ * @param channels
+ *     The number of channels. PNG supports 1 to 4 channels, QOI 3 or 4
+ *     channels and PNM any number of channels.
+ * @param depth
+ *     The number of bits of every channel; QOI supports only 8 bits.
+ * @return a new writer, or NULL if the format does not support the pixel
+ *     format or upon failure
+ */
+StereoRowWriter*
+stereo_row_writer_open(FILE *out, int format, unsigned int width,
+    unsigned int height, unsigned int channels, unsigned int depth);
+
+/**
+ * Encodes the next row of an image.
+ *
+ * @param writer
+ *     The writer.
+ * @param row
+ *     The row to encode.
+ * @return non-zero upon success, and 0 if all rows are written or upon
+ *     failure
+ */
+int
+stereo_row_writer_write(StereoRowWriter *writer, const unsigned char *row);
+
+/**
+ * Completes an image and frees the writer.
+ *
+ * The file is not closed.
+ *
+ * @param writer
+ *     The writer to free.
+ * @return non-zero if all rows were written successfully and 0 otherwise
+ */
+int
+stereo_row_writer_close(StereoRowWriter *writer);
+
+/**
+ * Creates a pattern from the remaining rows of a reader.
+ *
+ * Images in any format are converted to 8 bit RGBA; 8 bit RGBA rows are
+ * decoded directly into the pattern.
+ *
+ * @param reader
+ *     The reader; it is not closed.
+ * @return a new pattern, or NULL upon failure
+ */
+StereoPattern*
+stereo_pattern_create_from_reader(StereoRowReader *reader);
+
+/**
+ * Creates a pattern from an image file in any supported format.
+ *
+ * @param filename
+ *     The name of the file.
+ * @return a new pattern, or NULL upon failure; while the pattern cache is
+ *     enabled, this may be a shared reference to a cached pattern
+ */
+StereoPattern*
+stereo_pattern_create_from_file(const char *filename);
+
+/**
+ * Writes a pattern to a writer.
+ *
+ * @param pattern
+ *     The pattern to write.
+ * @param writer
+ *     The writer; it is not closed. Its dimensions must be those of the
+ *     pattern, and it must have 3 or 4 channels of 8 bits.
+ * @return non-zero upon success and 0 otherwise
+ */
+int
+stereo_pattern_write(StereoPattern *pattern, StereoRowWriter *writer);
+
+/**
+ * Saves a pattern as an RGBA image.
+ *
+ * PNG files are encoded with stereo_pattern_save_to_png.
+ *
+ * @param pattern
+ *     The pattern to save.
+ * @param out
+ *     The file to write.
+ * @param format
+ *     The file format; one of the STEREO_FORMAT_* values.
+ * @return non-zero upon success and 0 otherwise
+ */
+int
+stereo_pattern_save(StereoPattern *pattern, FILE *out, int format);
+
+/**
+ * Saves a pattern as an RGBA image.
+ *
+ * @param pattern
+ *     The pattern to save.
+ * @param filename
+ *     The file to write. If this file cannot be created, the function fails.
+ * @param format
+ *     The file format; one of the STEREO_FORMAT_* values.
+ * @return non-zero upon success and 0 otherwise
+ * @see stereo_pattern_save
+ */
+int
+stereo_pattern_save_file(StereoPattern *pattern, const char *filename,
+    int format);
+
+/**
+ * Creates a z-buffer from the remaining rows of a reader.
+ *
+ * The z-buffer has the channels and the depth of the image.
+ *
+ * @param reader
+ *     The reader; it is not closed.
+ * @return a new z-buffer, or NULL upon failure
+ */
+ZBuffer*
+stereo_zbuffer_create_from_reader(StereoRowReader *reader);
+
+/**
+ * Creates a z-buffer from an image file in any supported format.
+ *
+ * @param filename
+ *     The name of the file.
+ * @return a new z-buffer, or NULL upon failure
+ */
+ZBuffer*
+stereo_zbuffer_create_from_file(const char *filename);
+
+/**
+ * Writes a z-buffer to a writer.
+ *
+ * @param buffer
+ *     The z-buffer to write.
+ * @param writer
+ *     The writer; it is not closed. Its dimensions, channels and depth must
+ *     be those of the z-buffer.
+ * @return non-zero upon success and 0 otherwise
+ */
+int
+stereo_zbuffer_write(ZBuffer *buffer, StereoRowWriter *writer);
+
+/**
+ * Saves a z-buffer in its own channels and depth.
+ *
+ * @param buffer
+ *     The z-buffer to save.
+ * @param out
+ *     The file to write.
+ * @param format
+ *     The file format; one of the STEREO_FORMAT_* values.
+ * @return non-zero upon success and 0 otherwise
+ */
+int
+stereo_zbuffer_save(ZBuffer *buffer, FILE *out, int format);
+
+/**
+ * Saves a z-buffer in its own channels and depth.
+ *
+ * @param buffer
+ *     The z-buffer to save.
+ * @param filename
+ *     The file to write. If this file cannot be created, the function fails.
+ * @param format
+ *     The file format; one of the STEREO_FORMAT_* values.
+ * @return non-zero upon success and 0 otherwise
+ * @see stereo_zbuffer_save
+ */
+int
+stereo_zbuffer_save_file(ZBuffer *buffer, const char *filename, int format);
+
+#endif
@@ -0,0 +1,200 @@
+#include <png.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include "../private/stream.h"
+
+/**
+ * A reader of PNG files.
+ */
+typedef struct {
+    StereoRowReader b;
+
+    /** The PNG decoder */
+    ZBufferPNGReader *png;
+
+    /** The decoded rows; this holds one row, or the entire image if it is
+        interlaced */
+    ZBuffer *rows;
+
+    /** Whether the image is interlaced */
+    int interlaced;
+} PNGRowReader;
+
+/**
+ * A writer of PNG files.
+ */
+typedef struct {
+    StereoRowWriter b;
+
+    /** The PNG structures */
+    png_structp png;
+    png_infop info;
+} PNGRowWriter;
+
+/**
+ * See StereoRowReader::Read.
+ */
+static int
+png_row_read(PNGRowReader *reader, unsigned char *row)
+{
+    unsigned int y = 0;
+
+    if (reader->interlaced) {
+        /* Every row is spread over all passes, so the first read decodes the
+           entire image */
+        if (!reader->b.row && stereo_zbuffer_png_read(reader->png,
+                reader->rows, 0, reader->b.height) != reader->b.height) {
+            return 0;
+        }
+        y = reader->b.row;
+    }
+    else if (stereo_zbuffer_png_read(reader->png, reader->rows, 0, 1) != 1) {
+        return 0;
+    }
+
+    memcpy(row, stereo_zbuffer_row_get(reader->rows, y), stream_row_bytes(
+        reader->b.width, reader->b.channels, reader->b.depth));
+
+    return 1;
+}
+
+/**
+ * See StereoRowReader::Close.
+ */
+static void
+png_row_close(PNGRowReader *reader)
+{
+    stereo_zbuffer_free(reader->rows);
+    stereo_zbuffer_png_close(reader->png);
+    free(reader);
+}
+
+StereoRowReader*
+stereo_row_reader_open_png(FILE *in)
+{
+    ZBufferPNGReader *png = stereo_zbuffer_png_open(in);
+    PNGRowReader *result;
+
+    if (!png) {
+        return NULL;
+    }
+
+    result = malloc(sizeof(PNGRowReader));
+    stereo_zbuffer_png_get_format(png, &result->b.width, &result->b.height,
+        &result->b.channels, &result->b.depth, &result->interlaced);
+    result->b.row = 0;
+    result->b.Read = (void*)png_row_read;
+    result->b.Close = (void*)png_row_close;
+    result->png = png;
+    result->rows = stereo_zbuffer_png_create_buffer(png,
+        result->interlaced ? 0 : 1);
+
+    return (StereoRowReader*)result;
+}
+
+/**
+ * See StereoRowWriter::Write.
+ */
+static int
+png_row_write(PNGRowWriter *writer, const unsigned char *row)
+{
+    /* We return here upon errors */
+    if (setjmp(png_jmpbuf(writer->png))) {
+        return 0;
+    }
+
+    png_write_row(writer->png, (png_const_bytep)row);
+
+    return 1;
+}
+
+/**
+ * See StereoRowWriter::Close.
+ */
+static int
+png_row_writer_close(PNGRowWriter *writer)
+{
+    volatile int result = writer->b.row == writer->b.height;
+
+    /* We return here upon errors */
+    if (setjmp(png_jmpbuf(writer->png))) {
+        result = 0;
+    }
+    else if (result) {
+        png_write_end(writer->png, NULL);
+        png_write_flush(writer->png);
+    }
+
+    png_destroy_write_struct(&writer->png, &writer->info);
+    free(writer);
+
+    return result;
+}
+
+StereoRowWriter*
+stream_writer_open_png(FILE *out, unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth)
+{
+    static const int color_types[] = {
+        PNG_COLOR_TYPE_GRAY,
+        PNG_COLOR_TYPE_GRAY_ALPHA,
+        PNG_COLOR_TYPE_RGB,
+        PNG_COLOR_TYPE_RGB_ALPHA};
+    PNGRowWriter *result;
+
+    if (channels > 4) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = malloc(sizeof(PNGRowWriter));
+    result->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+        NULL);
+    if (!result->png) {
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+    result->info = png_create_info_struct(result->png);
+    if (!result->info) {
+        png_destroy_write_struct(&result->png, NULL);
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* We return here upon errors */
+    if (setjmp(png_jmpbuf(result->png))) {
+        png_destroy_write_struct(&result->png, &result->info);
+        free(result);
+
+        return NULL;
+    }
+
+    png_init_io(result->png, out);
+    png_set_compression_level(result->png, stereo_png_profile_default.level);
+    png_set_IHDR(result->png, result->info, width, height, depth,
+        color_types[channels - 1], PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(result->png, result->info);
+
+    /* Rows are in host byte order */
+    if (depth == 16 && stream_little_endian()) {
+        png_set_swap(result->png);
+    }
+
+    result->b.width = width;
+    result->b.height = height;
+    result->b.channels = channels;
+    result->b.depth = depth;
+    result->b.row = 0;
+    result->b.Write = (void*)png_row_write;
+    result->b.Close = (void*)png_row_writer_close;
+
+    return (StereoRowWriter*)result;
+}
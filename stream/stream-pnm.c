@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "../private/stream.h"
+
+/**
+ * A reader of binary PGM, PPM and PAM files.
+ */
+typedef struct {
+    StereoRowReader b;
+
+    /** The file */
+    FILE *in;
+
+    /** The maximum sample value */
+    unsigned int maxval;
+} PNMReader;
+
+/**
+ * A writer of binary PGM, PPM and PAM files.
+ */
+typedef struct {
+    StereoRowWriter b;
+
+    /** The file */
+    FILE *out;
+
+    /** A row of 16 bit samples in big endian byte order, or NULL if samples
+        are written as they are */
+    unsigned char *swapped;
+} PNMWriter;
+
+/**
+ * Reads a decimal number from a PGM or PPM header, skipping white space and
+ * comments before it.
+ *
+ * @param in
+ *     The file.
+ * @param value
+ *     The number read.
+ * @return non-zero upon success and 0 otherwise, which includes numbers
+ *     greater than INT_MAX
+ */
+static int
+pnm_number(FILE *in, unsigned int *value)
+{
+    int c = getc(in);
+
+    for (;;) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) {
+                c = getc(in);
+            }
+        }
+        else if (isspace(c)) {
+            c = getc(in);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (!isdigit(c)) {
+        return 0;
+    }
+
+    *value = 0;
+    while (isdigit(c)) {
+        if (*value > (INT_MAX - (unsigned int)(c - '0')) / 10) {
+            return 0;
+        }
+        *value = 10 * *value + (c - '0');
+        c = getc(in);
+    }
+
+    /* The single white space character after the number is consumed, which
+       is required after the maximum value */
+    return isspace(c);
+}
+
+/**
+ * Checks whether the first word of a PAM header line is a keyword.
+ *
+ * @param line
+ *     The line.
+ * @param end
+ *     The end of the first word.
+ * @param keyword
+ *     The keyword.
+ * @return non-zero if the word is the keyword
+ */
+static int
+pnm_keyword(const char *line, const char *end, const char *keyword)
+{
+    return (size_t)(end - line) == strlen(keyword)
+        && !strncmp(line, keyword, end - line);
+}
+
+/**
+ * Parses the value of a PAM header field.
+ *
+ * @param value
+ *     The text after the keyword.
+ * @return the value, or 0 if it is greater than INT_MAX, which every field
+ *     rejects
+ */
+static unsigned int
+pnm_pam_value(const char *value)
+{
+    unsigned long result = strtoul(value, NULL, 10);
+
+    return result > INT_MAX ? 0 : (unsigned int)result;
+}
+
+/**
+ * Reads the header of a PAM file after the magic number.
+ *
+ * @param reader
+ *     The reader to initialise.
+ * @return non-zero upon success and 0 otherwise
+ */
+static int
+pnm_pam_header(PNMReader *reader)
+{
+    char line[256];
+
+    while (fgets(line, sizeof(line), reader->in)) {
+        char *value = line;
+
+        while (*value && !isspace((unsigned char)*value)) {
+            value++;
+        }
+
+        if (pnm_keyword(line, value, "ENDHDR")) {
+            return 1;
+        }
+        else if (pnm_keyword(line, value, "WIDTH")) {
+            reader->b.width = pnm_pam_value(value);
+        }
+        else if (pnm_keyword(line, value, "HEIGHT")) {
+            reader->b.height = pnm_pam_value(value);
+        }
+        else if (pnm_keyword(line, value, "DEPTH")) {
+            reader->b.channels = pnm_pam_value(value);
+        }
+        else if (pnm_keyword(line, value, "MAXVAL")) {
+            reader->maxval = pnm_pam_value(value);
+        }
+
+        /* TUPLTYPE and comments are ignored; the channels are interpreted by
+           their number */
+    }
+
+    return 0;
+}
+
+/**
+ * See StereoRowReader::Read.
+ */
+static int
+pnm_read(PNMReader *reader, unsigned char *row)
+{
+    size_t samples = (size_t)reader->b.width * reader->b.channels;
+    size_t i;
+
+    if (fread(row, reader->b.depth / 8, samples, reader->in) != samples) {
+        return 0;
+    }
+
+    /* Samples are stored in big endian byte order */
+    if (reader->b.depth == 16 && stream_little_endian()) {
+        stream_swap16(row, row, samples);
+    }
+
+    /* Scale the samples to the full range */
+    if (reader->b.depth == 8 && reader->maxval != 0xFF) {
+        for (i = 0; i < samples; i++) {
+            unsigned int v = row[i] < reader->maxval
+                ? row[i] : reader->maxval;
+
+            row[i] = (v * 0xFF + reader->maxval / 2) / reader->maxval;
+        }
+    }
+    else if (reader->b.depth == 16 && reader->maxval != 0xFFFF) {
+        unsigned short *s = (unsigned short*)row;
+
+        for (i = 0; i < samples; i++) {
+            unsigned long v = s[i] < reader->maxval ? s[i] : reader->maxval;
+
+            s[i] = (v * 0xFFFF + reader->maxval / 2) / reader->maxval;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * See StereoRowReader::Close.
+ */
+static void
+pnm_close(PNMReader *reader)
+{
+    free(reader);
+}
+
+StereoRowReader*
+stereo_row_reader_open_pnm(FILE *in)
+{
+    PNMReader *result;
+    unsigned char magic[2];
+
+    if (!in) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)) {
+        return NULL;
+    }
+    if (magic[0] != 'P' || magic[1] < '5' || magic[1] > '7') {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = malloc(sizeof(PNMReader));
+    result->b.width = 0;
+    result->b.height = 0;
+    result->b.channels = magic[1] == '6' ? 3 : 1;
+    result->b.row = 0;
+    result->b.Read = (void*)pnm_read;
+    result->b.Close = (void*)pnm_close;
+    result->in = in;
+    result->maxval = 0;
+
+    if (magic[1] == '7') {
+        if (!pnm_pam_header(result)) {
+            free(result);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    else if (!pnm_number(in, &result->b.width)
+            || !pnm_number(in, &result->b.height)
+            || !pnm_number(in, &result->maxval)) {
+        free(result);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!result->b.width || !result->b.height || !result->b.channels
+            || !result->maxval || result->maxval > 0xFFFF) {
+        free(result);
+        errno = EINVAL;
+        return NULL;
+    }
+    result->b.depth = result->maxval > 0xFF ? 16 : 8;
+
+    return (StereoRowReader*)result;
+}
+
+/**
+ * See StereoRowWriter::Write.
+ */
+static int
+pnm_write(PNMWriter *writer, const unsigned char *row)
+{
+    size_t samples = (size_t)writer->b.width * writer->b.channels;
+
+    if (writer->swapped) {
+        stream_swap16(writer->swapped, row, samples);
+        row = writer->swapped;
+    }
+
+    return fwrite(row, writer->b.depth / 8, samples, writer->out) == samples;
+}
+
+/**
+ * See StereoRowWriter::Close.
+ */
+static int
+pnm_writer_close(PNMWriter *writer)
+{
+    int result = writer->b.row == writer->b.height
+        && !fflush(writer->out);
+
+    free(writer->swapped);
+    free(writer);
+
+    return result;
+}
+
+StereoRowWriter*
+stream_writer_open_pnm(FILE *out, unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth)
+{
+    PNMWriter *result;
+    unsigned int maxval = (1 << depth) - 1;
+    int written;
+
+    switch (channels) {
+    case 1:
+        written = fprintf(out, "P5\n%u %u\n%u\n", width, height, maxval);
+        break;
+
+    case 3:
+        written = fprintf(out, "P6\n%u %u\n%u\n", width, height, maxval);
+        break;
+
+    default:
+        written = fprintf(out, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\n"
+            "MAXVAL %u\n%sENDHDR\n", width, height, channels, maxval,
+            channels == 2 ? "TUPLTYPE GRAYSCALE_ALPHA\n"
+                : channels == 4 ? "TUPLTYPE RGB_ALPHA\n" : "");
+        break;
+    }
+    if (written < 0) {
+        return NULL;
+    }
+
+    result = malloc(sizeof(PNMWriter));
+    result->b.width = width;
+    result->b.height = height;
+    result->b.channels = channels;
+    result->b.depth = depth;
+    result->b.row = 0;
+    result->b.Write = (void*)pnm_write;
+    result->b.Close = (void*)pnm_writer_close;
+    result->out = out;
+    result->swapped = depth == 16 && stream_little_endian()
+        ? malloc(stream_row_bytes(width, channels, depth)) : NULL;
+
+    return (StereoRowWriter*)result;
+}
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include "../private/stream.h"
+
+/**
+ * The QOI chunk tags.
+ */
+enum {
+    QOI_OP_INDEX = 0x00,
+    QOI_OP_DIFF = 0x40,
+    QOI_OP_LUMA = 0x80,
+    QOI_OP_RUN = 0xC0,
+    QOI_OP_RGB = 0xFE,
+    QOI_OP_RGBA = 0xFF,
+
+    /** The mask of the two bit tags */
+    QOI_MASK = 0xC0
+};
+
+/**
+ * The size of the header.
+ */
+#define QOI_HEADER_SIZE 14
+
+/**
+ * The longest run of a single chunk.
+ */
+#define QOI_RUN_MAX 62
+
+/**
+ * The marker after the last chunk.
+ */
+static const unsigned char qoi_end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+/**
+ * The state shared by the encoder and the decoder.
+ */
+typedef struct {
+    /** The previous pixel */
+    unsigned char px[4];
+
+    /** The pixels seen, indexed by their hash */
+    unsigned char index[64][4];
+
+    /** The number of repetitions of px remaining or pending */
+    unsigned int run;
+} QOIState;
+
+/**
+ * A reader of QOI files.
+ */
+typedef struct {
+    StereoRowReader b;
+
+    /** The file */
+    FILE *in;
+
+    /** The decoder state */
+    QOIState state;
+} QOIReader;
+
+/**
+ * A writer of QOI files.
+ */
+typedef struct {
+    StereoRowWriter b;
+
+    /** The file */
+    FILE *out;
+
+    /** The encoder state */
+    QOIState state;
+
+    /** The chunks of a row; a pixel takes at most 5 bytes */
+    unsigned char *buffer;
+} QOIWriter;
+
+/**
+ * Returns the index of a pixel in QOIState::index.
+ */
+static inline unsigned int
+qoi_hash(const unsigned char *px)
+{
+    return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+}
+
+/**
+ * Initialises the state of an encoder or a decoder.
+ */
+static void
+qoi_state_initialize(QOIState *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->px[3] = 0xFF;
+}
+
+/**
+ * Reads a big endian 32 bit value.
+ */
+static inline unsigned long
+qoi_get32(const unsigned char *s)
+{
+    return ((unsigned long)s[0] << 24) | ((unsigned long)s[1] << 16)
+        | ((unsigned long)s[2] << 8) | s[3];
+}
+
+/**
+ * Writes a big endian 32 bit value.
+ */
+static inline void
+qoi_put32(unsigned char *d, unsigned long v)
+{
+    d[0] = (unsigned char)(v >> 24);
+    d[1] = (unsigned char)(v >> 16);
+    d[2] = (unsigned char)(v >> 8);
+    d[3] = (unsigned char)v;
+}
+
+/**
+ * See StereoRowReader::Read.
+ */
+static int
+qoi_read(QOIReader *reader, unsigned char *row)
+{
+    QOIState *state = &reader->state;
+    unsigned int channels = reader->b.channels;
+    unsigned int x;
+    int result = 1;
+
+    /* Chunks are read a byte at a time, so avoid locking for every byte */
+    flockfile(reader->in);
+
+    for (x = 0; x < reader->b.width; x++) {
+        if (state->run) {
+            state->run--;
+        }
+        else {
+            int b1 = getc_unlocked(reader->in);
+            int b2;
+
+            if (b1 == EOF) {
+                result = 0;
+                break;
+            }
+
+            if (b1 == QOI_OP_RGB) {
+                state->px[0] = getc_unlocked(reader->in);
+                state->px[1] = getc_unlocked(reader->in);
+                state->px[2] = getc_unlocked(reader->in);
+            }
+            else if (b1 == QOI_OP_RGBA) {
+                state->px[0] = getc_unlocked(reader->in);
+                state->px[1] = getc_unlocked(reader->in);
+                state->px[2] = getc_unlocked(reader->in);
+                state->px[3] = getc_unlocked(reader->in);
+            }
+            else switch (b1 & QOI_MASK) {
+            case QOI_OP_INDEX:
+                memcpy(state->px, state->index[b1], 4);
+                break;
+
+            case QOI_OP_DIFF:
+                state->px[0] += ((b1 >> 4) & 0x03) - 2;
+                state->px[1] += ((b1 >> 2) & 0x03) - 2;
+                state->px[2] += (b1 & 0x03) - 2;
+                break;
+
+            case QOI_OP_LUMA:
+                b2 = getc_unlocked(reader->in);
+                b1 = (b1 & 0x3F) - 32;
+                state->px[0] += b1 - 8 + ((b2 >> 4) & 0x0F);
+                state->px[1] += b1;
+                state->px[2] += b1 - 8 + (b2 & 0x0F);
+                break;
+
+            case QOI_OP_RUN:
+                state->run = b1 & 0x3F;
+                break;
+            }
+
+            memcpy(state->index[qoi_hash(state->px)], state->px, 4);
+        }
+
+        memcpy(row + x * channels, state->px, channels);
+    }
+
+    /* Consume the end marker after the last row, so that the file is
+       positioned after the image */
+    if (result && reader->b.row + 1 == reader->b.height) {
+        for (x = 0; x < sizeof(qoi_end); x++) {
+            if (getc_unlocked(reader->in) != qoi_end[x]) {
+                result = 0;
+                break;
+            }
+        }
+    }
+
+    funlockfile(reader->in);
+
+    /* A chunk cut short by the end of the file reads its missing bytes as
+       EOF, which only shows in the end of file flag */
+    return result && !ferror(reader->in) && !feof(reader->in);
+}
+
+/**
+ * See StereoRowReader::Close.
+ */
+static void
+qoi_close(QOIReader *reader)
+{
+    free(reader);
+}
+
+StereoRowReader*
+stereo_row_reader_open_qoi(FILE *in)
+{
+    QOIReader *result;
+    unsigned char header[QOI_HEADER_SIZE];
+
+    if (!in) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (fread(header, 1, sizeof(header), in) != sizeof(header)) {
+        return NULL;
+    }
+    if (memcmp(header, "qoif", 4)
+            || !qoi_get32(header + 4) || !qoi_get32(header + 8)
+            || (header[12] != 3 && header[12] != 4)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = malloc(sizeof(QOIReader));
+    result->b.width = qoi_get32(header + 4);
+    result->b.height = qoi_get32(header + 8);
+    result->b.channels = header[12];
+    result->b.depth = 8;
+    result->b.row = 0;
+    result->b.Read = (void*)qoi_read;
+    result->b.Close = (void*)qoi_close;
+    result->in = in;
+    qoi_state_initialize(&result->state);
+
+    return (StereoRowReader*)result;
+}
+
+/**
+ * See StereoRowWriter::Write.
+ */
+static int
+qoi_write(QOIWriter *writer, const unsigned char *row)
+{
+    QOIState *state = &writer->state;
+    unsigned int channels = writer->b.channels;
+    int last = writer->b.row + 1 == writer->b.height;
+    unsigned char *d = writer->buffer;
+    unsigned char px[4];
+    unsigned int x, hash;
+
+    px[3] = 0xFF;
+
+    for (x = 0; x < writer->b.width; x++) {
+        memcpy(px, row + x * channels, channels);
+
+        /* Runs continue across rows, and end at the end of the image */
+        if (!memcmp(px, state->px, 4)) {
+            if (++state->run == QOI_RUN_MAX
+                    || (last && x + 1 == writer->b.width)) {
+                *d++ = QOI_OP_RUN | (state->run - 1);
+                state->run = 0;
+            }
+            continue;
+        }
+
+        if (state->run) {
+            *d++ = QOI_OP_RUN | (state->run - 1);
+            state->run = 0;
+        }
+
+        hash = qoi_hash(px);
+        if (!memcmp(state->index[hash], px, 4)) {
+            *d++ = QOI_OP_INDEX | hash;
+        }
+        else {
+            memcpy(state->index[hash], px, 4);
+
+            if (px[3] == state->px[3]) {
+                signed char vr = px[0] - state->px[0];
+                signed char vg = px[1] - state->px[1];
+                signed char vb = px[2] - state->px[2];
+                signed char vg_r = vr - vg;
+                signed char vg_b = vb - vg;
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2
+                        && vb > -3 && vb < 2) {
+                    *d++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2
+                        | (vb + 2);
+                }
+                else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32
+                        && vg_b > -9 && vg_b < 8) {
+                    *d++ = QOI_OP_LUMA | (vg + 32);
+                    *d++ = (vg_r + 8) << 4 | (vg_b + 8);
+                }
+                else {
+                    *d++ = QOI_OP_RGB;
+                    *d++ = px[0];
+                    *d++ = px[1];
+                    *d++ = px[2];
+                }
+            }
+            else {
+                *d++ = QOI_OP_RGBA;
+                *d++ = px[0];
+                *d++ = px[1];
+                *d++ = px[2];
+                *d++ = px[3];
+            }
+        }
+
+        memcpy(state->px, px, 4);
+    }
+
+    return fwrite(writer->buffer, 1, d - writer->buffer, writer->out)
+        == (size_t)(d - writer->buffer);
+}
+
+/**
+ * See StereoRowWriter::Close.
+ */
+static int
+qoi_writer_close(QOIWriter *writer)
+{
+    int result = writer->b.row == writer->b.height
+        && fwrite(qoi_end, 1, sizeof(qoi_end), writer->out)
+            == sizeof(qoi_end)
+        && !fflush(writer->out);
+
+    free(writer->buffer);
+    free(writer);
+
+    return result;
+}
+
+StereoRowWriter*
+stream_writer_open_qoi(FILE *out, unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth)
+{
+    QOIWriter *result;
+    unsigned char header[QOI_HEADER_SIZE];
+
+    if (!width || !height || (channels != 3 && channels != 4)
+            || depth != 8) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* The colour space is sRGB with linear alpha */
+    memcpy(header, "qoif", 4);
+    qoi_put32(header + 4, width);
+    qoi_put32(header + 8, height);
+    header[12] = channels;
+    header[13] = 0;
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
+        return NULL;
+    }
+
+    result = malloc(sizeof(QOIWriter));
+    result->b.width = width;
+    result->b.height = height;
+    result->b.channels = channels;
+    result->b.depth = depth;
+    result->b.row = 0;
+    result->b.Write = (void*)qoi_write;
+    result->b.Close = (void*)qoi_writer_close;
+    result->out = out;
+    qoi_state_initialize(&result->state);
+    result->buffer = malloc(5 * (size_t)width);
+
+    return (StereoRowWriter*)result;
+}
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include "../private/pattern.h"
+#include "../private/stream.h"
+
+StereoRowReader*
+stereo_row_reader_open(FILE *in)
+{
+    int c;
+
+    if (!in) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Peek at the first byte, which differs between all formats */
+    c = getc(in);
+    if (c == EOF || ungetc(c, in) == EOF) {
+        return NULL;
+    }
+
+    switch (c) {
+    case 0x89:
+        return stereo_row_reader_open_png(in);
+
+    case 'P':
+        return stereo_row_reader_open_pnm(in);
+
+    case 'q':
+        return stereo_row_reader_open_qoi(in);
+
+    default:
+        errno = EINVAL;
+        return NULL;
+    }
+}
+
+int
+stereo_row_reader_read(StereoRowReader *reader, unsigned char *row)
+{
+    if (reader->row >= reader->height || !reader->Read(reader, row)) {
+        return 0;
+    }
+    reader->row++;
+
+    return 1;
+}
+
+unsigned int
+stereo_row_reader_read_zbuffer(StereoRowReader *reader, ZBuffer *buffer,
+    unsigned int y, unsigned int count)
+{
+    unsigned int i;
+
+    /* Verify the format of the z-buffer */
+    if (buffer->width != reader->width
+            || buffer->channels != reader->channels
+            || buffer->depth != reader->depth
+            || y + count > buffer->height) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!stereo_row_reader_read(reader,
+                stereo_zbuffer_row_get(buffer, y + i))) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+void
+stereo_row_reader_close(StereoRowReader *reader)
+{
+    reader->Close(reader);
+}
+
+StereoRowWriter*
+stereo_row_writer_open(FILE *out, int format, unsigned int width,
+    unsigned int height, unsigned int channels, unsigned int depth)
+{
+    if (!out || !channels || (depth != 8 && depth != 16)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    switch (format) {
+    case STEREO_FORMAT_PNG:
+        return stream_writer_open_png(out, width, height, channels, depth);
+
+    case STEREO_FORMAT_PNM:
+        return stream_writer_open_pnm(out, width, height, channels, depth);
+
+    case STEREO_FORMAT_QOI:
+        return stream_writer_open_qoi(out, width, height, channels, depth);
+
+    default:
+        errno = EINVAL;
+        return NULL;
+    }
+}
+
+int
+stereo_row_writer_write(StereoRowWriter *writer, const unsigned char *row)
+{
+    if (writer->row >= writer->height || !writer->Write(writer, row)) {
+        return 0;
+    }
+    writer->row++;
+
+    return 1;
+}
+
+int
+stereo_row_writer_close(StereoRowWriter *writer)
+{
+    return writer->Close(writer);
+}
+
+/**
+ * Converts a row of any format to pattern pixels.
+ *
+ * One channel is gray, two are gray and alpha, three are RGB and four or more
+ * are RGBA. Only the most significant byte of 16 bit samples is kept.
+ *
+ * @param d
+ *     The pixels to write.
+ * @param s
+ *     The row to convert.
+ * @param width
+ *     The number of pixels.
+ * @param channels
+ *     The number of channels of s.
+ * @param depth
+ *     The number of bits of every channel of s.
+ */
+static void
+stream_row_to_pixels(PatternPixel *d, const unsigned char *s,
+    unsigned int width, unsigned int channels, unsigned int depth)
+{
+    unsigned char v[4];
+    unsigned int x, c, n = channels < 4 ? channels : 4;
+
+    for (x = 0; x < width; x++) {
+        for (c = 0; c < n; c++) {
+            v[c] = depth == 16
+                ? ((const unsigned short*)s)[x * channels + c] >> 8
+                : s[x * channels + c];
+        }
+
+        switch (n) {
+        case 1:
+            d[x].r = d[x].g = d[x].b = v[0];
+            d[x].a = 0xFF;
+            break;
+
+        case 2:
+            d[x].r = d[x].g = d[x].b = v[0];
+            d[x].a = v[1];
+            break;
+
+        case 3:
+            d[x].r = v[0];
+            d[x].g = v[1];
+            d[x].b = v[2];
+            d[x].a = 0xFF;
+            break;
+
+        default:
+            d[x].r = v[0];
+            d[x].g = v[1];
+            d[x].b = v[2];
+            d[x].a = v[3];
+            break;
+        }
+    }
+}
+
+StereoPattern*
+stereo_pattern_create_from_reader(StereoRowReader *reader)
+{
+    StereoPattern *result;
+    unsigned char *row = NULL;
+    unsigned int y;
+    int direct = reader->channels == 4 && reader->depth == 8;
+
+    if (reader->row >= reader->height) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = stereo_pattern_allocate(reader->width,
+        reader->height - reader->row);
+    if (!direct) {
+        row = malloc(stream_row_bytes(reader->width, reader->channels,
+            reader->depth));
+    }
+
+    for (y = 0; y < result->height; y++) {
+        PatternPixel *d = stereo_pattern_row_get(result, y);
+
+        /* RGBA rows have the layout of PatternPixel */
+        if (direct) {
+            if (!stereo_row_reader_read(reader, (unsigned char*)d)) {
+                break;
+            }
+        }
+        else {
+            if (!stereo_row_reader_read(reader, row)) {
+                break;
+            }
+            stream_row_to_pixels(d, row, reader->width, reader->channels,
+                reader->depth);
+        }
+    }
+
+    free(row);
+    if (y < result->height) {
+        stereo_pattern_free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+/**
+ * See PatternDecode; decodes a pattern in any supported format.
+ */
+static StereoPattern*
+pattern_decode(FILE *in)
+{
+    StereoRowReader *reader = stereo_row_reader_open(in);
+    StereoPattern *result = NULL;
+
+    if (reader) {
+        result = stereo_pattern_create_from_reader(reader);
+        stereo_row_reader_close(reader);
+    }
+
+    return result;
+}
+
+StereoPattern*
+stereo_pattern_create_from_file(const char *filename)
+{
+    return pattern_cache_load(filename, pattern_decode);
+}
+
+int
+stereo_pattern_write(StereoPattern *pattern, StereoRowWriter *writer)
+{
+    unsigned char *row;
+    unsigned int x, y;
+
+    if (writer->width != pattern->width || writer->height != pattern->height
+            || writer->depth != 8
+            || (writer->channels != 3 && writer->channels != 4)) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    /* RGBA rows have the layout of PatternPixel */
+    if (writer->channels == 4) {
+        for (y = 0; y < pattern->height; y++) {
+            if (!stereo_row_writer_write(writer, (const unsigned char*)
+                    stereo_pattern_row_get(pattern, y))) {
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    row = malloc(3 * (size_t)pattern->width);
+    for (y = 0; y < pattern->height; y++) {
+        const PatternPixel *s = stereo_pattern_row_get(pattern, y);
+
+        for (x = 0; x < pattern->width; x++) {
+            row[3 * x] = s[x].r;
+            row[3 * x + 1] = s[x].g;
+            row[3 * x + 2] = s[x].b;
+        }
+        if (!stereo_row_writer_write(writer, row)) {
+            break;
+        }
+    }
+    free(row);
+
+    return y == pattern->height;
+}
+
+int
+stereo_pattern_save(StereoPattern *pattern, FILE *out, int format)
+{
+    StereoRowWriter *writer;
+    int result;
+
+    /* The PNG encoder is parallel, but works on entire images */
+    if (format == STEREO_FORMAT_PNG) {
+        return stereo_pattern_save_to_png(pattern, out);
+    }
+
+    writer = stereo_row_writer_open(out, format, pattern->width,
+        pattern->height, 4, 8);
+    if (!writer) {
+        return 0;
+    }
+
+    result = stereo_pattern_write(pattern, writer);
+
+    return stereo_row_writer_close(writer) && result;
+}
+
+int
+stereo_pattern_save_file(StereoPattern *pattern, const char *filename,
+    int format)
+{
+    FILE *out = fopen(filename, "wb");
+    int result;
+
+    if (!out) {
+        return 0;
+    }
+
+    result = stereo_pattern_save(pattern, out, format);
+
+    return !fclose(out) && result;
+}
+
+ZBuffer*
+stereo_zbuffer_create_from_reader(StereoRowReader *reader)
+{
+    ZBuffer *result;
+
+    if (reader->row >= reader->height) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    result = stereo_zbuffer_create_with_depth(reader->width,
+        reader->height - reader->row, reader->channels, reader->depth);
+    if (!result) {
+        return NULL;
+    }
+
+    if (stereo_row_reader_read_zbuffer(reader, result, 0, result->height)
+            != result->height) {
+        stereo_zbuffer_free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+ZBuffer*
+stereo_zbuffer_create_from_file(const char *filename)
+{
+    FILE *in = fopen(filename, "rb");
+    StereoRowReader *reader;
+    ZBuffer *result = NULL;
+
+    if (!in) {
+        return NULL;
+    }
+
+    reader = stereo_row_reader_open(in);
+    if (reader) {
+        result = stereo_zbuffer_create_from_reader(reader);
+        stereo_row_reader_close(reader);
+    }
+    fclose(in);
+
+    return result;
+}
+
+int
+stereo_zbuffer_write(ZBuffer *buffer, StereoRowWriter *writer)
+{
+    unsigned int y;
+
+    if (writer->width != buffer->width || writer->height != buffer->height
+            || writer->channels != buffer->channels
+            || writer->depth != buffer->depth) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    for (y = 0; y < buffer->height; y++) {
+        if (!stereo_row_writer_write(writer,
+                stereo_zbuffer_row_get(buffer, y))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int
+stereo_zbuffer_save(ZBuffer *buffer, FILE *out, int format)
+{
+    StereoRowWriter *writer = stereo_row_writer_open(out, format,
+        buffer->width, buffer->height, buffer->channels, buffer->depth);
+    int result;
+
+    if (!writer) {
+        return 0;
+    }
+
+    result = stereo_zbuffer_write(buffer, writer);
+
+    return stereo_row_writer_close(writer) && result;
+}
+
+int
+stereo_zbuffer_save_file(ZBuffer *buffer, const char *filename, int format)
+{
+    FILE *out = fopen(filename, "wb");
+    int result;
+
+    if (!out) {
+        return 0;
+    }
+
+    result = stereo_zbuffer_save(buffer, out, format);
+
+    return !fclose(out) && result;
+}
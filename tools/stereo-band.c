@@ -0,0 +1,278 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../band.h"
+#include "../stream.h"
+
+/**
+ * The default strength of the effect.
+ */
+#define BAND_STRENGTH 4.0
+
+/**
+ * Accepts coordinators and serves every one of them in a process of its
+ * own.
+ *
+ * @return the exit status
+ */
+static int
+band_worker_main(const char *name, const char *address)
+{
+    int fd = stereo_band_listen(address);
+
+    if (fd < 0) {
+        fprintf(stderr, "%s: cannot listen on %s: %s\n", name, address,
+            strerror(errno));
+        return 1;
+    }
+
+    /* The children are not waited for */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        int connection = accept(fd, NULL, NULL);
+
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+            return 1;
+        }
+
+        switch (fork()) {
+        case 0:
+            close(fd);
+            _exit(stereo_band_serve(connection) ? 0 : 1);
+
+        case -1:
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+            break;
+        }
+        close(connection);
+    }
+}
+
+/**
+ * Starts a worker process connected to this process.
+ *
+ * This must be called before any threads are started.
+ *
+ * @return the socket connected to the worker, or -1 upon error
+ */
+static int
+band_spawn(void)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+        return -1;
+    }
+
+    switch (fork()) {
+    case 0:
+        close(fds[0]);
+        _exit(stereo_band_serve(fds[1]) ? 0 : 1);
+
+    case -1:
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    close(fds[1]);
+
+    return fds[0];
+}
+
+/**
+ * See StereoBandWrite; writes the rows of a band to a row writer.
+ */
+static int
+band_write(StereoRowWriter *writer, StereoPattern *band, unsigned int y)
+{
+    unsigned int i;
+
+    for (i = 0; i < band->height; i++) {
+        if (!stereo_row_writer_write(writer,
+                (unsigned char*)stereo_pattern_row_get(band, i))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Prints the usage.
+ */
+static void
+band_usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s -l ADDRESS\n"
+        "       %s -p PATTERN [-s STRENGTH] [-i] [-f FORMAT] [-b ROWS]\n"
+        "           [-n WORKERS] [-w ADDRESS]... DEPTH OUTPUT\n"
+        "\n"
+        "Renders stereograms in bands of rows on worker processes.\n"
+        "\n"
+        "  -l ADDRESS   work for the coordinators connecting to ADDRESS\n"
+        "  -p PATTERN   the pattern file\n"
+        "  -s STRENGTH  the strength of the effect (default %.1f)\n"
+        "  -i           the depth map is inverted\n"
+        "  -f FORMAT    the output format: png, pnm or qoi (default png)\n"
+        "  -b ROWS      the number of rows of every band\n"
+        "  -n WORKERS   start WORKERS local worker processes\n"
+        "  -w ADDRESS   use the worker at ADDRESS\n"
+        "\n"
+        "Addresses are unix:PATH or HOST:PORT.\n",
+        name, name, BAND_STRENGTH);
+}
+
+int
+main(int argc, char *argv[])
+{
+    StereoBandSettings settings = stereo_band_settings_default;
+    const char *pattern_name = NULL;
+    double strength = BAND_STRENGTH;
+    int format = STEREO_FORMAT_PNG, inverted = 0, *workers = NULL;
+    unsigned int worker_count = 0;
+    long local = 0;
+    int c, result, i;
+    StereoPattern *pattern;
+    StereoImage *image;
+    ZBuffer *buffer;
+    StereoRowWriter *writer;
+    FILE *out;
+
+    while ((c = getopt(argc, argv, "l:p:s:if:b:n:w:h")) != -1) {
+        switch (c) {
+        case 'l':
+            return band_worker_main(argv[0], optarg);
+
+        case 'p':
+            pattern_name = optarg;
+            break;
+
+        case 's':
+            strength = atof(optarg);
+            break;
+
+        case 'i':
+            inverted = 1;
+            break;
+
+        case 'f':
+            if (!strcmp(optarg, "png")) {
+                format = STEREO_FORMAT_PNG;
+            }
+            else if (!strcmp(optarg, "pnm") || !strcmp(optarg, "pam")) {
+                format = STEREO_FORMAT_PNM;
+            }
+            else if (!strcmp(optarg, "qoi")) {
+                format = STEREO_FORMAT_QOI;
+            }
+            else {
+                fprintf(stderr, "%s: unknown format %s\n", argv[0], optarg);
+                return 2;
+            }
+            break;
+
+        case 'b':
+            settings.band_height = atoi(optarg);
+            break;
+
+        case 'n':
+            local = atol(optarg);
+            break;
+
+        case 'w':
+            workers = realloc(workers,
+                (worker_count + 1) * sizeof(*workers));
+            workers[worker_count] = stereo_band_connect(optarg);
+            if (workers[worker_count] < 0) {
+                fprintf(stderr, "%s: cannot connect to %s: %s\n", argv[0],
+                    optarg, strerror(errno));
+                return 1;
+            }
+            worker_count++;
+            break;
+
+        default:
+            band_usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (!pattern_name || argc - optind != 2
+            || (!worker_count && local < 1)) {
+        band_usage(argv[0]);
+        return 2;
+    }
+
+    /* Local workers are forked before the stereo image starts its threads */
+    for (i = 0; i < local; i++) {
+        workers = realloc(workers, (worker_count + 1) * sizeof(*workers));
+        workers[worker_count] = band_spawn();
+        if (workers[worker_count] < 0) {
+            fprintf(stderr, "%s: cannot start a worker: %s\n", argv[0],
+                strerror(errno));
+            return 1;
+        }
+        worker_count++;
+    }
+
+    pattern = stereo_pattern_create_from_file(pattern_name);
+    if (!pattern) {
+        fprintf(stderr, "%s: cannot read the pattern %s\n", argv[0],
+            pattern_name);
+        return 1;
+    }
+    buffer = stereo_zbuffer_create_from_file(argv[optind]);
+    if (!buffer) {
+        fprintf(stderr, "%s: cannot read the depth map %s\n", argv[0],
+            argv[optind]);
+        return 1;
+    }
+
+    /* The bands are written as they arrive, so the image of the stereo image
+       only needs a single row */
+    image = stereo_image_create(buffer->width, 1, pattern, strength,
+        inverted);
+
+    out = fopen(argv[optind + 1], "wb");
+    writer = out ? stereo_row_writer_open(out, format, buffer->width,
+        buffer->height, 4, 8) : NULL;
+    if (!writer) {
+        fprintf(stderr, "%s: cannot write %s\n", argv[0], argv[optind + 1]);
+        return 1;
+    }
+
+    result = stereo_band_render(image, buffer, 0, workers, worker_count,
+        &settings, (StereoBandWrite)band_write, writer);
+    if (!result) {
+        fprintf(stderr, "%s: rendering failed: %s\n", argv[0],
+            strerror(errno));
+    }
+    result = stereo_row_writer_close(writer) && result;
+    result = !fclose(out) && result;
+
+    /* Closing the connections ends the local workers */
+    for (i = 0; i < (int)worker_count; i++) {
+        close(workers[i]);
+    }
+    while (local-- > 0) {
+        wait(NULL);
+    }
+    free(workers);
+    stereo_zbuffer_free(buffer);
+    stereo_image_free(image);
+
+    return result ? 0 : 1;
+}
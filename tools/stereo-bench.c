@@ -0,0 +1,757 @@
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "../effect.h"
+#include "../stereo.h"
+#include "../tune.h"
+
+#include "../private/pixel.h"
+#include "../private/sin.h"
+
+/**
+ * The default minimum time in seconds spent measuring every case.
+ */
+#define BENCH_SECONDS 0.25
+
+/**
+ * The minimum number of measured runs of every case.
+ */
+#define BENCH_REPEATS 3
+
+/**
+ * The number of kernel calls in every run of a kernel benchmark.
+ */
+#define BENCH_KERNEL_CALLS 65536
+
+/**
+ * The settings of a benchmark run.
+ */
+typedef struct {
+    /** Whether to print JSON lines instead of tab separated values */
+    int json;
+
+    /** Whether to measure all combinations of the parameters of
+        stereo_image_apply instead of varying one at a time */
+    int all;
+
+    /** The minimum time in seconds spent measuring every case */
+    double seconds;
+
+    /** Only cases whose group or name contains this string are measured, or
+        NULL to measure all cases */
+    const char *filter;
+
+    /** The number of processors */
+    unsigned int cpus;
+} Bench;
+
+/**
+ * A function that runs a benchmark case once.
+ */
+typedef void (*BenchRun)(void *context);
+
+/**
+ * The state of the pseudo random number generator; a fixed generator is used
+ * so that all runs measure the same data.
+ */
+static unsigned int bench_seed = 1;
+
+/**
+ * Returns a pseudo random number between 0 and 255.
+ */
+static unsigned int
+bench_random(void)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+
+    return (bench_seed >> 16) & 0xFF;
+}
+
+/**
+ * Returns the current time in nanoseconds.
+ */
+static long long
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Returns whether a case is selected by the filter.
+ */
+static int
+bench_selected(Bench *bench, const char *group, const char *name)
+{
+    return !bench->filter || strstr(group, bench->filter)
+        || strstr(name, bench->filter);
+}
+
+/**
+ * Measures a case and prints the result.
+ *
+ * The case is run once to warm up, and then until both BENCH_REPEATS runs and
+ * the configured time have passed. The fastest run determines the reported
+ * rate, since it is least disturbed by other processes; the mean is reported
+ * as well.
+ *
+ * @param group
+ *     The group of the case.
+ * @param name
+ *     The name of the case.
+ * @param parameters
+ *     The parameters of the case as space separated key=value pairs.
+ * @param pixels
+ *     The number of pixels, or kernel calls, processed by every run.
+ * @param run
+ *     The function that runs the case.
+ * @param context
+ *     The context passed to run.
+ */
+static void
+bench_measure(Bench *bench, const char *group, const char *name,
+    const char *parameters, unsigned long long pixels, BenchRun run,
+    void *context)
+{
+    long long best = LLONG_MAX, total = 0, start;
+    unsigned int iterations = 0;
+    double ns, mean;
+
+    run(context);
+
+    start = bench_now();
+    do {
+        long long before = bench_now(), elapsed;
+
+        run(context);
+        elapsed = bench_now() - before;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+        total += elapsed;
+        iterations++;
+    } while (iterations < BENCH_REPEATS
+        || bench_now() - start < (long long)(bench->seconds * 1e9));
+
+    ns = (double)best / pixels;
+    mean = (double)total / iterations / pixels;
+
+    if (bench->json) {
+        printf("{\"group\": \"%s\", \"name\": \"%s\", \"parameters\": \"%s\", "
+            "\"pixels\": %llu, \"iterations\": %u, \"mpixels_per_s\": %.3f, "
+            "\"ns_per_pixel\": %.4f, \"mean_ns_per_pixel\": %.4f}\n",
+            group, name, parameters, pixels, iterations, 1000.0 / ns, ns,
+            mean);
+    }
+    else {
+        printf("%s\t%s\t%s\t%llu\t%u\t%.3f\t%.4f\t%.4f\n", group, name,
+            parameters, pixels, iterations, 1000.0 / ns, ns, mean);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Creates a pattern of random pixels.
+ */
+static StereoPattern*
+bench_pattern(unsigned int width, unsigned int height)
+{
+    StereoPattern *result = stereo_pattern_create(width, height);
+    unsigned int i;
+
+    for (i = 0; i < width * height; i++) {
+        result->pixels[i].r = bench_random();
+        result->pixels[i].g = bench_random();
+        result->pixels[i].b = bench_random();
+    }
+
+    return result;
+}
+
+/**
+ * The depth distributions.
+ */
+enum {
+    /** All samples are the same */
+    DEPTH_FLAT = 0,
+
+    /** All samples are random */
+    DEPTH_NOISE,
+
+    /** A smooth background with raised shapes, like most depth maps */
+    DEPTH_TYPICAL,
+
+    DEPTH_COUNT
+};
+
+static const char *depth_names[DEPTH_COUNT] = {"flat", "noise", "typical"};
+
+/**
+ * Fills all channels of an 8 bit z-buffer with a depth distribution.
+ */
+static void
+bench_depth(ZBuffer *buffer, int depth)
+{
+    unsigned int x, y, c;
+
+    for (y = 0; y < buffer->height; y++) {
+        unsigned char *z = stereo_zbuffer_row_get(buffer, y);
+
+        for (x = 0; x < buffer->width; x++) {
+            unsigned int value;
+
+            switch (depth) {
+            case DEPTH_FLAT:
+                value = 128;
+                break;
+
+            case DEPTH_NOISE:
+                value = bench_random();
+                break;
+
+            default: {
+                /* A gradient with a disc in the middle and a box on the
+                   left */
+                int dx = (int)x - (int)buffer->width / 2;
+                int dy = (int)y - (int)buffer->height / 2;
+                int r = (int)buffer->height / 4;
+
+                value = 32 + 64 * y / buffer->height;
+                if (dx * dx + dy * dy < r * r) {
+                    value = 224 - 96 * (dx * dx + dy * dy) / (r * r);
+                }
+                else if (x > buffer->width / 8 && x < buffer->width / 4
+                        && y > buffer->height / 4
+                        && y < buffer->height * 3 / 4) {
+                    value = 160;
+                }
+                break;
+            }
+            }
+
+            for (c = 0; c < buffer->channels; c++) {
+                *z++ = value;
+            }
+        }
+    }
+}
+
+/**
+ * A case of stereo_image_apply.
+ */
+typedef struct {
+    StereoImage *image;
+    ZBuffer *buffer;
+} ApplyCase;
+
+/**
+ * See BenchRun.
+ */
+static void
+bench_apply_run(ApplyCase *c)
+{
+    stereo_image_apply(c->image, c->buffer, 0);
+}
+
+/**
+ * Measures stereo_image_apply.
+ *
+ * Unless all combinations are requested, every parameter is varied on its
+ * own while the others keep their baseline values: 1920x1080, a pattern width
+ * of 128, the typical depth distribution, a single channel and all
+ * processors.
+ */
+static void
+bench_apply(Bench *bench)
+{
+    static const unsigned int sizes[][2] = {
+        {640, 480}, {1920, 1080}, {3840, 2160}};
+    static const unsigned int pattern_widths[] = {64, 128, 256};
+    static const unsigned int channels[] = {1, 3};
+    unsigned int threads[32], thread_count = 0;
+    unsigned int s, p, d, c, t;
+
+    if (!bench_selected(bench, "apply", "stereo_image_apply")) {
+        return;
+    }
+
+    /* Powers of two up to the number of processors */
+    for (t = 1; t < bench->cpus && thread_count < 31; t *= 2) {
+        threads[thread_count++] = t;
+    }
+    threads[thread_count++] = bench->cpus;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    for (p = 0; p < sizeof(pattern_widths) / sizeof(pattern_widths[0]); p++)
+    for (d = 0; d < DEPTH_COUNT; d++)
+    for (c = 0; c < sizeof(channels) / sizeof(channels[0]); c++)
+    for (t = 0; t < thread_count; t++) {
+        unsigned int width = sizes[s][0], height = sizes[s][1];
+        StereoTuning tuning = {
+            width, pattern_widths[p], threads[t], 0, 0, STEREO_ISA_AUTO};
+        char parameters[256];
+        ApplyCase a;
+
+        if (!bench->all && (s != 1) + (p != 1) + (d != DEPTH_TYPICAL)
+                + (c != 0) + (t != thread_count - 1) > 1) {
+            continue;
+        }
+
+        /* The number of workers is limited through the profile */
+        stereo_tuning_clear();
+        stereo_tuning_set(&tuning);
+
+        a.buffer = stereo_zbuffer_create(width, height, channels[c]);
+        bench_depth(a.buffer, d);
+        a.image = stereo_image_create(width, height,
+            bench_pattern(pattern_widths[p], pattern_widths[p]), 4.0, 0);
+
+        snprintf(parameters, sizeof(parameters),
+            "width=%u height=%u pattern=%u depth=%s channels=%u threads=%u",
+            width, height, pattern_widths[p], depth_names[d], channels[c],
+            threads[t]);
+        bench_measure(bench, "apply", "stereo_image_apply", parameters,
+            (unsigned long long)width * height, (BenchRun)bench_apply_run,
+            &a);
+
+        stereo_image_free(a.image);
+        stereo_zbuffer_free(a.buffer);
+    }
+
+    stereo_tuning_clear();
+}
+
+/**
+ * The dimension of the patterns of the effect benchmarks.
+ */
+#define BENCH_EFFECT_SIZE 512
+
+/**
+ * See BenchRun.
+ */
+static void
+bench_effect_run(StereoPatternEffect *effect)
+{
+    stereo_pattern_effect_apply(effect);
+}
+
+/**
+ * Creates a luminance or a wave effect with uniform strengths.
+ */
+static StereoPatternEffect*
+bench_effect_create(StereoPattern *target, int wave, unsigned int waves)
+{
+    double strengths[64];
+    unsigned int i;
+
+    for (i = 0; i < 2 * waves; i++) {
+        strengths[i] = wave ? 2.0 : 0.5 / waves;
+    }
+
+    if (wave) {
+        return stereo_pattern_effect_wave(target, waves, strengths,
+            bench_pattern(target->width, target->height));
+    }
+    else {
+        return stereo_pattern_effect_luminance(target, waves, strengths,
+            PP_COLORS);
+    }
+}
+
+/**
+ * Measures the effects.
+ */
+static void
+bench_effects(Bench *bench)
+{
+    static const unsigned int wave_counts[] = {1, 4, 16};
+    static const char *names[] = {"luminance", "wave", "chain", "cache"};
+    unsigned long long pixels = BENCH_EFFECT_SIZE * BENCH_EFFECT_SIZE;
+    unsigned int i, w;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    for (w = 0; w < sizeof(wave_counts) / sizeof(wave_counts[0]); w++) {
+        unsigned int waves = wave_counts[w];
+        StereoPattern *target;
+        StereoPatternEffect *effect;
+        char parameters[256];
+
+        if (!bench_selected(bench, "effect", names[i])) {
+            continue;
+        }
+
+        target = bench_pattern(BENCH_EFFECT_SIZE, BENCH_EFFECT_SIZE);
+        switch (i) {
+        case 0:
+        case 1:
+            effect = bench_effect_create(target, i == 1, waves);
+            break;
+
+        case 2: {
+            /* A luminance wave over a distorted copy */
+            StereoPatternEffect *effects[2];
+
+            effects[0] = bench_effect_create(target, 1, waves);
+            effects[1] = bench_effect_create(target, 0, waves);
+            effect = stereo_pattern_effect_chain(target, 2, effects);
+            break;
+        }
+
+        default: {
+            /* Replaying a whole cached period of a wave effect */
+            unsigned int period = 32, frame;
+
+            effect = stereo_pattern_effect_cache(target,
+                bench_effect_create(target, 1, waves), period,
+                (size_t)period * pixels * sizeof(PatternPixel), 0);
+            for (frame = 0; frame < period; frame++) {
+                stereo_pattern_effect_apply(effect);
+            }
+            break;
+        }
+        }
+
+        snprintf(parameters, sizeof(parameters), "size=%u waves=%u",
+            BENCH_EFFECT_SIZE, waves);
+        bench_measure(bench, "effect", names[i], parameters, pixels,
+            (BenchRun)bench_effect_run, effect);
+
+        stereo_pattern_effect_free(effect);
+        stereo_pattern_free(target);
+    }
+}
+
+/**
+ * A case of the PNG benchmarks.
+ */
+typedef struct {
+    /** The image to save */
+    StereoPattern *image;
+
+    /** The profile to save with */
+    const StereoPNGProfile *profile;
+
+    /** The encoded image */
+    char *data;
+    size_t size;
+} PNGCase;
+
+/**
+ * See BenchRun; saves an image to memory.
+ */
+static void
+bench_png_save_run(PNGCase *c)
+{
+    char *data;
+    size_t size;
+    FILE *out = open_memstream(&data, &size);
+
+    stereo_pattern_save_to_png_with_profile(c->image, out, c->profile);
+    fclose(out);
+    free(data);
+}
+
+/**
+ * See BenchRun; loads a pattern from memory.
+ */
+static void
+bench_png_load_run(PNGCase *c)
+{
+    FILE *in = fmemopen(c->data, c->size, "rb");
+
+    stereo_pattern_free(stereo_pattern_create_from_png(in));
+    fclose(in);
+}
+
+/**
+ * See BenchRun; loads a z-buffer from memory.
+ */
+static void
+bench_png_zbuffer_run(PNGCase *c)
+{
+    FILE *in = fmemopen(c->data, c->size, "rb");
+
+    stereo_zbuffer_free(stereo_zbuffer_create_from_png(in));
+    fclose(in);
+}
+
+/**
+ * Measures saving and loading PNG files.
+ *
+ * The image is a stereogram rendered from the typical depth distribution,
+ * which compresses like real output.
+ */
+static void
+bench_png(Bench *bench)
+{
+    static const char *names[] = {"fast", "default", "small"};
+    const StereoPNGProfile *profiles[] = {
+        &stereo_png_profile_fast, &stereo_png_profile_default,
+        &stereo_png_profile_small};
+    unsigned int width = 1920, height = 1080, i;
+    unsigned long long pixels = (unsigned long long)width * height;
+    char parameters[256];
+    StereoImage *image;
+    ZBuffer *buffer;
+    PNGCase c;
+    FILE *out;
+
+    if (!bench_selected(bench, "png", "save") && !bench_selected(bench, "png",
+            "load")) {
+        return;
+    }
+
+    buffer = stereo_zbuffer_create(width, height, 1);
+    bench_depth(buffer, DEPTH_TYPICAL);
+    image = stereo_image_create(width, height, bench_pattern(128, 128), 4.0,
+        0);
+    stereo_image_apply(image, buffer, 0);
+    c.image = image->image;
+
+    for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "save-%s", names[i]);
+        if (!bench_selected(bench, "png", name)) {
+            continue;
+        }
+        c.profile = profiles[i];
+        snprintf(parameters, sizeof(parameters), "width=%u height=%u",
+            width, height);
+        bench_measure(bench, "png", name, parameters, pixels,
+            (BenchRun)bench_png_save_run, &c);
+    }
+
+    out = open_memstream(&c.data, &c.size);
+    stereo_pattern_save_to_png(c.image, out);
+    fclose(out);
+    snprintf(parameters, sizeof(parameters), "width=%u height=%u bytes=%lu",
+        width, height, (unsigned long)c.size);
+    if (bench_selected(bench, "png", "load-pattern")) {
+        bench_measure(bench, "png", "load-pattern", parameters, pixels,
+            (BenchRun)bench_png_load_run, &c);
+    }
+    if (bench_selected(bench, "png", "load-zbuffer")) {
+        bench_measure(bench, "png", "load-zbuffer", parameters, pixels,
+            (BenchRun)bench_png_zbuffer_run, &c);
+    }
+    free(c.data);
+
+    stereo_image_free(image);
+    stereo_zbuffer_free(buffer);
+}
+
+/**
+ * The data of the kernel benchmarks.
+ */
+typedef struct {
+    /** Two rows of a pattern and the destination row */
+    PatternPixel *row1, *row2, *destination;
+
+    /** The width of the pattern rows */
+    int width;
+
+    /** The sine table and the phase evaluator */
+    SinTable *sin_table;
+    SinPhase sin_phase;
+
+    /** The sum of the sines, which keeps them from being optimised away */
+    volatile int sum;
+} KernelCase;
+
+/**
+ * See BenchRun.
+ */
+static void
+bench_blend2_run(KernelCase *c)
+{
+    int i;
+
+    for (i = 0; i < BENCH_KERNEL_CALLS; i++) {
+        blend2(&c->destination[i & 1023], c->row1, mkfix(i) + i * 37,
+            c->width);
+    }
+}
+
+/**
+ * See BenchRun.
+ */
+static void
+bench_blend4_run(KernelCase *c)
+{
+    int i;
+
+    for (i = 0; i < BENCH_KERNEL_CALLS; i++) {
+        blend4(&c->destination[i & 1023], c->row1, c->row2,
+            mkfix(i) + i * 37, i * 53, c->width);
+    }
+}
+
+/**
+ * See BenchRun.
+ */
+static void
+bench_nearest_run(KernelCase *c)
+{
+    int i;
+
+    for (i = 0; i < BENCH_KERNEL_CALLS; i++) {
+        nearest(&c->destination[i & 1023], c->row1, mkfix(i) + i * 37,
+            c->width);
+    }
+}
+
+/**
+ * See BenchRun.
+ */
+static void
+bench_ssin_run(KernelCase *c)
+{
+    int i, sum = 0;
+
+    for (i = 0; i < BENCH_KERNEL_CALLS; i++) {
+        sum += ssin(c->sin_table, i * 7);
+    }
+    c->sum = sum;
+}
+
+/**
+ * See BenchRun.
+ */
+static void
+bench_sin_phase_run(KernelCase *c)
+{
+    int i, sum = 0;
+
+    for (i = 0; i < BENCH_KERNEL_CALLS; i++) {
+        sum += sin_phase(&c->sin_phase, i * 7);
+    }
+    c->sum = sum;
+}
+
+/**
+ * Measures the pixel and sine kernels.
+ */
+static void
+bench_kernels(Bench *bench)
+{
+    static const struct {
+        const char *name;
+        BenchRun run;
+    } kernels[] = {
+        {"blend2", (BenchRun)bench_blend2_run},
+        {"blend4", (BenchRun)bench_blend4_run},
+        {"nearest", (BenchRun)bench_nearest_run},
+        {"ssin", (BenchRun)bench_ssin_run},
+        {"sin_phase", (BenchRun)bench_sin_phase_run}};
+    StereoPattern *pattern = bench_pattern(128, 2);
+    KernelCase c;
+    unsigned int i;
+
+    c.row1 = stereo_pattern_row_get(pattern, 0);
+    c.row2 = stereo_pattern_row_get(pattern, 1);
+    c.destination = malloc(1024 * sizeof(PatternPixel));
+    c.width = pattern->width;
+    c.sin_table = sin_table_acquire(1000);
+    sin_phase_initialize(&c.sin_phase, 1000);
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (bench_selected(bench, "kernel", kernels[i].name)) {
+            bench_measure(bench, "kernel", kernels[i].name, "calls=65536",
+                BENCH_KERNEL_CALLS, kernels[i].run, &c);
+        }
+    }
+
+    sin_phase_finalize(&c.sin_phase);
+    sin_table_release(c.sin_table);
+    free(c.destination);
+    stereo_pattern_free(pattern);
+}
+
+/**
+ * Prints the usage.
+ */
+static void
+bench_usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-j] [-a] [-t SECONDS] [-g FILTER]\n"
+        "\n"
+        "Measures the rendering kernels, the effects and PNG input and output,\n"
+        "and prints one line per case with the rate in Mpixel/s and the time\n"
+        "in ns/pixel of the fastest run, and the mean time in ns/pixel.\n"
+        "\n"
+        "  -j          print JSON lines instead of tab separated values\n"
+        "  -a          measure all combinations of the parameters of\n"
+        "              stereo_image_apply instead of one at a time\n"
+        "  -t SECONDS  the minimum time spent on every case (default %.2f)\n"
+        "  -g FILTER   only measure cases whose group or name contains\n"
+        "              FILTER; the groups are apply, effect, png and kernel\n",
+        name, BENCH_SECONDS);
+}
+
+int
+main(int argc, char *argv[])
+{
+    Bench bench = {0, 0, BENCH_SECONDS, NULL, 1};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+
+    while ((c = getopt(argc, argv, "jat:g:h")) != -1) {
+        switch (c) {
+        case 'j':
+            bench.json = 1;
+            break;
+
+        case 'a':
+            bench.all = 1;
+            break;
+
+        case 't':
+            bench.seconds = atof(optarg);
+            break;
+
+        case 'g':
+            bench.filter = optarg;
+            break;
+
+        default:
+            bench_usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+    if (cpus > 1) {
+        bench.cpus = cpus;
+    }
+
+    /* The effects seed their waves with rand */
+    srand(1);
+
+    if (!bench.json) {
+        printf("# cpus=%u\n"
+            "group\tname\tparameters\tpixels\titerations\tmpixels_per_s\t"
+            "ns_per_pixel\tmean_ns_per_pixel\n", bench.cpus);
+    }
+
+    bench_apply(&bench);
+    bench_effects(&bench);
+    bench_png(&bench);
+    bench_kernels(&bench);
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "../daemon.h"
+#include "../stream.h"
+
+/**
+ * The daemon stopped by the signal handler.
+ */
+static StereoDaemon *daemon_running;
+
+/**
+ * Stops the daemon upon SIGINT and SIGTERM.
+ */
+static void
+daemon_signal(int signal)
+{
+    stereo_daemon_stop(daemon_running);
+}
+
+/**
+ * Loads a pattern given as NAME=FILE and adds it to the daemon.
+ *
+ * @param wave
+ *     The strength of the wave effect to add to the pattern, or 0.0 to add no
+ *     effect.
+ * @return non-zero upon success
+ */
+static int
+daemon_load(StereoDaemon *daemon, const char *argument, double wave)
+{
+    const char *separator = strchr(argument, '=');
+    StereoPatternEffect *effect = NULL;
+    StereoPattern *pattern;
+    char *name;
+    int result;
+
+    if (!separator || separator == argument) {
+        fprintf(stderr, "invalid pattern %s; use NAME=FILE\n", argument);
+        return 0;
+    }
+
+    pattern = stereo_pattern_create_from_file(separator + 1);
+    if (!pattern) {
+        fprintf(stderr, "cannot read the pattern %s\n", separator + 1);
+        return 0;
+    }
+
+    /* The loaded pattern is the target of the effect, and sessions render
+       frames of the effect to their own copies of it; the pattern cache may
+       hold another reference to it */
+    if (wave > 0.0) {
+        double strengths[] = {wave, wave * 0.75, wave * 0.5, wave * 0.375};
+        StereoPattern *source;
+
+        pattern = stereo_pattern_unshare(pattern);
+        source = stereo_pattern_allocate(pattern->width, pattern->height);
+        memcpy(source->pixels, pattern->pixels,
+            (size_t)pattern->width * pattern->height * sizeof(PatternPixel));
+        effect = stereo_pattern_effect_wave(pattern, 2, strengths, source);
+    }
+
+    name = strndup(argument, separator - argument);
+    result = stereo_daemon_add_pattern(daemon, name, pattern, effect);
+    if (!result) {
+        fprintf(stderr, "cannot add the pattern %s: %s\n", name,
+            strerror(errno));
+        if (effect) {
+            stereo_pattern_effect_free(effect);
+        }
+        stereo_pattern_free(pattern);
+    }
+    free(name);
+
+    return result;
+}
+
+/**
+ * Prints the usage.
+ */
+static void
+daemon_usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-w STRENGTH] SOCKET NAME=PATTERN...\n"
+        "\n"
+        "Keeps the patterns loaded and renders stereograms for the clients\n"
+        "connecting to SOCKET; clients select patterns by NAME.\n"
+        "\n"
+        "  -w STRENGTH  add a wave effect of the given strength to every\n"
+        "               pattern; clients select the frame of the effect\n",
+        name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sigaction action;
+    StereoDaemon *daemon;
+    double wave = 0.0;
+    int c, i, result;
+
+    while ((c = getopt(argc, argv, "w:h")) != -1) {
+        switch (c) {
+        case 'w':
+            wave = atof(optarg);
+            break;
+
+        default:
+            daemon_usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (argc - optind < 2) {
+        daemon_usage(argv[0]);
+        return 2;
+    }
+
+    daemon = stereo_daemon_create(argv[optind]);
+    if (!daemon) {
+        fprintf(stderr, "%s: cannot listen on %s: %s\n", argv[0],
+            argv[optind], strerror(errno));
+        return 1;
+    }
+    for (i = optind + 1; i < argc; i++) {
+        if (!daemon_load(daemon, argv[i], wave)) {
+            stereo_daemon_free(daemon);
+            return 1;
+        }
+    }
+
+    daemon_running = daemon;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = daemon_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    result = stereo_daemon_run(daemon);
+    stereo_daemon_free(daemon);
+
+    return result ? 0 : 1;
+}
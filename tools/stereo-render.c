@@ -0,0 +1,833 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../stereo.h"
+#include "../stream.h"
+
+/**
+ * The default strength of the effect.
+ */
+#define RENDER_STRENGTH 4.0
+
+/**
+ * The suffix appended to the stem of derived output file names.
+ */
+#define RENDER_SUFFIX "-stereo"
+
+/**
+ * The stages of the pipeline.
+ */
+enum {
+    STAGE_DECODE = 0,
+    STAGE_RENDER,
+    STAGE_ENCODE,
+    STAGE_COUNT
+};
+
+static const char *stage_names[STAGE_COUNT] = {"decode", "render", "encode"};
+
+/**
+ * A rendering job.
+ */
+typedef struct {
+    /** The file names of the depth map, the pattern and the output */
+    char *depth, *pattern, *output;
+
+    /** The strength of the effect */
+    double strength;
+
+    /** The decoded depth map */
+    ZBuffer *zbuffer;
+
+    /** The decoded pattern; this is shared with other jobs */
+    StereoPattern *texture;
+
+    /** The rendered image */
+    StereoPattern *result;
+
+    /** The error message if the job failed, or NULL */
+    const char *error;
+} Job;
+
+/**
+ * A bounded queue of jobs between pipeline stages.
+ */
+typedef struct {
+    /** The jobs */
+    Job **jobs;
+
+    /** The capacity, the index of the first job and the number of jobs */
+    unsigned int capacity, first, count;
+
+    /** The number of producers that have not yet finished */
+    unsigned int producers;
+
+    /** The lock and the condition signalled when the queue changes */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Queue;
+
+/**
+ * A pattern shared by all jobs using the same file.
+ *
+ * Every job holds a reference, and so does the renderer, so that a pattern is
+ * decoded only once.
+ */
+typedef struct SharedPattern SharedPattern;
+struct SharedPattern {
+    /** The file name */
+    char *name;
+
+    /** The pattern, or NULL if it could not be decoded */
+    StereoPattern *pattern;
+
+    /** The next shared pattern */
+    SharedPattern *next;
+};
+
+/**
+ * Statistics of a pipeline stage.
+ */
+typedef struct {
+    /** The number of files processed */
+    unsigned int files;
+
+    /** The number of pixels processed */
+    unsigned long long pixels;
+
+    /** The time spent, summed over all threads, in nanoseconds */
+    long long busy;
+} Stage;
+
+/**
+ * The state of the renderer.
+ */
+typedef struct {
+    /** The jobs */
+    Job *jobs;
+    unsigned int job_count, job_capacity;
+
+    /** The next job to decode */
+    unsigned int next;
+
+    /** The output format; one of the STEREO_FORMAT_* values */
+    int format;
+
+    /** Whether depth values are inverted */
+    int inverted;
+
+    /** The queues between the stages */
+    Queue decoded, rendered;
+
+    /** The shared patterns and their lock */
+    SharedPattern *patterns;
+    pthread_mutex_t patterns_lock;
+
+    /** The statistics and their lock */
+    Stage stages[STAGE_COUNT];
+    pthread_mutex_t stages_lock;
+
+    /** The number of failed jobs */
+    unsigned int failed;
+} Renderer;
+
+/**
+ * Returns the current time in nanoseconds.
+ */
+static long long
+render_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Adds a measurement to the statistics of a stage.
+ */
+static void
+render_measure(Renderer *renderer, int stage, unsigned long long pixels,
+    long long start)
+{
+    long long elapsed = render_now() - start;
+
+    pthread_mutex_lock(&renderer->stages_lock);
+    renderer->stages[stage].files++;
+    renderer->stages[stage].pixels += pixels;
+    renderer->stages[stage].busy += elapsed;
+    pthread_mutex_unlock(&renderer->stages_lock);
+}
+
+static void
+queue_initialize(Queue *queue, unsigned int capacity, unsigned int producers)
+{
+    queue->jobs = malloc(capacity * sizeof(*queue->jobs));
+    queue->capacity = capacity;
+    queue->first = 0;
+    queue->count = 0;
+    queue->producers = producers;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+}
+
+static void
+queue_finalize(Queue *queue)
+{
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->jobs);
+}
+
+/**
+ * Adds a job to a queue, waiting while it is full.
+ */
+static void
+queue_put(Queue *queue, Job *job)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    queue->jobs[(queue->first + queue->count++) % queue->capacity] = job;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Marks a producer of a queue as finished.
+ */
+static void
+queue_done(Queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->producers--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Takes a job from a queue, waiting while it is empty.
+ *
+ * @return a job, or NULL if the queue is empty and all producers are finished
+ */
+static Job*
+queue_get(Queue *queue)
+{
+    Job *result = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->count && queue->producers) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->count) {
+        result = queue->jobs[queue->first];
+        queue->first = (queue->first + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return result;
+}
+
+/**
+ * Returns a reference to a shared pattern, decoding it if it is not yet
+ * loaded.
+ *
+ * @return the pattern, or NULL if it cannot be decoded
+ */
+static StereoPattern*
+shared_pattern_get(Renderer *renderer, const char *name)
+{
+    SharedPattern *shared;
+
+    pthread_mutex_lock(&renderer->patterns_lock);
+
+    for (shared = renderer->patterns; shared; shared = shared->next) {
+        if (!strcmp(shared->name, name)) {
+            break;
+        }
+    }
+
+    /* Patterns are decoded with the lock held, so that every pattern is
+       decoded only once */
+    if (!shared) {
+        shared = malloc(sizeof(SharedPattern));
+        shared->name = strdup(name);
+        shared->pattern = stereo_pattern_create_from_file(name);
+        shared->next = renderer->patterns;
+        renderer->patterns = shared;
+    }
+
+    pthread_mutex_unlock(&renderer->patterns_lock);
+
+    return shared->pattern ? stereo_pattern_ref(shared->pattern) : NULL;
+}
+
+/**
+ * Frees all shared patterns.
+ */
+static void
+shared_patterns_free(Renderer *renderer)
+{
+    while (renderer->patterns) {
+        SharedPattern *shared = renderer->patterns;
+
+        renderer->patterns = shared->next;
+        if (shared->pattern) {
+            stereo_pattern_free(shared->pattern);
+        }
+        free(shared->name);
+        free(shared);
+    }
+}
+
+/**
+ * Decodes depth maps and patterns.
+ *
+ * This is the entry point of the decoder threads.
+ */
+static void*
+render_decoder(Renderer *renderer)
+{
+    for (;;) {
+        unsigned int i = __sync_fetch_and_add(&renderer->next, 1);
+        long long start = render_now();
+        Job *job;
+
+        if (i >= renderer->job_count) {
+            break;
+        }
+        job = &renderer->jobs[i];
+
+        job->zbuffer = stereo_zbuffer_create_from_file(job->depth);
+        if (!job->zbuffer) {
+            job->error = "cannot decode the depth map";
+        }
+        else {
+            job->texture = shared_pattern_get(renderer, job->pattern);
+            if (!job->texture) {
+                job->error = "cannot decode the pattern";
+            }
+            render_measure(renderer, STAGE_DECODE,
+                (unsigned long long)job->zbuffer->width
+                    * job->zbuffer->height, start);
+        }
+
+        queue_put(&renderer->decoded, job);
+    }
+
+    queue_done(&renderer->decoded);
+
+    return NULL;
+}
+
+/**
+ * Renders the decoded jobs.
+ *
+ * This runs on the main thread. The stereo image is reused as long as the
+ * dimensions do not change, and every rendered image is handed over to the
+ * encoders.
+ */
+static void
+render_renderer(Renderer *renderer)
+{
+    StereoImage *image = NULL;
+    Job *job;
+
+    while ((job = queue_get(&renderer->decoded))) {
+        ZBuffer *zbuffer = job->zbuffer;
+        long long start = render_now();
+
+        if (job->error) {
+            if (job->texture) {
+                stereo_pattern_free(job->texture);
+            }
+            queue_put(&renderer->rendered, job);
+            continue;
+        }
+
+        if (image && (image->image->width != zbuffer->width
+                || image->image->height != zbuffer->height)) {
+            stereo_image_free(image);
+            image = NULL;
+        }
+        if (!image) {
+            image = stereo_image_create_from_zbuffer(zbuffer, job->texture,
+                job->strength, renderer->inverted);
+        }
+        else {
+            stereo_pattern_free(image->pattern);
+            image->pattern = job->texture;
+            stereo_image_set_strength(image, job->strength,
+                renderer->inverted);
+        }
+        job->texture = NULL;
+
+        if (stereo_image_apply(image, zbuffer, 0)) {
+            job->result = image->image;
+            image->image = stereo_pattern_create(zbuffer->width,
+                zbuffer->height);
+        }
+        else {
+            job->error = "cannot render the image";
+        }
+
+        render_measure(renderer, STAGE_RENDER,
+            (unsigned long long)zbuffer->width * zbuffer->height, start);
+
+        stereo_zbuffer_free(zbuffer);
+        job->zbuffer = NULL;
+
+        queue_put(&renderer->rendered, job);
+    }
+
+    if (image) {
+        stereo_image_free(image);
+    }
+
+    queue_done(&renderer->rendered);
+}
+
+/**
+ * Encodes rendered images.
+ *
+ * This is the entry point of the encoder threads.
+ */
+static void*
+render_encoder(Renderer *renderer)
+{
+    Job *job;
+
+    while ((job = queue_get(&renderer->rendered))) {
+        long long start = render_now();
+
+        if (!job->error) {
+            if (stereo_pattern_save_file(job->result, job->output,
+                    renderer->format)) {
+                render_measure(renderer, STAGE_ENCODE,
+                    (unsigned long long)job->result->width
+                        * job->result->height, start);
+            }
+            else {
+                job->error = "cannot write the image";
+            }
+            stereo_pattern_free(job->result);
+            job->result = NULL;
+        }
+
+        if (job->error) {
+            if (job->zbuffer) {
+                stereo_zbuffer_free(job->zbuffer);
+                job->zbuffer = NULL;
+            }
+            fprintf(stderr, "%s: %s\n", job->depth, job->error);
+            __sync_fetch_and_add(&renderer->failed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the file name extension of a format.
+ */
+static const char*
+render_extension(int format)
+{
+    switch (format) {
+    case STEREO_FORMAT_PNM:
+        return ".pam";
+
+    case STEREO_FORMAT_QOI:
+        return ".qoi";
+
+    default:
+        return ".png";
+    }
+}
+
+/**
+ * Adds a job.
+ *
+ * @param output
+ *     The output file name, or NULL to derive it from the depth file name.
+ * @param directory
+ *     The directory of derived output file names, or NULL to use the
+ *     directory of the depth file.
+ */
+static void
+render_add(Renderer *renderer, const char *depth, const char *pattern,
+    double strength, const char *output, const char *directory)
+{
+    Job *job;
+
+    if (renderer->job_count == renderer->job_capacity) {
+        renderer->job_capacity = renderer->job_capacity
+            ? 2 * renderer->job_capacity : 64;
+        renderer->jobs = realloc(renderer->jobs,
+            renderer->job_capacity * sizeof(*renderer->jobs));
+    }
+    job = &renderer->jobs[renderer->job_count++];
+    memset(job, 0, sizeof(*job));
+
+    job->depth = strdup(depth);
+    job->pattern = strdup(pattern);
+    job->strength = strength;
+
+    if (output) {
+        job->output = strdup(output);
+    }
+    else {
+        const char *base = strrchr(depth, '/');
+        const char *stem, *dot;
+        size_t length;
+
+        base = base ? base + 1 : depth;
+        dot = strrchr(base, '.');
+
+        /* Without a directory, the output is written next to the depth map */
+        stem = directory ? base : depth;
+        length = (dot ? dot : base + strlen(base)) - stem;
+
+        job->output = malloc((directory ? strlen(directory) + 1 : 0)
+            + length + sizeof(RENDER_SUFFIX) + 8);
+        sprintf(job->output, "%s%s%.*s" RENDER_SUFFIX "%s",
+            directory ? directory : "", directory ? "/" : "", (int)length,
+            stem, render_extension(renderer->format));
+    }
+}
+
+static int
+render_compare(const void *a, const void *b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Adds a job for every image in a directory, in alphabetical order.
+ *
+ * Images whose stem ends in RENDER_SUFFIX are skipped, since they are the
+ * output of an earlier run.
+ *
+ * @return non-zero upon success and 0 if the directory cannot be read
+ */
+static int
+render_add_directory(Renderer *renderer, const char *path,
+    const char *pattern, double strength, const char *directory)
+{
+    static const char *extensions[] = {
+        ".png", ".pgm", ".ppm", ".pam", ".pnm", ".qoi"};
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    char **names = NULL;
+    unsigned int count = 0, capacity = 0, i, j;
+
+    if (!dir) {
+        return 0;
+    }
+
+    while ((entry = readdir(dir))) {
+        const char *dot = strrchr(entry->d_name, '.');
+
+        for (j = 0; dot && j < sizeof(extensions) / sizeof(*extensions);
+                j++) {
+            if (!strcasecmp(dot, extensions[j])) {
+                break;
+            }
+        }
+        if (!dot || j == sizeof(extensions) / sizeof(*extensions)) {
+            continue;
+        }
+        if ((size_t)(dot - entry->d_name) >= sizeof(RENDER_SUFFIX) - 1
+                && !strncmp(dot - (sizeof(RENDER_SUFFIX) - 1), RENDER_SUFFIX,
+                    sizeof(RENDER_SUFFIX) - 1)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            names = realloc(names, capacity * sizeof(*names));
+        }
+        names[count] = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        sprintf(names[count++], "%s/%s", path, entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(*names), render_compare);
+    for (i = 0; i < count; i++) {
+        render_add(renderer, names[i], pattern, strength, NULL, directory);
+        free(names[i]);
+    }
+    free(names);
+
+    return 1;
+}
+
+/**
+ * Adds the jobs of a manifest.
+ *
+ * Every line contains the depth map, the pattern, the strength and optionally
+ * the output file, separated by white space. A - uses the default pattern or
+ * strength, and lines starting with # are ignored.
+ *
+ * @return non-zero upon success and 0 if the manifest cannot be read or is
+ *     invalid
+ */
+static int
+render_add_manifest(Renderer *renderer, const char *filename,
+    const char *pattern, double strength, const char *directory)
+{
+    FILE *in = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    char line[4096];
+    unsigned int number = 0;
+    int result = 1;
+
+    if (!in) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        char *fields[4] = {NULL, NULL, NULL, NULL};
+        const char *job_pattern;
+        char *token;
+        int count = 0;
+
+        number++;
+        for (token = strtok(line, " \t\r\n"); token && count < 4;
+                token = strtok(NULL, " \t\r\n")) {
+            fields[count++] = token;
+        }
+        if (!count || fields[0][0] == '#') {
+            continue;
+        }
+
+        /* A - falls back to the default pattern, which may not be set */
+        job_pattern = count > 1 && strcmp(fields[1], "-") ? fields[1] : pattern;
+        if (!job_pattern) {
+            fprintf(stderr, "%s:%u: no pattern\n", filename, number);
+            result = 0;
+            continue;
+        }
+
+        render_add(renderer, fields[0], job_pattern,
+            count > 2 && strcmp(fields[2], "-") ? atof(fields[2]) : strength,
+            fields[3], directory);
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    return result;
+}
+
+/**
+ * Prints the throughput of every stage.
+ */
+static void
+render_report(Renderer *renderer, long long elapsed)
+{
+    int i;
+
+    for (i = 0; i < STAGE_COUNT; i++) {
+        Stage *stage = &renderer->stages[i];
+
+        fprintf(stderr, "%-8s %6u files %8.3f s busy %10.2f Mpixel/s\n",
+            stage_names[i], stage->files, stage->busy / 1e9,
+            stage->busy ? stage->pixels * 1e3 / stage->busy : 0.0);
+    }
+    fprintf(stderr, "%-8s %6u files %8.3f s wall %10.2f files/s\n", "total",
+        renderer->job_count - renderer->failed, elapsed / 1e9,
+        elapsed ? (renderer->job_count - renderer->failed) * 1e9 / elapsed
+            : 0.0);
+}
+
+static void
+render_usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [OPTION]... [DEPTH | DIRECTORY]...\n"
+        "Renders stereograms from depth maps in PNG, PNM or QOI format.\n"
+        "Output files are named after the depth maps with the suffix "
+        RENDER_SUFFIX ",\n"
+        "and images with that suffix in a DIRECTORY are skipped.\n"
+        "\n"
+        "  -p PATTERN   the pattern used for all jobs without one\n"
+        "  -s STRENGTH  the strength of the effect (default %.1f)\n"
+        "  -i           depth values are inverted; 255 is far away\n"
+        "  -m MANIFEST  read jobs from a manifest; every line contains\n"
+        "               DEPTH PATTERN STRENGTH [OUTPUT], and - uses the\n"
+        "               default; use - as MANIFEST to read standard input\n"
+        "  -o DIRECTORY write output files to DIRECTORY\n"
+        "  -f FORMAT    the output format: png, pnm or qoi (default png)\n"
+        "  -j THREADS   the number of decoder and of encoder threads\n"
+        "  -q           do not report the throughput\n",
+        name, RENDER_STRENGTH);
+}
+
+int
+main(int argc, char *argv[])
+{
+    Renderer renderer;
+    const char *pattern = NULL, *directory = NULL;
+    const char **manifests = NULL;
+    double strength = RENDER_STRENGTH;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int quiet = 0, manifest_count = 0, c, i;
+    pthread_t *decoders, *encoders;
+    long long start;
+
+    memset(&renderer, 0, sizeof(renderer));
+    renderer.format = STEREO_FORMAT_PNG;
+
+    while ((c = getopt(argc, argv, "p:s:im:o:f:j:qh")) != -1) {
+        switch (c) {
+        case 'p':
+            pattern = optarg;
+            break;
+
+        case 's':
+            strength = atof(optarg);
+            break;
+
+        case 'i':
+            renderer.inverted = 1;
+            break;
+
+        case 'm':
+            manifests = realloc(manifests,
+                (manifest_count + 1) * sizeof(*manifests));
+            manifests[manifest_count++] = optarg;
+            break;
+
+        case 'o':
+            directory = optarg;
+            break;
+
+        case 'f':
+            if (!strcmp(optarg, "png")) {
+                renderer.format = STEREO_FORMAT_PNG;
+            }
+            else if (!strcmp(optarg, "pnm") || !strcmp(optarg, "pam")) {
+                renderer.format = STEREO_FORMAT_PNM;
+            }
+            else if (!strcmp(optarg, "qoi")) {
+                renderer.format = STEREO_FORMAT_QOI;
+            }
+            else {
+                fprintf(stderr, "%s: unknown format %s\n", argv[0], optarg);
+                return 2;
+            }
+            break;
+
+        case 'j':
+            threads = atol(optarg);
+            break;
+
+        case 'q':
+            quiet = 1;
+            break;
+
+        default:
+            render_usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    /* Collect the jobs */
+    for (i = 0; i < manifest_count; i++) {
+        if (!render_add_manifest(&renderer, manifests[i], pattern, strength,
+                directory)) {
+            fprintf(stderr, "%s: cannot read the manifest %s\n", argv[0],
+                manifests[i]);
+            return 1;
+        }
+    }
+    free(manifests);
+    for (i = optind; i < argc; i++) {
+        struct stat st;
+
+        if (!pattern) {
+            fprintf(stderr, "%s: no pattern for %s\n", argv[0], argv[i]);
+            return 2;
+        }
+        if (!stat(argv[i], &st) && S_ISDIR(st.st_mode)) {
+            if (!render_add_directory(&renderer, argv[i], pattern, strength,
+                    directory)) {
+                fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[i]);
+                return 1;
+            }
+        }
+        else {
+            render_add(&renderer, argv[i], pattern, strength, NULL,
+                directory);
+        }
+    }
+    if (!renderer.job_count) {
+        render_usage(argv[0]);
+        return 2;
+    }
+    if (directory) {
+        mkdir(directory, 0777);
+    }
+
+    /* Decode and encode on thread pools while the main thread renders; the
+       queues bound the number of images in flight */
+    start = render_now();
+    queue_initialize(&renderer.decoded, 2 * threads, threads);
+    queue_initialize(&renderer.rendered, 2 * threads, 1);
+    pthread_mutex_init(&renderer.patterns_lock, NULL);
+    pthread_mutex_init(&renderer.stages_lock, NULL);
+
+    decoders = malloc(threads * sizeof(*decoders));
+    encoders = malloc(threads * sizeof(*encoders));
+    for (i = 0; i < threads; i++) {
+        pthread_create(&decoders[i], NULL, (void*(*)(void*))render_decoder,
+            &renderer);
+        pthread_create(&encoders[i], NULL, (void*(*)(void*))render_encoder,
+            &renderer);
+    }
+
+    render_renderer(&renderer);
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(decoders[i], NULL);
+        pthread_join(encoders[i], NULL);
+    }
+
+    if (!quiet) {
+        render_report(&renderer, render_now() - start);
+    }
+
+    free(decoders);
+    free(encoders);
+    shared_patterns_free(&renderer);
+    queue_finalize(&renderer.decoded);
+    queue_finalize(&renderer.rendered);
+    pthread_mutex_destroy(&renderer.patterns_lock);
+    pthread_mutex_destroy(&renderer.stages_lock);
+    for (i = 0; i < (int)renderer.job_count; i++) {
+        free(renderer.jobs[i].depth);
+        free(renderer.jobs[i].pattern);
+        free(renderer.jobs[i].output);
+    }
+    free(renderer.jobs);
+
+    return renderer.failed ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+#ifndef STEREO_TUNE_H
+#define STEREO_TUNE_H
+
+/**
+ * The maximum number of entries in a performance profile.
+ */
+#define STEREO_TUNING_MAX 32
+
+/**
+ * The name of the environment variable naming the profile that is loaded when
+ * the library is loaded.
+ */
+#define STEREO_TUNING_ENV "STEREO_PROFILE"
+
+/**
+ * Flags for stereo_tuning_autotune.
+ */
+enum {
+    /** Tune even if the profile already contains an entry for the size */
+    STEREO_TUNING_FORCE = 1 << 0
+};
+
+/**
+ * Return values of stereo_tuning_load.
+ */
+enum {
+    /** The profile was loaded */
+    STEREO_TUNING_OK = 0,
+
+    /** The profile does not exist or cannot be read */
+    STEREO_TUNING_MISSING,
+
+    /** The profile was created on different hardware and was not loaded */
+    STEREO_TUNING_HOST_CHANGED
+};
+
+/**
+ * Instruction set levels of kernels.
+ */
+enum {
+    /** Use the best level supported by the processor */
+    STEREO_ISA_AUTO = 0,
+
+    /** Use only portable C kernels */
+    STEREO_ISA_GENERIC,
+
+    /** Use AVX2 kernels where available */
+    STEREO_ISA_AVX2
+};
+
+/**
+ * Settings that control how work is split between threads and which kernels
+ * are used.
+ */
+typedef struct {
+    /** The image width for which these settings were measured */
+    unsigned int width;
+
+    /** The pattern width for which these settings were measured */
+    unsigned int pattern_width;
+
+    /** The maximum number of workers to use; 0 means one per processor */
+    unsigned int workers;
+
+    /** The number of rows handed out at once; 0 means adaptive */
+    unsigned int chunk_rows;
+
+    /** Calls touching fewer pixels than this run on the calling thread */
+    unsigned int inline_pixels;
+
+    /** The highest instruction set level kernels may use; this is one of the
+        STEREO_ISA_* values */
+    unsigned int isa;
+} StereoTuning;
+
+/**
+ * Returns the settings to use for an image.
+ *
+ * If no entry has been measured for the exact size, the entry with the closest
+ * image width is used, and if the profile is empty, the defaults are returned.
+ *
+ * @param width
+ *     The width of the image.
+ * @param pattern_width
+ *     The width of the pattern. Pass 0 if no pattern is involved.
+ * @return the settings to use; this is never NULL
+ */
+const StereoTuning*
+stereo_tuning_get(unsigned int width, unsigned int pattern_width);
+
+/**
+ * Adds settings to the current profile.
+ *
+ * Any previous entry for the same image and pattern width is replaced.
+ *
+ * @param tuning
+ *     The settings to add.
+ * @return non-zero upon success or 0 if the profile is full
+ */
+int
+stereo_tuning_set(const StereoTuning *tuning);
+
+/**
+ * Removes all entries from the current profile.
+ */
+void
+stereo_tuning_clear(void);
+
+/**
+ * Loads a profile file, replacing the current profile.
+ *
+ * A profile is bound to the hardware on which it was created; if the hardware
+ * has changed, the profile is not loaded.
+ *
+ * @param filename
+ *     The name of the profile file.
+ * @return STEREO_TUNING_OK upon success, or STEREO_TUNING_MISSING or
+ *     STEREO_TUNING_HOST_CHANGED
+ */
+int
+stereo_tuning_load(const char *filename);
+
+/**
+ * Saves the current profile.
+ *
+ * @param filename
+ *     The name of the profile file.
+ * @return non-zero upon success or 0 otherwise
+ */
+int
+stereo_tuning_save(const char *filename);
+
+/**
+ * Measures the best settings for a stereo image and adds them to the profile.
+ *
+ * This runs short calibration renders, and applies a wave effect to a pattern
+ * of the same size as the image to choose the instruction set level. This
+ * takes in the order of a second. Other threads must not render while this
+ * function is running.
+ *
+ * @param width
+ *     The width of the stereo image.
+ * @param height
+ *     The height of the stereo image. Only a limited number of rows are
+ *     rendered during calibration.
+ * @param pattern_width
+ *     The width of the pattern.
+ * @param filename
+ *     The profile file. It is loaded before tuning, unless it was created on
+ *     different hardware, and the updated profile is saved to it afterwards.
+ *     This may be NULL, in which case only the current profile is updated.
+ * @param flags
+ *     A combination of STEREO_TUNING_* flags.
+ * @return non-zero upon success or 0 otherwise
+ */
+int
+stereo_tuning_autotune(unsigned int width, unsigned int height,
+    unsigned int pattern_width, const char *filename, int flags);
+
+#endif
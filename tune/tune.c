@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../private/sched.h"
+
+#include "../effect.h"
+#include "../stereo.h"
+#include "../tune.h"
+
+/**
+ * The maximum number of rows rendered during calibration.
+ */
+#define TUNE_ROWS 256
+
+/**
+ * The number of times every measurement is repeated; the fastest run is used.
+ */
+#define TUNE_REPEATS 5
+
+/**
+ * The settings used when the profile has no entries.
+ */
+static const StereoTuning tuning_default = {
+    0, 0, 0, 0, 0, STEREO_ISA_AUTO
+};
+
+/**
+ * The entries of the current profile.
+ */
+static StereoTuning tuning_entries[STEREO_TUNING_MAX];
+
+/**
+ * The number of entries in tuning_entries.
+ */
+static unsigned int tuning_count;
+
+/**
+ * The settings being measured, or NULL if no calibration is running.
+ */
+static const StereoTuning *tuning_calibrating;
+
+/**
+ * Calculates a fingerprint of the hardware.
+ *
+ * The fingerprint changes if the number of processors changes, or if the model
+ * or feature flags of the processor change.
+ *
+ * @return a fingerprint
+ */
+static unsigned long long
+tuning_host(void)
+{
+    unsigned long long result = 14695981039346656037ULL;
+    FILE *in;
+    char line[4096];
+    int found = 0;
+
+    result ^= (unsigned long long)sysconf(_SC_NPROCESSORS_ONLN);
+    result *= 1099511628211ULL;
+
+    in = fopen("/proc/cpuinfo", "r");
+    if (!in) {
+        return result;
+    }
+
+    /* Hash the model name and the flags of the first processor */
+    while (found < 2 && fgets(line, sizeof(line), in)) {
+        char *c;
+
+        if (strncmp(line, "model name", 10) && strncmp(line, "flags", 5)) {
+            continue;
+        }
+
+        for (c = line; *c; c++) {
+            result ^= (unsigned char)*c;
+            result *= 1099511628211ULL;
+        }
+        found++;
+    }
+
+    fclose(in);
+
+    return result;
+}
+
+const StereoTuning*
+stereo_tuning_get(unsigned int width, unsigned int pattern_width)
+{
+    const StereoTuning *result = &tuning_default;
+    unsigned int best = (unsigned int)-1, best_pattern = (unsigned int)-1;
+    unsigned int i;
+
+    if (tuning_calibrating) {
+        return tuning_calibrating;
+    }
+
+    /* Find the entry with the closest width, and then the closest pattern
+       width */
+    for (i = 0; i < tuning_count; i++) {
+        const StereoTuning *t = &tuning_entries[i];
+        unsigned int d = t->width > width
+            ? t->width - width : width - t->width;
+        unsigned int dp = t->pattern_width > pattern_width
+            ? t->pattern_width - pattern_width
+            : pattern_width - t->pattern_width;
+
+        if (d < best || (d == best && dp < best_pattern)) {
+            result = t;
+            best = d;
+            best_pattern = dp;
+        }
+    }
+
+    return result;
+}
+
+int
+stereo_tuning_set(const StereoTuning *tuning)
+{
+    unsigned int i;
+
+    for (i = 0; i < tuning_count; i++) {
+        if (tuning_entries[i].width == tuning->width
+                && tuning_entries[i].pattern_width == tuning->pattern_width) {
+            break;
+        }
+    }
+
+    if (i == STEREO_TUNING_MAX) {
+        return 0;
+    }
+    if (i == tuning_count) {
+        tuning_count++;
+    }
+    tuning_entries[i] = *tuning;
+
+    return 1;
+}
+
+void
+stereo_tuning_clear(void)
+{
+    tuning_count = 0;
+}
+
+int
+stereo_tuning_load(const char *filename)
+{
+    FILE *in = fopen(filename, "r");
+    char line[256];
+    unsigned long long host;
+    StereoTuning entries[STEREO_TUNING_MAX];
+    unsigned int count = 0;
+
+    if (!in) {
+        return STEREO_TUNING_MISSING;
+    }
+
+    /* The first line identifies the hardware */
+    if (!fgets(line, sizeof(line), in)
+            || sscanf(line, "host %llx", &host) != 1) {
+        fclose(in);
+        return STEREO_TUNING_MISSING;
+    }
+    if (host != tuning_host()) {
+        fclose(in);
+        return STEREO_TUNING_HOST_CHANGED;
+    }
+
+    /* Read one entry per line; unknown lines are ignored, and the
+       instruction set level may be missing in old profiles */
+    while (count < STEREO_TUNING_MAX && fgets(line, sizeof(line), in)) {
+        StereoTuning *t = &entries[count];
+
+        t->isa = STEREO_ISA_AUTO;
+        if (sscanf(line, "entry %u %u %u %u %u %u", &t->width,
+                &t->pattern_width, &t->workers, &t->chunk_rows,
+                &t->inline_pixels, &t->isa) >= 5) {
+            count++;
+        }
+    }
+
+    fclose(in);
+
+    memcpy(tuning_entries, entries, count * sizeof(entries[0]));
+    tuning_count = count;
+
+    return STEREO_TUNING_OK;
+}
+
+int
+stereo_tuning_save(const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    unsigned int i;
+    int result;
+
+    if (!out) {
+        return 0;
+    }
+
+    fprintf(out, "host %llx\n", tuning_host());
+    fprintf(out,
+        "# width pattern_width workers chunk_rows inline_pixels isa\n");
+    for (i = 0; i < tuning_count; i++) {
+        const StereoTuning *t = &tuning_entries[i];
+
+        fprintf(out, "entry %u %u %u %u %u %u\n", t->width, t->pattern_width,
+            t->workers, t->chunk_rows, t->inline_pixels, t->isa);
+    }
+
+    result = !ferror(out);
+    result = !fclose(out) && result;
+
+    return result;
+}
+
+/**
+ * Measures the time it takes to render rows of an image with some settings.
+ *
+ * @param tuning
+ *     The settings to measure.
+ * @param image
+ *     The calibration image.
+ * @param zbuffer
+ *     The calibration z-buffer.
+ * @param rows
+ *     The number of rows to render.
+ * @return the fastest time in nanoseconds
+ */
+static long long
+tuning_measure(const StereoTuning *tuning, StereoImage *image,
+    ZBuffer *zbuffer, unsigned int rows)
+{
+    long long result = -1;
+    int i;
+
+    tuning_calibrating = tuning;
+
+    for (i = 0; i < TUNE_REPEATS; i++) {
+        long long t = sched_now();
+
+        stereo_image_apply_lines(image, zbuffer, 0, 0, rows);
+        t = sched_now() - t;
+        if (result < 0 || t < result) {
+            result = t;
+        }
+    }
+
+    tuning_calibrating = NULL;
+
+    return result;
+}
+
+/**
+ * Measures the time it takes to apply an effect with some settings.
+ *
+ * @param tuning
+ *     The settings to measure.
+ * @param effect
+ *     The effect to apply.
+ * @return the fastest time in nanoseconds
+ */
+static long long
+tuning_measure_effect(const StereoTuning *tuning, StereoPatternEffect *effect)
+{
+    long long result = -1;
+    int i;
+
+    tuning_calibrating = tuning;
+
+    for (i = 0; i < TUNE_REPEATS; i++) {
+        long long t = sched_now();
+
+        stereo_pattern_effect_apply(effect);
+        t = sched_now() - t;
+        if (result < 0 || t < result) {
+            result = t;
+        }
+    }
+
+    tuning_calibrating = NULL;
+
+    return result;
+}
+
+int
+stereo_tuning_autotune(unsigned int width, unsigned int height,
+    unsigned int pattern_width, const char *filename, int flags)
+{
+    static const unsigned int chunks[] = {0, 1, 4, 16, 64};
+    static double strengths[] = {4.0, 3.0, 2.0, 1.5};
+    StereoPatternEffect *effect;
+    unsigned int processors = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int rows = height < TUNE_ROWS ? height : TUNE_ROWS;
+    StereoTuning tuning, candidate;
+    StereoPattern *pattern;
+    StereoImage *image;
+    ZBuffer *zbuffer;
+    long long best, t;
+    unsigned int i, x, y;
+
+    if (!width || !rows || !pattern_width) {
+        return 0;
+    }
+
+    if (filename) {
+        stereo_tuning_load(filename);
+    }
+
+    /* Do not tune again unless asked to */
+    if (!(flags & STEREO_TUNING_FORCE)) {
+        const StereoTuning *current = stereo_tuning_get(width, pattern_width);
+
+        if (current->width == width && current->pattern_width == pattern_width
+                && current != &tuning_default) {
+            return 1;
+        }
+    }
+
+    /* Create a noisy pattern and a z-buffer with both flat areas and noise */
+    pattern = stereo_pattern_create(pattern_width, 64);
+    for (i = 0; i < pattern_width * 64; i++) {
+        pattern->pixels[i].r = rand();
+        pattern->pixels[i].g = rand();
+        pattern->pixels[i].b = rand();
+    }
+    zbuffer = stereo_zbuffer_create(width, rows, 1);
+    for (y = 0; y < rows; y++) {
+        unsigned char *z = stereo_zbuffer_row_get(zbuffer, y);
+
+        for (x = 0; x < width; x++) {
+            z[x] = ((x / 64 + y / 64) & 1) ? rand() : 128;
+        }
+    }
+    image = stereo_image_create(width, rows, pattern, 0.3, 0);
+
+    tuning.width = width;
+    tuning.pattern_width = pattern_width;
+    tuning.workers = 0;
+    tuning.chunk_rows = 0;
+    tuning.inline_pixels = 0;
+    tuning.isa = STEREO_ISA_AUTO;
+
+    /* Find the best number of workers */
+    best = tuning_measure(&tuning, image, zbuffer, rows);
+    candidate = tuning;
+    for (i = 1; i < processors; i *= 2) {
+        candidate.workers = i;
+        t = tuning_measure(&candidate, image, zbuffer, rows);
+        if (t < best) {
+            best = t;
+            tuning.workers = i;
+        }
+    }
+
+    /* Find the best chunk size */
+    candidate = tuning;
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        if (chunks[i] == tuning.chunk_rows) {
+            continue;
+        }
+        candidate.chunk_rows = chunks[i];
+        t = tuning_measure(&candidate, image, zbuffer, rows);
+        if (t < best) {
+            best = t;
+            tuning.chunk_rows = chunks[i];
+        }
+    }
+
+    /* Find the smallest number of rows for which running in parallel pays
+       off */
+    candidate = tuning;
+    tuning.inline_pixels = width * rows;
+    for (i = 1; i <= rows; i *= 2) {
+        long long parallel, serial;
+
+        candidate.inline_pixels = 0;
+        parallel = tuning_measure(&candidate, image, zbuffer, i);
+        candidate.inline_pixels = (unsigned int)-1;
+        serial = tuning_measure(&candidate, image, zbuffer, i);
+        if (parallel < serial) {
+            tuning.inline_pixels = width * i;
+            break;
+        }
+    }
+
+    /* Find the best instruction set level for the wave effect */
+    effect = stereo_pattern_effect_wave(image->image, 2, strengths,
+        stereo_pattern_create(pattern_width, 64));
+    candidate = tuning;
+    best = -1;
+    for (i = STEREO_ISA_GENERIC; i <= STEREO_ISA_AVX2; i++) {
+        candidate.isa = i;
+        t = tuning_measure_effect(&candidate, effect);
+        if (best < 0 || t < best) {
+            best = t;
+            tuning.isa = i;
+        }
+    }
+    stereo_pattern_effect_free(effect);
+
+    stereo_image_free(image);
+    stereo_zbuffer_free(zbuffer);
+
+    if (!stereo_tuning_set(&tuning)) {
+        return 0;
+    }
+
+    return filename ? stereo_tuning_save(filename) : 1;
+}
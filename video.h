@@ -0,0 +1,79 @@
+#ifndef STEREO_VIDEO_H
+#define STEREO_VIDEO_H
+
+#include "effect.h"
+#include "stereo.h"
+
+/**
+ * The video stream formats.
+ */
+enum {
+    /** Frames of raw samples without any header; depth frames are 8 or 16
+        bit grayscale in host byte order, and rendered frames are 8 bit RGBA */
+    STEREO_VIDEO_RAW = 0,
+
+    /** YUV4MPEG2; depth is read from the luma plane, which may be 8 or 16
+        bit, and rendered frames are written as 8 bit 4:4:4 */
+    STEREO_VIDEO_Y4M
+};
+
+/**
+ * Settings for stereo_video_render.
+ */
+typedef struct {
+    /** The format of the depth stream; one of the STEREO_VIDEO_* values */
+    int input;
+
+    /** The format of the rendered stream; one of the STEREO_VIDEO_* values */
+    int output;
+
+    /** The number of bits of every raw depth sample; this is 8 or 16, and is
+        ignored for Y4M, which declares its own depth */
+    unsigned int depth;
+
+    /** The number of frames buffered between reading and rendering and
+        between rendering and writing; this is at least 2 */
+    unsigned int ring;
+
+    /** The maximum number of frames to render, or 0 to render until the end
+        of the depth stream */
+    unsigned int frames;
+} StereoVideoSettings;
+
+/**
+ * The default settings: raw 8 bit depth in, raw RGBA out and a ring of 3
+ * frames.
+ */
+extern const StereoVideoSettings stereo_video_settings_default;
+
+/**
+ * Renders a stream of depth frames to a stream of stereograms.
+ *
+ * Reading, rendering and writing run on separate threads connected by rings
+ * of frames, so reading and writing overlap with rendering, and a stall of
+ * either file descriptor only stalls rendering once the ring is exhausted.
+ *
+ * The dimensions of the depth frames must be those of the stereo image.
+ *
+ * @param image
+ *     The stereo image to render with. Its image is replaced by one of the
+ *     frames of the output ring, and contains the last frame rendered when
+ *     this function returns.
+ * @param in
+ *     The file descriptor to read depth frames from.
+ * @param out
+ *     The file descriptor to write rendered frames to.
+ * @param settings
+ *     The settings, or NULL to use stereo_video_settings_default.
+ * @param effect
+ *     An effect to apply to the pattern for every frame with
+ *     stereo_image_apply_pipelined, or NULL. If this is set, the stereo image
+ *     must have a back pattern.
+ * @return the number of frames rendered, or -1 if a frame could not be read,
+ *     rendered or written
+ */
+long
+stereo_video_render(StereoImage *image, int in, int out,
+    const StereoVideoSettings *settings, StereoPatternEffect *effect);
+
+#endif
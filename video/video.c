@@ -0,0 +1,740 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "../video.h"
+
+/**
+ * The frame rate written to Y4M streams when the input does not declare one.
+ */
+#define VIDEO_RATE "25:1"
+
+/**
+ * The maximum length of a Y4M stream or frame header.
+ */
+#define VIDEO_HEADER_MAX 1024
+
+const StereoVideoSettings stereo_video_settings_default = {
+    STEREO_VIDEO_RAW, STEREO_VIDEO_RAW, 8, 3, 0};
+
+/**
+ * The state of a slot of a ring.
+ */
+enum {
+    /** The slot contains a frame */
+    VIDEO_FRAME = 0,
+
+    /** There are no more frames */
+    VIDEO_END,
+
+    /** A frame could not be read or rendered */
+    VIDEO_ERROR
+};
+
+/**
+ * A ring of frames between a single producer and a single consumer.
+ *
+ * The semaphores count the free and the filled slots, and every side keeps
+ * its own position, so the slots themselves are never locked.
+ */
+typedef struct {
+    /** The frames; these are ZBuffer or StereoPattern pointers */
+    void **items;
+
+    /** The VIDEO_* state of every slot */
+    int *states;
+
+    /** The number of slots */
+    unsigned int count;
+
+    /** The number of free and filled slots */
+    sem_t free, full;
+
+    /** The next slot of the producer and of the consumer */
+    unsigned int put, get;
+} VideoRing;
+
+/**
+ * The shared state of the threads of stereo_video_render.
+ */
+typedef struct {
+    /** The settings */
+    StereoVideoSettings settings;
+
+    /** The file descriptors */
+    int in, out;
+
+    /** The dimensions of the frames */
+    unsigned int width, height;
+
+    /** The number of bits of every input sample, and the number of bits the
+        samples must be shifted to fill 16 bits */
+    unsigned int depth, shift;
+
+    /** The number of bytes of the input planes following the luma plane */
+    size_t skip;
+
+    /** The frame rate of the Y4M output */
+    char rate[32];
+
+    /** The ring from the reader to the renderer */
+    VideoRing depths;
+
+    /** The ring from the renderer to the writer */
+    VideoRing images;
+
+    /** Set when writing failed, so that the other threads stop */
+    int stop;
+} Video;
+
+/**
+ * Initialises a ring.
+ *
+ * @param ring
+ *     The ring.
+ * @param count
+ *     The number of slots.
+ */
+static void
+video_ring_initialize(VideoRing *ring, unsigned int count)
+{
+    ring->items = calloc(count, sizeof(*ring->items));
+    ring->states = calloc(count, sizeof(*ring->states));
+    ring->count = count;
+    sem_init(&ring->free, 0, count);
+    sem_init(&ring->full, 0, 0);
+    ring->put = 0;
+    ring->get = 0;
+}
+
+/**
+ * Frees the resources of a ring; the frames are not freed.
+ *
+ * @param ring
+ *     The ring.
+ */
+static void
+video_ring_finalize(VideoRing *ring)
+{
+    sem_destroy(&ring->free);
+    sem_destroy(&ring->full);
+    free(ring->items);
+    free(ring->states);
+}
+
+/**
+ * Waits for a free slot.
+ *
+ * @param ring
+ *     The ring.
+ * @return the index of the slot
+ */
+static unsigned int
+video_ring_acquire(VideoRing *ring)
+{
+    while (sem_wait(&ring->free) && errno == EINTR);
+
+    return ring->put;
+}
+
+/**
+ * Hands a slot acquired by video_ring_acquire to the consumer.
+ *
+ * @param ring
+ *     The ring.
+ * @param state
+ *     The VIDEO_* state of the slot.
+ */
+static void
+video_ring_publish(VideoRing *ring, int state)
+{
+    ring->states[ring->put] = state;
+    ring->put = (ring->put + 1) % ring->count;
+    sem_post(&ring->full);
+}
+
+/**
+ * Waits for a filled slot.
+ *
+ * @param ring
+ *     The ring.
+ * @return the index of the slot
+ */
+static unsigned int
+video_ring_take(VideoRing *ring)
+{
+    while (sem_wait(&ring->full) && errno == EINTR);
+
+    return ring->get;
+}
+
+/**
+ * Returns a slot taken by video_ring_take to the producer.
+ *
+ * @param ring
+ *     The ring.
+ */
+static void
+video_ring_release(VideoRing *ring)
+{
+    ring->get = (ring->get + 1) % ring->count;
+    sem_post(&ring->free);
+}
+
+/**
+ * Stops the reader and the renderer after a write failure.
+ *
+ * The renderer is woken from waiting for either ring; it then cancels the
+ * reader, which may be blocked reading the input.
+ *
+ * @param video
+ *     The video.
+ */
+static void
+video_stop(Video *video)
+{
+    __atomic_store_n(&video->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&video->depths.full);
+    sem_post(&video->images.free);
+}
+
+/**
+ * Returns whether video_stop has been called.
+ *
+ * @param video
+ *     The video.
+ * @return non-zero if the threads must stop
+ */
+static inline int
+video_stopped(Video *video)
+{
+    return __atomic_load_n(&video->stop, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Reads from a file descriptor until a buffer is full or the end of the file
+ * is reached.
+ *
+ * @param fd
+ *     The file descriptor.
+ * @param buffer
+ *     The buffer.
+ * @param size
+ *     The number of bytes to read.
+ * @return the number of bytes read, or -1 upon failure
+ */
+static ssize_t
+video_read(int fd, void *buffer, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t count = read(fd, (char*)buffer + done, size - done);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return -1;
+        }
+        if (!count) {
+            break;
+        }
+        done += count;
+    }
+
+    return done;
+}
+
+/**
+ * Writes an entire buffer to a file descriptor.
+ *
+ * @param fd
+ *     The file descriptor.
+ * @param buffer
+ *     The buffer.
+ * @param size
+ *     The number of bytes to write.
+ * @return non-zero upon success and 0 otherwise
+ */
+static int
+video_write(int fd, const void *buffer, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t count = write(fd, (const char*)buffer + done, size - done);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return 0;
+        }
+        done += count;
+    }
+
+    return 1;
+}
+
+/**
+ * Reads a Y4M header line.
+ *
+ * The line is read a byte at a time, so that no data after it is consumed.
+ *
+ * @param fd
+ *     The file descriptor.
+ * @param line
+ *     The line read, without the line feed. This must have room for
+ *     VIDEO_HEADER_MAX bytes.
+ * @return the length of the line, 0 at the end of the file, or -1 upon
+ *     failure
+ */
+static int
+video_y4m_line(int fd, char *line)
+{
+    int length = 0;
+
+    for (;;) {
+        ssize_t count = read(fd, line + length, 1);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0 || (!count && length)) {
+            return -1;
+        }
+        if (!count) {
+            return 0;
+        }
+        if (line[length] == '\n') {
+            line[length] = '\0';
+            return length ? length : -1;
+        }
+        if (++length == VIDEO_HEADER_MAX) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Reads the header of a Y4M stream.
+ *
+ * @param video
+ *     The video; the dimensions, the depth, the chroma planes and the frame
+ *     rate are read.
+ * @return non-zero upon success and 0 otherwise
+ */
+static int
+video_y4m_header(Video *video)
+{
+    char line[VIDEO_HEADER_MAX];
+    const char *colorspace = "420";
+    char *token;
+    size_t w, h;
+    unsigned int bits = 8;
+
+    if (video_y4m_line(video->in, line) <= 0
+            || strncmp(line, "YUV4MPEG2 ", 10)) {
+        return 0;
+    }
+
+    video->width = video->height = 0;
+    for (token = strtok(line + 10, " "); token; token = strtok(NULL, " ")) {
+        switch (token[0]) {
+        case 'W':
+            video->width = strtoul(token + 1, NULL, 10);
+            break;
+
+        case 'H':
+            video->height = strtoul(token + 1, NULL, 10);
+            break;
+
+        case 'F':
+            snprintf(video->rate, sizeof(video->rate), "%s", token + 1);
+            break;
+
+        case 'C':
+            colorspace = token + 1;
+            break;
+        }
+    }
+    if (!video->width || !video->height) {
+        return 0;
+    }
+
+    /* Deep formats have a suffix such as p10 or 16, and are stored as 16 bit
+       little endian samples */
+    if (!strncmp(colorspace, "mono", 4)) {
+        if (colorspace[4]) {
+            bits = strtoul(colorspace + 4, NULL, 10);
+        }
+    }
+    else {
+        const char *p = strchr(colorspace, 'p');
+
+        if (p && p[1] >= '0' && p[1] <= '9') {
+            bits = strtoul(p + 1, NULL, 10);
+        }
+    }
+    if (bits < 8 || bits > 16) {
+        return 0;
+    }
+    video->depth = bits > 8 ? 16 : 8;
+    video->shift = bits > 8 ? 16 - bits : 0;
+
+    /* The chroma planes are skipped */
+    w = video->width;
+    h = video->height;
+    if (!strncmp(colorspace, "mono", 4)) {
+        video->skip = 0;
+    }
+    else if (!strncmp(colorspace, "444alpha", 8)) {
+        video->skip = 3 * w * h;
+    }
+    else if (!strncmp(colorspace, "444", 3)) {
+        video->skip = 2 * w * h;
+    }
+    else if (!strncmp(colorspace, "422", 3)) {
+        video->skip = 2 * ((w + 1) / 2) * h;
+    }
+    else if (!strncmp(colorspace, "411", 3)) {
+        video->skip = 2 * ((w + 3) / 4) * h;
+    }
+    else if (!strncmp(colorspace, "420", 3)) {
+        video->skip = 2 * ((w + 1) / 2) * ((h + 1) / 2);
+    }
+    else {
+        return 0;
+    }
+    video->skip *= video->depth / 8;
+
+    return 1;
+}
+
+/**
+ * Reads a depth frame.
+ *
+ * @param video
+ *     The video.
+ * @param buffer
+ *     The z-buffer to read to; its rows are contiguous.
+ * @param scratch
+ *     A buffer of video->skip bytes for the chroma planes.
+ * @return VIDEO_FRAME, VIDEO_END or VIDEO_ERROR
+ */
+static int
+video_read_frame(Video *video, ZBuffer *buffer, unsigned char *scratch)
+{
+    size_t size = (size_t)buffer->rowoffset * buffer->height;
+    size_t i, samples = (size_t)buffer->width * buffer->height;
+    unsigned short *deep = (unsigned short*)buffer->data;
+    const unsigned short one = 1;
+    ssize_t count;
+
+    if (video->settings.input == STEREO_VIDEO_Y4M) {
+        char line[VIDEO_HEADER_MAX];
+        int length = video_y4m_line(video->in, line);
+
+        if (!length) {
+            return VIDEO_END;
+        }
+        if (length < 0 || strncmp(line, "FRAME", 5)) {
+            return VIDEO_ERROR;
+        }
+    }
+
+    count = video_read(video->in, buffer->data, size);
+    if (!count && video->settings.input == STEREO_VIDEO_RAW) {
+        return VIDEO_END;
+    }
+    if (count != (ssize_t)size
+            || (video->skip && video_read(video->in, scratch, video->skip)
+                != (ssize_t)video->skip)) {
+        return VIDEO_ERROR;
+    }
+
+    /* Y4M stores deep samples in little endian byte order, with the
+       significant bits at the bottom */
+    if (video->settings.input == STEREO_VIDEO_Y4M && video->depth == 16) {
+        if (!*(const unsigned char*)&one) {
+            for (i = 0; i < samples; i++) {
+                deep[i] = (unsigned short)(deep[i] << 8 | deep[i] >> 8);
+            }
+        }
+        if (video->shift) {
+            for (i = 0; i < samples; i++) {
+                deep[i] = (unsigned short)(deep[i] << video->shift
+                    | deep[i] >> (16 - 2 * video->shift));
+            }
+        }
+    }
+
+    return VIDEO_FRAME;
+}
+
+/**
+ * Reads depth frames into the depth ring.
+ *
+ * This is the entry point of the reader thread.
+ *
+ * @param video
+ *     The video.
+ * @return NULL
+ */
+static void*
+video_reader(Video *video)
+{
+    unsigned char *scratch = malloc(video->skip ? video->skip : 1);
+    unsigned int frame;
+    int state = VIDEO_FRAME;
+
+    /* The reader is cancelled if rendering fails */
+    pthread_cleanup_push(free, scratch);
+
+    for (frame = 0; state == VIDEO_FRAME && !video_stopped(video);
+            frame++) {
+        unsigned int slot = video_ring_acquire(&video->depths);
+
+        if (video->settings.frames && frame == video->settings.frames) {
+            state = VIDEO_END;
+        }
+        else {
+            state = video_read_frame(video, video->depths.items[slot],
+                scratch);
+        }
+        video_ring_publish(&video->depths, state);
+    }
+
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+/**
+ * Converts a rendered frame to 8 bit 4:4:4 YCbCr planes with the BT.601
+ * coefficients.
+ *
+ * @param pattern
+ *     The rendered frame.
+ * @param d
+ *     The planes to write.
+ */
+static void
+video_ycbcr(StereoPattern *pattern, unsigned char *d)
+{
+    size_t i, count = (size_t)pattern->width * pattern->height;
+    unsigned char *cb = d + count, *cr = cb + count;
+
+    for (i = 0; i < count; i++) {
+        int r = pattern->pixels[i].r;
+        int g = pattern->pixels[i].g;
+        int b = pattern->pixels[i].b;
+
+        d[i] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        cb[i] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8)
+            + 128);
+        cr[i] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8)
+            + 128);
+    }
+}
+
+/**
+ * Writes rendered frames from the image ring.
+ *
+ * This is the entry point of the writer thread. A failed write stops the
+ * other threads with video_stop, and the writer returns at once.
+ *
+ * @param video
+ *     The video.
+ * @return NULL upon success, and a non-NULL value if a write failed
+ */
+static void*
+video_writer(Video *video)
+{
+    size_t count = (size_t)video->width * video->height;
+    unsigned char *planes = NULL;
+    int ok = 1;
+
+    if (video->settings.output == STEREO_VIDEO_Y4M) {
+        char header[VIDEO_HEADER_MAX];
+
+        snprintf(header, sizeof(header),
+            "YUV4MPEG2 W%u H%u F%s Ip A1:1 C444\n", video->width,
+            video->height, video->rate);
+        ok = video_write(video->out, header, strlen(header));
+        planes = malloc(6 + 3 * count);
+        memcpy(planes, "FRAME\n", 6);
+    }
+
+    while (ok) {
+        unsigned int slot = video_ring_take(&video->images);
+        StereoPattern *pattern = video->images.items[slot];
+
+        if (video->images.states[slot] != VIDEO_FRAME) {
+            video_ring_release(&video->images);
+            break;
+        }
+
+        if (planes) {
+            video_ycbcr(pattern, planes + 6);
+            ok = video_write(video->out, planes, 6 + 3 * count);
+        }
+        else {
+            ok = video_write(video->out, pattern->pixels,
+                count * sizeof(PatternPixel));
+        }
+
+        video_ring_release(&video->images);
+    }
+
+    free(planes);
+    if (!ok) {
+        video_stop(video);
+    }
+
+    return ok ? NULL : video;
+}
+
+long
+stereo_video_render(StereoImage *image, int in, int out,
+    const StereoVideoSettings *settings, StereoPatternEffect *effect)
+{
+    Video video;
+    pthread_t reader, writer;
+    unsigned int i;
+    void *failed;
+    int input, state;
+    long result = 0;
+
+    video.settings = settings ? *settings : stereo_video_settings_default;
+    video.in = in;
+    video.out = out;
+    video.width = image->image->width;
+    video.height = image->image->height;
+    video.depth = video.settings.depth;
+    video.shift = 0;
+    video.skip = 0;
+    video.stop = 0;
+    strcpy(video.rate, VIDEO_RATE);
+
+    if (video.settings.ring < 2) {
+        video.settings.ring = 2;
+    }
+    if (video.settings.input == STEREO_VIDEO_Y4M) {
+        if (!video_y4m_header(&video)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if ((video.depth != 8 && video.depth != 16)
+            || video.width != image->image->width
+            || video.height != image->image->height
+            || (effect && !image->back)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Depth frames have contiguous rows, so that a frame is a single read;
+       the rendered frames include the current image of the stereo image, and
+       the others start as copies of it, since rendering keeps the alpha
+       channel */
+    video_ring_initialize(&video.depths, video.settings.ring);
+    video_ring_initialize(&video.images, video.settings.ring);
+    for (i = 0; i < video.settings.ring; i++) {
+        size_t rowbytes = (size_t)video.width * (video.depth / 8);
+        ZBuffer *buffer = stereo_zbuffer_create_from_data(video.width,
+            video.height, rowbytes, 1, malloc(rowbytes * video.height));
+
+        buffer->depth = video.depth;
+        buffer->free_data = 1;
+        video.depths.items[i] = buffer;
+        if (i) {
+            StereoPattern *copy = stereo_pattern_allocate(video.width,
+                video.height);
+
+            memcpy(copy->pixels, image->image->pixels,
+                (size_t)video.width * video.height * sizeof(PatternPixel));
+            video.images.items[i] = copy;
+        }
+        else {
+            video.images.items[i] = image->image;
+        }
+    }
+
+    if (pthread_create(&reader, NULL, (void*(*)(void*))video_reader, &video)) {
+        result = -1;
+    }
+    else if (pthread_create(&writer, NULL, (void*(*)(void*))video_writer,
+            &video)) {
+        pthread_cancel(reader);
+        pthread_join(reader, NULL);
+        result = -1;
+    }
+    else {
+        for (;;) {
+            unsigned int slot = video_ring_take(&video.depths);
+            unsigned int target = 0;
+
+            if (!video_stopped(&video)) {
+                target = video_ring_acquire(&video.images);
+            }
+            if (video_stopped(&video)) {
+                /* The writer failed; the reader may still be running */
+                input = VIDEO_FRAME;
+                result = -1;
+                break;
+            }
+
+            input = state = video.depths.states[slot];
+
+            if (state == VIDEO_FRAME) {
+                image->image = video.images.items[target];
+                if (!(effect
+                        ? stereo_image_apply_pipelined(image,
+                            video.depths.items[slot], 0, effect)
+                        : stereo_image_apply(image,
+                            video.depths.items[slot], 0))) {
+                    state = VIDEO_ERROR;
+                }
+            }
+            video_ring_release(&video.depths);
+            video_ring_publish(&video.images, state);
+
+            if (state != VIDEO_FRAME) {
+                if (state == VIDEO_ERROR) {
+                    result = -1;
+                }
+                break;
+            }
+            result++;
+        }
+
+        /* The reader is only still running if rendering or writing
+           failed */
+        if (input == VIDEO_FRAME) {
+            pthread_cancel(reader);
+        }
+        pthread_join(reader, NULL);
+        pthread_join(writer, &failed);
+        if (failed) {
+            result = -1;
+        }
+    }
+
+    for (i = 0; i < video.settings.ring; i++) {
+        stereo_zbuffer_free(video.depths.items[i]);
+        if (video.images.items[i] != image->image) {
+            stereo_pattern_free(video.images.items[i]);
+        }
+    }
+    video_ring_finalize(&video.depths);
+    video_ring_finalize(&video.images);
+
+    return result;
+}
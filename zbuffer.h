@@ -16,6 +16,10 @@ typedef struct {
     /** The number of channels for every buffer element */
     unsigned int channels;
 
+    /** The number of bits of every channel; this is 8 or 16, and 16 bit
+        values are stored in host byte order */
+    unsigned int depth;
+
     /** The actual buffer data */
     unsigned char *data;
 
@@ -42,6 +46,25 @@ ZBuffer*
 stereo_zbuffer_create(unsigned int width, unsigned int height,
     unsigned int channels);
 
+/**
+ * Creates a z-buffer with a specific number of bits per channel.
+ *
+ * The rows of the buffer are aligned on sizeof(int).
+ *
+ * @param width
+ *     The width of the z-buffer.
+ * @param height
+ *     The height of the z-buffer.
+ * @param channels
+ *     The number of channels.
+ * @param depth
+ *     The number of bits of every channel; this must be 8 or 16.
+ * @return a new z-buffer, or NULL if depth is invalid
+ */
+ZBuffer*
+stereo_zbuffer_create_with_depth(unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth);
+
 /**
  * Creates a z-buffer from pre-allocated memory.
  *
@@ -77,6 +100,120 @@ stereo_zbuffer_create_from_data(unsigned int width, unsigned int height,
 ZBuffer*
 stereo_zbuffer_create_from_pattern(StereoPattern *pattern);
 
+/**
+ * A reader decoding a PNG file into z-buffers a band of rows at a time.
+ */
+typedef struct ZBufferPNGReader ZBufferPNGReader;
+
+/**
+ * Starts reading a z-buffer from a PNG file.
+ *
+ * The channels and the bit depth of the image are kept: grayscale images give
+ * one channel and 16 bit images give 16 bit channels. Palette images are
+ * expanded to RGB or RGBA, and images with fewer than 8 bits are expanded to
+ * 8 bits.
+ *
+ * @param in
+ *     The file to read. Please make sure that it is opened in binary mode. If
+ *     it is not a valid PNG file, the function fails.
+ * @return a new reader, or NULL upon failure
+ */
+ZBufferPNGReader*
+stereo_zbuffer_png_open(FILE *in);
+
+/**
+ * Returns the format of the image read by a reader.
+ *
+ * Any of the pointers may be NULL.
+ *
+ * @param reader
+ *     The reader.
+ * @param width
+ *     The width of the image.
+ * @param height
+ *     The height of the image.
+ * @param channels
+ *     The number of channels of the decoded rows.
+ * @param depth
+ *     The number of bits of every channel of the decoded rows.
+ * @param interlaced
+ *     Whether the image is interlaced, so that it cannot be decoded in bands.
+ */
+void
+stereo_zbuffer_png_get_format(ZBufferPNGReader *reader, unsigned int *width,
+    unsigned int *height, unsigned int *channels, unsigned int *depth,
+    int *interlaced);
+
+/**
+ * Creates a z-buffer in the format of the image read by a reader.
+ *
+ * @param reader
+ *     The reader.
+ * @param height
+ *     The number of rows of the z-buffer. Pass 0 to create a z-buffer for the
+ *     entire image.
+ * @return a new z-buffer
+ */
+ZBuffer*
+stereo_zbuffer_png_create_buffer(ZBufferPNGReader *reader,
+    unsigned int height);
+
+/**
+ * Decodes the next rows of the image.
+ *
+ * Interlaced images cannot be decoded in bands; they must be decoded with a
+ * single call for all rows.
+ *
+ * @param reader
+ *     The reader.
+ * @param buffer
+ *     The z-buffer to decode to. Its width, channels and depth must be those
+ *     of the image; use stereo_zbuffer_png_create_buffer to create it.
+ * @param y
+ *     The first row of buffer to write.
+ * @param count
+ *     The maximum number of rows to decode.
+ * @return the number of rows decoded, which is 0 at the end of the image and
+ *     upon failure
+ */
+unsigned int
+stereo_zbuffer_png_read(ZBufferPNGReader *reader, ZBuffer *buffer,
+    unsigned int y, unsigned int count);
+
+/**
+ * Frees a reader.
+ *
+ * The file is not closed.
+ *
+ * @param reader
+ *     The reader to free.
+ */
+void
+stereo_zbuffer_png_close(ZBufferPNGReader *reader);
+
+/**
+ * Creates a z-buffer from a PNG file.
+ *
+ * @param in
+ *     The file to read.
+ * @return a new z-buffer, or NULL upon failure
+ * @see stereo_zbuffer_png_open
+ */
+ZBuffer*
+stereo_zbuffer_create_from_png(FILE *in);
+
+/**
+ * Creates a z-buffer from a PNG file.
+ *
+ * @param filename
+ *     The name of the file. If it does not exist or cannot be opened, the
+ *     function fails.
+ * @return a new z-buffer, or NULL upon failure
+ * @see stereo_zbuffer_create_from_png
+ */
+ZBuffer*
+stereo_zbuffer_create_from_png_file(const char *filename);
+
 /**
  * Frees a z-buffer.
  *
@@ -114,6 +251,7 @@ stereo_zbuffer_free(ZBuffer *zbuffer);
  * @return a pointer to an unsigned char at the specified location
  */
 #define stereo_zbuffer_pixel_get(buffer, x, y) \
-    (stereo_zbuffer_row_get(buffer, y) + (x) * (buffer)->channels)
+    (stereo_zbuffer_row_get(buffer, y) \
+        + (x) * (buffer)->channels * ((buffer)->depth / 8))
 
 #endif
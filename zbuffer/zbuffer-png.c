@@ -0,0 +1,219 @@
+#include <png.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+
+#include "../zbuffer.h"
+
+struct ZBufferPNGReader {
+    /** The PNG structures */
+    png_structp png;
+    png_infop info;
+
+    /** The dimensions of the image */
+    unsigned int width, height;
+
+    /** The number of channels after transformations */
+    unsigned int channels;
+
+    /** The number of bits of every channel after transformations */
+    unsigned int depth;
+
+    /** The number of interlace passes */
+    int passes;
+
+    /** The next row to decode */
+    unsigned int row;
+};
+
+ZBufferPNGReader*
+stereo_zbuffer_png_open(FILE *in)
+{
+    unsigned char signature[8];
+    ZBufferPNGReader *result;
+    png_uint_32 width, height;
+    int depth, color_type, interlace;
+
+    /* Check the signature */
+    if (!in) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (fread(signature, 1, sizeof(signature), in) != sizeof(signature)) {
+        return NULL;
+    }
+    if (png_sig_cmp(signature, 0, sizeof(signature))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Create the PNG structures */
+    result = malloc(sizeof(ZBufferPNGReader));
+    result->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+        NULL);
+    if (!result->png) {
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+    result->info = png_create_info_struct(result->png);
+    if (!result->info) {
+        png_destroy_read_struct(&result->png, NULL, NULL);
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+    png_set_sig_bytes(result->png, sizeof(signature));
+
+    /* We return here upon errors */
+    if (setjmp(png_jmpbuf(result->png))) {
+        png_destroy_read_struct(&result->png, &result->info, NULL);
+        free(result);
+
+        return NULL;
+    }
+
+    /* Initialise the PNG struct to use in as input stream */
+    png_init_io(result->png, in);
+    png_read_info(result->png, result->info);
+    png_get_IHDR(result->png, result->info, &width, &height, &depth,
+        &color_type, &interlace, NULL, NULL);
+
+    /* Keep the channels and the depth, but expand palettes and samples of
+       less than 8 bits, and store 16 bit samples in host byte order */
+    png_set_packing(result->png);
+    png_set_expand(result->png);
+    if (depth == 16) {
+        const unsigned short one = 1;
+
+        if (*(const unsigned char*)&one) {
+            png_set_swap(result->png);
+        }
+    }
+    result->passes = png_set_interlace_handling(result->png);
+    png_read_update_info(result->png, result->info);
+
+    result->width = width;
+    result->height = height;
+    result->channels = png_get_channels(result->png, result->info);
+    result->depth = png_get_bit_depth(result->png, result->info);
+    result->row = 0;
+
+    return result;
+}
+
+void
+stereo_zbuffer_png_get_format(ZBufferPNGReader *reader, unsigned int *width,
+    unsigned int *height, unsigned int *channels, unsigned int *depth,
+    int *interlaced)
+{
+    if (width) {
+        *width = reader->width;
+    }
+    if (height) {
+        *height = reader->height;
+    }
+    if (channels) {
+        *channels = reader->channels;
+    }
+    if (depth) {
+        *depth = reader->depth;
+    }
+    if (interlaced) {
+        *interlaced = reader->passes > 1;
+    }
+}
+
+ZBuffer*
+stereo_zbuffer_png_create_buffer(ZBufferPNGReader *reader,
+    unsigned int height)
+{
+    return stereo_zbuffer_create_with_depth(reader->width,
+        height ? height : reader->height, reader->channels, reader->depth);
+}
+
+unsigned int
+stereo_zbuffer_png_read(ZBufferPNGReader *reader, ZBuffer *buffer,
+    unsigned int y, unsigned int count)
+{
+    unsigned int i;
+    int pass;
+
+    /* Verify the format of the z-buffer */
+    if (buffer->width != reader->width
+            || buffer->channels != reader->channels
+            || buffer->depth != reader->depth
+            || y + count > buffer->height) {
+        return 0;
+    }
+
+    if (count > reader->height - reader->row) {
+        count = reader->height - reader->row;
+    }
+
+    /* Interlaced images spread every row over several passes */
+    if (reader->passes > 1
+            && (reader->row != 0 || count != reader->height)) {
+        return 0;
+    }
+
+    /* We return here upon errors */
+    if (setjmp(png_jmpbuf(reader->png))) {
+        return 0;
+    }
+
+    for (pass = 0; pass < reader->passes; pass++) {
+        for (i = 0; i < count; i++) {
+            png_read_row(reader->png,
+                (png_bytep)stereo_zbuffer_row_get(buffer, y + i), NULL);
+        }
+    }
+    reader->row += count;
+
+    return count;
+}
+
+void
+stereo_zbuffer_png_close(ZBufferPNGReader *reader)
+{
+    png_destroy_read_struct(&reader->png, &reader->info, NULL);
+    free(reader);
+}
+
+ZBuffer*
+stereo_zbuffer_create_from_png(FILE *in)
+{
+    ZBufferPNGReader *reader = stereo_zbuffer_png_open(in);
+    ZBuffer *result;
+
+    if (!reader) {
+        return NULL;
+    }
+
+    result = stereo_zbuffer_png_create_buffer(reader, 0);
+    if (stereo_zbuffer_png_read(reader, result, 0, result->height)
+            != result->height) {
+        stereo_zbuffer_free(result);
+        result = NULL;
+    }
+
+    stereo_zbuffer_png_close(reader);
+
+    return result;
+}
+
+ZBuffer*
+stereo_zbuffer_create_from_png_file(const char *filename)
+{
+    FILE *in = fopen(filename, "rb");
+    ZBuffer *result = NULL;
+
+    if (in) {
+        result = stereo_zbuffer_create_from_png(in);
+        fclose(in);
+    }
+
+    return result;
+}
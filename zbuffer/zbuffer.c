@@ -6,16 +6,28 @@ ZBuffer*
 stereo_zbuffer_create(unsigned int width, unsigned int height,
     unsigned int channels)
 {
-    ZBuffer *result = malloc(sizeof(ZBuffer));
+    return stereo_zbuffer_create_with_depth(width, height, channels, 8);
+}
+
+ZBuffer*
+stereo_zbuffer_create_with_depth(unsigned int width, unsigned int height,
+    unsigned int channels, unsigned int depth)
+{
+    ZBuffer *result;
+    size_t rowbytes = (size_t)width * channels * (depth / 8);
+
+    if (depth != 8 && depth != 16) {
+        return NULL;
+    }
 
+    result = malloc(sizeof(ZBuffer));
     result->width = width;
     result->height = height;
-    result->rowoffset = (width * channels)
-        + ((width * channels) % sizeof(int)
-            ? sizeof(int) - (width * channels) % sizeof(int)
-            : 0);
+    result->rowoffset = rowbytes
+        + (rowbytes % sizeof(int) ? sizeof(int) - rowbytes % sizeof(int) : 0);
     result->channels = channels;
-    result->data = malloc(result->rowoffset * height);
+    result->depth = depth;
+    result->data = malloc((size_t)result->rowoffset * height);
     result->free_data = 1;
 
     return result;
@@ -31,6 +43,7 @@ stereo_zbuffer_create_from_data(unsigned int width, unsigned int height,
     result->height = height;
     result->rowoffset = rowoffset;
     result->channels = channels;
+    result->depth = 8;
     result->data = data;
     result->free_data = 0;
 
@@ -48,6 +61,7 @@ stereo_zbuffer_create_from_pattern(StereoPattern *pattern)
         * (stereo_pattern_row_get(pattern, 1)
             - stereo_pattern_row_get(pattern, 0));
     result->channels = 4;
+    result->depth = 8;
     result->data = (unsigned char*)pattern->pixels;
     result->free_data = 0;
 